@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <time.h>
 
@@ -32,6 +33,9 @@
 	#ifndef snprintf
 		#define snprintf _snprintf
 	#endif
+	#ifndef vsnprintf
+		#define vsnprintf _vsnprintf
+	#endif
 #else
 	#include <errno.h>
 	#include <pthread.h>
@@ -42,10 +46,29 @@
 	#include <sys/time.h>
 	#include <sys/stat.h>
 	#include <sys/socket.h>
+	#include <sys/mman.h>
+	#include <sys/wait.h>
+	#include <fcntl.h>
+
+	#include <sys/un.h>
 
 	#include <netinet/in.h>
 	#include <arpa/inet.h>
 	#include <netdb.h>
+
+	#define HAS_UNIX_SOCKETS
+	#define HAS_PREFORK
+	#define HAS_MMAP
+	#ifdef __linux__
+		#include <sys/sendfile.h>
+		#include <sys/prctl.h>
+		#define HAS_SENDFILE
+		#define HAS_ROBUST_MUTEX
+		#define HAS_CGROUPS
+	#endif /* __linux__ */
+	#ifndef MAP_ANONYMOUS
+		#define MAP_ANONYMOUS MAP_ANON
+	#endif /* !MAP_ANONYMOUS */
 #endif /* _WIN32 */
 
 
@@ -55,14 +78,88 @@
 #define LISTEN_PORT      70
 #define MAX_CONNECTIONS  10
 #define RECV_TIMEOUT     3
+#define OVERLOAD_WAIT    10
+#define SEND_CHUNK_SIZE  262144L
 
 #define DEFAULT_HOSTNAME "localhost"
 #define DEFAULT_PORT     LISTEN_PORT
 
+#define CONFIG_PATH         "amigos.conf"
 #define FILETYPES_CONF_PATH "filetypes.conf"
+#define ROUTES_CONF_PATH    "routes.conf"
+#define PLUGIN_FLUSH_SIZE   4096
+
+#define ROUTE_MAX_ALIAS_HOPS 8
 #define DEFAULT_FILE_TYPE   '0'
 #define EXT_MAX_LEN         20
 
+#define SEARCH_SELECTOR        "search"
+#define SEARCH_THREADS         4
+#define SEARCH_MAX_RESULTS     50
+#define SEARCH_MAX_TERMS       8
+#define SEARCH_TERM_MAX_LEN    32
+#define SEARCH_MAX_FILE_SIZE   1048576L
+#define SEARCH_MAX_DEPTH       16
+#define SEARCH_RESCAN_INTERVAL 60
+
+#define CACHE_MAX_SIZE         16777216L
+#define CACHE_MIN_SIZE         1048576L
+#define CACHE_BUCKETS          1024
+#define CACHE_TINYLFU          1
+#define CACHE_WINDOW_PERCENT   1
+#define CACHE_SKETCH_WIDTH     4096
+#define CACHE_SKETCH_DEPTH     4
+#define PROXY_CACHE_TTL        300
+#define PROXY_STALE_TTL        3600
+#define PROXY_MAX_CONNS        4
+#define PROXY_TIMEOUT          10
+#define PROXY_MAX_OBJECT_SIZE  1048576L
+#define MENU_CACHE_TTL         30
+#define CAPTURE_MAX_SIZE       2097152L
+#define HTTP_MAX_REQUEST_SIZE  4096
+#define HTTP_MAX_KEEPALIVE     100
+
+#define UNIX_SOCKET_PATH       ""
+#define ADMIN_SOCKET_PATH      ""
+#define ADMIN_MAX_COMMAND      512
+#define ADMIN_SELECTOR_LEN     128
+#define ADMIN_TOP_ITEMS        20
+#define ADMIN_SEND_TIMEOUT     3
+#define TLS_PORT               0
+#define TLS_CERT_PATH          "cert.pem"
+#define TLS_KEY_PATH           "key.pem"
+#define TLS_SESSION_TIMEOUT    7200
+#define STATS_LOG_INTERVAL     60
+#define SLOW_REQUEST           10
+#define STUCK_REQUEST          60
+#define KILL_STUCK             0
+#define HOT_REQUESTS           16
+#define WARMUP_PATH            ""
+#define MEMORY_PRESSURE        1
+#define MEMORY_HIGH_PERCENT    90
+#define MEMORY_LOW_PERCENT     70
+#define MEMORY_PSI_HIGH        10.0
+#define MEMORY_PSI_LOW         1.0
+#define WARMUP_THREADS         4
+#define WARMUP_MAX_SELECTORS   4096
+#define WARMUP_TAIL_SIZE       1048576L
+#define HITTERS_SIZE           64
+#define HITTERS_DECAY_INTERVAL 60
+#define STATS_PATH             ""
+#define WORKERS                0
+#define MAX_WORKERS            64
+#define WORKER_RESPAWN_DELAY   1
+#define CACHE_SHM_SIZE         16777216L
+#define CACHE_SHM_SLOT_SIZE    16384
+#define CACHE_SHM_SHARDS       16
+#define LOG_MAX_LEN            1024
+#define PROFILER_HZ            99
+#define PROFILER_SECONDS       10
+#define PROFILER_MAX_SECONDS   300
+#define PROFILER_MAX_SAMPLES   16384
+#define PROFILER_MAX_DEPTH     32
+#define PROFILER_SKIP_FRAMES   2
+
 #define LISTEN_BACKLOG   5
 #define INVALID_TYPE     '\0'
 #define INVALID_HOST     "null.host"
@@ -91,6 +188,89 @@
 /* Include configuration. */
 #include "config.h"
 
+/* Public interface. */
+#include "amigos.h"
+#include "amigos_stats.h"
+
+/* Transport Layer Security. */
+#ifdef WITH_TLS
+	#include <openssl/ssl.h>
+	#include <openssl/err.h>
+
+	#ifndef BIO_get_ktls_send
+		#define BIO_get_ktls_send(b) 0
+	#endif /* !BIO_get_ktls_send */
+	#if defined(HAS_SENDFILE) && (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+		#define TLS_HAS_SENDFILE
+	#endif /* HAS_SENDFILE && OpenSSL 3 */
+#endif /* WITH_TLS */
+
+/* Dynamic handler plugins. */
+#ifdef WITH_PLUGINS
+	#include "amigos_plugin.h"
+
+	#ifdef _WIN32
+		#define plugin_dlopen(path)    LoadLibrary(path)
+		#define plugin_dlsym(hnd, sym) GetProcAddress(hnd, sym)
+		#define plugin_dlfunc(hnd, sym, fptr) \
+			(*(FARPROC*)(&(fptr)) = GetProcAddress(hnd, sym))
+		#define plugin_dlclose(hnd)    FreeLibrary(hnd)
+		#define plugin_dlerror()       "LoadLibrary failed"
+		typedef HMODULE plugin_hnd_t;
+	#else
+		#include <dlfcn.h>
+
+		#define plugin_dlopen(path)    dlopen(path, RTLD_NOW | RTLD_LOCAL)
+		#define plugin_dlsym(hnd, sym) dlsym(hnd, sym)
+		#define plugin_dlfunc(hnd, sym, fptr) \
+			(*(void**)(&(fptr)) = dlsym(hnd, sym))
+		#define plugin_dlclose(hnd)    dlclose(hnd)
+		#define plugin_dlerror()       dlerror()
+		typedef void* plugin_hnd_t;
+	#endif /* _WIN32 */
+#endif /* WITH_PLUGINS */
+
+/* Sampling profiler. */
+#ifdef WITH_PROFILER
+	#ifdef _WIN32
+		#error "The sampling profiler is only available on UNIX systems"
+	#endif /* _WIN32 */
+	#include <execinfo.h>
+#endif /* WITH_PROFILER */
+
+/* Static tracepoints for tracing requests on a live server. They always fire,
+ * but each one also has a semaphore that some tracers bump while attached, so
+ * that arguments that are costly to work out can be skipped until then. */
+#ifdef WITH_USDT
+	#define _SDT_HAS_SEMAPHORES 1
+	#include <sys/sdt.h>
+	#define USDT_SEMAPHORE(name) \
+		volatile unsigned short amigos_##name##_semaphore \
+		__attribute__((unused)) __attribute__((section(".probes")))
+	#define USDT_ENABLED(name) (amigos_##name##_semaphore != 0)
+	#define USDT1(name, a)          DTRACE_PROBE1(amigos, name, a)
+	#define USDT2(name, a, b)       DTRACE_PROBE2(amigos, name, a, b)
+	#define USDT3(name, a, b, c)    DTRACE_PROBE3(amigos, name, a, b, c)
+	#define USDT4(name, a, b, c, d) DTRACE_PROBE4(amigos, name, a, b, c, d)
+#else
+	#define USDT_ENABLED(name)      0
+	#define USDT1(name, a)          ((void)0)
+	#define USDT2(name, a, b)       ((void)0)
+	#define USDT3(name, a, b, c)    ((void)0)
+	#define USDT4(name, a, b, c, d) ((void)0)
+#endif /* WITH_USDT */
+
+/* Fault injection into the calls made while serving requests. */
+#ifdef WITH_FAULTS
+	#define fault_fopen(conn, path, mode) \
+		(fault_inject(conn, FAULT_OPEN, NULL) ? fopen(path, mode) : NULL)
+	#define fault_opendir(conn, path) \
+		(fault_inject(conn, FAULT_OPEN, NULL) ? opendir(path) : NULL)
+#else
+	#define fault_fopen(conn, path, mode) fopen(path, mode)
+	#define fault_opendir(conn, path)     opendir(path)
+#endif /* WITH_FAULTS */
+
 /* Socket abstractions. */
 #ifdef _WIN32
 	#define SOCKERR   SOCKET_ERROR
@@ -110,6 +290,9 @@
 #ifndef INET6_ADDRSTRLEN
 	#define INET6_ADDRSTRLEN 46
 #endif /* !INET6_ADDRSTRLEN */
+#ifndef MSG_NOSIGNAL
+	#define MSG_NOSIGNAL 0
+#endif /* !MSG_NOSIGNAL */
 
 /* Thread abstractions. */
 #ifdef _WIN32
@@ -117,16 +300,77 @@
 	#define thread_ret unsigned int __stdcall
 	#define INVALID_THREAD NULL
 	typedef HANDLE thread_hnd_t;
+	typedef CRITICAL_SECTION mutex_t;
+
+	#define mutex_init(m)    InitializeCriticalSection(m)
+	#define mutex_lock(m)    EnterCriticalSection(m)
+	#define mutex_unlock(m)  LeaveCriticalSection(m)
+	#define mutex_destroy(m) DeleteCriticalSection(m)
 #else
 	#define thread_ret void*
 	typedef pthread_t thread_hnd_t;
+	typedef pthread_mutex_t mutex_t;
 	#ifdef __linux__
 		#define INVALID_THREAD 0UL
 	#else
 		#define INVALID_THREAD NULL
 	#endif /* __linux__ */
+
+	#define mutex_init(m)    pthread_mutex_init(m, NULL)
+	#define mutex_lock(m)    pthread_mutex_lock(m)
+	#define mutex_unlock(m)  pthread_mutex_unlock(m)
+	#define mutex_destroy(m) pthread_mutex_destroy(m)
+#endif /* _WIN32 */
+typedef thread_ret thread_func_t(void *data);
+
+/* Atomic operation abstractions. Windows 95 and the Visual C++ 6 SDK only
+ * have InterlockedExchange, so everything else is done under spinlocks. */
+#ifdef _WIN32
+	#define ATOMIC_LOCKS 64
+
+	#define atomic_get_u32(p) \
+		win32_atomic_add_u32((volatile uint32_t*)(p), 0)
+	#define atomic_set_u32(p, v) \
+		win32_atomic_set_u32((volatile uint32_t*)(p), (uint32_t)(v))
+	#define atomic_add_u32(p, v) \
+		win32_atomic_add_u32((volatile uint32_t*)(p), (uint32_t)(v))
+	#define atomic_get_u64(p) \
+		win32_atomic_add_u64((volatile uint64_t*)(p), 0)
+	#define atomic_add_u64(p, v) \
+		win32_atomic_add_u64((volatile uint64_t*)(p), (uint64_t)(v))
+	#define atomic_get_ptr(p) \
+		win32_atomic_get_ptr((void* volatile*)(p))
+	#define atomic_set_ptr(p, v) \
+		win32_atomic_set_ptr((void* volatile*)(p), (void*)(v))
+	#define atomic_fence() \
+		{ LONG _barrier; InterlockedExchange(&_barrier, 0); }
+	#define counter_add(p, v) \
+		win32_atomic_add_u64((volatile uint64_t*)(p), (uint64_t)(v))
+	#define gauge_set(p, v) \
+		win32_atomic_set_u64((volatile uint64_t*)(p), (uint64_t)(v))
+#else
+	#define atomic_get_u32(p)    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+	#define atomic_set_u32(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+	#define atomic_add_u32(p, v) __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+	#define atomic_get_u64(p)    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+	#define atomic_add_u64(p, v) __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+	#define atomic_get_ptr(p)    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+	#define atomic_set_ptr(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+	#define atomic_fence()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+	#define counter_add(p, v)    __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+	#define gauge_set(p, v)      __atomic_store_n(p, v, __ATOMIC_RELAXED)
 #endif /* _WIN32 */
 
+/* Read-copy-update reader slots. */
+#define RCU_SLOT_SEARCH  MAX_CONNECTIONS
+#define RCU_SLOT_ADMIN   (MAX_CONNECTIONS + 1)
+#define RCU_SLOT_WATCHDOG (MAX_CONNECTIONS + 2)
+#define RCU_SLOT_WARMUP  (MAX_CONNECTIONS + 3)
+#define RCU_MAX_READERS  (MAX_CONNECTIONS + 3 + WARMUP_THREADS)
+
+/* Kind of a request that hasn't been resolved yet. */
+#define REQ_PENDING (AMIGOS_STATS_REQ_KINDS - 1)
+
 /* Log levels. */
 typedef enum {
 	LOG_CRIT = 0,
@@ -148,14 +392,222 @@ typedef struct gopher_item {
 	char *hostname;
 } gopher_item_t;
 
+/**
+ * Types of file system entries.
+ */
+enum path_types {
+	PATH_NONE = 0,
+	PATH_FILE,
+	PATH_DIR
+};
+
 /**
  * Status flags used by the client_conn_t structure.
  */
 enum client_conn_status {
 	CONN_FINISHED = 0x01,
-	CONN_INUSE    = 0x02
+	CONN_INUSE    = 0x02,
+	CONN_TLS      = 0x04,
+	CONN_UNIX     = 0x08
 };
 
+/**
+ * What a client connection is currently doing.
+ */
+typedef enum {
+	PHASE_HANDSHAKE = 0,
+	PHASE_RECV,
+	PHASE_REPLY,
+	PHASE_CLOSE
+} conn_phase_t;
+
+/**
+ * Subsystems that heap allocations are accounted to.
+ */
+typedef enum {
+	MEM_SERVER = 0,
+	MEM_CONFIG,
+	MEM_CONNECTIONS,
+	MEM_GOPHERMAP,
+	MEM_PATHS,
+	MEM_FILETYPES,
+	MEM_CACHE,
+	MEM_PROXY,
+	MEM_SEARCH,
+	MEM_TAGS
+} mem_tag_t;
+
+#ifdef WITH_FAULTS
+/**
+ * Kinds of calls that faults can be injected into.
+ */
+typedef enum {
+	FAULT_OPEN = 0,
+	FAULT_READ,
+	FAULT_RECV,
+	FAULT_SEND,
+	FAULT_OPS
+} fault_op_t;
+
+/**
+ * Faults injected into a kind of call. Rates are in parts per million.
+ */
+typedef struct fault {
+	uint32_t delay;       /* Milliseconds to hold the call up for. */
+	uint32_t jitter;      /* Up to this many more milliseconds, at random. */
+	uint32_t delay_rate;
+	uint32_t short_rate;  /* Transfers cut short at a random length. */
+	uint32_t error_rate;
+	int error;            /* Error the failed calls report. */
+} fault_t;
+#endif /* WITH_FAULTS */
+
+#ifdef WITH_PROFILER
+/**
+ * Stack sampled by the profiler, along with what the thread was doing.
+ */
+typedef struct prof_sample {
+	volatile uint8_t ready;
+	uint8_t tag;       /* Connection phase or kind of thread. */
+	uint8_t kind;      /* Kind of request, as defined in amigos_stats.h. */
+	uint8_t depth;
+	void *pcs[PROFILER_MAX_DEPTH];
+} prof_sample_t;
+
+/**
+ * Stack folded into the names of its functions, and how often it was seen.
+ */
+typedef struct prof_stack {
+	char *frames;
+	unsigned long count;
+} prof_stack_t;
+
+/**
+ * Sampling profiler, shared by the whole process since the timer it uses is.
+ */
+typedef struct profiler {
+	amigos_t *srv;
+	prof_sample_t *samples;
+	volatile uint32_t next;
+	struct sigaction old_action;  /* Handler of SIGPROF before we took it. */
+} profiler_t;
+#endif /* WITH_PROFILER */
+
+/**
+ * Memory accounted to a subsystem, updated without locking by every thread.
+ */
+typedef struct mem_account {
+	uint64_t bytes;   /* Bytes currently allocated. */
+	uint64_t peak;    /* Most bytes ever allocated at once, approximately. */
+	uint64_t count;   /* Allocations currently alive. */
+	uint64_t total;   /* Allocations ever made. */
+	uint64_t failed;  /* Allocations refused over the limit or that failed. */
+	uint64_t limit;   /* Maximum number of bytes or 0 for no limit. */
+} mem_account_t;
+
+/**
+ * Header placed in front of every accounted allocation, aligned so that what
+ * follows it is suitably aligned for anything.
+ */
+typedef union mem_header {
+	struct {
+		size_t size;
+		mem_tag_t tag;
+	} info;
+	long double _align;
+} mem_header_t;
+
+/**
+ * Growable memory buffer.
+ */
+typedef struct buffer {
+	char *data;
+	size_t len;
+	size_t size;
+	mem_tag_t tag;
+} buffer_t;
+
+/**
+ * Immutable snapshot of the runtime configuration.
+ */
+typedef struct config {
+	char *listen_addr;
+	char *hostname;
+	uint16_t listen_port;
+	uint16_t port;
+	uint16_t max_connections;
+	uint16_t backlog;
+	unsigned int recv_timeout;
+	unsigned int slow_request;
+	unsigned int stuck_request;
+	uint8_t kill_stuck;
+	unsigned int hot_requests;
+	uint8_t cache_tinylfu;
+	char *warmup_path;
+#ifdef HAS_CGROUPS
+	uint8_t memory_pressure;
+#endif /* HAS_CGROUPS */
+	uint64_t memory_limits[MEM_TAGS];
+#ifdef WITH_FAULTS
+	fault_t faults[FAULT_OPS];
+#endif /* WITH_FAULTS */
+#ifdef HAS_PREFORK
+	uint16_t workers;
+#endif /* HAS_PREFORK */
+	char *filetypes_path;
+	char *routes_path;
+#ifdef HAS_MMAP
+	char *stats_path;
+#endif /* HAS_MMAP */
+#ifdef HAS_UNIX_SOCKETS
+	char *unix_path;
+	char *admin_path;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	uint16_t tls_port;
+	char *tls_cert;
+	char *tls_key;
+#endif /* WITH_TLS */
+} config_t;
+
+/**
+ * Immutable table of Gopher file type associations.
+ */
+typedef struct gopher_types {
+	char **exts;
+	uint16_t len;
+	uint32_t generation;
+} gopher_types_t;
+
+/**
+ * Object that has been replaced and is waiting for its readers to be done
+ * with it before being free'd.
+ */
+typedef struct rcu_retired {
+	void *ptr;
+	void (*free_func)(void *ptr);
+	uint32_t epoch;
+	struct rcu_retired *next;
+} rcu_retired_t;
+
+/**
+ * Progress of a client connection, kept up to date by its thread and read by
+ * the admin socket and the watchdog without any locking, so it may be slightly
+ * inconsistent.
+ */
+typedef struct conn_score {
+	uint8_t phase;
+	uint8_t kind;      /* Kind of request, as defined in amigos_stats.h. */
+	time_t accepted;
+	time_t progressed; /* Last time the phase changed or data went through. */
+	uint64_t sent;
+	char selector[ADMIN_SELECTOR_LEN];
+
+	/* Only touched by the watchdog. */
+	time_t flagged_progressed;
+	uint8_t flagged;
+} conn_score_t;
+
 /**
  * Client connection thread object.
  */
@@ -163,23 +615,481 @@ typedef struct client_conn {
 	uint8_t status;
 	sockfd_t sockfd;
 	char *selector;
+	char *query;
+	char addr[INET6_ADDRSTRLEN];
+	const config_t *config;
+	amigos_t *server;
+	buffer_t *capture;
+	conn_score_t *score;
 	thread_hnd_t thread;
-#ifdef _WIN32
-	unsigned int thread_id;
-#endif /* _WIN32 */
+#ifdef WITH_TLS
+	SSL *ssl;
+#endif /* WITH_TLS */
 } client_conn_t;
 
+/**
+ * Server statistics counters, laid out as published in the statistics file.
+ */
+typedef amigos_stats_slot_t stats_t;
+
+/**
+ * Document indexed for full-text search.
+ */
+typedef struct search_doc {
+	char *selector;
+	char *path;
+	uint64_t mtime;
+	uint64_t size;
+	uint32_t nterms;
+	char type;
+	uint8_t alive;
+} search_doc_t;
+
+/**
+ * Occurrence of a term in a document.
+ */
+typedef struct search_posting {
+	uint32_t doc;
+	uint32_t freq;
+} search_posting_t;
+
+/**
+ * Term of the inverted index and the documents it appears in, sorted by
+ * document ID.
+ */
+typedef struct search_term {
+	char *term;
+	uint32_t hash;
+	uint32_t len;
+	uint32_t size;
+	search_posting_t *postings;
+	struct search_term *next;
+} search_term_t;
+
+/**
+ * Inverted index of the text documents and gophermaps in the document root.
+ */
+typedef struct search_index {
+	search_term_t **buckets;
+	uint32_t nbuckets;
+	uint32_t nterms;
+	search_doc_t *docs;
+	uint32_t ndocs;
+	uint32_t docs_size;
+	uint32_t ndead;
+	uint64_t totterms;
+} search_index_t;
+
+/**
+ * Slice of documents to be tokenized by an indexing thread.
+ */
+typedef struct search_job {
+	search_doc_t *docs;
+	uint32_t ndocs;
+	search_index_t *index;
+	thread_hnd_t thread;
+} search_job_t;
+
+/**
+ * Scored search result.
+ */
+typedef struct search_result {
+	uint32_t doc;
+	uint32_t matches;
+	double score;
+} search_result_t;
+
+#ifdef WITH_PLUGINS
+/**
+ * Dynamic handler plugin mapped to a selector prefix.
+ */
+typedef struct plugin {
+	char *prefix;
+	plugin_hnd_t handle;
+	amigos_handler_func handler;
+	amigos_plugin_free_func cleanup;
+} plugin_t;
+
+/**
+ * Output state shared with a plugin through its writer.
+ */
+typedef struct plugin_output {
+	const struct client_conn *conn;
+	buffer_t buf;
+	int failed;
+} plugin_output_t;
+#endif /* WITH_PLUGINS */
+
+/**
+ * Kinds of handlers that a selector prefix can be routed to.
+ */
+typedef enum {
+	ROUTE_STATIC = 0,
+	ROUTE_ALIAS,
+	ROUTE_REDIRECT,
+	ROUTE_PLUGIN,
+	ROUTE_SEARCH,
+	ROUTE_PROXY
+} route_kind_t;
+
+/**
+ * Upstream Gopher server that a selector prefix is proxied to.
+ */
+typedef struct upstream {
+	char *host;
+	char *port;
+	char *selector;
+	uint16_t nconns;
+} upstream_t;
+
+/**
+ * Handler that a selector prefix is routed to.
+ */
+typedef struct route {
+	route_kind_t kind;
+	char *target;
+	gopher_item_t *item;
+	upstream_t *upstream;
+#ifdef WITH_PLUGINS
+	plugin_t *plugin;
+#endif /* WITH_PLUGINS */
+} route_t;
+
+/**
+ * Flags of a cached object.
+ */
+enum cache_flags {
+	CACHE_MENU       = 0x01,
+	CACHE_REFRESHING = 0x02,
+	CACHE_DEAD       = 0x04,
+	CACHE_PINNED     = 0x08,
+	CACHE_WINDOW     = 0x10
+};
+
+/**
+ * Freshness of a cached object.
+ */
+typedef enum {
+	CACHE_MISS = 0,
+	CACHE_FRESH,
+	CACHE_STALE,
+	CACHE_EXPIRED
+} cache_state_t;
+
+/**
+ * Picks cached objects by their key, which isn't necessarily terminated.
+ */
+typedef int (*cache_match_func)(const char *key, size_t len, const void *ctx);
+
+/**
+ * Object stored in the content cache.
+ */
+typedef struct cache_entry {
+	char *key;
+	uint32_t hash;
+	char *data;
+	size_t size;
+	time_t expires;
+	time_t stale;
+	uint8_t flags;
+	unsigned int refs;
+
+	struct cache_entry *hnext;
+	struct cache_entry *prev;
+	struct cache_entry *next;
+} cache_entry_t;
+
+#ifdef HAS_PREFORK
+/**
+ * Slot of the content cache shared between worker processes, followed by the
+ * key and the contents of the object.
+ */
+typedef struct shm_slot {
+	uint32_t hash;
+	uint32_t keylen;
+	uint32_t size;
+	uint8_t valid;
+	uint8_t flags;
+	time_t expires;
+	time_t stale;
+	time_t used;
+} shm_slot_t;
+
+/**
+ * Header of the shared memory segment that holds the content cache shared
+ * between worker processes. The slots are split into shards, each with its
+ * own lock.
+ */
+typedef struct shm_cache {
+	size_t size;
+	pthread_mutex_t locks[CACHE_SHM_SHARDS];
+} shm_cache_t;
+#endif /* HAS_PREFORK */
+
+/**
+ * Size bounded content cache with least recently used eviction. With TinyLFU
+ * admission new objects go into a small window first, and only make it into
+ * the main part of the cache if they're requested more often than the object
+ * they would push out.
+ */
+typedef struct cache {
+	cache_entry_t **buckets;
+	cache_entry_t *head;
+	cache_entry_t *tail;
+	cache_entry_t *window_head;
+	cache_entry_t *window_tail;
+	size_t size;
+	size_t max_size;
+	size_t window_size;
+	size_t window_max;
+	size_t pinned_size;
+	uint8_t *sketch;  /* Frequency sketch, or NULL for plain LRU. */
+	uint32_t sketch_adds;
+	uint32_t count;
+	mutex_t lock;
+	stats_t *stats;
+#ifdef HAS_PREFORK
+	shm_cache_t *shared;
+#endif /* HAS_PREFORK */
+} cache_t;
+
+/**
+ * Background revalidation of a stale proxied object.
+ */
+typedef struct proxy_job {
+	upstream_t *upstream;
+	char *request;
+	char *key;
+	cache_entry_t *entry;
+	struct proxy_job *next;
+} proxy_job_t;
+
+#ifdef HAS_UNIX_SOCKETS
+/**
+ * Cached objects to be flushed through the admin socket.
+ */
+typedef struct admin_flush {
+	const char *key;       /* Key of the proxied object or NULL. */
+	const char *selector;  /* Selector of the menu or NULL for everything. */
+} admin_flush_t;
+#endif /* HAS_UNIX_SOCKETS */
+
+/**
+ * Counter of the Space-Saving algorithm, tracking an item that may be one of
+ * the heaviest in a stream.
+ */
+typedef struct hitter {
+	uint32_t hash;
+	uint64_t count;
+	uint64_t error;  /* How much the count may be overestimated by. */
+	char key[ADMIN_SELECTOR_LEN];
+} hitter_t;
+
+/**
+ * Heaviest items in a stream, by number of occurrences or by the weight of
+ * each one, tracked in a fixed amount of memory.
+ */
+typedef struct hitters {
+	hitter_t items[HITTERS_SIZE];
+	unsigned int len;
+	mutex_t lock;
+} hitters_t;
+
+/**
+ * Selector to be rendered during the warm-up.
+ */
+typedef struct warmup_item {
+	char *selector;
+	uint32_t hash;
+	uint32_t count;  /* Number of times it was listed. */
+	uint32_t order;  /* Position it was first listed at. */
+} warmup_item_t;
+
+/**
+ * Thread rendering selectors during the warm-up.
+ */
+typedef struct warmup_worker {
+	amigos_t *srv;
+	unsigned int slot;  /* Read-copy-update reader slot. */
+	thread_hnd_t thread;
+} warmup_worker_t;
+
+/**
+ * Node of the radix tree used to route selectors to their handlers.
+ */
+typedef struct route_node {
+	char *label;
+	size_t len;
+	route_t *route;
+	struct route_node **children;
+	uint16_t nchildren;
+} route_node_t;
+
+
+/**
+ * Server instance along with all of its state.
+ */
+struct amigos {
+	int af;
+	char *docroot;
+	char *config_path;
+	volatile int running;
+	volatile sig_atomic_t reload_pending;
+	int started;
+	int background;
+	int worker;  /* Index of the pre-fork worker plus one. */
+	config_t *config;
+	time_t last_stats;
+
+	volatile uint32_t rcu_epoch;
+	volatile uint32_t rcu_readers[RCU_MAX_READERS];
+	rcu_retired_t *rcu_retired_list;
+
+	gopher_types_t *gopher_types;
+	uint32_t gopher_types_generation;
+
+	sockfd_t server_socket;
+#ifdef HAS_UNIX_SOCKETS
+	sockfd_t unix_socket;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	sockfd_t tls_socket;
+	SSL_CTX *tls_ctx;
+#endif /* WITH_TLS */
+	client_conn_t connections[MAX_CONNECTIONS];
+	conn_score_t scores[MAX_CONNECTIONS];
+	mutex_t conn_lock;
+#ifdef HAS_PREFORK
+	uint16_t nworkers;
+	pid_t workers[MAX_WORKERS];
+	time_t workers_started[MAX_WORKERS];
+#endif /* HAS_PREFORK */
+
+	stats_t *stats;
+	stats_t local_stats;
+#ifdef HAS_MMAP
+	amigos_stats_header_t *stats_file;
+#endif /* HAS_MMAP */
+	uint64_t last_connections;
+#ifdef WITH_TLS
+	uint64_t last_handshakes;
+#endif /* WITH_TLS */
+
+	route_node_t *routes;
+#ifdef WITH_PLUGINS
+	plugin_t **plugins;
+	uint16_t plugins_len;
+#endif /* WITH_PLUGINS */
+
+	search_index_t *search_index;
+	mutex_t search_lock;
+	thread_hnd_t search_thread;
+	volatile int search_running;
+
+	cache_t content_cache;
+#ifdef HAS_CGROUPS
+	char *memory_cgroup;  /* Directory of our cgroup or NULL. */
+	char *memory_psi;     /* Memory pressure stall information or NULL. */
+	time_t memory_checked;
+#endif /* HAS_CGROUPS */
+	mutex_t proxy_lock;
+	proxy_job_t *proxy_jobs;
+	thread_hnd_t proxy_thread;
+	volatile int proxy_running;
+
+	thread_hnd_t watchdog_thread;
+	volatile int watchdog_running;
+
+	warmup_worker_t warmup_workers[WARMUP_THREADS];
+	warmup_item_t *warmup_items;
+	uint32_t warmup_len;
+	uint32_t warmup_next;
+	uint32_t warmup_done;
+	uint32_t warmup_failed;
+	uint32_t warmup_reported;  /* Tenths of the warm-up reported so far. */
+	uint64_t warmup_started;
+	mutex_t warmup_lock;
+	volatile int warmup_running;
+
+	hitters_t top_requests;  /* Selectors by number of requests. */
+	hitters_t top_bytes;     /* Selectors by bytes sent. */
+	hitters_t top_clients;   /* Client addresses by bytes sent. */
+	time_t hitters_decayed;
+
+#ifdef HAS_UNIX_SOCKETS
+	sockfd_t admin_socket;
+	char *admin_path;
+	thread_hnd_t admin_thread;
+	volatile int admin_running;
+#endif /* HAS_UNIX_SOCKETS */
+};
+
 
 /* Constants for quick validation. */
-static char *invalid_host_c;
+static char invalid_host_c[] = INVALID_HOST;
+
+/* Logging hook and verbosity shared by every server instance. */
+static amigos_log_func log_hook;
+static void *log_hook_ctx;
+static volatile log_level_t log_level = LOG_INFO;
+
+#ifdef _WIN32
+/* Spinlocks that stand in for the atomic operations Windows 95 lacks. */
+static LONG volatile atomic_locks[ATOMIC_LOCKS];
+#endif /* _WIN32 */
 
-/* Global state variables. */
-static int running;
-static char *docroot;
-static char **gopher_types;
-static uint16_t gopher_types_len;
-static sockfd_t server_socket;
-static client_conn_t connections[MAX_CONNECTIONS];
+/* Memory accounted to each subsystem by every server instance. */
+static mem_account_t mem_accounts[MEM_TAGS];
+static const char *mem_tag_names[] = {
+	"server", "config", "connections", "gophermap", "paths", "filetypes",
+	"cache", "proxy", "search"
+};
+
+#ifdef WITH_FAULTS
+/* Calls that faults can be injected into and what they fail with. */
+static const char *fault_op_names[] = {
+	"open", "read", "recv", "send"
+};
+static const int fault_op_errors[] = {
+	EIO, EIO, ECONNRESET, ECONNRESET
+};
+static volatile uint32_t fault_state;
+#endif /* WITH_FAULTS */
+
+#ifdef WITH_PROFILER
+/* Sampling profiler and the names of what the sampled threads were doing. */
+static profiler_t profiler;
+static pthread_mutex_t profiler_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *prof_threads[] = {
+	"search", "proxy", "watchdog", "admin", "warmup", "other"
+};
+static const char *prof_kinds[] = {
+	"static", "redirect", "search", "plugin", "proxy", "not_found", "http",
+	"pending"
+};
+#endif /* WITH_PROFILER */
+
+#ifdef WITH_USDT
+/* Semaphores of the static tracepoints. */
+USDT_SEMAPHORE(conn_accept);
+USDT_SEMAPHORE(request_selector);
+USDT_SEMAPHORE(request_route);
+USDT_SEMAPHORE(reply_start);
+USDT_SEMAPHORE(reply_end);
+USDT_SEMAPHORE(cache_hit);
+USDT_SEMAPHORE(cache_miss);
+USDT_SEMAPHORE(conn_close);
+#endif /* WITH_USDT */
+
+/* Names of the connection phases. */
+static const char *conn_phases[] = {
+	"handshake", "recv", "reply", "close"
+};
+
+#ifndef AMIGOS_LIBRARY
+/* Instance run by the standalone server. */
+static amigos_t *server;
+#endif /* !AMIGOS_LIBRARY */
 
 
 /* Gopher item operations. */
@@ -189,14 +1099,39 @@ gopher_item_t* gopher_item_parse(const char *line);
 void gopher_item_print(gopher_item_t *item);
 
 /* Server operations. */
-sockfd_t server_start(int af, const char *addr, uint16_t port);
-void server_loop(int af, sockfd_t sockfd);
-void server_stop(void);
+sockfd_t server_start(amigos_t *srv, const config_t *cfg);
+sockfd_t server_listen(int af, const config_t *cfg, uint16_t port);
+#ifdef HAS_UNIX_SOCKETS
+sockfd_t server_listen_unix(const config_t *cfg, const char *path);
+#endif /* HAS_UNIX_SOCKETS */
+void server_loop(amigos_t *srv);
+int server_poll(amigos_t *srv);
+int server_accept(amigos_t *srv, sockfd_t listener);
+int server_serve(amigos_t *srv, sockfd_t sockfd, uint8_t flags,
+				 const char *addr);
+void server_background(amigos_t *srv);
+void server_stop(amigos_t *srv);
 thread_ret server_process_request(void *data);
+const route_t* server_resolve(amigos_t *srv, const char *selector,
+							  char aliases[2][256], const char **path);
+int server_dispatch(client_conn_t *conn, const route_t *route,
+					const char *path);
+int server_render(amigos_t *srv, unsigned int slot, const char *selector,
+				  buffer_t *buf);
+unsigned int stats_route_kind(const route_t *route);
+void server_track(client_conn_t *conn, conn_phase_t phase,
+				  const char *selector);
 const char* inet_addr_str(int af, void *addr, char *buf);
+#ifndef _WIN32
+int socket_set_blocking(sockfd_t sockfd, int blocking);
+#endif /* !_WIN32 */
 
 /* Client operations. */
 int client_send_file(const client_conn_t *conn, const char *path);
+int client_send_stream(const client_conn_t *conn, FILE *fh);
+#ifdef HAS_SENDFILE
+int client_sendfile(const client_conn_t *conn, FILE *fh);
+#endif /* HAS_SENDFILE */
 int client_send_dir(const client_conn_t *conn, const char *path, int header);
 int client_send_gophermap(const client_conn_t *conn, const char *path);
 int client_send_item(const client_conn_t *conn, const gopher_item_t *item);
@@ -204,40 +1139,359 @@ int client_send_item_simple(const client_conn_t *conn, char type,
 							const char *msg);
 int client_send_info(const client_conn_t *conn, const char *msg);
 int client_send_error(const client_conn_t *conn, const char *msg);
+int client_send_raw(const client_conn_t *conn, const void *buf, size_t len);
+ssize_t client_recv(const client_conn_t *conn, void *buf, size_t len);
+char* client_static_path(const client_conn_t *conn, const char *root,
+						 const char *path);
+int client_send_static(client_conn_t *conn, const char *root,
+					   const char *path);
+int client_send_menu(client_conn_t *conn, const char *path);
+int client_send_redirect(const client_conn_t *conn,
+						 const gopher_item_t *target);
+int client_send_search(const client_conn_t *conn);
+#ifdef WITH_PLUGINS
+int client_send_plugin(const client_conn_t *conn, const plugin_t *plugin,
+					   const char *path);
+#endif /* WITH_PLUGINS */
+int client_send_proxy(const client_conn_t *conn, const route_t *route,
+					  const char *path);
+
+/* HTTP gateway. */
+void http_process_request(client_conn_t *conn, const char *data, size_t len);
+int http_handle(client_conn_t *conn, char *req, int *keepalive);
+int http_send_file(const client_conn_t *conn, const char *path, int head,
+				   int keepalive);
+int http_send_response(const client_conn_t *conn, int status,
+					   const char *ctype, const char *data, size_t len,
+					   int head, int keepalive);
+int http_send_status(const client_conn_t *conn, int status, int head,
+					 int keepalive);
+int http_send_header(const client_conn_t *conn, int status, const char *ctype,
+					 unsigned long len, int keepalive);
+int http_render_menu(const client_conn_t *conn, const char *data, size_t size,
+					 buffer_t *html);
+int http_append(buffer_t *html, const char *str, int escape);
+int http_append_n(buffer_t *html, const char *str, size_t len, int escape);
+int http_append_url(buffer_t *html, const char *str, size_t len);
+int http_url_safe(const char *url, size_t len);
+int http_url_decode(char *dst, size_t size, const char *src, int plus);
+const char* http_header(const char *headers, const char *name, size_t *len);
+int http_has_token(const char *str, size_t len, const char *token);
+const char* http_content_type(char type, const char *name);
+const char* http_status_text(int status);
 
 /* Gopher file types utilities. */
-int gopher_types_load(const char *fname);
-int gopher_types_append(char type, const char *ext);
-void gopher_types_free(void);
-char gopher_types_infer(const char *fname);
-void gopher_types_dump(void);
+gopher_types_t* gopher_types_load(amigos_t *srv, const char *fname);
+int gopher_types_append(gopher_types_t *types, char type, const char *ext);
+void gopher_types_reload(amigos_t *srv);
+void gopher_types_free(void *ptr);
+char gopher_types_infer(amigos_t *srv, const char *fname);
+void gopher_types_dump(const gopher_types_t *types);
+
+#ifdef WITH_TLS
+/* Transport layer security. */
+int tls_start(amigos_t *srv, const config_t *cfg);
+void tls_stop(amigos_t *srv);
+SSL_CTX* tls_ctx_new(const config_t *cfg, SSL_CTX *prev);
+void tls_ctx_free(void *ptr);
+int tls_reload(amigos_t *srv, const config_t *cfg, const config_t *old);
+int tls_accept(client_conn_t *conn);
+void tls_close(client_conn_t *conn);
+#endif /* WITH_TLS */
+
+/* Statistics. */
+void stats_log(amigos_t *srv, unsigned int elapsed);
+void stats_request(amigos_t *srv, unsigned int kind, uint64_t start);
+void stats_update(amigos_t *srv, unsigned int active);
+void stats_attach(amigos_t *srv, unsigned int slot);
+#ifdef HAS_MMAP
+int stats_open(amigos_t *srv, const char *path, unsigned int nslots);
+void stats_close(amigos_t *srv);
+#endif /* HAS_MMAP */
+uint64_t clock_usec(void);
+
+/* Heavy hitters. */
+void hitters_init(hitters_t *hh);
+void hitters_free(hitters_t *hh);
+void hitters_add(hitters_t *hh, const char *key, uint64_t weight);
+uint64_t hitters_count(hitters_t *hh, const char *key);
+void hitters_decay(hitters_t *hh);
+unsigned int hitters_snapshot(hitters_t *hh, hitter_t *items);
+int hitter_cmp(const void *a, const void *b);
+void hitters_request(client_conn_t *conn, uint64_t sent);
+void hitters_pin(const client_conn_t *conn, cache_entry_t *entry);
+void hitters_update(amigos_t *srv);
+
+#ifdef HAS_CGROUPS
+/* Memory pressure. */
+int memory_init(amigos_t *srv);
+void memory_free(amigos_t *srv);
+void memory_update(amigos_t *srv);
+int memory_read(const char *path, const char *name, char *buf, size_t len);
+#endif /* HAS_CGROUPS */
+
+/* Runtime configuration. */
+config_t* config_new(void);
+config_t* config_load(const char *fname);
+int config_set(config_t *cfg, const char *key, const char *value);
+int config_set_string(char **field, const char *value);
+void config_reload(amigos_t *srv);
+#ifdef HAS_PREFORK
+int config_keep_listeners(config_t *cfg, const config_t *old);
+#endif /* HAS_PREFORK */
+void config_free(void *ptr);
+
+/* Read-copy-update. */
+void rcu_read_lock(amigos_t *srv, unsigned int slot);
+void rcu_read_unlock(amigos_t *srv, unsigned int slot);
+void rcu_retire(amigos_t *srv, void *ptr, void (*free_func)(void *ptr));
+void rcu_reclaim(amigos_t *srv);
+
+/* Selector routing. */
+int router_init(amigos_t *srv);
+int router_load(amigos_t *srv, const char *fname);
+int router_add(amigos_t *srv, const char *prefix, route_kind_t kind,
+			   const char *arg);
+void router_free(amigos_t *srv);
+const route_t* router_match(amigos_t *srv, const char *selector,
+							 const char **path);
+route_t* route_new(amigos_t *srv, const char *prefix, route_kind_t kind,
+				   const char *arg);
+void route_free(route_t *route);
+route_node_t* route_node_new(const char *label, size_t len);
+void route_node_free(route_node_t *node);
+int route_node_insert(route_node_t *root, const char *key, route_t *route);
+
+#ifdef WITH_PLUGINS
+/* Dynamic handler plugins. */
+plugin_t* plugins_append(amigos_t *srv, const char *prefix, const char *path);
+void plugins_free(amigos_t *srv);
+int plugin_writer_write(amigos_writer_t *w, const void *buf, size_t len);
+#endif /* WITH_PLUGINS */
+
+/* Content cache. */
+int cache_init(cache_t *cache, size_t max_size);
+int cache_admission(cache_t *cache);
+void cache_free(cache_t *cache);
+cache_entry_t* cache_get(cache_t *cache, const char *key,
+						 cache_state_t *state);
+cache_entry_t* cache_put(cache_t *cache, const char *key, char *data,
+						 size_t size, unsigned int ttl, unsigned int stale_ttl,
+						 uint8_t flags);
+cache_entry_t* cache_insert(cache_t *cache, cache_entry_t *entry);
+void cache_evict(cache_t *cache, size_t size);
+void cache_resize(cache_t *cache, size_t max_size);
+void cache_admit(cache_t *cache);
+void cache_list_push(cache_t *cache, cache_entry_t *entry);
+void cache_list_remove(cache_t *cache, cache_entry_t *entry);
+cache_entry_t* cache_next(const cache_t *cache, const cache_entry_t *entry);
+void cache_sketch_add(cache_t *cache, uint32_t hash);
+unsigned int cache_sketch_freq(const cache_t *cache, uint32_t hash);
+void cache_release(cache_t *cache, cache_entry_t *entry);
+int cache_claim_refresh(cache_t *cache, cache_entry_t *entry);
+void cache_end_refresh(cache_t *cache, cache_entry_t *entry);
+void cache_unlink(cache_t *cache, cache_entry_t *entry);
+void cache_entry_free(cache_entry_t *entry);
+int cache_pin(cache_t *cache, cache_entry_t *entry);
+void cache_unpin(cache_t *cache);
+unsigned int cache_remove(cache_t *cache, cache_match_func match,
+						  const void *ctx);
+#ifdef HAS_PREFORK
+int cache_share(cache_t *cache);
+
+/* Shared content cache. */
+shm_cache_t* shm_cache_new(void);
+void shm_cache_free(shm_cache_t *shm);
+cache_entry_t* shm_cache_get(shm_cache_t *shm, const char *key, uint32_t hash);
+void shm_cache_put(shm_cache_t *shm, const cache_entry_t *entry);
+unsigned int shm_cache_remove(shm_cache_t *shm, cache_match_func match,
+							  const void *ctx);
+void shm_cache_usage(shm_cache_t *shm, uint32_t *count, size_t *size);
+int shm_cache_lock(shm_cache_t *shm, unsigned int shard);
+shm_slot_t* shm_cache_slot(shm_cache_t *shm, unsigned int shard,
+						   unsigned int i);
+
+/* Pre-fork workers. */
+void prefork_run(amigos_t *srv);
+int prefork_spawn(amigos_t *srv, unsigned int i);
+void prefork_signal(amigos_t *srv, int signum);
+#endif /* HAS_PREFORK */
+
+#ifdef HAS_UNIX_SOCKETS
+/* Admin socket. */
+int admin_init(amigos_t *srv);
+void admin_stop(amigos_t *srv);
+thread_ret admin_thread_func(void *data);
+void admin_handle(amigos_t *srv, sockfd_t sockfd);
+void admin_conns(amigos_t *srv, buffer_t *out);
+void admin_cache(amigos_t *srv, buffer_t *out, const char *filter);
+void admin_top(amigos_t *srv, buffer_t *out, const char *which);
+void admin_top_list(hitters_t *hh, buffer_t *out, const char *title,
+					uint64_t hot);
+void admin_flush(amigos_t *srv, buffer_t *out, const char *selector);
+int admin_flush_match(const char *key, size_t len, const void *ctx);
+void admin_warm(amigos_t *srv, buffer_t *out, const char *selector);
+void admin_loglevel(buffer_t *out, const char *level);
+void admin_memory(buffer_t *out);
+#ifdef WITH_PROFILER
+void admin_profile(amigos_t *srv, buffer_t *out, const char *args);
+#endif /* WITH_PROFILER */
+int admin_printf(buffer_t *out, const char *format, ...);
+#endif /* HAS_UNIX_SOCKETS */
+
+#ifdef WITH_PROFILER
+/* Sampling profiler. */
+int profiler_start(amigos_t *srv, unsigned int hz);
+void profiler_stop(buffer_t *out);
+void profiler_signal(int signum);
+uint8_t profiler_tag(amigos_t *srv, uint8_t *kind);
+void profiler_fold(buffer_t *out);
+char* profiler_symbol(char *sym);
+int profiler_sample_cmp(const void *a, const void *b);
+int profiler_stack_cmp(const void *a, const void *b);
+#endif /* WITH_PROFILER */
+
+/* Request watchdog. */
+int watchdog_init(amigos_t *srv);
+void watchdog_stop(amigos_t *srv);
+thread_ret watchdog_thread_func(void *data);
+void watchdog_check(amigos_t *srv, const config_t *cfg);
+int watchdog_kill(amigos_t *srv, int slot, time_t progressed);
+
+/* Cache warm-up. */
+int warmup_init(amigos_t *srv, const char *fname);
+void warmup_stop(amigos_t *srv);
+thread_ret warmup_thread_func(void *data);
+int warmup_load(amigos_t *srv, const char *fname);
+int warmup_add(amigos_t *srv, const char *selector);
+void warmup_progress(amigos_t *srv, int ok);
+int warmup_item_cmp(const void *a, const void *b);
+
+/* Caching proxy. */
+int proxy_init(amigos_t *srv);
+void proxy_stop(amigos_t *srv);
+thread_ret proxy_thread_func(void *data);
+upstream_t* upstream_new(const char *arg);
+void upstream_free(upstream_t *upstream);
+int proxy_request(const upstream_t *upstream, const char *path,
+				  const char *query, char **request, char **key);
+int proxy_acquire(amigos_t *srv, upstream_t *upstream);
+void proxy_release(amigos_t *srv, upstream_t *upstream);
+int proxy_fetch(const upstream_t *upstream, const char *request,
+				buffer_t *buf, const client_conn_t *conn, int *streamed);
+void proxy_refresh(amigos_t *srv, upstream_t *upstream, const char *request,
+				   const char *key, cache_entry_t *entry);
+int proxy_send(const client_conn_t *conn, const route_t *route,
+			   const char *data, size_t size, int menu);
+int proxy_is_menu(const char *data, size_t size);
+
+/* Full-text search. */
+int search_init(amigos_t *srv);
+void search_stop(amigos_t *srv);
+thread_ret search_thread_func(void *data);
+search_index_t* search_build(amigos_t *srv);
+int search_rescan(amigos_t *srv);
+int search_walk(amigos_t *srv, search_index_t *list, const char *path,
+				const char *selector, int depth);
+int search_tokenize_docs(search_index_t *index, search_doc_t *docs,
+						 uint32_t ndocs, uint32_t base);
+thread_ret search_tokenize_thread(void *data);
+int search_tokenize_file(search_index_t *index, uint32_t doc, const char *path,
+						 uint32_t *nterms);
+int search_tokenize_query(const char *query,
+						  char terms[][SEARCH_TERM_MAX_LEN + 1]);
+search_result_t* search_query(const search_index_t *index,
+							  char terms[][SEARCH_TERM_MAX_LEN + 1],
+							  int nterms, uint32_t *count);
+search_index_t* search_index_new(void);
+void search_index_free(search_index_t *index);
+int search_index_add_doc(search_index_t *index, const search_doc_t *doc);
+int search_index_reserve(search_index_t *index, uint32_t ndocs);
+search_term_t* search_index_term(search_index_t *index, const char *term,
+								 int create);
+int search_index_posting(search_index_t *index, const char *term,
+						 uint32_t doc, uint32_t freq);
+int search_index_merge(search_index_t *dst, const search_index_t *src,
+					   uint32_t offset);
+void search_index_truncate(search_index_t *index, uint32_t ndocs);
+int search_doc_cmp(const void *a, const void *b);
+int search_docp_cmp(const void *a, const void *b);
+int search_result_cmp(const void *a, const void *b);
+uint32_t search_hash(const char *str);
+double search_ln(double x);
+
+/* Threading. */
+int thread_create(thread_hnd_t *thread, thread_func_t *func, void *arg);
+void thread_join(thread_hnd_t thread);
+void thread_sleep(unsigned int ms);
+#ifdef _WIN32
+void win32_atomic_lock(volatile void *p);
+void win32_atomic_unlock(volatile void *p);
+uint32_t win32_atomic_add_u32(volatile uint32_t *p, uint32_t v);
+void win32_atomic_set_u32(volatile uint32_t *p, uint32_t v);
+uint64_t win32_atomic_add_u64(volatile uint64_t *p, uint64_t v);
+void win32_atomic_set_u64(volatile uint64_t *p, uint64_t v);
+void* win32_atomic_get_ptr(void* volatile *p);
+void win32_atomic_set_ptr(void* volatile *p, void *v);
+#endif /* _WIN32 */
+
+/* Memory accounting. */
+void* mem_alloc(mem_tag_t tag, size_t size);
+void* mem_calloc(mem_tag_t tag, size_t nmemb, size_t size);
+void* mem_realloc(mem_tag_t tag, void *ptr, size_t size);
+char* mem_strdup(mem_tag_t tag, const char *str);
+void mem_free(void *ptr);
+void mem_retag(void *ptr, mem_tag_t tag);
+int mem_over(mem_tag_t tag, size_t size);
+void mem_charge(mem_tag_t tag, size_t size, size_t prev);
+void mem_limit(const config_t *cfg);
+
+#ifdef WITH_FAULTS
+/* Fault injection. */
+int fault_parse(config_t *cfg, const char *op, const char *spec);
+int fault_inject(const client_conn_t *conn, fault_op_t op, size_t *len);
+uint32_t fault_random(void);
+#endif /* WITH_FAULTS */
+
+/* Memory buffers. */
+void buffer_init(buffer_t *buf, mem_tag_t tag);
+int buffer_append(buffer_t *buf, const void *data, size_t len);
+void buffer_free(buffer_t *buf);
 
 /* File system utilities. */
 int file_exists(const char *fname);
 int dir_exists(const char *path);
+int path_type(const char *path);
+uint64_t path_mtime(const char *path);
 size_t path_concat(char **buf, const char *sep, ...);
 int path_sanitize(char *path);
 int path_normalize(char *path, char fromsep, char tosep);
 
 /* Logging and debugging. */
-void log_vprintf(log_level_t level, const char *format, va_list ap);
+void log_vprintf(log_level_t level, const char *suffix, const char *format,
+				 va_list ap);
 void log_printf(log_level_t level, const char *format, ...);
 void log_syserr(log_level_t level, const char *format, ...);
 void log_sockerr(log_level_t level, const char *format, ...);
-
-/* Misc. */
-void const_init(void);
-void const_free(void);
+#ifdef WITH_TLS
+void log_tlserr(log_level_t level, const char *format, ...);
+#endif /* WITH_TLS */
 
 
+#ifndef AMIGOS_LIBRARY
 /**
  * Handles a process signal.
  *
  * @param signum Signal number that was triggered.
  */
 void signal_handler(int signum) {
-	if (signum == SIGINT)
-		server_stop();
+	if (signum == SIGINT) {
+		amigos_stop(server);
+#ifdef SIGHUP
+	} else if (signum == SIGHUP) {
+		amigos_reload(server);
+#endif /* SIGHUP */
+	}
 }
 
 #ifdef _WIN32
@@ -254,7 +1508,7 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType) {
 	case CTRL_CLOSE_EVENT:
 	case CTRL_LOGOFF_EVENT:
 	case CTRL_SHUTDOWN_EVENT:
-		server_stop();
+		amigos_stop(server);
 		return TRUE;
 	}
 
@@ -272,7 +1526,9 @@ BOOL WINAPI ConsoleSignalHandler(DWORD dwCtrlType) {
  */
 int main(int argc, char **argv) {
 	int retval;
-	int i;
+#ifndef _WIN32
+	struct sigaction sa;
+#endif /* !_WIN32 */
 #ifdef _WIN32
 	WSADATA wsaData;
 	WORD wVersionRequested;
@@ -284,9 +1540,6 @@ int main(int argc, char **argv) {
 	_CrtMemState snapDiff;
 	_CrtMemCheckpoint(&snapBegin);
 #endif /* DEBUG */
-
-	/* Setup console signal handler. */
-	SetConsoleCtrlHandler(&ConsoleSignalHandler, TRUE);
 #endif /* _WIN32 */
 
 	/* Check if we have a document root folder. */
@@ -294,13 +1547,6 @@ int main(int argc, char **argv) {
 		printf("usage: %s docroot\n", argv[0]);
 		return 1;
 	}
-	docroot = argv[1];
-
-	/* Check if document root folder actually exists. */
-	if (!dir_exists(docroot)) {
-		log_printf(LOG_CRIT, "Document root path '%s' doesn't exist.", docroot);
-		return 1;
-	}
 
 #ifdef _WIN32
 	/* Initialize Winsock stuff. */
@@ -311,48 +1557,38 @@ int main(int argc, char **argv) {
 	}
 #endif /* _WIN32 */
 
+	/* Create our server instance. */
+	retval = 1;
+	server = amigos_new(argv[1], CONFIG_PATH);
+	if (server == NULL)
+		goto finish;
+
 	/* Register signal handlers. */
+#ifdef _WIN32
+	SetConsoleCtrlHandler(&ConsoleSignalHandler, TRUE);
+#endif /* _WIN32 */
 	signal(SIGINT, signal_handler);
 #ifndef _WIN32
 	signal(SIGPIPE, SIG_IGN);  /* Ensures SIGPIPE doesn't crash our server. */
-#endif /* !_WIN32 */
-
-	/* Initialize constants and state variables. */
-	const_init();
-	retval = 0;
-	running = 0;
-	for (i = 0; i < MAX_CONNECTIONS; i++) {
-		connections[i].sockfd = SOCKERR;
-		connections[i].status = 0;
-		connections[i].thread = INVALID_THREAD;
-		connections[i].selector = NULL;
-	}
 
-	/* Load Gopher file type information. */
-	gopher_types = NULL;
-	gopher_types_len = 0;
-	if (!gopher_types_load(FILETYPES_CONF_PATH))
-		retval = 1;
-#ifdef DEBUG
-	gopher_types_dump();
-#endif /* DEBUG */
+	/* Reload the configuration on SIGHUP without restarting system calls. */
+	memset(&sa, '\0', sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGHUP, &sa, NULL);
+#endif /* !_WIN32 */
 
-	/* Start server. */
-	server_socket = server_start(LISTEN_AF, LISTEN_ADDR, LISTEN_PORT);
-	if (server_socket == SOCKERR) {
-		retval = 1;
-		goto finish;
+	/* Start the server and run its listen loop. */
+	if (amigos_start(server)) {
+		amigos_run(server);
+		retval = 0;
 	}
 
-	/* Run server listen loop. */
-	server_loop(LISTEN_AF, server_socket);
-
 finish:
 	/* Free resources and exit. */
-	if (running)
-		server_stop();
-	const_free();
-	gopher_types_free();
+	amigos_free(server);
+	server = NULL;
 #ifdef _WIN32
 	WSACleanup();
 
@@ -375,6 +1611,7 @@ finish:
 
 	return retval;
 }
+#endif /* !AMIGOS_LIBRARY */
 
 /**
  * =============================================================================
@@ -385,13 +1622,41 @@ finish:
 /**
  * Starts up the server.
  *
+ * @param srv Server instance.
+ * @param cfg Configuration with the address and port to bind ourselves to.
+ *
+ * @return Socket file descriptor or SOCKERR if an error occurred.
+ */
+sockfd_t server_start(amigos_t *srv, const config_t *cfg) {
+	sockfd_t sockfd;
+
+	/* Ensure that we don't have a server already running. */
+	if (srv->running != 0) {
+		log_printf(LOG_CRIT, "Tried to start a server while already running.");
+		return SOCKERR;
+	}
+
+	/* Start listening for connections. */
+	sockfd = server_listen(srv->af, cfg, cfg->listen_port);
+	if (sockfd == SOCKERR)
+		return SOCKERR;
+
+	log_printf(LOG_INFO, "Server running on %s:%u", cfg->listen_addr,
+		cfg->listen_port);
+	srv->running = 1;
+	return sockfd;
+}
+
+/**
+ * Creates a socket that's listening for connections.
+ *
  * @param af   Address family.
- * @param addr IP address to bind ourselves to.
+ * @param cfg  Configuration with the address to bind ourselves to.
  * @param port Port to bind ourselves to.
  *
  * @return Socket file descriptor or SOCKERR if an error occurred.
  */
-sockfd_t server_start(int af, const char *addr, uint16_t port) {
+sockfd_t server_listen(int af, const config_t *cfg, uint16_t port) {
 	struct sockaddr_storage sa;
 	sockfd_t sockfd;
 	socklen_t addrlen;
@@ -407,12 +1672,6 @@ sockfd_t server_start(int af, const char *addr, uint16_t port) {
 	addrlen = af == AF_INET ? sizeof(struct sockaddr_in) :
 		sizeof(struct sockaddr_in6);
 
-	/* Ensure that we don't have a server already running. */
-	if (running != 0) {
-		log_printf(LOG_CRIT, "Tried to start a server while already running.");
-		return SOCKERR;
-	}
-
 	/* Get a socket file descriptor. */
 	sockfd = socket(af == AF_INET ? PF_INET : PF_INET6, SOCK_STREAM, 0);
 	if (sockfd == SOCKERR) {
@@ -425,7 +1684,7 @@ sockfd_t server_start(int af, const char *addr, uint16_t port) {
 		struct sockaddr_in *inaddr = (struct sockaddr_in*)&sa;
 		inaddr->sin_family = af;
 		inaddr->sin_port = htons(port);
-		inaddr->sin_addr.s_addr = inet_addr(addr);
+		inaddr->sin_addr.s_addr = inet_addr(cfg->listen_addr);
 	} else {
 		struct sockaddr_in6 *in6addr = (struct sockaddr_in6*)&sa;
 		in6addr->sin6_family = af;
@@ -444,7 +1703,7 @@ sockfd_t server_start(int af, const char *addr, uint16_t port) {
 	}
 
 	/* Set a receive timeout so that we don't block indefinitely. */
-	tv.tv_sec = RECV_TIMEOUT;
+	tv.tv_sec = cfg->recv_timeout;
 	tv.tv_usec = 0;
 #ifdef _WIN32
 	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,
@@ -466,147 +1725,438 @@ sockfd_t server_start(int af, const char *addr, uint16_t port) {
 	}
 
 	/* Start listening on our desired socket. */
-	if (listen(sockfd, LISTEN_BACKLOG) == SOCKERR) {
+	if (listen(sockfd, cfg->backlog) == SOCKERR) {
 		log_sockerr(LOG_CRIT, "Failed to listen on socket");
 		sockclose(sockfd);
 		return SOCKERR;
 	}
 
-	log_printf(LOG_INFO, "Server running on %s:%u", addr, port);
-	running = 1;
 	return sockfd;
 }
 
+#ifdef HAS_UNIX_SOCKETS
 /**
- * Stops the server immediately.
+ * Creates a Unix domain socket that's listening for connections from local
+ * front-ends. A stale socket file left behind by a previous instance is
+ * replaced, but one that's still being listened on is left alone.
+ *
+ * @param cfg  Configuration with the socket options.
+ * @param path Path to bind ourselves to.
+ *
+ * @return Socket file descriptor or SOCKERR if an error occurred.
  */
-void server_stop(void) {
-	int i;
+sockfd_t server_listen_unix(const config_t *cfg, const char *path) {
+	struct sockaddr_un sa;
+	struct timeval tv;
+	struct stat sb;
+	sockfd_t sockfd;
 
-	/* Stop the server. */
-	log_printf(LOG_INFO, "Stopping the server...");
-	running = 0;
-	if ((server_socket != SOCKERR) && (sockclose(server_socket) == SOCKERR))
-		log_sockerr(LOG_ERROR, "Failed to close server socket");
-	server_socket = SOCKERR;
+	/* Populate socket address information. */
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		log_printf(LOG_CRIT, "Unix socket path '%s' is too long",
+			path);
+		return SOCKERR;
+	}
+	memset(&sa, '\0', sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
 
-	/* Close all client connections. */
+	/* Never replace anything that isn't a stale socket. */
+	if ((lstat(path, &sb) == 0) && !S_ISSOCK(sb.st_mode)) {
+		log_printf(LOG_CRIT, "'%s' already exists and isn't a Unix socket, "
+			"refusing to replace it", path);
+		return SOCKERR;
+	}
+
+	/* Get a socket file descriptor. */
+	sockfd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sockfd == SOCKERR) {
+		log_sockerr(LOG_CRIT, "Failed to get a Unix socket file descriptor");
+		return SOCKERR;
+	}
+
+	/* Check if someone is still listening on the socket file. */
+	if (connect(sockfd, (struct sockaddr*)&sa, sizeof(sa)) != SOCKERR) {
+		log_printf(LOG_CRIT, "Unix socket '%s' is already in use",
+			path);
+		sockclose(sockfd);
+		return SOCKERR;
+	}
+	sockclose(sockfd);
+	unlink(path);
+
+	/* Get a fresh socket file descriptor since the last one was used. */
+	sockfd = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sockfd == SOCKERR) {
+		log_sockerr(LOG_CRIT, "Failed to get a Unix socket file descriptor");
+		return SOCKERR;
+	}
+
+	/* Set a receive timeout so that we don't block indefinitely. */
+	tv.tv_sec = cfg->recv_timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			sizeof(tv)) == SOCKERR) {
+		log_sockerr(LOG_CRIT, "Failed to set socket receive timeout");
+		sockclose(sockfd);
+		return SOCKERR;
+	}
+
+	/* Bind address to socket. */
+	if (bind(sockfd, (struct sockaddr*)&sa, sizeof(sa)) == SOCKERR) {
+		log_sockerr(LOG_CRIT, "Failed binding to Unix socket '%s'",
+			path);
+		sockclose(sockfd);
+		return SOCKERR;
+	}
+
+	/* Start listening on our desired socket. */
+	if (listen(sockfd, cfg->backlog) == SOCKERR) {
+		log_sockerr(LOG_CRIT, "Failed to listen on Unix socket");
+		sockclose(sockfd);
+		unlink(path);
+		return SOCKERR;
+	}
+
+	return sockfd;
+}
+#endif /* HAS_UNIX_SOCKETS */
+
+/**
+ * Starts the threads that do the server's background work: building the
+ * search index, revalidating stale proxied objects, keeping an eye on slow
+ * requests, and answering the admin socket.
+ *
+ * @param srv Server instance.
+ */
+void server_background(amigos_t *srv) {
+	srv->background = 1;
+	search_init(srv);
+	proxy_init(srv);
+	watchdog_init(srv);
+#ifdef HAS_UNIX_SOCKETS
+	admin_init(srv);
+#endif /* HAS_UNIX_SOCKETS */
+	if (*srv->config->warmup_path != '\0')
+		warmup_init(srv, srv->config->warmup_path);
+}
+
+/**
+ * Stops the server immediately.
+ *
+ * @param srv Server instance.
+ */
+void server_stop(amigos_t *srv) {
+	int i;
+
+	/* Stop the server. */
+	log_printf(LOG_INFO, "Stopping the server...");
+	srv->running = 0;
+	if ((srv->server_socket != SOCKERR) &&
+			(sockclose(srv->server_socket) == SOCKERR))
+		log_sockerr(LOG_ERROR, "Failed to close server socket");
+	srv->server_socket = SOCKERR;
+#ifdef HAS_UNIX_SOCKETS
+	if ((srv->unix_socket != SOCKERR) &&
+			(sockclose(srv->unix_socket) == SOCKERR))
+		log_sockerr(LOG_ERROR, "Failed to close Unix server socket");
+	srv->unix_socket = SOCKERR;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	if ((srv->tls_socket != SOCKERR) && (sockclose(srv->tls_socket) == SOCKERR))
+		log_sockerr(LOG_ERROR, "Failed to close TLS server socket");
+	srv->tls_socket = SOCKERR;
+#endif /* WITH_TLS */
+
+	/* Close all client connections. */
 	for (i = 0; i < MAX_CONNECTIONS; i++) {
-		if ((connections[i].status & CONN_INUSE) == 0)
+		if ((srv->connections[i].status & CONN_INUSE) == 0)
 			continue;
 
-		connections[i].status = 0;
-		if (connections[i].sockfd != SOCKERR)
-			sockclose(connections[i].sockfd);
-		connections[i].sockfd = SOCKERR;
-		if (connections[i].thread != INVALID_THREAD) {
+		srv->connections[i].status = 0;
+		if (srv->connections[i].sockfd != SOCKERR)
+			sockclose(srv->connections[i].sockfd);
+		srv->connections[i].sockfd = SOCKERR;
+		if (srv->connections[i].thread != INVALID_THREAD) {
 #ifdef _WIN32
-			WaitForSingleObject(connections[i].thread, THREAD_WAIT_TIMEOUT);
-			CloseHandle(connections[i].thread);
+			WaitForSingleObject(srv->connections[i].thread,
+				THREAD_WAIT_TIMEOUT);
+			CloseHandle(srv->connections[i].thread);
 #else
-			pthread_join(connections[i].thread, NULL);
+			pthread_join(srv->connections[i].thread, NULL);
 #endif /* _WIN32 */
 		}
-		connections[i].thread = INVALID_THREAD;
+		srv->connections[i].thread = INVALID_THREAD;
 	}
 }
 
 /**
  * Server listening loop.
  *
- * @param af     Socket address family.
- * @param sockfd Socket in which the server is listening on.
+ * @param srv Server instance.
  */
-void server_loop(int af, sockfd_t sockfd) {
-	while (running) {
-		int numavail;
+void server_loop(amigos_t *srv) {
+	int overloaded;
+	int turn;
+
+	overloaded = 0;
+	turn = 0;
+	while (srv->running) {
+		sockfd_t fds[3];
+		struct timeval tv;
+		fd_set rfds;
+		sockfd_t maxfd;
+		int nfds;
 		int i;
 
-		/* Clean up finished requests. */
-		numavail = 0;
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			/* Looks like a request that has served its purpose. */
-			if (connections[i].status & CONN_FINISHED) {
-				/* Join thread if needed. */
-				if (connections[i].thread != INVALID_THREAD) {
+		/* Do our housekeeping and check if we are overloaded. */
+		if (server_poll(srv) == 0) {
+			if (!overloaded) {
+				log_printf(LOG_WARNING, "No workers available to accept new "
+					"connections.");
+				overloaded = 1;
+			}
+
+			/* Give the workers some time instead of spinning. */
+			thread_sleep(OVERLOAD_WAIT);
+			continue;
+		}
+		overloaded = 0;
+
+		/* Wait for a connection on any of our listening sockets. */
+		nfds = amigos_listeners(srv, fds, 3);
+		FD_ZERO(&rfds);
+		maxfd = fds[0];
+		for (i = 0; i < nfds; i++) {
+			FD_SET(fds[i], &rfds);
+			if (fds[i] > maxfd)
+				maxfd = fds[i];
+		}
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		if ((i = select(maxfd + 1, &rfds, NULL, NULL, &tv)) <= 0) {
 #ifdef _WIN32
-					WaitForSingleObject(connections[i].thread,
-						THREAD_WAIT_TIMEOUT);
-					CloseHandle(connections[i].thread);
+			if ((i < 0) && srv->running)
 #else
-					pthread_join(connections[i].thread, NULL);
+			if ((i < 0) && srv->running && (sockerrno != EINTR))
 #endif /* _WIN32 */
-				}
+				log_sockerr(LOG_ERROR, "Failed to wait for connections");
+			continue;
+		}
 
-				/* Clean up worker state. */
-				connections[i].thread = INVALID_THREAD;
-				connections[i].selector = NULL;
-				connections[i].status = 0;
-			}
+		/* Accept the connection from the listener that has one waiting,
+		 * taking turns so that a busy listener can't starve the others. */
+		for (i = 0; i < nfds; i++) {
+			int j = (turn + i) % nfds;
 
-			/* Count number of available workers. */
-			if (connections[i].status == 0)
-				numavail++;
+			if (FD_ISSET(fds[j], &rfds)) {
+				server_accept(srv, fds[j]);
+				turn = j + 1;
+				break;
+			}
 		}
+	}
 
-		/* Check if we are overloaded. */
-		if (numavail == 0) {
-			log_printf(LOG_WARNING, "No workers available to accept new "
-				"connections.");
-			continue;
-		}
+	/* Looks like we've been asked to stop. */
+	if (srv->server_socket != SOCKERR)
+		server_stop(srv);
+}
 
-		/* Check if we can accept new connections at the moment. */
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			struct sockaddr_storage csa;
-			client_conn_t *conn;
-			socklen_t socklen;
-			char addrstr[INET6_ADDRSTRLEN];
-			int threrr;
+/**
+ * Performs the periodic housekeeping of the server: applies pending
+ * configuration reloads, frees up stale snapshots, reports statistics, and
+ * cleans up finished requests.
+ *
+ * @param srv Server instance.
+ *
+ * @return Number of new connections that can be accepted at the moment.
+ */
+int server_poll(amigos_t *srv) {
+	time_t now;
+	int numavail;
+	int i;
 
-			/* Ignore slots currently in use. */
-			conn = &connections[i];
-			if (conn->status & CONN_INUSE)
-				continue;
+	/* Apply configuration changes and free up stale snapshots. */
+	if (srv->reload_pending) {
+		srv->reload_pending = 0;
+		config_reload(srv);
+		gopher_types_reload(srv);
+	}
+	rcu_reclaim(srv);
 
-			/* Accept the client connection. */
-			socklen = sizeof(csa);
-			conn->sockfd = accept(sockfd, (struct sockaddr*)&csa, &socklen);
-			if (conn->sockfd == SOCKERR) {
-				if (running && (sockerrno != EWOULDBLOCK))
-					log_sockerr(LOG_ERROR, "Failed to accept connection");
-				conn->status = 0;
-				break;
-			}
-			conn->status = CONN_INUSE;
+	/* Periodically report our statistics. */
+	now = time(NULL);
+	if ((now - srv->last_stats) >= STATS_LOG_INTERVAL) {
+		stats_log(srv, (unsigned int)(now - srv->last_stats));
+		srv->last_stats = now;
+	}
 
-			/* Get client address string and announce connection. */
-			if (inet_addr_str(af, &csa, addrstr) == NULL) {
-				log_sockerr(LOG_ERROR, "Failed to get client address string");
-			} else {
-				log_printf(LOG_INFO, "Client connected from %s", addrstr);
+	/* Clean up finished requests. */
+	numavail = 0;
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		/* Looks like a request that has served its purpose. */
+		if (srv->connections[i].status & CONN_FINISHED) {
+			/* Join thread if needed. */
+			if (srv->connections[i].thread != INVALID_THREAD) {
+#ifdef _WIN32
+				WaitForSingleObject(srv->connections[i].thread,
+					THREAD_WAIT_TIMEOUT);
+				CloseHandle(srv->connections[i].thread);
+#else
+				pthread_join(srv->connections[i].thread, NULL);
+#endif /* _WIN32 */
 			}
 
-			/* Process the client's request. */
+			/* Clean up worker state. */
+			srv->connections[i].thread = INVALID_THREAD;
+			srv->connections[i].selector = NULL;
+			srv->connections[i].query = NULL;
+			srv->connections[i].status = 0;
+		}
+
+		/* Count number of available workers. */
+		if (srv->connections[i].status == 0)
+			numavail++;
+	}
+	stats_update(srv, (unsigned int)(MAX_CONNECTIONS - numavail));
+	hitters_update(srv);
+#ifdef HAS_CGROUPS
+	memory_update(srv);
+#endif /* HAS_CGROUPS */
+
+	/* Respect the configured limit of simultaneous clients. */
+	numavail -= MAX_CONNECTIONS - srv->config->max_connections;
+	return (numavail > 0) ? numavail : 0;
+}
+
+/**
+ * Accepts a client connection waiting on one of our listening sockets and
+ * starts processing its request.
+ *
+ * @param srv      Server instance.
+ * @param listener Listening socket that has a connection waiting.
+ *
+ * @return TRUE if the connection is being served, FALSE otherwise.
+ */
+int server_accept(amigos_t *srv, sockfd_t listener) {
+	struct sockaddr_storage csa;
+	socklen_t socklen;
+	sockfd_t sockfd;
+	uint8_t flags;
+	char addrstr[INET6_ADDRSTRLEN];
+
+	/* Figure out which kind of listener the connection came from. */
+	flags = CONN_INUSE;
+#ifdef HAS_UNIX_SOCKETS
+	if (listener == srv->unix_socket)
+		flags |= CONN_UNIX;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	if (listener == srv->tls_socket)
+		flags |= CONN_TLS;
+#endif /* WITH_TLS */
+
+	/* Accept the client connection. */
+	socklen = sizeof(csa);
+	sockfd = accept(listener, (struct sockaddr*)&csa, &socklen);
+	if (sockfd == SOCKERR) {
 #ifdef _WIN32
-			conn->thread = (HANDLE)_beginthreadex(NULL, 0,
-				&server_process_request, conn, 0, &conn->thread_id);
-			threrr = conn->thread == 0;
+		if (srv->running && (sockerrno != EWOULDBLOCK))
 #else
-			threrr = pthread_create(&conn->thread, NULL, server_process_request,
-				conn);
+		if (srv->running && (sockerrno != EWOULDBLOCK) &&
+				(sockerrno != EAGAIN) && (sockerrno != EINTR))
 #endif /* _WIN32 */
-			if (threrr) {
-				log_printf(LOG_ERROR, "Failed to create request processing "
-					"thread");
-				sockclose(conn->sockfd);
-				conn->status = 0;
-				break;
-			}
+			log_sockerr(LOG_ERROR, "Failed to accept connection");
+		return 0;
+	}
+#ifdef HAS_PREFORK
+	/* Some systems pass on the non-blocking flag of pre-fork listeners. */
+	if (srv->nworkers > 0)
+		socket_set_blocking(sockfd, 1);
+#endif /* HAS_PREFORK */
+	counter_add(&srv->stats->connections, 1);
+
+	/* Get client address string and announce connection. */
+	if (flags & CONN_UNIX) {
+		log_printf(LOG_INFO, "Client connected through Unix socket");
+		strcpy(addrstr, "unix");
+	} else if (inet_addr_str(srv->af, &csa, addrstr) == NULL) {
+		log_sockerr(LOG_ERROR, "Failed to get client address string");
+		strcpy(addrstr, "?");
+	} else {
+		log_printf(LOG_INFO, "Client connected from %s", addrstr);
+	}
+
+	/* Process the client's request. */
+	if (!server_serve(srv, sockfd, flags, addrstr)) {
+		sockclose(sockfd);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Hands a connected client socket over to a worker that processes its request
+ * and closes it once finished.
+ *
+ * @param srv    Server instance.
+ * @param sockfd Connected client socket.
+ * @param flags  Connection flags describing where the client came from.
+ * @param addr   Client address string.
+ *
+ * @return TRUE if the connection is being served, FALSE if there are no
+ *         workers available or the worker couldn't be started, in which case
+ *         the socket is still owned by the caller.
+ */
+int server_serve(amigos_t *srv, sockfd_t sockfd, uint8_t flags,
+				 const char *addr) {
+	client_conn_t *conn;
+#ifdef SO_NOSIGPIPE
+	int flag;
+#endif /* SO_NOSIGPIPE */
+	int i;
 
+	/* Look for a slot that's not currently in use. */
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		conn = &srv->connections[i];
+		if ((conn->status & CONN_INUSE) == 0)
 			break;
-		}
 	}
+	if (i == MAX_CONNECTIONS) {
+		log_printf(LOG_WARNING, "No workers available to accept new "
+			"connections.");
+		return 0;
+	}
+
+#ifdef SO_NOSIGPIPE
+	/* Writing to a client that has gone away mustn't kill the host. */
+	flag = 1;
+	setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif /* SO_NOSIGPIPE */
+
+	/* Setup the worker state. */
+	conn->sockfd = sockfd;
+	conn->status = flags;
+	strncpy(conn->addr, addr, sizeof(conn->addr) - 1);
+	conn->addr[sizeof(conn->addr) - 1] = '\0';
+	conn->score = &srv->scores[i];
+	conn->score->accepted = time(NULL);
+	conn->score->sent = 0;
+	conn->score->kind = REQ_PENDING;
+	server_track(conn, (flags & CONN_TLS) ? PHASE_HANDSHAKE : PHASE_RECV, "");
+	USDT3(conn_accept, i, conn->addr, flags);
+
+	/* Process the client's request. */
+	if (!thread_create(&conn->thread, server_process_request, conn)) {
+		log_printf(LOG_ERROR, "Failed to create request processing thread");
+		conn->sockfd = SOCKERR;
+		conn->thread = INVALID_THREAD;
+		conn->status = 0;
+		return 0;
+	}
+
+	return 1;
 }
 
 /**
@@ -618,26 +2168,69 @@ void server_loop(int af, sockfd_t sockfd) {
  */
 thread_ret server_process_request(void *data) {
 	client_conn_t *conn;
+	const route_t *route;
+	const char *rpath;
 	char selector[256];
-	char *fpath;
+	char aliases[2][256];
+	unsigned int slot;
+	struct timeval tv;
+	uint64_t start;
+	uint64_t sent;
+	ssize_t recvd;
 	ssize_t len;
-	char sep;
 	int i;
 
 	/* Initialize values. */
 	conn = (client_conn_t*)data;
 	conn->selector = selector;
-	sep = PATH_SEPARATOR;
-	fpath = NULL;
+	conn->query = NULL;
+	conn->capture = NULL;
+
+	/* Grab a consistent snapshot of the configuration for this request. */
+	slot = (unsigned int)(conn - conn->server->connections);
+	rcu_read_lock(conn->server, slot);
+	conn->config = (const config_t*)atomic_get_ptr(&conn->server->config);
+
+	/* Set a receive timeout so that we don't block indefinitely. */
+	tv.tv_sec = conn->config->recv_timeout;
+	tv.tv_usec = 0;
+#ifdef _WIN32
+	setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,
+		sizeof(tv));
+#else
+	setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif /* _WIN32 */
 
-	/* Read the selector from client's request. */
-	if ((len = recv(conn->sockfd, selector, 255, 0)) < 0) {
-		if (running)
+#ifdef WITH_TLS
+	/* Perform the TLS handshake. */
+	conn->ssl = NULL;
+	if ((conn->status & CONN_TLS) && !tls_accept(conn))
+		goto close_conn;
+	server_track(conn, PHASE_RECV, NULL);
+#endif /* WITH_TLS */
+
+	/* Read the selector from client's request, which may arrive in pieces. */
+	len = 0;
+	do {
+		recvd = client_recv(conn, selector + len, 255 - len);
+		if (recvd <= 0)
+			break;
+		len += recvd;
+	} while ((len < 255) && (memchr(selector, '\n', len) == NULL));
+	if ((recvd < 0) && (len == 0)) {
+		if (conn->server->running)
 			log_sockerr(LOG_ERROR, "Failed to receive selector");
 		goto close_conn;
 	}
 	selector[len] = '\0';
 
+	/* Web browsers get served through the HTTP gateway. */
+	if (((len >= 4) && (strncmp(selector, "GET ", 4) == 0)) ||
+			((len >= 5) && (strncmp(selector, "HEAD ", 5) == 0))) {
+		http_process_request(conn, selector, (size_t)len);
+		goto close_conn;
+	}
+
 	/* Ensure the request wasn't too long. */
 	if (len >= 255) {
 		log_printf(LOG_WARNING, "Selector unusually long, closing connection.");
@@ -645,75 +2238,51 @@ thread_ret server_process_request(void *data) {
 		goto close_conn;
 	}
 
-	/* Terminate selector string before CRLF. */
+	/* Terminate selector string before CRLF and split off the query. */
 	for (i = 0; i < len; i++) {
-		if ((selector[i] == '\t') || (selector[i] == '\r') ||
-				(selector[i] == '\n')) {
+		if (selector[i] == '\t') {
+			selector[i] = '\0';
+			if (conn->query == NULL)
+				conn->query = selector + i + 1;
+		} else if ((selector[i] == '\r') || (selector[i] == '\n')) {
 			selector[i] = '\0';
 			break;
 		}
 	}
 
 	/* Sanitize selector before using it. */
+	start = clock_usec();
 	path_sanitize(selector);
+	server_track(conn, PHASE_REPLY, selector);
 	log_printf(LOG_INFO, "Client requested selector '%s'", selector);
-
-	/* Build local file request path from selector. */
-	if (*selector == '\0') {
-		fpath = strdup(docroot);
-	} else if (path_concat(&fpath, &sep, docroot, selector,
-			NULL) == 0) {
-		log_printf(LOG_ERROR, "Failed to build request path for selector %s",
-			selector);
-		goto close_conn;
-	}
+	USDT3(request_selector, slot, selector, conn->query);
 
 	/* Reply to client. */
-	if (dir_exists(fpath)) {
-		/* Selector matches a directory. */
-		char *mapfile;
-
-		/* Check if there's a gophermap file in the directory. */
-		if (!path_concat(&mapfile, &sep, fpath, "gophermap", NULL))
-			goto close_conn;
-		if (file_exists(mapfile)) {
-			/* Send gophermap. */
-			if (!client_send_gophermap(conn, mapfile)) {
-				free(mapfile);
-				goto close_conn;
-			}
-		} else {
-			/* List the contents of the directory. */
-			if (!client_send_dir(conn, fpath, 1)) {
-				free(mapfile);
-				goto close_conn;
-			}
-		}
-
-		free(mapfile);
-		mapfile = NULL;
-		send(conn->sockfd, ".", 1, 0);
-	} else if (file_exists(fpath)) {
-		/* Selector matches a file. */
-		if (!client_send_file(conn, fpath))
-			goto close_conn;
-	} else {
-		/* Looks like the client requested a path that doesn't exist. */
-		if (!client_send_error(conn, "Selector not found."))
-			goto close_conn;
-		send(conn->sockfd, ".", 1, 0);
-	}
+	sent = conn->score->sent;
+	route = server_resolve(conn->server, selector, aliases, &rpath);
+	conn->score->kind = (uint8_t)stats_route_kind(route);
+	USDT3(request_route, slot, conn->score->kind, rpath);
+	USDT2(reply_start, slot, conn->score->kind);
+	server_dispatch(conn, route, rpath);
+	USDT4(reply_end, slot, conn->score->kind, conn->score->sent - sent,
+		USDT_ENABLED(reply_end) ? (clock_usec() - start) : 0);
+	stats_request(conn->server, stats_route_kind(route), start);
+	hitters_request(conn, conn->score->sent - sent);
 
 close_conn:
-	/* Free up allocated resources. */
-	if (fpath != NULL)
-		free(fpath);
-	fpath = NULL;
-
 	/* Close the client connection and signal that we are finished here. */
+	server_track(conn, PHASE_CLOSE, NULL);
+	USDT2(conn_close, slot, conn->score->sent);
+#ifdef WITH_TLS
+	tls_close(conn);
+#endif /* WITH_TLS */
+	mutex_lock(&conn->server->conn_lock);
 	if (conn->sockfd != SOCKERR)
 		sockclose(conn->sockfd);
 	conn->sockfd = SOCKERR;
+	mutex_unlock(&conn->server->conn_lock);
+	conn->config = NULL;
+	rcu_read_unlock(conn->server, slot);
 	conn->status |= CONN_FINISHED;
 
 #ifdef _WIN32
@@ -725,6 +2294,175 @@ close_conn:
 #endif /* _WIN32 */
 }
 
+/**
+ * Resolves the aliases of a selector until we get to the actual handler of the
+ * request.
+ *
+ * @param srv      Server instance.
+ * @param selector Sanitized selector requested by the client.
+ * @param aliases  Scratch space for the selectors that aliases resolve to.
+ * @param path     Pointer to the part of the selector after the route's prefix.
+ *
+ * @return Route that handles the selector or NULL if there isn't one.
+ */
+const route_t* server_resolve(amigos_t *srv, const char *selector,
+							  char aliases[2][256], const char **path) {
+	const route_t *route;
+	int i;
+
+	route = router_match(srv, selector, path);
+	for (i = 0; (route != NULL) && (route->kind == ROUTE_ALIAS); i++) {
+		char *alias = aliases[i % 2];
+
+		if (i >= ROUTE_MAX_ALIAS_HOPS) {
+			log_printf(LOG_WARNING, "Too many aliases for selector '%s'",
+				selector);
+			return NULL;
+		}
+
+		snprintf(alias, 256, "%s%s%s", route->target,
+			(**path == '\0') ? "" : "/", *path);
+		route = router_match(srv, alias, path);
+	}
+
+	return route;
+}
+
+/**
+ * Replies to the client using the handler of the requested selector.
+ *
+ * @param conn  Client connection object.
+ * @param route Route that handles the selector or NULL if there isn't one.
+ * @param path  Part of the selector after the route's prefix.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int server_dispatch(client_conn_t *conn, const route_t *route,
+					const char *path) {
+	if (route == NULL) {
+		if (!client_send_error(conn, "Selector not found."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
+	}
+
+	switch (route->kind) {
+		case ROUTE_STATIC:
+			return client_send_static(conn, route->target, path);
+		case ROUTE_REDIRECT:
+			return client_send_redirect(conn, route->item);
+		case ROUTE_SEARCH:
+			return client_send_search(conn);
+#ifdef WITH_PLUGINS
+		case ROUTE_PLUGIN:
+			return client_send_plugin(conn, route->plugin, path);
+#endif /* WITH_PLUGINS */
+		case ROUTE_PROXY:
+			return client_send_proxy(conn, route, path);
+		default:
+			log_printf(LOG_ERROR, "Unknown route kind %d for selector '%s'",
+				route->kind, conn->selector);
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Renders a selector as if a client had requested it, so that its reply ends
+ * up in the content cache, without sending it anywhere.
+ *
+ * @param srv      Server instance.
+ * @param slot     Read-copy-update reader slot of the calling thread.
+ * @param selector Selector to be rendered.
+ * @param buf      Buffer that gets the rendered reply.
+ *
+ * @return TRUE if the selector was rendered, FALSE if it failed, or -1 if
+ *         there's nothing that handles it.
+ */
+int server_render(amigos_t *srv, unsigned int slot, const char *selector,
+				  buffer_t *buf) {
+	client_conn_t conn;
+	conn_score_t score;
+	const route_t *route;
+	const char *rpath;
+	char sel[256];
+	char aliases[2][256];
+	int ret;
+
+	/* Set up a connection that captures everything. */
+	strncpy(sel, selector, sizeof(sel) - 1);
+	sel[sizeof(sel) - 1] = '\0';
+	path_sanitize(sel);
+	memset(&conn, 0, sizeof(client_conn_t));
+	memset(&score, 0, sizeof(conn_score_t));
+	strncpy(score.selector, sel, ADMIN_SELECTOR_LEN - 1);
+	conn.status = CONN_INUSE;
+	conn.sockfd = SOCKERR;
+	conn.selector = sel;
+	conn.query = NULL;
+	strcpy(conn.addr, "local");
+	conn.server = srv;
+	conn.capture = buf;
+	conn.score = &score;
+	conn.thread = INVALID_THREAD;
+
+	/* Render it. */
+	rcu_read_lock(srv, slot);
+	conn.config = (const config_t*)atomic_get_ptr(&srv->config);
+	route = server_resolve(srv, sel, aliases, &rpath);
+	ret = (route != NULL) ? server_dispatch(&conn, route, rpath) : -1;
+	rcu_read_unlock(srv, slot);
+
+	return ret;
+}
+
+/**
+ * Gets the kind of request that is handled by a route, for statistics.
+ *
+ * @param route Route that handled the request or NULL if there wasn't one.
+ *
+ * @return Kind of request as defined in amigos_stats.h.
+ */
+unsigned int stats_route_kind(const route_t *route) {
+	if (route == NULL)
+		return AMIGOS_STATS_REQ_NOT_FOUND;
+
+	switch (route->kind) {
+		case ROUTE_REDIRECT:
+			return AMIGOS_STATS_REQ_REDIRECT;
+		case ROUTE_SEARCH:
+			return AMIGOS_STATS_REQ_SEARCH;
+#ifdef WITH_PLUGINS
+		case ROUTE_PLUGIN:
+			return AMIGOS_STATS_REQ_PLUGIN;
+#endif /* WITH_PLUGINS */
+		case ROUTE_PROXY:
+			return AMIGOS_STATS_REQ_PROXY;
+		default:
+			break;
+	}
+
+	return AMIGOS_STATS_REQ_STATIC;
+}
+
+/**
+ * Updates the progress of a client connection that's shown by the admin
+ * socket.
+ *
+ * @param conn     Client connection object.
+ * @param phase    What the connection is doing now.
+ * @param selector Selector being handled or NULL to keep the current one.
+ */
+void server_track(client_conn_t *conn, conn_phase_t phase,
+				  const char *selector) {
+	if (selector != NULL) {
+		strncpy(conn->score->selector, selector, ADMIN_SELECTOR_LEN - 1);
+		conn->score->selector[ADMIN_SELECTOR_LEN - 1] = '\0';
+	}
+	conn->score->progressed = time(NULL);
+	conn->score->phase = (uint8_t)phase;
+}
+
 /**
  * Gets a string representation of a network address structure.
  *
@@ -753,6 +2491,32 @@ const char* inet_addr_str(int af, void *addr, char *buf) {
 #endif /* !inet_ntop */
 }
 
+#ifndef _WIN32
+/**
+ * Switches a socket between blocking and non-blocking mode.
+ *
+ * @param sockfd   Socket to be changed.
+ * @param blocking Should operations on the socket block?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int socket_set_blocking(sockfd_t sockfd, int blocking) {
+	int flags;
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	if (flags != -1) {
+		flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+		flags = fcntl(sockfd, F_SETFL, flags);
+	}
+	if (flags == -1) {
+		log_syserr(LOG_ERROR, "Failed to change the blocking mode of a socket");
+		return 0;
+	}
+
+	return 1;
+}
+#endif /* !_WIN32 */
+
 /**
  * =============================================================================
  * === Client Replies ==========================================================
@@ -760,34 +2524,353 @@ const char* inet_addr_str(int af, void *addr, char *buf) {
  */
 
 /**
- * Replies to the client with the contents of a file.
+ * Replies to the client with the contents of a file or directory served from
+ * a directory in the local file system.
  *
  * @param conn Client connection object.
- * @param path Path to the file to send to the client.
+ * @param root Directory that files are being served from.
+ * @param path Path relative to the root directory that was requested.
  *
  * @return TRUE if the operation was successful, FALSE otherwise.
  */
-int client_send_file(const client_conn_t *conn, const char *path) {
-	FILE *fh;
-	size_t flen;
-	uint8_t buf[256];
+int client_send_static(client_conn_t *conn, const char *root,
+					   const char *path) {
+	char *fpath;
 	int ret;
 
-	/* Open file for reading. */
-	ret = 1;
-	fh = fopen(path, "rb");
-	if (fh == NULL) {
-		log_printf(LOG_ERROR, "Failed to open file %s for request selector "
-			"'%s'", path, conn->selector);
+	/* Build local file request path from selector. */
+	fpath = client_static_path(conn, root, path);
+	if (fpath == NULL)
 		return 0;
+
+	/* Reply to client. */
+	ret = 0;
+	switch (path_type(fpath)) {
+		case PATH_DIR:
+			/* Send the directory's menu. */
+			ret = client_send_menu(conn, fpath);
+			if (ret)
+				ret = client_send_raw(conn, ".", 1);
+			break;
+		case PATH_FILE:
+			/* Selector matches a file. */
+			ret = client_send_file(conn, fpath);
+			break;
+		default:
+			/* Looks like the client requested a path that doesn't exist. */
+			if (client_send_error(conn, "Selector not found."))
+				ret = client_send_raw(conn, ".", 1);
+			break;
 	}
 
-	/* Pipe file contents straight to socket. */
-	while ((flen = fread(buf, sizeof(uint8_t), 256, fh)) > 0) {
-		if (send(conn->sockfd, buf, flen, 0) < 0) {
-#ifdef _WIN32
-			log_sockerr(LOG_ERROR, "Failed to pipe contents of file to socket");
+	/* Free up allocated resources. */
+	mem_free(fpath);
+	fpath = NULL;
+
+	return ret;
+}
+
+/**
+ * Builds the path of the local file that a selector of a static route refers
+ * to.
+ *
+ * @warning This function allocates memory that must be free'd by you!
+ *
+ * @param conn Client connection object.
+ * @param root Directory that files are being served from.
+ * @param path Path relative to the root directory that was requested.
+ *
+ * @return Path to the local file or NULL if an error occurred.
+ */
+char* client_static_path(const client_conn_t *conn, const char *root,
+						 const char *path) {
+	char *fpath;
+	char sep;
+
+	sep = PATH_SEPARATOR;
+	fpath = NULL;
+	if (*path == '\0') {
+		fpath = mem_strdup(MEM_PATHS, root);
+		if (fpath == NULL)
+			log_syserr(LOG_ERROR, "Failed to allocate request path");
+	} else if (path_concat(&fpath, &sep, root, path, NULL) == 0) {
+		log_printf(LOG_ERROR, "Failed to build request path for selector %s",
+			conn->selector);
+		return NULL;
+	}
+
+	return fpath;
+}
+
+/**
+ * Replies to the client with the menu of a directory, without its terminator.
+ * Rendered menus are kept in the content cache for as long as the directory,
+ * its gophermap, the file type associations, and the advertised host don't
+ * change.
+ *
+ * @param conn Client connection object.
+ * @param path Path to the directory.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int client_send_menu(client_conn_t *conn, const char *path) {
+	amigos_t *srv;
+	const gopher_types_t *types;
+	cache_entry_t *entry;
+	cache_state_t state;
+	buffer_t *prev;
+	buffer_t buf;
+	char *mapfile;
+	char *key;
+	char sep;
+	uint64_t map_mtime;
+	int ret;
+
+	/* Check if there's a gophermap file in the directory. */
+	srv = conn->server;
+	sep = PATH_SEPARATOR;
+	mapfile = NULL;
+	if (!path_concat(&mapfile, &sep, path, "gophermap", NULL))
+		return 0;
+	map_mtime = path_mtime(mapfile);
+
+	/* Build the cache key out of everything that goes into the menu. */
+	types = (const gopher_types_t*)atomic_get_ptr(&srv->gopher_types);
+	key = (char*)mem_alloc(MEM_CONNECTIONS, strlen(conn->config->hostname) +
+		strlen(conn->selector) + 80);
+	if (key == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate menu cache key");
+		mem_free(mapfile);
+		return 0;
+	}
+	sprintf(key, "menu\t%s\t%u\t%lu\t%lu\t%lu\t%s", conn->config->hostname,
+		conn->config->port, (types == NULL) ? 0UL :
+		(unsigned long)types->generation, (unsigned long)path_mtime(path),
+		(unsigned long)map_mtime, conn->selector);
+
+	/* Serve it straight from the cache if we can. */
+	entry = cache_get(&srv->content_cache, key, &state);
+	if (state == CACHE_FRESH) {
+		hitters_pin(conn, entry);
+		ret = client_send_raw(conn, entry->data, entry->size);
+		cache_release(&srv->content_cache, entry);
+		mem_free(mapfile);
+		mem_free(key);
+		return ret;
+	}
+	if (entry != NULL)
+		cache_release(&srv->content_cache, entry);
+
+	/* Render the menu into a buffer. */
+	buffer_init(&buf, MEM_CONNECTIONS);
+	prev = conn->capture;
+	conn->capture = &buf;
+	if (file_exists(mapfile)) {
+		ret = client_send_gophermap(conn, mapfile);
+	} else {
+		ret = client_send_dir(conn, path, 1);
+	}
+	conn->capture = prev;
+	mem_free(mapfile);
+	mapfile = NULL;
+
+	/* Cache it if it was rendered properly and send it. */
+	entry = NULL;
+	if (ret) {
+		entry = cache_put(&srv->content_cache, key, buf.data, buf.len,
+			MENU_CACHE_TTL, 0, CACHE_MENU);
+	}
+	if (entry != NULL) {
+		hitters_pin(conn, entry);
+		buffer_init(&buf, MEM_CONNECTIONS);
+		if (!client_send_raw(conn, entry->data, entry->size))
+			ret = 0;
+		cache_release(&srv->content_cache, entry);
+	} else {
+		if ((buf.len > 0) && !client_send_raw(conn, buf.data, buf.len))
+			ret = 0;
+		buffer_free(&buf);
+	}
+	mem_free(key);
+
+	return ret;
+}
+
+/**
+ * Replies to the client with a menu pointing to the new location of a
+ * selector.
+ *
+ * @param conn   Client connection object.
+ * @param target Item pointing to the new location.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int client_send_redirect(const client_conn_t *conn,
+						 const gopher_item_t *target) {
+	char buf[256];
+	size_t len;
+
+	/* Tell the client what's happening. */
+	if (!client_send_info(conn, "This resource has moved to:"))
+		return 0;
+
+	/* Send the new location as is, since it may be on another server. */
+	len = snprintf(buf, 256, "%c%s\t%s\t%s\t%u\r\n.", target->type,
+		target->name, target->selector, (target->hostname == NULL) ?
+		conn->config->hostname : target->hostname,
+		(target->port == INVALID_PORT) ? conn->config->port : target->port);
+	if (len >= 256) {
+		log_printf(LOG_ERROR, "Redirect line too long for '%s'", target->name);
+		return 0;
+	}
+
+	return client_send_raw(conn, buf, len);
+}
+
+/**
+ * Replies to the client with the contents of a file.
+ *
+ * @param conn Client connection object.
+ * @param path Path to the file to send to the client.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int client_send_file(const client_conn_t *conn, const char *path) {
+	FILE *fh;
+	int ret;
+
+	/* Open file for reading. */
+	fh = fault_fopen(conn, path, "rb");
+	if (fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open file %s for request selector "
+			"'%s'", path, conn->selector);
+		return 0;
+	}
+
+	/* Send it and close the file handle. */
+	ret = client_send_stream(conn, fh);
+	fclose(fh);
+	return ret;
+}
+
+/**
+ * Replies to the client with the contents of an open file.
+ *
+ * @param conn Client connection object.
+ * @param fh   Handle of the file to be sent, positioned at its start.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int client_send_stream(const client_conn_t *conn, FILE *fh) {
+	size_t flen;
+	uint8_t buf[256];
+	int ret;
+
+#ifdef HAS_SENDFILE
+	/* Let the kernel pipe the file straight to the socket if we can. */
+	if (conn->capture == NULL) {
+		ret = client_sendfile(conn, fh);
+		if (ret >= 0)
+			return ret;
+	}
+#endif /* HAS_SENDFILE */
+
+	/* Pipe file contents straight to socket. */
+	ret = 1;
+	for (;;) {
+		flen = sizeof(buf);
+#ifdef WITH_FAULTS
+		if (!fault_inject(conn, FAULT_READ, &flen)) {
+			log_syserr(LOG_ERROR, "Failed to read file for request selector");
+			ret = 0;
+			break;
+		}
+#endif /* WITH_FAULTS */
+		flen = fread(buf, sizeof(uint8_t), flen, fh);
+		if (flen == 0)
+			break;
+
+		if (!client_send_raw(conn, buf, flen)) {
+			ret = 0;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+#ifdef HAS_SENDFILE
+/**
+ * Sends the contents of a file to the client without copying it through
+ * userspace. Encrypted connections can only do this when the kernel is the one
+ * taking care of the encryption.
+ *
+ * @param conn Client connection object.
+ * @param fh   Handle of the file to be sent.
+ *
+ * @return TRUE if the operation was successful, FALSE if it failed, or -1 if
+ *         the file has to be sent the old fashioned way.
+ */
+int client_sendfile(const client_conn_t *conn, FILE *fh) {
+	struct stat sb;
+	off_t offset;
+	size_t count;
+	ssize_t sent;
+	int fd;
+
+	/* Only regular files can be sent this way. */
+	fd = fileno(fh);
+	if ((fstat(fd, &sb) != 0) || !S_ISREG(sb.st_mode))
+		return -1;
+	offset = 0;
+
+#ifdef WITH_TLS
+	if (conn->ssl != NULL) {
+#ifdef TLS_HAS_SENDFILE
+		if (!BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+			return -1;
+
+		while (offset < sb.st_size) {
+			count = (size_t)(sb.st_size - offset);
+			if (count > SEND_CHUNK_SIZE)
+				count = SEND_CHUNK_SIZE;
+			sent = SSL_sendfile(conn->ssl, fd, offset, count, 0);
+			if (sent <= 0) {
+				log_tlserr(LOG_ERROR, "Failed to send file to client");
+				return 0;
+			}
+
+			counter_add(&conn->server->stats->tls_bytes_out, sent);
+			counter_add(&conn->server->stats->bytes_out, sent);
+			conn->score->sent += sent;
+			conn->score->progressed = time(NULL);
+			offset += sent;
+		}
+
+		return 1;
 #else
+		return -1;
+#endif /* TLS_HAS_SENDFILE */
+	}
+#endif /* WITH_TLS */
+
+	/* Send it in chunks, so that the watchdog can tell it's moving along. */
+	while (offset < sb.st_size) {
+		count = (size_t)(sb.st_size - offset);
+		if (count > SEND_CHUNK_SIZE)
+			count = SEND_CHUNK_SIZE;
+#ifdef WITH_FAULTS
+		if (!fault_inject(conn, FAULT_SEND, &count)) {
+			log_sockerr(LOG_ERROR, "Failed to pipe contents of file to socket");
+			return 0;
+		}
+#endif /* WITH_FAULTS */
+		sent = sendfile(conn->sockfd, fd, &offset, count);
+		if (sent < 0) {
+			/* Some file systems don't support it. */
+			if ((offset == 0) && ((errno == EINVAL) || (errno == ENOSYS)))
+				return -1;
+
 			if (sockerrno == EPIPE) {
 				log_sockerr(LOG_WARNING, "Client closed connection before file "
 					"transfer finished");
@@ -795,17 +2878,19 @@ int client_send_file(const client_conn_t *conn, const char *path) {
 				log_sockerr(LOG_ERROR, "Failed to pipe contents of file to "
 					"socket");
 			}
-#endif /* _WIN32 */
 
-			ret = 0;
+			return 0;
+		} else if (sent == 0) {
 			break;
 		}
+		counter_add(&conn->server->stats->bytes_out, sent);
+		conn->score->sent += sent;
+		conn->score->progressed = time(NULL);
 	}
 
-	/* Close file handle. */
-	fclose(fh);
-	return ret;
+	return 1;
 }
+#endif /* HAS_SENDFILE */
 
 /**
  * Replies to the client with a directory listing.
@@ -841,7 +2926,7 @@ int client_send_dir(const client_conn_t *conn, const char *path, int header) {
 		return 0;
 	}
 #else
-	dh = opendir(path);
+	dh = fault_opendir(conn, path);
 	if (dh == NULL) {
 		log_syserr(LOG_ERROR, "Failed to open directory for listing");
 		return 0;
@@ -858,8 +2943,17 @@ int client_send_dir(const client_conn_t *conn, const char *path, int header) {
 
 	/* Set common Gopher item parameters. */
 	item = gopher_item_new();
-	item->hostname = strdup(DEFAULT_HOSTNAME);
-	item->port = DEFAULT_PORT;
+	if (item == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate directory listing item");
+#ifdef _WIN32
+		FindClose(hFind);
+#else
+		closedir(dh);
+#endif /* _WIN32 */
+		return 0;
+	}
+	item->hostname = mem_strdup(MEM_GOPHERMAP, conn->config->hostname);
+	item->port = conn->config->port;
 
 	/* Read directory contents. */
 #ifdef _WIN32
@@ -880,7 +2974,8 @@ int client_send_dir(const client_conn_t *conn, const char *path, int header) {
 		}
 
 		/* Build up Gopher item entry. */
-		item->type = bIsDir ? '1' : gopher_types_infer(ffd.cFileName);
+		item->type = bIsDir ? '1' :
+			gopher_types_infer(conn->server, ffd.cFileName);
 		snprintf(name, 71, "%s%c", ffd.cFileName, bIsDir ? '/' : ' ');
 		item->name = name;
 		item->selector = ffd.cFileName;
@@ -898,7 +2993,7 @@ int client_send_dir(const client_conn_t *conn, const char *path, int header) {
 
 		/* Build up Gopher item entry. */
 		item->type = dirent->d_type == DT_DIR ? '1' :
-			gopher_types_infer(dirent->d_name);
+			gopher_types_infer(conn->server, dirent->d_name);
 		snprintf(name, 71, "%s%c", dirent->d_name,
 			(dirent->d_type == DT_DIR ? '/' : ' '));
 		item->name = name;
@@ -949,7 +3044,7 @@ int client_send_gophermap(const client_conn_t *conn, const char *path) {
 
 	/* Open file for reading. */
 	ret = 1;
-	fh = fopen(path, "r");
+	fh = fault_fopen(conn, path, "r");
 	if (fh == NULL) {
 		log_printf(LOG_ERROR, "Failed to open gophermap for request selector "
 			"'%s'", conn->selector);
@@ -963,6 +3058,15 @@ int client_send_gophermap(const client_conn_t *conn, const char *path) {
 		char *tmp;
 		int tabs;
 
+#ifdef WITH_FAULTS
+		if (!fault_inject(conn, FAULT_READ, NULL)) {
+			log_syserr(LOG_ERROR, "Failed to read gophermap for request "
+				"selector");
+			ret = 0;
+			break;
+		}
+#endif /* WITH_FAULTS */
+
 		/* Strip newline and count tabs. */
 		linenum++;
 		tmp = buf;
@@ -982,10 +3086,16 @@ int client_send_gophermap(const client_conn_t *conn, const char *path) {
 				break;
 			} else if (strcmp(buf, "*") == 0) {
 				/* Render a directory listing. */
-				char *dir = strdup(path);
+				char *dir = mem_strdup(MEM_PATHS, path);
+				if (dir == NULL) {
+					log_syserr(LOG_ERROR, "Failed to allocate gophermap "
+						"directory path");
+					ret = 0;
+					continue;
+				}
 				dir[strlen(path) - 10] = '\0';
 				ret = client_send_dir(conn, dir, 0);
-				free(dir);
+				mem_free(dir);
 				dir = NULL;
 				continue;
 			}
@@ -1026,10 +3136,20 @@ int client_send_gophermap(const client_conn_t *conn, const char *path) {
  * @return TRUE if the operation was successful, FALSE otherwise.
  */
 int client_send_item(const client_conn_t *conn, const gopher_item_t *item) {
+	const char *hostname;
+	uint16_t port;
 	char buf[256];
 	size_t len;
 	char *selector;
 
+	/* Items without a host point to ourselves. */
+	hostname = item->hostname;
+	port = item->port;
+	if (hostname == NULL)
+		hostname = conn->config->hostname;
+	if ((port == INVALID_PORT) && (item->hostname != invalid_host_c))
+		port = conn->config->port;
+
 	/* Build up the selector string. */
 	selector = NULL;
 	if ((*conn->selector != '\0') && (item->selector != NULL) &&
@@ -1047,12 +3167,11 @@ int client_send_item(const client_conn_t *conn, const gopher_item_t *item) {
 	len = snprintf(buf, 256, "%c%s\t%s\t%s\t%u\r\n", item->type,
 		item->name == NULL ? "" : item->name,
 		selector == NULL ? item->selector ? item->selector : "" : selector,
-		item->hostname == NULL ? DEFAULT_HOSTNAME : item->hostname,
-		item->port);
+		hostname, port);
 
 	/* Free up used selector string. */
 	if (selector != NULL)
-		free(selector);
+		mem_free(selector);
 	selector = NULL;
 
 	/* Check if the string buffer was big enough. */
@@ -1063,12 +3182,7 @@ int client_send_item(const client_conn_t *conn, const gopher_item_t *item) {
 	}
 
 	/* Send out the entry line. */
-	if (send(conn->sockfd, buf, len, 0) < 0) {
-		log_sockerr(LOG_ERROR, "Failed to send entry item line");
-		return 0;
-	}
-
-	return 1;
+	return client_send_raw(conn, buf, len);
 }
 
 /**
@@ -1086,6 +3200,10 @@ int client_send_item_simple(const client_conn_t *conn, char type,
 
 	/* Populate item object. */
 	gopher_item_t *item = gopher_item_new();
+	if (item == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate item");
+		return 0;
+	}
 	item->type = type;
 	item->name = (char*)msg;
 	item->hostname = invalid_host_c;
@@ -1126,380 +3244,8413 @@ int client_send_error(const client_conn_t *conn, const char *msg) {
 }
 
 /**
- * =============================================================================
- * === Gopher Item Abstractions ================================================
- * =============================================================================
+ * Sends raw data to the client, ensuring all of it gets sent, or appends it to
+ * the capture buffer of the connection if there's one.
+ *
+ * @param conn Client connection object.
+ * @param buf  Data to be sent.
+ * @param len  Length of the data in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
+int client_send_raw(const client_conn_t *conn, const void *buf, size_t len) {
+	const char *cur;
+	size_t chunk;
+	ssize_t sent;
+
+	/* Output is being captured instead of sent. */
+	if (conn->capture != NULL) {
+		if ((conn->capture->len + len) > CAPTURE_MAX_SIZE) {
+			log_printf(LOG_ERROR, "Reply to selector '%s' too large to be "
+				"captured", conn->selector);
+			return 0;
+		}
+
+		return buffer_append(conn->capture, buf, len);
+	}
+
+	/* Send it in chunks, so that the watchdog can tell it's moving along. */
+	cur = (const char*)buf;
+	while (len > 0) {
+		chunk = (len > SEND_CHUNK_SIZE) ? SEND_CHUNK_SIZE : len;
+#ifdef WITH_FAULTS
+		if (!fault_inject(conn, FAULT_SEND, &chunk)) {
+			log_sockerr(LOG_ERROR, "Failed to send data to client");
+			return 0;
+		}
+#endif /* WITH_FAULTS */
+#ifdef WITH_TLS
+		if (conn->ssl != NULL) {
+			sent = SSL_write(conn->ssl, cur, (int)chunk);
+			if (sent <= 0) {
+				log_tlserr(LOG_ERROR, "Failed to send data to client");
+				return 0;
+			}
+			counter_add(&conn->server->stats->tls_bytes_out, sent);
+			counter_add(&conn->server->stats->bytes_out, sent);
+			conn->score->sent += sent;
+			conn->score->progressed = time(NULL);
+
+			cur += sent;
+			len -= sent;
+			continue;
+		}
+#endif /* WITH_TLS */
+
+		sent = send(conn->sockfd, cur, chunk, MSG_NOSIGNAL);
+		if (sent < 0) {
+			log_sockerr(LOG_ERROR, "Failed to send data to client");
+			return 0;
+		}
+		counter_add(&conn->server->stats->bytes_out, sent);
+		conn->score->sent += sent;
+		conn->score->progressed = time(NULL);
+
+		cur += sent;
+		len -= sent;
+	}
+
+	return 1;
+}
 
 /**
- * Allocates a brand new Gopher item object.
- *
- * @warning This function allocates memory that must be free'd using a special
- *          function.
+ * Receives data from the client.
  *
- * @return Allocated item object or NULL if an error occurred.
+ * @param conn Client connection object.
+ * @param buf  Buffer to store the received data.
+ * @param len  Maximum number of bytes to receive.
  *
- * @see gopher_item_free
+ * @return Number of bytes received or -1 if an error occurred.
  */
-gopher_item_t* gopher_item_new(void) {
-	gopher_item_t *item;
+ssize_t client_recv(const client_conn_t *conn, void *buf, size_t len) {
+	ssize_t recvd;
+
+#ifdef WITH_FAULTS
+	if (!fault_inject(conn, FAULT_RECV, &len))
+		return -1;
+#endif /* WITH_FAULTS */
+#ifdef WITH_TLS
+	if (conn->ssl != NULL) {
+		int ret;
+
+		ret = SSL_read(conn->ssl, buf, (int)len);
+		if (ret <= 0) {
+			if (SSL_get_error(conn->ssl, ret) == SSL_ERROR_ZERO_RETURN)
+				return 0;
+			return -1;
+		}
+		counter_add(&conn->server->stats->tls_bytes_in, ret);
+		counter_add(&conn->server->stats->bytes_in, ret);
+		conn->score->progressed = time(NULL);
 
-	/* Try to allocate our item object. */
-	item = (gopher_item_t*)malloc(sizeof(gopher_item_t));
-	if (item == NULL)
-		return NULL;
+		return ret;
+	}
+#endif /* WITH_TLS */
 
-	/* Populate it with sane defaults. */
-	item->type = INVALID_TYPE;
-	item->_pad = INVALID_TYPE;
-	item->name = NULL;
-	item->selector = NULL;
-	item->hostname = invalid_host_c;
-	item->port = INVALID_PORT;
+	recvd = recv(conn->sockfd, buf, len, 0);
+	if (recvd > 0) {
+		counter_add(&conn->server->stats->bytes_in, recvd);
+		conn->score->progressed = time(NULL);
+	}
 
-	return item;
+	return recvd;
 }
 
 /**
- * Frees up an Gopher item that was dynamically allocated.
+ * Replies to the client with the results of a full-text search of the
+ * document root.
  *
- * @see gopher_item_new
+ * @param conn Client connection object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-void gopher_item_free(gopher_item_t *item) {
-	item->type = INVALID_TYPE;
-	if (item->name != NULL)
-		free(item->name);
-	if (item->selector != NULL)
-		free(item->selector);
-	if ((item->hostname != invalid_host_c) && (item->hostname != NULL))
-		free(item->hostname);
-	free(item);
+int client_send_search(const client_conn_t *conn) {
+	amigos_t *srv;
+	char terms[SEARCH_MAX_TERMS][SEARCH_TERM_MAX_LEN + 1];
+	search_result_t *results;
+	gopher_item_t *items;
+	char msg[256];
+	uint32_t count;
+	uint32_t i;
+	int failed;
+	int nterms;
+	int ret;
+
+	/* Check if we have anything to search for. */
+	srv = conn->server;
+	nterms = 0;
+	if (conn->query != NULL)
+		nterms = search_tokenize_query(conn->query, terms);
+	if (nterms == 0) {
+		if (!client_send_info(conn, "Please provide some words to search for."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
+	}
+
+	/* Query the index and copy the results so we can release it quickly. */
+	items = NULL;
+	count = 0;
+	mutex_lock(&srv->search_lock);
+	if (srv->search_index == NULL) {
+		mutex_unlock(&srv->search_lock);
+		if (!client_send_info(conn, "The search index is still being built. "
+				"Try again in a moment."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
+	}
+	results = search_query(srv->search_index, terms, nterms, &count);
+	failed = 0;
+	if (count > 0) {
+		items = (gopher_item_t*)mem_alloc(MEM_CONNECTIONS,
+			count * sizeof(gopher_item_t));
+		failed = items == NULL;
+	}
+	for (i = 0; !failed && (i < count); i++) {
+		const search_doc_t *doc = &srv->search_index->docs[results[i].doc];
+
+		items[i].type = doc->type;
+		items[i].port = INVALID_PORT;
+		items[i].hostname = NULL;
+		items[i].name = mem_strdup(MEM_CONNECTIONS, doc->selector);
+		if ((items[i].name == NULL) || (path_concat(&items[i].selector, "/",
+				"/", doc->selector, NULL) == 0)) {
+			/* Throw away everything we've copied so far. */
+			mem_free(items[i].name);
+			while (i-- > 0) {
+				mem_free(items[i].name);
+				mem_free(items[i].selector);
+			}
+			mem_free(items);
+			items = NULL;
+			failed = 1;
+		}
+	}
+	mutex_unlock(&srv->search_lock);
+	if (results != NULL)
+		mem_free(results);
+
+	/* Let the client know if we couldn't make a copy of the results. */
+	if (failed) {
+		log_syserr(LOG_ERROR, "Failed to allocate search results");
+		if (!client_send_error(conn, "Failed to handle the request."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
+	}
+
+	/* Send out the results header. */
+	ret = 1;
+	snprintf(msg, 256, "%u result%s for '%.200s':", count,
+		(count == 1) ? "" : "s", conn->query);
+	if (!client_send_info(conn, msg) || !client_send_info(conn, ""))
+		ret = 0;
+
+	/* Send out the results. */
+	for (i = 0; i < count; i++) {
+		if (ret && !client_send_item(conn, &items[i]))
+			ret = 0;
+		mem_free(items[i].name);
+		mem_free(items[i].selector);
+	}
+	if (items != NULL)
+		mem_free(items);
+
+	return ret && client_send_raw(conn, ".", 1);
 }
 
+#ifdef WITH_PLUGINS
 /**
- * Parses a Gopher item object from a gophermap line.
- *
- * @warning This function allocates memory that must be free'd using a special
- *          function.
+ * Replies to the client with the output of a dynamic handler plugin.
  *
- * @return Allocated item object or NULL if an error occurred.
+ * @param conn   Client connection object.
+ * @param plugin Plugin that will handle the request.
+ * @param path   Part of the selector after the plugin's prefix.
  *
- * @see gopher_item_free
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-gopher_item_t* gopher_item_parse(const char *line) {
-	gopher_item_t *item;
-	const char *tmp;
-	char *cbuf;
-	char buf[256];
+int client_send_plugin(const client_conn_t *conn, const plugin_t *plugin,
+					   const char *path) {
+	amigos_request_t req;
+	amigos_writer_t writer;
+	plugin_output_t out;
+	int ret;
 
-	/* Try to allocate brand new item object. */
-	item = gopher_item_new();
-	if (item == NULL)
-		return NULL;
+	/* Populate the request information. */
+	req.selector = conn->selector;
+	req.path = path;
+	req.query = conn->query;
+	req.client = conn->addr;
+	req.hostname = conn->config->hostname;
+	req.port = conn->config->port;
+
+	/* Setup the output writer. */
+	out.conn = conn;
+	out.failed = 0;
+	buffer_init(&out.buf, MEM_CONNECTIONS);
+	writer.write = plugin_writer_write;
+	writer.ctx = &out;
+
+	/* Let the plugin handle the request. */
+	ret = plugin->handler(&req, &writer);
+	if (out.failed) {
+		/* Client is gone, nothing else to do. */
+		buffer_free(&out.buf);
+		return 0;
+	}
 
-	/* Populate it with some defaults. */
-	item->hostname = strdup(DEFAULT_HOSTNAME);
-	item->port = DEFAULT_PORT;
+	/* Check if the plugin was able to handle the request. */
+	if ((ret != AMIGOS_HANDLER_MENU) && (ret != AMIGOS_HANDLER_RAW)) {
+		log_printf(LOG_ERROR, "Plugin for prefix '%s' failed to handle "
+			"selector '%s'", plugin->prefix, conn->selector);
+		buffer_free(&out.buf);
+		if (!client_send_error(conn, "Failed to handle the request."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
+	}
 
-	/* Get item type. */
-	tmp = line;
-	item->type = *tmp++;
+	/* Terminate menus and flush whatever is left in the output buffer. */
+	if ((ret == AMIGOS_HANDLER_MENU) && !buffer_append(&out.buf, ".", 1))
+		ret = AMIGOS_HANDLER_ERROR;
+	if ((out.buf.len > 0) && !client_send_raw(conn, out.buf.data, out.buf.len))
+		ret = AMIGOS_HANDLER_ERROR;
+	buffer_free(&out.buf);
 
-	/* Get item name. */
-	cbuf = buf;
-	while (*tmp != '\t') {
-		*cbuf = *tmp++;
-		cbuf++;
+	return ret != AMIGOS_HANDLER_ERROR;
+}
+#endif /* WITH_PLUGINS */
+
+/**
+ * Replies to the client with the contents of a selector proxied from an
+ * upstream server, serving it from the content cache whenever possible.
+ *
+ * @param conn  Client connection object.
+ * @param route Proxy route that will handle the request.
+ * @param path  Part of the selector after the route's prefix.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int client_send_proxy(const client_conn_t *conn, const route_t *route,
+					  const char *path) {
+	amigos_t *srv;
+	upstream_t *upstream;
+	cache_entry_t *entry;
+	cache_entry_t *fresh;
+	cache_state_t state;
+	buffer_t buf;
+	char *request;
+	char *key;
+	int streamed;
+	int ret;
+
+	/* Build the upstream request and its cache key. */
+	srv = conn->server;
+	upstream = route->upstream;
+	if (!proxy_request(upstream, path, conn->query, &request, &key)) {
+		if (!client_send_error(conn, "Failed to handle the request."))
+			return 0;
+		return client_send_raw(conn, ".", 1);
 	}
-	*cbuf = '\0';
-	item->name = strdup(buf);
-	tmp++;
 
-	/* Get item selector. */
-	cbuf = buf;
-	while ((*tmp != '\t') && (*tmp != '\0')) {
-		*cbuf = *tmp++;
-		cbuf++;
+	/* Serve from the cache, revalidating stale objects in the background. */
+	entry = cache_get(&srv->content_cache, key, &state);
+	if ((state == CACHE_FRESH) || (state == CACHE_STALE)) {
+		if (state == CACHE_STALE)
+			proxy_refresh(conn->server, upstream, request, key, entry);
+		hitters_pin(conn, entry);
+		ret = proxy_send(conn, route, entry->data, entry->size,
+			entry->flags & CACHE_MENU);
+		cache_release(&srv->content_cache, entry);
+		goto cleanup;
 	}
-	*cbuf = '\0';
-	item->selector = strdup(buf);
-	if (*tmp == '\0')
-		return item;
-	tmp++;
 
-	/* Get item hostname. */
-	cbuf = buf;
-	while ((*tmp != '\t') && (*tmp != '\0')) {
-		*cbuf = *tmp++;
-		cbuf++;
+	/* Fetch the object from the upstream server. */
+	ret = 0;
+	streamed = 0;
+	buffer_init(&buf, MEM_CONNECTIONS);
+	if (proxy_acquire(conn->server, upstream)) {
+		ret = proxy_fetch(upstream, request, &buf, conn, &streamed);
+		proxy_release(conn->server, upstream);
+	} else {
+		log_printf(LOG_WARNING, "Too many connections to upstream %s:%s",
+			upstream->host, upstream->port);
 	}
-	*cbuf = '\0';
-	if (item->hostname != NULL)
-		free(item->hostname);
-	item->hostname = strdup(buf);
-	if (*tmp == '\0')
-		return item;
-	tmp++;
 
-	/* Get item port. */
-	cbuf = buf;
-	while (*tmp != '\0') {
-		*cbuf = *tmp++;
-		cbuf++;
+	/* Objects too large to be cached have already been sent. */
+	if (streamed) {
+		if (entry != NULL)
+			cache_release(&srv->content_cache, entry);
+		if (ret && (buf.len > 0))
+			ret = client_send_raw(conn, buf.data, buf.len);
+		buffer_free(&buf);
+		goto cleanup;
 	}
-	*cbuf = '\0';
-	item->port = (uint16_t)atoi(buf);
 
-	return item;
-}
+	/* Fall back to an expired object if the upstream server failed us. */
+	if (!ret) {
+		buffer_free(&buf);
+		if (entry != NULL) {
+			log_printf(LOG_WARNING, "Serving expired copy of '%s' from "
+				"upstream %s:%s", request, upstream->host, upstream->port);
+			ret = proxy_send(conn, route, entry->data, entry->size,
+				entry->flags & CACHE_MENU);
+			cache_release(&srv->content_cache, entry);
+		} else if (client_send_error(conn, "Upstream server unavailable.")) {
+			ret = client_send_raw(conn, ".", 1);
+		}
 
-/**
- * Prints out the contents of a Gopher item object for debugging.
- *
- * @param item Gopher item to be inspected.
- */
-void gopher_item_print(gopher_item_t *item) {
-	printf("Type:     '%c'\nName:     %s\nSelector: %s\nHostname: %s\nPort:    "
-		" %u\n", item->type, item->name, item->selector, item->hostname,
-		item->port);
+		goto cleanup;
+	}
+	if (entry != NULL)
+		cache_release(&srv->content_cache, entry);
+
+	/* Cache the object and send it. */
+	fresh = cache_put(&srv->content_cache, key, buf.data, buf.len,
+		PROXY_CACHE_TTL, PROXY_STALE_TTL, proxy_is_menu(buf.data, buf.len) ? CACHE_MENU : 0);
+	if (fresh != NULL) {
+		hitters_pin(conn, fresh);
+		buffer_init(&buf, MEM_CONNECTIONS);
+		ret = proxy_send(conn, route, fresh->data, fresh->size,
+			fresh->flags & CACHE_MENU);
+		cache_release(&srv->content_cache, fresh);
+	} else {
+		ret = proxy_send(conn, route, buf.data, buf.len,
+			proxy_is_menu(buf.data, buf.len));
+		buffer_free(&buf);
+	}
+
+cleanup:
+	mem_free(request);
+	mem_free(key);
+
+	return ret;
 }
 
 /**
  * =============================================================================
- * === Gopher File Types =======================================================
+ * === HTTP Gateway ============================================================
  * =============================================================================
  */
 
 /**
- * Loads Gopher file type information from a configuration file.
+ * Serves the same content as the Gopher server over HTTP/1.1 to a client that
+ * sent us an HTTP request instead of a selector, keeping the connection alive
+ * between requests if the client wants to.
  *
- * @param fname Path to a Gopher file type information configuration file.
+ * @param conn Client connection object.
+ * @param data Data that has already been received from the client.
+ * @param len  Length of the received data in bytes.
+ */
+void http_process_request(client_conn_t *conn, const char *data, size_t len) {
+	char req[HTTP_MAX_REQUEST_SIZE + 1];
+	char *end;
+	size_t reqlen;
+	size_t used;
+	ssize_t recvd;
+	uint64_t start;
+	uint64_t sent;
+	int keepalive;
+	int count;
+	int ret;
+
+	/* Start off with what we've got so far. */
+	if (len > HTTP_MAX_REQUEST_SIZE)
+		len = HTTP_MAX_REQUEST_SIZE;
+	memcpy(req, data, len);
+	used = len;
+
+	for (count = 0; conn->server->running && (count < HTTP_MAX_KEEPALIVE);
+			count++) {
+		/* Receive data until we've got the whole request header. */
+		req[used] = '\0';
+		while ((end = strstr(req, "\r\n\r\n")) == NULL) {
+			if (used >= HTTP_MAX_REQUEST_SIZE) {
+				log_printf(LOG_WARNING, "HTTP request header too large, "
+					"closing connection.");
+				http_send_status(conn, 431, 0, 0);
+				return;
+			}
+
+			recvd = client_recv(conn, req + used, HTTP_MAX_REQUEST_SIZE - used);
+			if (recvd <= 0) {
+				/* Idle connections are closed without a fuss. */
+				if ((recvd < 0) && (used > 0) && conn->server->running)
+					log_sockerr(LOG_ERROR, "Failed to receive HTTP request");
+				return;
+			}
+			used += recvd;
+			req[used] = '\0';
+		}
+		*end = '\0';
+		reqlen = (end + 4) - req;
+
+		/* Reply to the request. */
+		start = clock_usec();
+		sent = conn->score->sent;
+		keepalive = count < (HTTP_MAX_KEEPALIVE - 1);
+		USDT2(reply_start, conn - conn->server->connections,
+			AMIGOS_STATS_REQ_HTTP);
+		ret = http_handle(conn, req, &keepalive);
+		USDT4(reply_end, conn - conn->server->connections,
+			AMIGOS_STATS_REQ_HTTP, conn->score->sent - sent,
+			USDT_ENABLED(reply_end) ? (clock_usec() - start) : 0);
+		stats_request(conn->server, AMIGOS_STATS_REQ_HTTP, start);
+		hitters_request(conn, conn->score->sent - sent);
+		if (!ret || !keepalive)
+			return;
+
+		/* Keep pipelined requests around for the next round. */
+		used -= reqlen;
+		memmove(req, req + reqlen, used);
+		server_track(conn, PHASE_RECV, NULL);
+	}
+}
+
+/**
+ * Replies to a single HTTP request. Request targets follow the Gopher URL
+ * scheme, where the path is made up of the item type followed by the
+ * selector, and searches are sent in the query string.
  *
- * @return TRUE if the operation was successful, FALSE otherwise.
+ * @param conn      Client connection object.
+ * @param req       Request line and headers without the final empty line.
+ * @param keepalive Should the connection be kept alive? Gets cleared if the
+ *                  client doesn't want it to be.
+ *
+ * @return TRUE if the connection can still be used, FALSE otherwise.
  */
-int gopher_types_load(const char *fname) {
-	FILE *fh;
-	int linenum;
+int http_handle(client_conn_t *conn, char *req, int *keepalive) {
+	const route_t *route;
+	const char *rpath;
+	const char *value;
+	char selector[256];
+	char aliases[2][256];
+	char query[256];
+	char *headers;
+	char *target;
+	char *version;
+	char *tmp;
+	buffer_t body;
+	size_t vlen;
 	char type;
-	char ext[EXT_MAX_LEN + 1];
-	uint8_t extlen;
-	char *buf;
-	char lastc;
-	int ci;
+	int head;
 	int ret;
 
-	/* Check if the file exists. */
-	if (!file_exists(fname)) {
-		log_printf(LOG_WARNING, "Gopher file types information file '%s' "
-			"wasn't found. All non-directory entries will default to '%c' on "
-			"directory listings.", fname, DEFAULT_FILE_TYPE);
-		return 0;
+	/* Split the request line into its parts. */
+	headers = strstr(req, "\r\n");
+	if (headers != NULL) {
+		*headers = '\0';
+		headers += 2;
+	} else {
+		headers = req + strlen(req);
 	}
-
-	/* Open file for reading. */
-	fh = fopen(fname, "r");
-	if (fh == NULL) {
-		log_printf(LOG_ERROR, "Failed to open file %s for type association.",
-			fname);
+	target = strchr(req, ' ');
+	version = (target == NULL) ? NULL : strchr(target + 1, ' ');
+	if ((version == NULL) || (strncmp(version + 1, "HTTP/1.", 7) != 0)) {
+		log_printf(LOG_WARNING, "Malformed HTTP request line, closing "
+			"connection.");
+		http_send_status(conn, 400, 0, 0);
 		return 0;
 	}
+	*target++ = '\0';
+	*version++ = '\0';
+
+	/* HTTP/1.0 clients have to explicitly ask to keep the connection alive. */
+	value = http_header(headers, "Connection", &vlen);
+	if ((value != NULL) && http_has_token(value, vlen, "close")) {
+		*keepalive = 0;
+	} else if ((version[7] == '0') && ((value == NULL) ||
+			!http_has_token(value, vlen, "keep-alive"))) {
+		*keepalive = 0;
+	}
 
-	/* Go through the file reading its properties. */
-	ret = 0;
-	linenum = 1;
-	lastc = '\n';
-	while ((ci = fgetc(fh)) != EOF) {
-		char c = (char)ci;
-
-		/* Have we just arrived at a new line? */
-		if (lastc == '\n') {
-			/* Cache file type. */
-			type = c;
-
-			/* Reset everything for the next extension. */
-			*ext = '\0';
-			extlen = 0;
-			buf = ext;
-
-			/* Jump to the first extension. */
-			while ((ci = fgetc(fh)) != EOF) {
-				c = (char)ci;
-				if ((c != '\t') && (c != ' '))
-					break;
-			}
+	/* We don't read request bodies, so we can't tell where the next starts. */
+	if (http_header(headers, "Transfer-Encoding", &vlen) != NULL)
+		*keepalive = 0;
+	value = http_header(headers, "Content-Length", &vlen);
+	if ((value != NULL) && (strtoul(value, NULL, 10) > 0))
+		*keepalive = 0;
+
+	/* Check if it's something that we know how to reply to. */
+	head = strcmp(req, "HEAD") == 0;
+	if (!head && (strcmp(req, "GET") != 0))
+		return http_send_status(conn, 405, 0, *keepalive);
+	if (*target != '/')
+		return http_send_status(conn, 400, head, 0);
+
+	/* Split the item type, selector, and search string from the target. */
+	conn->query = NULL;
+	tmp = strchr(target, '?');
+	if (tmp != NULL) {
+		*tmp++ = '\0';
+		if (strncmp(tmp, "q=", 2) == 0) {
+			tmp += 2;
+			tmp[strcspn(tmp, "&")] = '\0';
 		}
+		if (!http_url_decode(query, 256, tmp, 1))
+			return http_send_status(conn, 400, head, *keepalive);
+		conn->query = query;
+	}
+	target++;
+	type = '1';
+	if (*target != '\0')
+		type = *target++;
+	if (!http_url_decode(selector, 256, target, 0))
+		return http_send_status(conn, 404, head, *keepalive);
+	tmp = strchr(selector, '\t');
+	if (tmp != NULL) {
+		*tmp = '\0';
+		if (conn->query == NULL)
+			conn->query = tmp + 1;
+	}
 
-		/* Ignore CR. */
-		if (c == '\r')
-			goto next_char;
-
-		/* Build up extension. */
-		*buf++ = c;
-		extlen++;
+	/* Sanitize selector before using it. */
+	path_sanitize(selector);
+	conn->selector = selector;
+	conn->score->kind = AMIGOS_STATS_REQ_HTTP;
+	server_track(conn, PHASE_REPLY, selector);
+	log_printf(LOG_INFO, "Client requested selector '%s' over HTTP", selector);
+	USDT3(request_selector, conn - conn->server->connections, selector,
+		conn->query);
+
+	/* Files are sent straight from the file system. */
+	route = server_resolve(conn->server, selector, aliases, &rpath);
+	USDT3(request_route, conn - conn->server->connections,
+		stats_route_kind(route), rpath);
+	if (route == NULL)
+		return http_send_status(conn, 404, head, *keepalive);
+	if (route->kind == ROUTE_STATIC) {
+		char *fpath;
+
+		fpath = client_static_path(conn, route->target, rpath);
+		if (fpath == NULL)
+			return http_send_status(conn, 500, head, *keepalive);
+
+		switch (path_type(fpath)) {
+			case PATH_FILE:
+				ret = http_send_file(conn, fpath, head, *keepalive);
+				mem_free(fpath);
+				return ret;
+			case PATH_DIR:
+				type = '1';
+				break;
+			default:
+				mem_free(fpath);
+				return http_send_status(conn, 404, head, *keepalive);
+		}
+		mem_free(fpath);
+	}
 
-		/* Check if we have reached the end of this extension. */
-		if ((c == ' ') || (c == '\n')) {
-			/* Backtrack a bit do that we don't include whitespace. */
-			buf--;
-			*buf = '\0';
+	/* Capture whatever the handler replies with. */
+	buffer_init(&body, MEM_CONNECTIONS);
+	conn->capture = &body;
+	ret = server_dispatch(conn, route, rpath);
+	conn->capture = NULL;
+	if (!ret && (body.len == 0)) {
+		buffer_free(&body);
+		return http_send_status(conn, 500, head, *keepalive);
+	}
 
-			/* Append extension to types list. Skip empty extensions. */
-			if ((ext[0] != '\0') && !gopher_types_append(type, ext)) {
-				log_printf(LOG_ERROR, "Failed to append extension '%s' from "
-					"line %u to file types list.", ext, linenum);
-				ret = 0;
-			}
+	/* Menus get rendered to HTML, anything else is sent as is. */
+	if ((type == '1') || (type == '7') || (route->kind == ROUTE_SEARCH) ||
+			(route->kind == ROUTE_REDIRECT)) {
+		buffer_t html;
 
-			/* Reset everything for the next extension. */
-			*ext = '\0';
-			extlen = 0;
-			buf = ext;
+		buffer_init(&html, MEM_CONNECTIONS);
+		if (http_render_menu(conn, body.data, body.len, &html)) {
+			ret = http_send_response(conn, 200, "text/html; charset=utf-8",
+				html.data, html.len, head, *keepalive);
+		} else {
+			ret = http_send_status(conn, 500, head, *keepalive);
 		}
+		buffer_free(&html);
+	} else {
+		ret = http_send_response(conn, 200, http_content_type(type, selector),
+			body.data, body.len, head, *keepalive);
+	}
+	buffer_free(&body);
 
-		/* Increase the line counter if needed. */
-		if (c == '\n')
-			linenum++;
+	return ret;
+}
 
-		/* Check if we have reached the extension size limit. */
-		if (extlen >= EXT_MAX_LEN) {
-			buf--;
-			*buf = '\0';
-			log_printf(LOG_ERROR, "Extension size limit of %u reached when "
-				"parsing extension '%s' at line %u of file types.\n",
-				EXT_MAX_LEN, ext, linenum);
-			ret = 0;
-			break;
-		}
+/**
+ * Replies to an HTTP request with the contents of a file.
+ *
+ * @param conn      Client connection object.
+ * @param path      Path to the file to send to the client.
+ * @param head      Should only the header be sent?
+ * @param keepalive Will the connection be kept alive?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int http_send_file(const client_conn_t *conn, const char *path, int head,
+				   int keepalive) {
+	FILE *fh;
+	long size;
+	int ret;
 
-next_char:
-		lastc = c;
+	/* Open the file and get its size. */
+	fh = fopen(path, "rb");
+	if (fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open file %s for request selector "
+			"'%s'", path, conn->selector);
+		return http_send_status(conn, 404, head, keepalive);
 	}
-
-	/* Ensure that we get the last extension in case of no newline at EOF. */
-	if ((extlen == 0) && (lastc != '\n')) {
-		*buf = '\0';
-		if (!gopher_types_append(type, ext)) {
-			log_printf(LOG_ERROR, "Failed to append file's last extension '%s' "
-				"from line %u to file types list.", ext, linenum);
-			ret = 0;
-		}
-
-		*ext = '\0';
-		buf = ext;
+	if ((fseek(fh, 0, SEEK_END) != 0) || ((size = ftell(fh)) < 0) ||
+			(fseek(fh, 0, SEEK_SET) != 0)) {
+		log_syserr(LOG_ERROR, "Failed to get the size of file %s", path);
+		fclose(fh);
+		return http_send_status(conn, 500, head, keepalive);
 	}
 
-	/* Close file handle. */
+	/* Send the header followed by the file. */
+	ret = http_send_header(conn, 200,
+		http_content_type(gopher_types_infer(conn->server, path), path),
+		(unsigned long)size, keepalive);
+	if (ret && !head)
+		ret = client_send_stream(conn, fh);
+
 	fclose(fh);
 	return ret;
 }
 
 /**
- * Appends an extension to the file type information array.
+ * Sends an HTTP response with its entire body to the client.
  *
- * @param type Gopher file type.
- * @param ext  Extension to be associated with the file type.
+ * @param conn      Client connection object.
+ * @param status    HTTP status code.
+ * @param ctype     Content type of the body.
+ * @param data      Body of the response.
+ * @param len       Length of the body in bytes.
+ * @param head      Should only the header be sent?
+ * @param keepalive Will the connection be kept alive?
  *
  * @return TRUE if the operation was successful, FALSE otherwise.
  */
-int gopher_types_append(char type, const char *ext) {
-	char buf[EXT_MAX_LEN + 2];
+int http_send_response(const client_conn_t *conn, int status,
+					   const char *ctype, const char *data, size_t len,
+					   int head, int keepalive) {
+	if (!http_send_header(conn, status, ctype, (unsigned long)len, keepalive))
+		return 0;
+	if (head || (len == 0))
+		return 1;
 
-	/* Do an initial large allocation or an incremental reallocation. */
-	if (gopher_types == NULL) {
-		gopher_types = (char**)malloc(sizeof(char*));
-		if (gopher_types == NULL) {
-			log_syserr(LOG_CRIT, "Could not allocate initial item of file "
-				"types list");
-			return 0;
-		}
-	} else {
-		void *tmp = realloc(gopher_types, (gopher_types_len + 1) *
-			sizeof(char*));
-		if (tmp == NULL) {
-			log_syserr(LOG_CRIT, "Could not reallocate file types list");
-			return 0;
-		}
-		gopher_types = (char**)tmp;
-	}
+	return client_send_raw(conn, data, len);
+}
 
-	/* Add file type to extension string. */
-	snprintf(buf, EXT_MAX_LEN + 1, "%c%s", type, ext);
+/**
+ * Sends an HTTP response consisting of a simple page for a status code.
+ *
+ * @param conn      Client connection object.
+ * @param status    HTTP status code.
+ * @param head      Should only the header be sent?
+ * @param keepalive Will the connection be kept alive?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int http_send_status(const client_conn_t *conn, int status, int head,
+					 int keepalive) {
+	char buf[256];
+	size_t len;
 
-	/* Append extension to list and increase length counter. */
-	gopher_types[gopher_types_len] = strdup(buf);
-	gopher_types_len++;
+	len = snprintf(buf, 256, "<!DOCTYPE html>\n<html>\n<head><title>%d %s"
+		"</title></head>\n<body><h1>%d %s</h1></body>\n</html>\n", status,
+		http_status_text(status), status, http_status_text(status));
 
-	return 1;
+	return http_send_response(conn, status, "text/html; charset=utf-8", buf,
+		len, head, keepalive);
 }
 
 /**
- * Frees up any resources used for storing Gopher file type information.
+ * Sends the header of an HTTP response to the client.
+ *
+ * @param conn      Client connection object.
+ * @param status    HTTP status code.
+ * @param ctype     Content type of the body.
+ * @param len       Length of the body in bytes.
+ * @param keepalive Will the connection be kept alive?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-void gopher_types_free(void) {
-	uint16_t i;
-
-	/* Free each type element. */
-	for (i = 0; i < gopher_types_len; i++) {
-		if (gopher_types[i] != NULL)
-			free(gopher_types[i]);
+int http_send_header(const client_conn_t *conn, int status, const char *ctype,
+					 unsigned long len, int keepalive) {
+	char buf[256];
+	size_t hlen;
+
+	hlen = snprintf(buf, 256, "HTTP/1.1 %d %s\r\nServer: amigos\r\n"
+		"Content-Type: %s\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+		status, http_status_text(status), ctype, len,
+		keepalive ? "keep-alive" : "close");
+	if (hlen >= 256) {
+		log_printf(LOG_ERROR, "HTTP response header too long");
+		return 0;
 	}
 
-	/* Free the array itself. */
-	if (gopher_types != NULL)
-		free(gopher_types);
-	gopher_types = NULL;
-	gopher_types_len = 0;
+	return client_send_raw(conn, buf, hlen);
 }
 
 /**
- * Infers the Gopher file type character based on the file name.
+ * Renders a Gopher menu as an HTML page. Items that point to ourselves are
+ * linked through the gateway, anything else gets a Gopher URL.
  *
- * @param fname File name to be used for inference.
+ * @param conn Client connection object.
+ * @param data Contents of the menu.
+ * @param size Size of the contents in bytes.
+ * @param html Buffer to append the HTML page to.
  *
- * @return Guessed Gopher file type or DEFAULT_FILE_TYPE if we failed to guess.
+ * @return TRUE if the operation was successful, FALSE otherwise.
  */
-char gopher_types_infer(const char *fname) {
-	const char *ext;
-	uint16_t i;
+int http_render_menu(const client_conn_t *conn, const char *data, size_t size,
+					 buffer_t *html) {
+	const char *end;
+	int ret;
 
-	/* Do we even have our file type array initialized to infer anything? */
-	if (gopher_types == NULL)
-		return DEFAULT_FILE_TYPE;
+	/* Page header. */
+	ret = http_append(html, "<!DOCTYPE html>\n<html>\n<head>\n"
+			"<meta charset=\"utf-8\">\n<title>", 0) &&
+		http_append(html, (*conn->selector == '\0') ? conn->config->hostname :
+			conn->selector, 1) &&
+		http_append(html, "</title>\n</head>\n<body>\n<pre>\n", 0);
+
+	/* Go through the menu line by line. */
+	end = data + size;
+	while (ret && (data < end)) {
+		const char *fields[4];
+		const char *eol;
+		const char *next;
+		char hostport[300];
+		char prefix[2];
+		size_t lens[4];
+		unsigned long port;
+		size_t i;
+		int nfields;
+
+		/* Split the item into its fields. */
+		eol = (const char*)memchr(data, '\n', end - data);
+		next = (eol == NULL) ? end : (eol + 1);
+		if (eol == NULL)
+			eol = end;
+		if ((eol > data) && (*(eol - 1) == '\r'))
+			eol--;
+		if (((eol - data) == 1) && (*data == '.'))
+			break;
+		fields[0] = data;
+		for (nfields = 1; nfields <= 4; nfields++) {
+			const char *tab;
+
+			tab = (const char*)memchr(fields[nfields - 1], '\t',
+				eol - fields[nfields - 1]);
+			lens[nfields - 1] = ((tab == NULL) ? eol : tab) -
+				fields[nfields - 1];
+			if ((tab == NULL) || (nfields == 4))
+				break;
+			fields[nfields] = tab + 1;
+		}
+		data = next;
+		if (lens[0] == 0)
+			continue;
 
-	/* Get the file extension. */
-	ext = strrchr(fname, '.');
-	if (ext == NULL)
-		return DEFAULT_FILE_TYPE;
+		/* Informational lines and errors are just text. */
+		if ((fields[0][0] == 'i') || (fields[0][0] == '3') || (nfields < 4)) {
+			ret = http_append_n(html, fields[0] + 1, lens[0] - 1, 1) &&
+				http_append(html, "\n", 0);
+			continue;
+		}
+
+		/* Only link to URLs that can't run scripts on the gateway's origin. */
+		if ((fields[0][0] == 'h') && (lens[1] > 4) &&
+				(strncmp(fields[1], "URL:", 4) == 0) &&
+				!http_url_safe(fields[1] + 4, lens[1] - 4)) {
+			ret = http_append_n(html, fields[0] + 1, lens[0] - 1, 1) &&
+				http_append(html, "\n", 0);
+			continue;
+		}
+
+		/* Figure out where the item points to. */
+		port = 0;
+		for (i = 0; (i < lens[3]) && (fields[3][i] >= '0') &&
+				(fields[3][i] <= '9'); i++) {
+			port = (port * 10) + (fields[3][i] - '0');
+		}
+		snprintf(hostport, 300, "%.*s:%lu", (int)((lens[2] > 255) ? 255 :
+			lens[2]), fields[2], port);
+		prefix[0] = fields[0][0];
+		prefix[1] = '\0';
+		if (fields[0][0] == '7') {
+			ret = http_append(html, "</pre>\n<form method=\"get\" action=\"", 0);
+		} else {
+			ret = http_append(html, "<a href=\"", 0);
+		}
+		if ((fields[0][0] == 'h') && (lens[1] > 4) &&
+				(strncmp(fields[1], "URL:", 4) == 0)) {
+			ret = ret && http_append_n(html, fields[1] + 4, lens[1] - 4, 1);
+		} else if ((fields[0][0] == '8') || (fields[0][0] == 'T')) {
+			ret = ret && http_append(html, "telnet://", 0) &&
+				http_append(html, hostport, 1);
+		} else {
+			if ((lens[2] != strlen(conn->config->hostname)) ||
+					(strncmp(fields[2], conn->config->hostname, lens[2]) != 0) ||
+					(port != conn->config->port)) {
+				ret = ret && http_append(html, "gopher://", 0) &&
+					http_append(html, hostport, 1);
+			}
+			ret = ret && http_append(html, "/", 0) &&
+				http_append(html, prefix, 1) &&
+				http_append_url(html, fields[1], lens[1]);
+		}
+
+		/* Searches get a form, anything else is a link. */
+		if (fields[0][0] == '7') {
+			ret = ret && http_append(html, "\">", 0) &&
+				http_append_n(html, fields[0] + 1, lens[0] - 1, 1) &&
+				http_append(html, " <input type=\"search\" name=\"q\"> "
+					"<input type=\"submit\" value=\"Search\"></form>\n<pre>\n", 0);
+		} else {
+			ret = ret && http_append(html, "\">", 0) &&
+				http_append_n(html, fields[0] + 1, lens[0] - 1, 1) &&
+				http_append(html, "</a>\n", 0);
+		}
+	}
+
+	/* Page footer. */
+	return ret && http_append(html, "</pre>\n</body>\n</html>\n", 0);
+}
+
+/**
+ * Appends a string to an HTML buffer.
+ *
+ * @param html   Buffer to append the string to.
+ * @param str    String to be appended.
+ * @param escape Should HTML special characters be escaped?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int http_append(buffer_t *html, const char *str, int escape) {
+	return http_append_n(html, str, strlen(str), escape);
+}
+
+/**
+ * Appends a string with a known length to an HTML buffer.
+ *
+ * @param html   Buffer to append the string to.
+ * @param str    String to be appended.
+ * @param len    Length of the string.
+ * @param escape Should HTML special characters be escaped?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int http_append_n(buffer_t *html, const char *str, size_t len, int escape) {
+	size_t i;
+	size_t start;
+
+	if (!escape)
+		return buffer_append(html, str, len);
+
+	for (i = 0, start = 0; i < len; i++) {
+		const char *entity;
+
+		switch (str[i]) {
+			case '&':
+				entity = "&amp;";
+				break;
+			case '<':
+				entity = "&lt;";
+				break;
+			case '>':
+				entity = "&gt;";
+				break;
+			case '"':
+				entity = "&quot;";
+				break;
+			default:
+				continue;
+		}
+
+		if (!buffer_append(html, str + start, i - start) ||
+				!buffer_append(html, entity, strlen(entity))) {
+			return 0;
+		}
+		start = i + 1;
+	}
+
+	return buffer_append(html, str + start, len - start);
+}
+
+/**
+ * Appends a selector to an HTML buffer, percent-encoding anything that isn't
+ * allowed in a URL path.
+ *
+ * @param html Buffer to append the selector to.
+ * @param str  Selector to be appended.
+ * @param len  Length of the selector.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int http_append_url(buffer_t *html, const char *str, size_t len) {
+	char enc[4];
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)str[i];
+
+		if (isalnum(c) || (strchr("/-._~", c) != NULL)) {
+			if (!buffer_append(html, str + i, 1))
+				return 0;
+		} else {
+			sprintf(enc, "%%%02X", c);
+			if (!buffer_append(html, enc, 3))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Checks if a URL uses one of the schemes that are safe to link to from a
+ * page: http, https, gopher, and mailto.
+ *
+ * @param url URL to be checked.
+ * @param len Length of the URL.
+ *
+ * @return TRUE if the URL is safe to link to, FALSE otherwise.
+ */
+int http_url_safe(const char *url, size_t len) {
+	static const char *schemes[] = { "http:", "https:", "gopher:", "mailto:" };
+	size_t slen;
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < (sizeof(schemes) / sizeof(schemes[0])); i++) {
+		slen = strlen(schemes[i]);
+		if (len <= slen)
+			continue;
+		for (j = 0; j < slen; j++) {
+			if (tolower((unsigned char)url[j]) != schemes[i][j])
+				break;
+		}
+		if (j == slen)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Decodes a percent-encoded URL component.
+ *
+ * @param dst  Destination string.
+ * @param size Size of the destination string.
+ * @param src  Component to be decoded.
+ * @param plus Should plus signs be decoded as spaces?
+ *
+ * @return TRUE if the operation was successful, FALSE if the decoded string
+ *         wouldn't fit or contains a NUL character.
+ */
+int http_url_decode(char *dst, size_t size, const char *src, int plus) {
+	char hex[3];
+	size_t len;
+
+	len = 0;
+	hex[2] = '\0';
+	while (*src != '\0') {
+		char c = *src++;
+
+		if ((c == '%') && isxdigit((unsigned char)src[0]) &&
+				isxdigit((unsigned char)src[1])) {
+			hex[0] = src[0];
+			hex[1] = src[1];
+			c = (char)strtol(hex, NULL, 16);
+			src += 2;
+		} else if (plus && (c == '+')) {
+			c = ' ';
+		}
+
+		if ((c == '\0') || ((len + 1) >= size))
+			return 0;
+		dst[len++] = c;
+	}
+	dst[len] = '\0';
+
+	return 1;
+}
+
+/**
+ * Looks up the value of a request header.
+ *
+ * @param headers Request headers separated by CRLF.
+ * @param name    Name of the header.
+ * @param len     Pointer to store the length of the value.
+ *
+ * @return Value of the header or NULL if it isn't present.
+ */
+const char* http_header(const char *headers, const char *name, size_t *len) {
+	const char *line;
+	const char *eol;
+	size_t namelen;
+
+	namelen = strlen(name);
+	line = headers;
+	while (*line != '\0') {
+		eol = strstr(line, "\r\n");
+		if (eol == NULL)
+			eol = line + strlen(line);
+
+		if (((size_t)(eol - line) > namelen) && (line[namelen] == ':') &&
+				http_has_token(line, namelen, name)) {
+			line += namelen + 1;
+			while ((line < eol) && ((*line == ' ') || (*line == '\t')))
+				line++;
+			*len = eol - line;
+			return line;
+		}
+
+		line = (*eol == '\0') ? eol : (eol + 2);
+	}
+
+	return NULL;
+}
+
+/**
+ * Checks if a header value contains a token, ignoring case.
+ *
+ * @param str   Header value.
+ * @param len   Length of the header value.
+ * @param token Token to look for.
+ *
+ * @return TRUE if the token is in the header value.
+ */
+int http_has_token(const char *str, size_t len, const char *token) {
+	size_t toklen;
+	size_t i;
+	size_t j;
+
+	toklen = strlen(token);
+	for (i = 0; (i + toklen) <= len; i++) {
+		for (j = 0; j < toklen; j++) {
+			if (tolower((unsigned char)str[i + j]) !=
+					tolower((unsigned char)token[j])) {
+				break;
+			}
+		}
+
+		if (j == toklen)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets the content type of a file from its Gopher item type, refined by its
+ * extension for types that cover many formats.
+ *
+ * @param type Gopher item type.
+ * @param name Name of the file.
+ *
+ * @return Content type of the file.
+ */
+const char* http_content_type(char type, const char *name) {
+	static const char *mime_types[][2] = {
+		{ "png", "image/png" }, { "jpg", "image/jpeg" },
+		{ "jpeg", "image/jpeg" }, { "gif", "image/gif" },
+		{ "bmp", "image/bmp" }, { "svg", "image/svg+xml" },
+		{ "webp", "image/webp" }, { "ico", "image/x-icon" },
+		{ "mp3", "audio/mpeg" }, { "wav", "audio/wav" },
+		{ "ogg", "audio/ogg" }, { "flac", "audio/flac" },
+		{ "opus", "audio/opus" }, { "mp4", "video/mp4" },
+		{ "webm", "video/webm" }, { "pdf", "application/pdf" },
+		{ "zip", "application/zip" }, { "gz", "application/gzip" },
+		{ "css", "text/css" }, { "xml", "application/xml" },
+		{ "rss", "application/rss+xml" }, { NULL, NULL }
+	};
+	const char *ext;
+	int i;
+
+	switch (type) {
+		case '0':
+			return "text/plain; charset=utf-8";
+		case 'g':
+			return "image/gif";
+	}
+
+	/* Look for the extension in our list of known formats. */
+	ext = strrchr(name, '.');
+	if (ext != NULL) {
+		ext++;
+		for (i = 0; mime_types[i][0] != NULL; i++) {
+			if (strcmp(ext, mime_types[i][0]) == 0)
+				return mime_types[i][1];
+		}
+	}
+
+	return (type == 'h') ? "text/html" : "application/octet-stream";
+}
+
+/**
+ * Gets the reason phrase of an HTTP status code.
+ *
+ * @param status HTTP status code.
+ *
+ * @return Reason phrase of the status code.
+ */
+const char* http_status_text(int status) {
+	switch (status) {
+		case 200:
+			return "OK";
+		case 400:
+			return "Bad Request";
+		case 404:
+			return "Not Found";
+		case 405:
+			return "Method Not Allowed";
+		case 431:
+			return "Request Header Fields Too Large";
+		default:
+			return "Internal Server Error";
+	}
+}
+
+/**
+ * =============================================================================
+ * === Gopher Item Abstractions ================================================
+ * =============================================================================
+ */
+
+/**
+ * Allocates a brand new Gopher item object.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @return Allocated item object or NULL if an error occurred.
+ *
+ * @see gopher_item_free
+ */
+gopher_item_t* gopher_item_new(void) {
+	gopher_item_t *item;
+
+	/* Try to allocate our item object. */
+	item = (gopher_item_t*)mem_alloc(MEM_GOPHERMAP, sizeof(gopher_item_t));
+	if (item == NULL)
+		return NULL;
+
+	/* Populate it with sane defaults. */
+	item->type = INVALID_TYPE;
+	item->_pad = INVALID_TYPE;
+	item->name = NULL;
+	item->selector = NULL;
+	item->hostname = invalid_host_c;
+	item->port = INVALID_PORT;
+
+	return item;
+}
+
+/**
+ * Frees up an Gopher item that was dynamically allocated.
+ *
+ * @see gopher_item_new
+ */
+void gopher_item_free(gopher_item_t *item) {
+	item->type = INVALID_TYPE;
+	if (item->name != NULL)
+		mem_free(item->name);
+	if (item->selector != NULL)
+		mem_free(item->selector);
+	if ((item->hostname != invalid_host_c) && (item->hostname != NULL))
+		mem_free(item->hostname);
+	mem_free(item);
+}
+
+/**
+ * Parses a Gopher item object from a gophermap line.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @return Allocated item object or NULL if an error occurred.
+ *
+ * @see gopher_item_free
+ */
+gopher_item_t* gopher_item_parse(const char *line) {
+	gopher_item_t *item;
+	const char *tmp;
+	char *cbuf;
+	char buf[256];
+
+	/* Try to allocate brand new item object. */
+	item = gopher_item_new();
+	if (item == NULL)
+		return NULL;
+
+	/* Items without a host will point to ourselves when sent. */
+	item->hostname = NULL;
+	item->port = INVALID_PORT;
+
+	/* Get item type. */
+	tmp = line;
+	item->type = *tmp++;
+
+	/* Get item name. */
+	cbuf = buf;
+	while (*tmp != '\t') {
+		*cbuf = *tmp++;
+		cbuf++;
+	}
+	*cbuf = '\0';
+	item->name = mem_strdup(MEM_GOPHERMAP, buf);
+	tmp++;
+
+	/* Get item selector. */
+	cbuf = buf;
+	while ((*tmp != '\t') && (*tmp != '\0')) {
+		*cbuf = *tmp++;
+		cbuf++;
+	}
+	*cbuf = '\0';
+	item->selector = mem_strdup(MEM_GOPHERMAP, buf);
+	if (*tmp == '\0')
+		return item;
+	tmp++;
+
+	/* Get item hostname. */
+	cbuf = buf;
+	while ((*tmp != '\t') && (*tmp != '\0')) {
+		*cbuf = *tmp++;
+		cbuf++;
+	}
+	*cbuf = '\0';
+	if (item->hostname != NULL)
+		mem_free(item->hostname);
+	item->hostname = mem_strdup(MEM_GOPHERMAP, buf);
+	if (*tmp == '\0')
+		return item;
+	tmp++;
+
+	/* Get item port. */
+	cbuf = buf;
+	while (*tmp != '\0') {
+		*cbuf = *tmp++;
+		cbuf++;
+	}
+	*cbuf = '\0';
+	item->port = (uint16_t)atoi(buf);
+
+	return item;
+}
+
+/**
+ * Prints out the contents of a Gopher item object for debugging.
+ *
+ * @param item Gopher item to be inspected.
+ */
+void gopher_item_print(gopher_item_t *item) {
+	printf("Type:     '%c'\nName:     %s\nSelector: %s\nHostname: %s\nPort:    "
+		" %u\n", item->type, item->name, item->selector, item->hostname,
+		item->port);
+}
+
+/**
+ * =============================================================================
+ * === Gopher File Types =======================================================
+ * =============================================================================
+ */
+
+/**
+ * Loads Gopher file type information from a configuration file into a brand
+ * new table.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param srv   Server instance.
+ * @param fname Path to a Gopher file type information configuration file.
+ *
+ * @return Newly allocated table or NULL if an error occurred.
+ *
+ * @see gopher_types_free
+ */
+gopher_types_t* gopher_types_load(amigos_t *srv, const char *fname) {
+	gopher_types_t *types;
+	FILE *fh;
+	int linenum;
+	char type;
+	char ext[EXT_MAX_LEN + 1];
+	uint8_t extlen;
+	char *buf;
+	char lastc;
+	int ci;
+	int ret;
+
+	/* Allocate the table. */
+	types = (gopher_types_t*)mem_alloc(MEM_FILETYPES, sizeof(gopher_types_t));
+	if (types == NULL) {
+		log_syserr(LOG_CRIT, "Could not allocate file types table");
+		return NULL;
+	}
+	types->exts = NULL;
+	types->len = 0;
+	types->generation = ++srv->gopher_types_generation;
+
+	/* Check if the file exists. */
+	if (!file_exists(fname)) {
+		log_printf(LOG_WARNING, "Gopher file types information file '%s' "
+			"wasn't found. All non-directory entries will default to '%c' on "
+			"directory listings.", fname, DEFAULT_FILE_TYPE);
+		return types;
+	}
+
+	/* Open file for reading. */
+	fh = fopen(fname, "r");
+	if (fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open file %s for type association.",
+			fname);
+		gopher_types_free(types);
+		return NULL;
+	}
+
+	/* Go through the file reading its properties. */
+	ret = 1;
+	linenum = 1;
+	lastc = '\n';
+	while ((ci = fgetc(fh)) != EOF) {
+		char c = (char)ci;
+
+		/* Have we just arrived at a new line? */
+		if (lastc == '\n') {
+			/* Cache file type. */
+			type = c;
+
+			/* Reset everything for the next extension. */
+			*ext = '\0';
+			extlen = 0;
+			buf = ext;
+
+			/* Jump to the first extension. */
+			while ((ci = fgetc(fh)) != EOF) {
+				c = (char)ci;
+				if ((c != '\t') && (c != ' '))
+					break;
+			}
+		}
+
+		/* Ignore CR. */
+		if (c == '\r')
+			goto next_char;
+
+		/* Build up extension. */
+		*buf++ = c;
+		extlen++;
+
+		/* Check if we have reached the end of this extension. */
+		if ((c == ' ') || (c == '\n')) {
+			/* Backtrack a bit do that we don't include whitespace. */
+			buf--;
+			*buf = '\0';
+
+			/* Append extension to types list. Skip empty extensions. */
+			if ((ext[0] != '\0') && !gopher_types_append(types, type,
+					ext)) {
+				log_printf(LOG_ERROR, "Failed to append extension '%s' from "
+					"line %u to file types list.", ext, linenum);
+				ret = 0;
+			}
+
+			/* Reset everything for the next extension. */
+			*ext = '\0';
+			extlen = 0;
+			buf = ext;
+		}
+
+		/* Increase the line counter if needed. */
+		if (c == '\n')
+			linenum++;
+
+		/* Check if we have reached the extension size limit. */
+		if (extlen >= EXT_MAX_LEN) {
+			buf--;
+			*buf = '\0';
+			log_printf(LOG_ERROR, "Extension size limit of %u reached when "
+				"parsing extension '%s' at line %u of file types.\n",
+				EXT_MAX_LEN, ext, linenum);
+			ret = 0;
+			break;
+		}
+
+next_char:
+		lastc = c;
+	}
+
+	/* Ensure that we get the last extension in case of no newline at EOF. */
+	if ((extlen == 0) && (lastc != '\n')) {
+		*buf = '\0';
+		if (!gopher_types_append(types, type, ext)) {
+			log_printf(LOG_ERROR, "Failed to append file's last extension '%s' "
+				"from line %u to file types list.", ext, linenum);
+			ret = 0;
+		}
+
+		*ext = '\0';
+		buf = ext;
+	}
+
+	/* Close file handle. */
+	fclose(fh);
+
+	/* Never publish a partial table. */
+	if (!ret) {
+		gopher_types_free(types);
+		return NULL;
+	}
+
+	return types;
+}
+
+/**
+ * Appends an extension to a file type table that hasn't been published yet.
+ *
+ * @param types File type table.
+ * @param type  Gopher file type.
+ * @param ext   Extension to be associated with the file type.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int gopher_types_append(gopher_types_t *types, char type, const char *ext) {
+	char buf[EXT_MAX_LEN + 2];
+
+	/* Do an initial large allocation or an incremental reallocation. */
+	if (types->exts == NULL) {
+		types->exts = (char**)mem_alloc(MEM_FILETYPES, sizeof(char*));
+		if (types->exts == NULL) {
+			log_syserr(LOG_CRIT, "Could not allocate initial item of file "
+				"types list");
+			return 0;
+		}
+	} else {
+		void *tmp = mem_realloc(MEM_FILETYPES, types->exts,
+			(types->len + 1) * sizeof(char*));
+		if (tmp == NULL) {
+			log_syserr(LOG_CRIT, "Could not reallocate file types list");
+			return 0;
+		}
+		types->exts = (char**)tmp;
+	}
+
+	/* Add file type to extension string. */
+	snprintf(buf, EXT_MAX_LEN + 1, "%c%s", type, ext);
+
+	/* Append extension to list and increase length counter. */
+	types->exts[types->len] = mem_strdup(MEM_FILETYPES, buf);
+	if (types->exts[types->len] == NULL) {
+		log_syserr(LOG_CRIT, "Could not allocate file type association");
+		return 0;
+	}
+	types->len++;
+
+	return 1;
+}
+
+/**
+ * Reloads the file type information and publishes the new table. Lookups
+ * that are already in progress keep using the previous table, which gets
+ * free'd once all of them have finished.
+ *
+ * @warning Must only be called from the server loop.
+ *
+ * @param srv Server instance.
+ */
+void gopher_types_reload(amigos_t *srv) {
+	gopher_types_t *types;
+	gopher_types_t *old;
+
+	/* Build the new table. */
+	types = gopher_types_load(srv, srv->config->filetypes_path);
+	if (types == NULL) {
+		log_printf(LOG_ERROR, "Keeping the current file type associations");
+		return;
+	}
+#ifdef DEBUG
+	gopher_types_dump(types);
+#endif /* DEBUG */
+
+	/* Publish it and retire the old one. */
+	old = srv->gopher_types;
+	atomic_set_ptr(&srv->gopher_types, types);
+	if (old != NULL)
+		rcu_retire(srv, old, gopher_types_free);
+	log_printf(LOG_INFO, "File type associations reloaded (generation %u)",
+		types->generation);
+}
+
+/**
+ * Frees up any resources used by a Gopher file type information table.
+ *
+ * @param ptr File type table to be free'd.
+ *
+ * @see gopher_types_load
+ */
+void gopher_types_free(void *ptr) {
+	gopher_types_t *types;
+	uint16_t i;
+
+	types = (gopher_types_t*)ptr;
+	if (types == NULL)
+		return;
+
+	/* Free each type element. */
+	for (i = 0; i < types->len; i++) {
+		if (types->exts[i] != NULL)
+			mem_free(types->exts[i]);
+	}
+
+	/* Free the array and the table itself. */
+	if (types->exts != NULL)
+		mem_free(types->exts);
+	mem_free(types);
+}
+
+/**
+ * Infers the Gopher file type character based on the file name.
+ *
+ * @warning Must be called from within a read-side critical section.
+ *
+ * @param srv   Server instance.
+ * @param fname File name to be used for inference.
+ *
+ * @return Guessed Gopher file type or DEFAULT_FILE_TYPE if we failed to guess.
+ */
+char gopher_types_infer(amigos_t *srv, const char *fname) {
+	const gopher_types_t *types;
+	const char *ext;
+	uint16_t i;
+
+	/* Do we even have our file type table initialized to infer anything? */
+	types = (const gopher_types_t*)atomic_get_ptr(&srv->gopher_types);
+	if (types == NULL)
+		return DEFAULT_FILE_TYPE;
+
+	/* Get the file extension. */
+	ext = strrchr(fname, '.');
+	if (ext == NULL)
+		return DEFAULT_FILE_TYPE;
 	ext++;
 
-	/* Check if the file extension is anywhere in the file type list. */
-	for (i = 0; i < gopher_types_len; i++) {
-		if (strcmp(ext, gopher_types[i] + 1) == 0)
-			return *gopher_types[i];
+	/* Check if the file extension is anywhere in the file type list. */
+	for (i = 0; i < types->len; i++) {
+		if (strcmp(ext, types->exts[i] + 1) == 0)
+			return *types->exts[i];
+	}
+
+	return DEFAULT_FILE_TYPE;
+}
+
+/**
+ * Dumps the contents of a Gopher file type information table for debugging
+ * pursposes.
+ *
+ * @param types File type table to be dumped.
+ */
+void gopher_types_dump(const gopher_types_t *types) {
+	uint16_t i;
+
+	/* Do we even have any? */
+	if ((types == NULL) || (types->len == 0)) {
+		log_printf(LOG_WARNING, "No Gopher file type associations.");
+		return;
+	}
+
+	/* Dump associations array. */
+	printf("Gopher file type associations (%u):", types->len);
+	for (i = 0; i < types->len; i++)
+		printf(" %s", types->exts[i]);
+	printf("\n");
+}
+
+#ifdef WITH_TLS
+/**
+ * =============================================================================
+ * === Transport Layer Security ================================================
+ * =============================================================================
+ */
+
+/**
+ * Starts the TLS listener if it's enabled in the configuration.
+ *
+ * @param srv Server instance.
+ * @param cfg Configuration with the TLS port and certificates.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int tls_start(amigos_t *srv, const config_t *cfg) {
+	/* TLS is completely optional. */
+	srv->tls_socket = SOCKERR;
+	srv->tls_ctx = NULL;
+	if (cfg->tls_port == 0)
+		return 1;
+
+	/* Setup the context shared by all connections. */
+	srv->tls_ctx = tls_ctx_new(cfg, NULL);
+	if (srv->tls_ctx == NULL)
+		return 0;
+
+	/* Start listening for connections. */
+	srv->tls_socket = server_listen(srv->af, cfg, cfg->tls_port);
+	if (srv->tls_socket == SOCKERR) {
+		tls_ctx_free(srv->tls_ctx);
+		srv->tls_ctx = NULL;
+		return 0;
+	}
+
+	log_printf(LOG_INFO, "TLS server running on %s:%u", cfg->listen_addr,
+		cfg->tls_port);
+	return 1;
+}
+
+/**
+ * Stops the TLS listener and frees up its context.
+ *
+ * @param srv Server instance.
+ */
+void tls_stop(amigos_t *srv) {
+	if (srv->tls_socket != SOCKERR)
+		sockclose(srv->tls_socket);
+	srv->tls_socket = SOCKERR;
+
+	if (srv->tls_ctx != NULL)
+		tls_ctx_free(srv->tls_ctx);
+	srv->tls_ctx = NULL;
+}
+
+/**
+ * Creates a brand new TLS context with the certificates from a configuration.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param cfg  Configuration with the certificates.
+ * @param prev Context being replaced, whose session ticket keys should be kept
+ *             so that clients can still resume their sessions, or NULL.
+ *
+ * @return Newly created context or NULL if an error occurred.
+ *
+ * @see tls_ctx_free
+ */
+SSL_CTX* tls_ctx_new(const config_t *cfg, SSL_CTX *prev) {
+	SSL_CTX *ctx;
+
+	/* Create the context. */
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		log_tlserr(LOG_CRIT, "Failed to create TLS context");
+		return NULL;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Let the kernel take over the encryption after the handshake. */
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif /* SSL_OP_ENABLE_KTLS */
+
+	/* Allow clients to resume their sessions without a full handshake. */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"amigos", 6);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	if (prev != NULL) {
+		unsigned char keys[80];
+
+		if (SSL_CTX_get_tlsext_ticket_keys(prev, keys, sizeof(keys)) > 0)
+			SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+		memset(keys, '\0', sizeof(keys));
+	}
+
+	/* Load our certificate and its private key. */
+	if (SSL_CTX_use_certificate_chain_file(ctx, cfg->tls_cert) != 1) {
+		log_tlserr(LOG_CRIT, "Failed to load TLS certificate %s",
+			cfg->tls_cert);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	if ((SSL_CTX_use_PrivateKey_file(ctx, cfg->tls_key,
+			SSL_FILETYPE_PEM) != 1) || (SSL_CTX_check_private_key(ctx) != 1)) {
+		log_tlserr(LOG_CRIT, "Failed to load TLS private key %s",
+			cfg->tls_key);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+/**
+ * Frees up a TLS context. Connections that are still using it keep their own
+ * reference to it.
+ *
+ * @param ptr TLS context to be free'd.
+ *
+ * @see tls_ctx_new
+ */
+void tls_ctx_free(void *ptr) {
+	SSL_CTX_free((SSL_CTX*)ptr);
+}
+
+/**
+ * Reloads the TLS certificates and rebinds the TLS listener if its address has
+ * changed.
+ *
+ * @warning Must only be called from the server loop.
+ *
+ * @param srv Server instance.
+ * @param cfg New configuration.
+ * @param old Configuration currently in use.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int tls_reload(amigos_t *srv, const config_t *cfg, const config_t *old) {
+	SSL_CTX *ctx;
+	SSL_CTX *prev;
+	sockfd_t sockfd;
+
+	/* Rebuild the context so that renewed certificates get picked up. */
+	ctx = NULL;
+	if (cfg->tls_port != 0) {
+		ctx = tls_ctx_new(cfg, srv->tls_ctx);
+		if (ctx == NULL)
+			return 0;
+	}
+
+	/* Rebind the listening socket if its address has changed. */
+	if ((strcmp(cfg->listen_addr, old->listen_addr) != 0) ||
+			(cfg->tls_port != old->tls_port)) {
+		sockfd = SOCKERR;
+		if (cfg->tls_port != 0) {
+			sockfd = server_listen(srv->af, cfg, cfg->tls_port);
+			if (sockfd == SOCKERR) {
+				tls_ctx_free(ctx);
+				return 0;
+			}
+
+			log_printf(LOG_INFO, "TLS server now running on %s:%u",
+				cfg->listen_addr, cfg->tls_port);
+		}
+
+		if (srv->tls_socket != SOCKERR)
+			sockclose(srv->tls_socket);
+		srv->tls_socket = sockfd;
+	}
+
+	/* Publish the new context and retire the old one. */
+	prev = srv->tls_ctx;
+	atomic_set_ptr(&srv->tls_ctx, ctx);
+	if (prev != NULL)
+		rcu_retire(srv, prev, tls_ctx_free);
+
+	return 1;
+}
+
+/**
+ * Performs the TLS handshake with a client.
+ *
+ * @warning Must be called from within a read-side critical section.
+ *
+ * @param conn Client connection object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int tls_accept(client_conn_t *conn) {
+	SSL_CTX *ctx;
+
+	/* TLS might have been disabled in the meantime. */
+	ctx = (SSL_CTX*)atomic_get_ptr(&conn->server->tls_ctx);
+	if (ctx == NULL)
+		return 0;
+
+	/* Setup the connection. */
+	conn->ssl = SSL_new(ctx);
+	if (conn->ssl == NULL) {
+		log_tlserr(LOG_ERROR, "Failed to create TLS connection");
+		return 0;
+	}
+	SSL_set_fd(conn->ssl, (int)conn->sockfd);
+
+	/* Perform the handshake. */
+	if (SSL_accept(conn->ssl) != 1) {
+		counter_add(&conn->server->stats->tls_failed, 1);
+		log_tlserr(LOG_WARNING, "TLS handshake with %s failed", conn->addr);
+		SSL_free(conn->ssl);
+		conn->ssl = NULL;
+		return 0;
+	}
+
+	/* Keep track of how well we are doing. */
+	counter_add(&conn->server->stats->tls_handshakes, 1);
+	if (SSL_session_reused(conn->ssl))
+		counter_add(&conn->server->stats->tls_resumed, 1);
+	if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+		counter_add(&conn->server->stats->tls_ktls, 1);
+
+	return 1;
+}
+
+/**
+ * Shuts down the TLS session of a client connection, if there's one.
+ *
+ * @param conn Client connection object.
+ */
+void tls_close(client_conn_t *conn) {
+	if (conn->ssl == NULL)
+		return;
+
+	SSL_shutdown(conn->ssl);
+	SSL_free(conn->ssl);
+	conn->ssl = NULL;
+}
+#endif /* WITH_TLS */
+
+/**
+ * =============================================================================
+ * === Statistics ==============================================================
+ * =============================================================================
+ */
+
+/**
+ * Logs a summary of the server statistics since the last time it was called.
+ * Nothing is logged if we have been idle.
+ *
+ * @param srv     Server instance.
+ * @param elapsed Number of seconds since the last time it was called.
+ */
+void stats_log(amigos_t *srv, unsigned int elapsed) {
+	uint64_t connections;
+#ifdef WITH_TLS
+	uint64_t handshakes;
+#endif /* WITH_TLS */
+
+	/* Don't flood the log if we are idle. */
+	connections = atomic_get_u64(&srv->stats->connections);
+	if ((connections == srv->last_connections) || (elapsed == 0))
+		return;
+	log_printf(LOG_INFO, "Accepted %lu connections (%.2f/s)",
+		(unsigned long)(connections - srv->last_connections),
+		(double)(connections - srv->last_connections) / elapsed);
+	srv->last_connections = connections;
+
+#ifdef WITH_TLS
+	/* TLS handshakes and traffic. */
+	handshakes = atomic_get_u64(&srv->stats->tls_handshakes);
+	log_printf(LOG_INFO, "TLS handshakes: %.2f/s, %lu total, %lu resumed, "
+		"%lu failed, %lu offloaded; bytes in: %lu, bytes out: %lu",
+		(double)(handshakes - srv->last_handshakes) / elapsed,
+		(unsigned long)handshakes,
+		(unsigned long)atomic_get_u64(&srv->stats->tls_resumed),
+		(unsigned long)atomic_get_u64(&srv->stats->tls_failed),
+		(unsigned long)atomic_get_u64(&srv->stats->tls_ktls),
+		(unsigned long)atomic_get_u64(&srv->stats->tls_bytes_in),
+		(unsigned long)atomic_get_u64(&srv->stats->tls_bytes_out));
+	srv->last_handshakes = handshakes;
+#endif /* WITH_TLS */
+}
+
+/**
+ * Accounts for a request that has been replied to.
+ *
+ * @param srv   Server instance.
+ * @param kind  Kind of request.
+ * @param start Timestamp of when the request started being handled, as
+ *              returned by clock_usec.
+ */
+void stats_request(amigos_t *srv, unsigned int kind, uint64_t start) {
+	uint64_t elapsed;
+	unsigned int i;
+
+	/* Find the latency bucket it belongs to. */
+	elapsed = clock_usec() - start;
+	for (i = 0; i < (AMIGOS_STATS_LATENCY_BUCKETS - 1); i++) {
+		if (elapsed < ((uint64_t)AMIGOS_STATS_LATENCY_BASE << i))
+			break;
+	}
+
+	counter_add(&srv->stats->requests[kind], 1);
+	counter_add(&srv->stats->latency[i], 1);
+}
+
+/**
+ * Updates the gauges of the statistics of the current process.
+ *
+ * @param srv    Server instance.
+ * @param active Number of connections currently being served.
+ */
+void stats_update(amigos_t *srv, unsigned int active) {
+	uint64_t queued;
+	proxy_job_t *job;
+
+	/* Content cache usage. */
+	mutex_lock(&srv->content_cache.lock);
+	gauge_set(&srv->stats->cache_bytes, (uint64_t)srv->content_cache.size);
+	gauge_set(&srv->stats->cache_objects,
+		(uint64_t)srv->content_cache.count);
+	gauge_set(&srv->stats->cache_budget,
+		(uint64_t)srv->content_cache.max_size);
+	mutex_unlock(&srv->content_cache.lock);
+
+	/* Revalidations waiting on the proxy thread. */
+	queued = 0;
+	if (srv->background) {
+		mutex_lock(&srv->proxy_lock);
+		for (job = srv->proxy_jobs; job != NULL; job = job->next)
+			queued++;
+		mutex_unlock(&srv->proxy_lock);
+	}
+	gauge_set(&srv->stats->proxy_queue, queued);
+
+	gauge_set(&srv->stats->active, (uint64_t)active);
+	gauge_set(&srv->stats->updated, (int64_t)time(NULL));
+}
+
+/**
+ * Points the statistics of the current process to a slot of the statistics
+ * file, or to private memory if there's no file.
+ *
+ * @param srv  Server instance.
+ * @param slot Index of the slot in the statistics file.
+ */
+void stats_attach(amigos_t *srv, unsigned int slot) {
+#ifdef HAS_MMAP
+	if (srv->stats_file != NULL) {
+		srv->stats = (stats_t*)((char*)srv->stats_file +
+			srv->stats_file->header_size) + slot;
+	} else {
+		srv->stats = &srv->local_stats;
+	}
+#else
+	srv->stats = &srv->local_stats;
+#endif /* HAS_MMAP */
+	srv->content_cache.stats = srv->stats;
+	srv->last_connections = atomic_get_u64(&srv->stats->connections);
+#ifdef WITH_TLS
+	srv->last_handshakes = atomic_get_u64(&srv->stats->tls_handshakes);
+#endif /* WITH_TLS */
+
+#ifdef _WIN32
+	gauge_set(&srv->stats->pid, (int64_t)GetCurrentProcessId());
+#else
+	gauge_set(&srv->stats->pid, (int64_t)getpid());
+#endif /* _WIN32 */
+	gauge_set(&srv->stats->updated, (int64_t)time(NULL));
+}
+
+#ifdef HAS_MMAP
+/**
+ * Creates the statistics file and maps it into memory, so that it's shared
+ * with every process forked afterwards. Any previous file is replaced by a
+ * new one, leaving readers that still have it open unaffected.
+ *
+ * @param srv    Server instance.
+ * @param path   Path of the statistics file.
+ * @param nslots Number of slots to be used.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ *
+ * @see stats_close
+ */
+int stats_open(amigos_t *srv, const char *path, unsigned int nslots) {
+	amigos_stats_header_t *hdr;
+	size_t size;
+	int fd;
+
+	/* Create a brand new file of the right size. */
+	size = sizeof(amigos_stats_header_t) +
+		(AMIGOS_STATS_SLOTS * sizeof(amigos_stats_slot_t));
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		log_syserr(LOG_CRIT, "Failed to create statistics file '%s'", path);
+		return 0;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		log_syserr(LOG_CRIT, "Failed to resize statistics file '%s'", path);
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+
+	/* Map it. */
+	hdr = (amigos_stats_header_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == (amigos_stats_header_t*)MAP_FAILED) {
+		log_syserr(LOG_CRIT, "Failed to map statistics file '%s'", path);
+		unlink(path);
+		return 0;
+	}
+
+	/* Fill in the header, leaving the magic number for last. */
+	hdr->version = AMIGOS_STATS_VERSION;
+	hdr->header_size = sizeof(amigos_stats_header_t);
+	hdr->slot_size = sizeof(amigos_stats_slot_t);
+	hdr->nslots = nslots;
+	hdr->pid = (int64_t)getpid();
+	hdr->started = (int64_t)time(NULL);
+	atomic_fence();
+	hdr->magic = AMIGOS_STATS_MAGIC;
+
+	srv->stats_file = hdr;
+	stats_attach(srv, 0);
+	return 1;
+}
+
+/**
+ * Unmaps the statistics file from the current process, going back to keeping
+ * statistics in private memory.
+ *
+ * @param srv Server instance.
+ */
+void stats_close(amigos_t *srv) {
+	if (srv->stats_file == NULL)
+		return;
+
+	munmap((void*)srv->stats_file, sizeof(amigos_stats_header_t) +
+		(AMIGOS_STATS_SLOTS * sizeof(amigos_stats_slot_t)));
+	srv->stats_file = NULL;
+	srv->stats = &srv->local_stats;
+	srv->content_cache.stats = srv->stats;
+}
+#endif /* HAS_MMAP */
+
+/**
+ * Gets the current time from a clock that doesn't jump around.
+ *
+ * @return Timestamp in microseconds from an arbitrary starting point.
+ */
+uint64_t clock_usec(void) {
+#ifdef _WIN32
+	return (uint64_t)GetTickCount() * 1000;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+#endif /* _WIN32 */
+}
+
+
+/**
+ * =============================================================================
+ * === Heavy Hitters ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Initializes an empty set of heavy hitters.
+ *
+ * @param hh Set to be initialized.
+ *
+ * @see hitters_free
+ */
+void hitters_init(hitters_t *hh) {
+	hh->len = 0;
+	mutex_init(&hh->lock);
+}
+
+/**
+ * Frees up the resources used by a set of heavy hitters.
+ *
+ * @param hh Set to be free'd.
+ */
+void hitters_free(hitters_t *hh) {
+	hh->len = 0;
+	mutex_destroy(&hh->lock);
+}
+
+/**
+ * Accounts for an occurrence of an item using the Space-Saving algorithm: an
+ * item that isn't being tracked takes over the counter of the lightest one,
+ * inheriting its count as the error, so that the heaviest items are always
+ * tracked and their counts are never underestimated.
+ *
+ * @param hh     Set of heavy hitters.
+ * @param key    Item that occurred. Truncated if it's too long.
+ * @param weight Weight of the occurrence.
+ */
+void hitters_add(hitters_t *hh, const char *key, uint64_t weight) {
+	char buf[ADMIN_SELECTOR_LEN];
+	hitter_t *item;
+	hitter_t *min;
+	uint32_t hash;
+	unsigned int i;
+
+	strncpy(buf, key, ADMIN_SELECTOR_LEN - 1);
+	buf[ADMIN_SELECTOR_LEN - 1] = '\0';
+	hash = search_hash(buf);
+
+	/* Look for the item while keeping an eye out for the lightest one. */
+	mutex_lock(&hh->lock);
+	min = NULL;
+	for (i = 0; i < hh->len; i++) {
+		item = &hh->items[i];
+		if ((item->hash == hash) && (strcmp(item->key, buf) == 0)) {
+			item->count += weight;
+			mutex_unlock(&hh->lock);
+			return;
+		}
+
+		if ((min == NULL) || (item->count < min->count))
+			min = item;
+	}
+
+	/* Take a free counter or the one of the lightest item. */
+	if (hh->len < HITTERS_SIZE) {
+		item = &hh->items[hh->len++];
+		item->count = 0;
+		item->error = 0;
+	} else {
+		item = min;
+		item->error = item->count;
+	}
+	item->hash = hash;
+	item->count += weight;
+	strcpy(item->key, buf);
+	mutex_unlock(&hh->lock);
+}
+
+/**
+ * Gets the guaranteed count of an item, which is how much it has weighed at
+ * the very least.
+ *
+ * @param hh  Set of heavy hitters.
+ * @param key Item to look for.
+ *
+ * @return Guaranteed count of the item or 0 if it isn't being tracked.
+ */
+uint64_t hitters_count(hitters_t *hh, const char *key) {
+	char buf[ADMIN_SELECTOR_LEN];
+	uint64_t count;
+	uint32_t hash;
+	unsigned int i;
+
+	strncpy(buf, key, ADMIN_SELECTOR_LEN - 1);
+	buf[ADMIN_SELECTOR_LEN - 1] = '\0';
+	hash = search_hash(buf);
+
+	count = 0;
+	mutex_lock(&hh->lock);
+	for (i = 0; i < hh->len; i++) {
+		if ((hh->items[i].hash == hash) &&
+				(strcmp(hh->items[i].key, buf) == 0)) {
+			count = hh->items[i].count - hh->items[i].error;
+			break;
+		}
+	}
+	mutex_unlock(&hh->lock);
+
+	return count;
+}
+
+/**
+ * Halves every count, so that the set follows the current traffic instead of
+ * everything since the server started.
+ *
+ * @param hh Set of heavy hitters.
+ */
+void hitters_decay(hitters_t *hh) {
+	unsigned int i;
+
+	mutex_lock(&hh->lock);
+	for (i = 0; i < hh->len; i++) {
+		hh->items[i].count /= 2;
+		hh->items[i].error /= 2;
+	}
+	mutex_unlock(&hh->lock);
+}
+
+/**
+ * Takes a copy of the items being tracked, heaviest first.
+ *
+ * @param hh    Set of heavy hitters.
+ * @param items Array to copy the items to, big enough for HITTERS_SIZE items.
+ *
+ * @return Number of items copied.
+ */
+unsigned int hitters_snapshot(hitters_t *hh, hitter_t *items) {
+	unsigned int len;
+
+	mutex_lock(&hh->lock);
+	len = hh->len;
+	memcpy(items, hh->items, len * sizeof(hitter_t));
+	mutex_unlock(&hh->lock);
+
+	qsort(items, len, sizeof(hitter_t), hitter_cmp);
+	return len;
+}
+
+/**
+ * Compares two tracked items by count for qsort, heaviest first.
+ */
+int hitter_cmp(const void *a, const void *b) {
+	const hitter_t *ha = (const hitter_t*)a;
+	const hitter_t *hb = (const hitter_t*)b;
+
+	if (ha->count != hb->count)
+		return (ha->count > hb->count) ? -1 : 1;
+	return strcmp(ha->key, hb->key);
+}
+
+/**
+ * Accounts for a request that has been replied to in the heavy hitters.
+ *
+ * @param conn Client connection object.
+ * @param sent Number of bytes sent in reply to the request.
+ */
+void hitters_request(client_conn_t *conn, uint64_t sent) {
+	amigos_t *srv;
+
+	srv = conn->server;
+	hitters_add(&srv->top_requests, conn->score->selector, 1);
+	if (sent > 0) {
+		hitters_add(&srv->top_bytes, conn->score->selector, sent);
+		hitters_add(&srv->top_clients, conn->addr, sent);
+	}
+}
+
+/**
+ * Pins a cached reply if the selector being requested is one of the hot ones,
+ * so that it can't be evicted by objects that are only ever requested once.
+ *
+ * @param conn  Client connection object.
+ * @param entry Cached reply to the request.
+ */
+void hitters_pin(const client_conn_t *conn, cache_entry_t *entry) {
+	amigos_t *srv;
+
+	srv = conn->server;
+	if ((entry == NULL) || (conn->config->hot_requests == 0))
+		return;
+
+	if (hitters_count(&srv->top_requests, conn->score->selector) >=
+			conn->config->hot_requests) {
+		cache_pin(&srv->content_cache, entry);
+	}
+}
+
+/**
+ * Periodically decays the heavy hitters and unpins every cached object, so
+ * that only the replies to selectors that are still hot get pinned again.
+ *
+ * @param srv Server instance.
+ */
+void hitters_update(amigos_t *srv) {
+	time_t now;
+
+	now = time(NULL);
+	if ((now - srv->hitters_decayed) < HITTERS_DECAY_INTERVAL)
+		return;
+
+	hitters_decay(&srv->top_requests);
+	hitters_decay(&srv->top_bytes);
+	hitters_decay(&srv->top_clients);
+	cache_unpin(&srv->content_cache);
+	srv->hitters_decayed = now;
+}
+
+
+#ifdef HAS_CGROUPS
+/**
+ * =============================================================================
+ * === Memory Pressure =========================================================
+ * =============================================================================
+ */
+
+/**
+ * Looks for the memory controller of our cgroup and for memory pressure stall
+ * information, so that the cache budget can follow how much memory we have.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if there's something to watch, FALSE otherwise.
+ *
+ * @see memory_free
+ */
+int memory_init(amigos_t *srv) {
+	char line[LOG_MAX_LEN];
+	char buf[32];
+	FILE *fh;
+
+	/* Find our cgroup in the unified hierarchy. */
+	fh = fopen("/proc/self/cgroup", "r");
+	if (fh != NULL) {
+		while (fgets(line, sizeof(line), fh) != NULL) {
+			if (strncmp(line, "0::", 3) != 0)
+				continue;
+
+			line[strcspn(line, "\r\n")] = '\0';
+			srv->memory_cgroup = (char*)mem_alloc(MEM_SERVER,
+				strlen(line) + 16);
+			if (srv->memory_cgroup == NULL) {
+				log_syserr(LOG_ERROR, "Failed to allocate cgroup path");
+				break;
+			}
+			sprintf(srv->memory_cgroup, "/sys/fs/cgroup%s", line + 3);
+			break;
+		}
+		fclose(fh);
+	}
+	if ((srv->memory_cgroup != NULL) && !memory_read(srv->memory_cgroup,
+			"memory.current", buf, sizeof(buf))) {
+		mem_free(srv->memory_cgroup);
+		srv->memory_cgroup = NULL;
+	}
+
+	/* Pressure of the cgroup, or of the whole system if we aren't in one. */
+	if ((srv->memory_cgroup != NULL) && memory_read(srv->memory_cgroup,
+			"memory.pressure", buf, sizeof(buf))) {
+		srv->memory_psi = (char*)mem_alloc(MEM_SERVER,
+			strlen(srv->memory_cgroup) + 17);
+		if (srv->memory_psi != NULL)
+			sprintf(srv->memory_psi, "%s/memory.pressure", srv->memory_cgroup);
+	} else if (file_exists("/proc/pressure/memory")) {
+		srv->memory_psi = mem_strdup(MEM_SERVER, "/proc/pressure/memory");
+	}
+
+	if ((srv->memory_cgroup == NULL) && (srv->memory_psi == NULL)) {
+		log_printf(LOG_INFO, "No cgroup or memory pressure information, the "
+			"cache budget is fixed");
+		return 0;
+	}
+	log_printf(LOG_INFO, "Sizing the cache budget by the memory of %s",
+		(srv->memory_cgroup != NULL) ? srv->memory_cgroup : "the system");
+
+	return 1;
+}
+
+/**
+ * Frees up what was used to watch the memory.
+ *
+ * @param srv Server instance.
+ */
+void memory_free(amigos_t *srv) {
+	if (srv->memory_cgroup != NULL)
+		mem_free(srv->memory_cgroup);
+	if (srv->memory_psi != NULL)
+		mem_free(srv->memory_psi);
+	srv->memory_cgroup = NULL;
+	srv->memory_psi = NULL;
+}
+
+/**
+ * Checks how much memory we're using and how much we're stalling on it once a
+ * second, shrinking the cache budget by a quarter when either is too high and
+ * growing it back by an eighth once things have calmed down. The least recently
+ * used objects are evicted first whenever the budget shrinks.
+ *
+ * @param srv Server instance.
+ */
+void memory_update(amigos_t *srv) {
+	cache_t *cache;
+	char buf[4096];
+	char *field;
+	double current;
+	double limit;
+	double pressure;
+	size_t budget;
+	time_t now;
+	int high;
+	int low;
+
+	/* Only check once a second, if there's anything to check. */
+	now = time(NULL);
+	if (((srv->memory_cgroup == NULL) && (srv->memory_psi == NULL)) ||
+			(now == srv->memory_checked)) {
+		return;
+	}
+	srv->memory_checked = now;
+	cache = &srv->content_cache;
+	if (!srv->config->memory_pressure) {
+		if (cache->max_size != CACHE_MAX_SIZE)
+			cache_resize(cache, CACHE_MAX_SIZE);
+		return;
+	}
+
+	/* Memory in use, leaving out file pages the kernel can readily drop. */
+	current = 0;
+	limit = 0;
+	if (srv->memory_cgroup != NULL) {
+		if (memory_read(srv->memory_cgroup, "memory.current", buf,
+				sizeof(buf))) {
+			current = strtod(buf, NULL);
+		}
+		if (memory_read(srv->memory_cgroup, "memory.max", buf, sizeof(buf)) &&
+				(strncmp(buf, "max", 3) != 0)) {
+			limit = strtod(buf, NULL);
+		}
+		if (memory_read(srv->memory_cgroup, "memory.stat", buf, sizeof(buf)) &&
+				((field = strstr(buf, "\ninactive_file ")) != NULL)) {
+			current -= strtod(field + 15, NULL);
+			if (current < 0)
+				current = 0;
+		}
+	}
+
+	/* Share of the last 10 seconds that some of our tasks were stalled. */
+	pressure = 0;
+	if ((srv->memory_psi != NULL) &&
+			memory_read(srv->memory_psi, NULL, buf, sizeof(buf)) &&
+			((field = strstr(buf, "some avg10=")) != NULL)) {
+		pressure = strtod(field + 11, NULL);
+	}
+
+	gauge_set(&srv->stats->memory_current, (uint64_t)current);
+	gauge_set(&srv->stats->memory_limit, (uint64_t)limit);
+	gauge_set(&srv->stats->memory_pressure, (uint64_t)(pressure * 100));
+
+	/* Adjust the budget. */
+	high = (pressure >= MEMORY_PSI_HIGH) || ((limit > 0) &&
+		(current > (limit * MEMORY_HIGH_PERCENT / 100)));
+	low = (pressure < MEMORY_PSI_LOW) && ((limit == 0) ||
+		(current < (limit * MEMORY_LOW_PERCENT / 100)));
+	budget = cache->max_size;
+	if (high && (budget > CACHE_MIN_SIZE)) {
+		budget -= budget / 4;
+		if (budget < CACHE_MIN_SIZE)
+			budget = CACHE_MIN_SIZE;
+		log_printf(LOG_NOTICE, "Memory is tight (%.0f of %.0f bytes, %.2f%% "
+			"stalled), shrinking the cache budget to %lu bytes", current,
+			limit, pressure, (unsigned long)budget);
+	} else if (low && (budget < CACHE_MAX_SIZE)) {
+		budget += budget / 8;
+		if (budget > CACHE_MAX_SIZE)
+			budget = CACHE_MAX_SIZE;
+	}
+	if (budget != cache->max_size)
+		cache_resize(cache, budget);
+}
+
+/**
+ * Reads a small file from the cgroup file system.
+ *
+ * @param path Directory of the file, or the file itself if name is NULL.
+ * @param name Name of the file.
+ * @param buf  Buffer that gets the contents of the file.
+ * @param len  Size of the buffer.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int memory_read(const char *path, const char *name, char *buf, size_t len) {
+	char fname[LOG_MAX_LEN];
+	ssize_t nread;
+	int fd;
+
+	if (name != NULL) {
+		if ((strlen(path) + strlen(name) + 2) > sizeof(fname))
+			return 0;
+		sprintf(fname, "%s/%s", path, name);
+		path = fname;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	nread = read(fd, buf, len - 1);
+	close(fd);
+	if (nread < 0)
+		return 0;
+	buf[nread] = '\0';
+
+	return 1;
+}
+#endif /* HAS_CGROUPS */
+
+
+/**
+ * =============================================================================
+ * === Runtime Configuration ===================================================
+ * =============================================================================
+ */
+
+/**
+ * Allocates a brand new configuration object populated with the compile-time
+ * defaults.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @return Allocated configuration object or NULL if an error occurred.
+ *
+ * @see config_free
+ */
+config_t* config_new(void) {
+	config_t *cfg;
+
+	/* Try to allocate our configuration object. */
+	cfg = (config_t*)mem_alloc(MEM_CONFIG, sizeof(config_t));
+	if (cfg == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate configuration");
+		return NULL;
+	}
+
+	/* Populate it with the defaults. */
+	cfg->listen_addr = mem_strdup(MEM_CONFIG, LISTEN_ADDR);
+	cfg->hostname = mem_strdup(MEM_CONFIG, DEFAULT_HOSTNAME);
+	cfg->listen_port = LISTEN_PORT;
+	cfg->port = DEFAULT_PORT;
+	cfg->max_connections = MAX_CONNECTIONS;
+	cfg->backlog = LISTEN_BACKLOG;
+	cfg->recv_timeout = RECV_TIMEOUT;
+	cfg->slow_request = SLOW_REQUEST;
+	cfg->stuck_request = STUCK_REQUEST;
+	cfg->kill_stuck = KILL_STUCK;
+	cfg->hot_requests = HOT_REQUESTS;
+	cfg->cache_tinylfu = CACHE_TINYLFU;
+#ifdef HAS_CGROUPS
+	cfg->memory_pressure = MEMORY_PRESSURE;
+#endif /* HAS_CGROUPS */
+	memset(cfg->memory_limits, 0, sizeof(cfg->memory_limits));
+#ifdef WITH_FAULTS
+	memset(cfg->faults, 0, sizeof(cfg->faults));
+#endif /* WITH_FAULTS */
+#ifdef HAS_PREFORK
+	cfg->workers = WORKERS;
+#endif /* HAS_PREFORK */
+	cfg->filetypes_path = mem_strdup(MEM_CONFIG, FILETYPES_CONF_PATH);
+	cfg->routes_path = mem_strdup(MEM_CONFIG, ROUTES_CONF_PATH);
+	cfg->warmup_path = mem_strdup(MEM_CONFIG, WARMUP_PATH);
+#ifdef HAS_MMAP
+	cfg->stats_path = mem_strdup(MEM_CONFIG, STATS_PATH);
+#endif /* HAS_MMAP */
+#ifdef HAS_UNIX_SOCKETS
+	cfg->unix_path = mem_strdup(MEM_CONFIG, UNIX_SOCKET_PATH);
+	cfg->admin_path = mem_strdup(MEM_CONFIG, ADMIN_SOCKET_PATH);
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	cfg->tls_port = TLS_PORT;
+	cfg->tls_cert = mem_strdup(MEM_CONFIG, TLS_CERT_PATH);
+	cfg->tls_key = mem_strdup(MEM_CONFIG, TLS_KEY_PATH);
+#endif /* WITH_TLS */
+
+	/* Make sure every string made it. */
+	if ((cfg->listen_addr == NULL) || (cfg->hostname == NULL) ||
+			(cfg->filetypes_path == NULL) || (cfg->routes_path == NULL) ||
+#ifdef HAS_MMAP
+			(cfg->stats_path == NULL) ||
+#endif /* HAS_MMAP */
+#ifdef HAS_UNIX_SOCKETS
+			(cfg->unix_path == NULL) || (cfg->admin_path == NULL) ||
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+			(cfg->tls_cert == NULL) || (cfg->tls_key == NULL) ||
+#endif /* WITH_TLS */
+			(cfg->warmup_path == NULL)) {
+		log_syserr(LOG_CRIT, "Failed to allocate configuration");
+		config_free(cfg);
+		return NULL;
+	}
+
+	return cfg;
+}
+
+/**
+ * Loads the runtime configuration from a file on top of the compile-time
+ * defaults. Each line of the file sets an option in the form:
+ *
+ *     <key> = <value>
+ *
+ * Empty lines and lines starting with # are ignored.
+ *
+ * @param fname Path to the configuration file.
+ *
+ * @return Newly allocated configuration snapshot or NULL if an error occurred.
+ *
+ * @see config_free
+ */
+config_t* config_load(const char *fname) {
+	config_t *cfg;
+	FILE *fh;
+	char buf[512];
+	unsigned int linenum;
+	int portset;
+
+	/* Start from the defaults. */
+	cfg = config_new();
+	if (cfg == NULL)
+		return NULL;
+
+	/* The configuration file is completely optional. */
+	if (!file_exists(fname))
+		return cfg;
+
+	/* Open file for reading. */
+	fh = fopen(fname, "r");
+	if (fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open configuration file %s.", fname);
+		config_free(cfg);
+		return NULL;
+	}
+
+	/* Go through the file line by line. */
+	linenum = 0;
+	portset = 0;
+	while (fgets(buf, 512, fh) != NULL) {
+		char *key;
+		char *value;
+		char *tmp;
+
+		/* Strip newline and skip empty lines and comments. */
+		linenum++;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		key = buf + strspn(buf, "\t ");
+		if ((*key == '\0') || (*key == '#'))
+			continue;
+
+		/* Split the key from the value. */
+		tmp = key + strcspn(key, "\t =");
+		value = tmp + strspn(tmp, "\t =");
+		*tmp = '\0';
+		tmp = value + strlen(value);
+		while ((tmp > value) && ((*(tmp - 1) == ' ') || (*(tmp - 1) == '\t')))
+			*--tmp = '\0';
+
+		/* Set the option. */
+		if (!config_set(cfg, key, value)) {
+			log_printf(LOG_ERROR, "Invalid option '%s' at line %u of %s", key,
+				linenum, fname);
+			fclose(fh);
+			config_free(cfg);
+			return NULL;
+		}
+		if (strcmp(key, "port") == 0)
+			portset = 1;
+	}
+
+	/* Advertise the port we are listening on unless told otherwise. */
+	if (!portset)
+		cfg->port = cfg->listen_port;
+
+	/* Close file handle. */
+	fclose(fh);
+	return cfg;
+}
+
+/**
+ * Sets an option of a configuration object that hasn't been published yet.
+ *
+ * @param cfg   Configuration object.
+ * @param key   Name of the option.
+ * @param value Value of the option as a string.
+ *
+ * @return TRUE if the operation was successful, FALSE if the option is unknown
+ *         or its value is invalid.
+ */
+int config_set(config_t *cfg, const char *key, const char *value) {
+	char *end;
+	long num;
+	int i;
+
+	/* String options. */
+	if (strcmp(key, "listen_addr") == 0) {
+		return config_set_string(&cfg->listen_addr, value);
+	} else if (strcmp(key, "hostname") == 0) {
+		return config_set_string(&cfg->hostname, value);
+	} else if (strcmp(key, "filetypes_path") == 0) {
+		return config_set_string(&cfg->filetypes_path, value);
+	} else if (strcmp(key, "routes_path") == 0) {
+		return config_set_string(&cfg->routes_path, value);
+	} else if (strcmp(key, "warmup_path") == 0) {
+		return config_set_string(&cfg->warmup_path, value);
+	} else if (strcmp(key, "cache_policy") == 0) {
+		if (strcmp(value, "tinylfu") == 0) {
+			cfg->cache_tinylfu = 1;
+		} else if (strcmp(value, "lru") == 0) {
+			cfg->cache_tinylfu = 0;
+		} else {
+			return 0;
+		}
+		return 1;
+#ifdef HAS_MMAP
+	} else if (strcmp(key, "stats_path") == 0) {
+		return config_set_string(&cfg->stats_path, value);
+#endif /* HAS_MMAP */
+#ifdef HAS_UNIX_SOCKETS
+	} else if (strcmp(key, "unix_path") == 0) {
+		return config_set_string(&cfg->unix_path, value);
+	} else if (strcmp(key, "admin_path") == 0) {
+		return config_set_string(&cfg->admin_path, value);
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	} else if (strcmp(key, "tls_cert") == 0) {
+		return config_set_string(&cfg->tls_cert, value);
+	} else if (strcmp(key, "tls_key") == 0) {
+		return config_set_string(&cfg->tls_key, value);
+#endif /* WITH_TLS */
+#ifdef WITH_FAULTS
+	} else if (strncmp(key, "fault_", 6) == 0) {
+		return fault_parse(cfg, key + 6, value);
+#endif /* WITH_FAULTS */
+	}
+
+	/* Everything else is a positive number. */
+	num = strtol(value, &end, 10);
+	if ((*value == '\0') || (*end != '\0') || (num < 0))
+		return 0;
+
+	if (strcmp(key, "listen_port") == 0) {
+		if ((num == 0) || (num > 65535))
+			return 0;
+		cfg->listen_port = (uint16_t)num;
+	} else if (strcmp(key, "port") == 0) {
+		if ((num == 0) || (num > 65535))
+			return 0;
+		cfg->port = (uint16_t)num;
+	} else if (strcmp(key, "max_connections") == 0) {
+		if ((num == 0) || (num > MAX_CONNECTIONS)) {
+			log_printf(LOG_ERROR, "max_connections must be between 1 and the "
+				"compile-time limit of %d", MAX_CONNECTIONS);
+			return 0;
+		}
+		cfg->max_connections = (uint16_t)num;
+	} else if (strcmp(key, "backlog") == 0) {
+		if ((num == 0) || (num > 65535))
+			return 0;
+		cfg->backlog = (uint16_t)num;
+	} else if (strcmp(key, "recv_timeout") == 0) {
+		cfg->recv_timeout = (unsigned int)num;
+	} else if (strcmp(key, "slow_request") == 0) {
+		cfg->slow_request = (unsigned int)num;
+	} else if (strcmp(key, "stuck_request") == 0) {
+		cfg->stuck_request = (unsigned int)num;
+	} else if (strcmp(key, "kill_stuck") == 0) {
+		if (num > 1)
+			return 0;
+		cfg->kill_stuck = (uint8_t)num;
+	} else if (strcmp(key, "hot_requests") == 0) {
+		cfg->hot_requests = (unsigned int)num;
+#ifdef HAS_CGROUPS
+	} else if (strcmp(key, "memory_pressure") == 0) {
+		if (num > 1)
+			return 0;
+		cfg->memory_pressure = (uint8_t)num;
+#endif /* HAS_CGROUPS */
+	} else if (strncmp(key, "memory_limit_", 13) == 0) {
+		/* Only subsystems that cope with being refused memory. */
+		for (i = 0; i < MEM_TAGS; i++) {
+			if (strcmp(key + 13, mem_tag_names[i]) == 0)
+				break;
+		}
+		if ((i != MEM_CACHE) && (i != MEM_PROXY) && (i != MEM_SEARCH)) {
+			log_printf(LOG_ERROR, "Only the cache, proxy and search "
+				"subsystems can be held to a memory limit");
+			return 0;
+		}
+		cfg->memory_limits[i] = (uint64_t)num;
+#ifdef HAS_PREFORK
+	} else if (strcmp(key, "workers") == 0) {
+		if (num > MAX_WORKERS) {
+			log_printf(LOG_ERROR, "workers can't be larger than the "
+				"compile-time limit of %d", MAX_WORKERS);
+			return 0;
+		}
+		cfg->workers = (uint16_t)num;
+#endif /* HAS_PREFORK */
+#ifdef WITH_TLS
+	} else if (strcmp(key, "tls_port") == 0) {
+		if (num > 65535)
+			return 0;
+		cfg->tls_port = (uint16_t)num;
+#endif /* WITH_TLS */
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Replaces a string option of a configuration object, leaving it untouched if
+ * the new value can't be copied.
+ *
+ * @param field Option to be replaced.
+ * @param value New value of the option.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int config_set_string(char **field, const char *value) {
+	char *str;
+
+	str = mem_strdup(MEM_CONFIG, value);
+	if (str == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate configuration option");
+		return 0;
+	}
+
+	mem_free(*field);
+	*field = str;
+
+	return 1;
+}
+
+/**
+ * Reloads the configuration file and publishes the new snapshot, rebinding
+ * the listening socket if needed. The previous snapshot is free'd once every
+ * request that was using it has finished.
+ *
+ * @warning Must only be called from the server loop.
+ *
+ * @param srv Server instance.
+ */
+void config_reload(amigos_t *srv) {
+	config_t *cfg;
+	config_t *old;
+	sockfd_t sockfd;
+	int rebind;
+#ifdef HAS_UNIX_SOCKETS
+	sockfd_t unix_sockfd;
+	int unix_rebind;
+#endif /* HAS_UNIX_SOCKETS */
+
+	/* Instances configured without a file have nothing to reload. */
+	if (srv->config_path == NULL)
+		return;
+
+	/* Build the new snapshot. */
+	log_printf(LOG_INFO, "Reloading configuration...");
+	cfg = config_load(srv->config_path);
+	if (cfg == NULL) {
+		log_printf(LOG_ERROR, "Keeping the current configuration");
+		return;
+	}
+	old = srv->config;
+#ifdef HAS_PREFORK
+	if ((srv->nworkers > 0) && !config_keep_listeners(cfg, old)) {
+		log_printf(LOG_ERROR, "Keeping the current configuration");
+		config_free(cfg);
+		return;
+	}
+#endif /* HAS_PREFORK */
+	/* The router is only loaded at startup. */
+	if (strcmp(cfg->routes_path, old->routes_path) != 0) {
+		log_printf(LOG_WARNING, "Changes to the routes file require a "
+			"restart");
+		if (!config_set_string(&cfg->routes_path, old->routes_path)) {
+			log_printf(LOG_ERROR, "Keeping the current configuration");
+			config_free(cfg);
+			return;
+		}
+	}
+#ifdef HAS_MMAP
+	/* The statistics file is only created at startup. */
+	if (strcmp(cfg->stats_path, old->stats_path) != 0) {
+		log_printf(LOG_WARNING, "Changes to the statistics file require a "
+			"restart");
+		if (!config_set_string(&cfg->stats_path, old->stats_path)) {
+			log_printf(LOG_ERROR, "Keeping the current configuration");
+			config_free(cfg);
+			return;
+		}
+	}
+#endif /* HAS_MMAP */
+	/* The content cache is already filled under its policy. */
+	if (cfg->cache_tinylfu != old->cache_tinylfu) {
+		log_printf(LOG_WARNING, "Changes to the cache policy require a "
+			"restart");
+		cfg->cache_tinylfu = old->cache_tinylfu;
+	}
+#ifdef HAS_UNIX_SOCKETS
+	/* So is the admin socket. */
+	if (strcmp(cfg->admin_path, old->admin_path) != 0) {
+		log_printf(LOG_WARNING, "Changes to the admin socket require a "
+			"restart");
+		if (!config_set_string(&cfg->admin_path, old->admin_path)) {
+			log_printf(LOG_ERROR, "Keeping the current configuration");
+			config_free(cfg);
+			return;
+		}
+	}
+#endif /* HAS_UNIX_SOCKETS */
+
+	/* Bind a new listening socket if its address has changed. */
+	sockfd = SOCKERR;
+	rebind = (strcmp(cfg->listen_addr, old->listen_addr) != 0) ||
+		(cfg->listen_port != old->listen_port);
+	if (rebind) {
+		sockfd = server_listen(srv->af, cfg, cfg->listen_port);
+		if (sockfd == SOCKERR) {
+			log_printf(LOG_ERROR, "Keeping the current configuration");
+			config_free(cfg);
+			return;
+		}
+	}
+
+#ifdef HAS_UNIX_SOCKETS
+	/* Bind a new Unix socket if its path has changed. */
+	unix_sockfd = SOCKERR;
+	unix_rebind = strcmp(cfg->unix_path, old->unix_path) != 0;
+	if (unix_rebind && (*cfg->unix_path != '\0')) {
+		unix_sockfd = server_listen_unix(cfg, cfg->unix_path);
+		if (unix_sockfd == SOCKERR) {
+			log_printf(LOG_ERROR, "Keeping the current configuration");
+			if (sockfd != SOCKERR)
+				sockclose(sockfd);
+			config_free(cfg);
+			return;
+		}
+	}
+#endif /* HAS_UNIX_SOCKETS */
+
+#ifdef WITH_TLS
+	/* Reload the certificates and rebind the TLS listener if needed. */
+	if (!tls_reload(srv, cfg, old)) {
+		log_printf(LOG_ERROR, "Keeping the current configuration");
+		if (sockfd != SOCKERR)
+			sockclose(sockfd);
+#ifdef HAS_UNIX_SOCKETS
+		if (unix_sockfd != SOCKERR) {
+			sockclose(unix_sockfd);
+			unlink(cfg->unix_path);
+		}
+#endif /* HAS_UNIX_SOCKETS */
+		config_free(cfg);
+		return;
+	}
+#endif /* WITH_TLS */
+
+#ifdef HAS_UNIX_SOCKETS
+	/* Swap the Unix socket. */
+	if (unix_rebind) {
+		if (srv->unix_socket != SOCKERR) {
+			sockclose(srv->unix_socket);
+			unlink(old->unix_path);
+		}
+		srv->unix_socket = unix_sockfd;
+		if (srv->unix_socket != SOCKERR) {
+			log_printf(LOG_INFO, "Server now running on %s",
+				cfg->unix_path);
+		}
+	}
+#endif /* HAS_UNIX_SOCKETS */
+
+	/* Swap the listening socket. */
+	if (rebind) {
+		sockclose(srv->server_socket);
+		srv->server_socket = sockfd;
+		log_printf(LOG_INFO, "Server now running on %s:%u", cfg->listen_addr,
+			cfg->listen_port);
+	} else if (cfg->backlog != old->backlog) {
+		/* Calling listen again on the same socket only resizes the backlog. */
+		if (listen(srv->server_socket, cfg->backlog) == SOCKERR)
+			log_sockerr(LOG_ERROR, "Failed to resize the listen backlog");
+	}
+
+	/* Publish the new snapshot and retire the old one. */
+	atomic_set_ptr(&srv->config, cfg);
+	rcu_retire(srv, old, config_free);
+	mem_limit(cfg);
+	log_printf(LOG_INFO, "Configuration reloaded");
+}
+
+#ifdef HAS_PREFORK
+/**
+ * Carries the listening sockets' options over from the current configuration
+ * to a new one, since in pre-fork mode they are shared by every worker and
+ * can't be rebound without a restart.
+ *
+ * @param cfg New configuration object.
+ * @param old Current configuration object.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int config_keep_listeners(config_t *cfg, const config_t *old) {
+	/* Check if anything would have to change. */
+	if ((strcmp(cfg->listen_addr, old->listen_addr) == 0) &&
+			(cfg->listen_port == old->listen_port) &&
+			(strcmp(cfg->unix_path, old->unix_path) == 0) &&
+#ifdef WITH_TLS
+			(cfg->tls_port == old->tls_port) &&
+#endif /* WITH_TLS */
+			(cfg->workers == old->workers)) {
+		return 1;
+	}
+	log_printf(LOG_WARNING, "Changes to the listeners or the number of "
+		"workers require a restart in pre-fork mode");
+
+	/* Keep the current ones. */
+	if (!config_set_string(&cfg->listen_addr, old->listen_addr) ||
+			!config_set_string(&cfg->unix_path, old->unix_path)) {
+		return 0;
+	}
+	cfg->listen_port = old->listen_port;
+#ifdef WITH_TLS
+	cfg->tls_port = old->tls_port;
+#endif /* WITH_TLS */
+	cfg->workers = old->workers;
+
+	return 1;
+}
+#endif /* HAS_PREFORK */
+
+/**
+ * Frees up a configuration object.
+ *
+ * @param ptr Configuration object to be free'd.
+ *
+ * @see config_new
+ */
+void config_free(void *ptr) {
+	config_t *cfg;
+
+	cfg = (config_t*)ptr;
+	if (cfg == NULL)
+		return;
+
+	if (cfg->listen_addr != NULL)
+		mem_free(cfg->listen_addr);
+	if (cfg->hostname != NULL)
+		mem_free(cfg->hostname);
+	if (cfg->filetypes_path != NULL)
+		mem_free(cfg->filetypes_path);
+	if (cfg->routes_path != NULL)
+		mem_free(cfg->routes_path);
+	if (cfg->warmup_path != NULL)
+		mem_free(cfg->warmup_path);
+#ifdef HAS_MMAP
+	if (cfg->stats_path != NULL)
+		mem_free(cfg->stats_path);
+#endif /* HAS_MMAP */
+#ifdef HAS_UNIX_SOCKETS
+	if (cfg->unix_path != NULL)
+		mem_free(cfg->unix_path);
+	if (cfg->admin_path != NULL)
+		mem_free(cfg->admin_path);
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	if (cfg->tls_cert != NULL)
+		mem_free(cfg->tls_cert);
+	if (cfg->tls_key != NULL)
+		mem_free(cfg->tls_key);
+#endif /* WITH_TLS */
+	mem_free(cfg);
+}
+
+/**
+ * =============================================================================
+ * === Read-Copy-Update ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Marks the start of a read-side critical section. Pointers to shared objects
+ * loaded after this call stay valid until rcu_read_unlock is called.
+ *
+ * @param srv  Server instance.
+ * @param slot Reader slot exclusively owned by the calling thread.
+ */
+void rcu_read_lock(amigos_t *srv, unsigned int slot) {
+	atomic_set_u32(&srv->rcu_readers[slot], atomic_get_u32(&srv->rcu_epoch));
+	atomic_fence();
+}
+
+/**
+ * Marks the end of a read-side critical section.
+ *
+ * @param srv  Server instance.
+ * @param slot Reader slot exclusively owned by the calling thread.
+ */
+void rcu_read_unlock(amigos_t *srv, unsigned int slot) {
+	atomic_set_u32(&srv->rcu_readers[slot], 0);
+}
+
+/**
+ * Retires an object that has just been replaced by a newly published one. It
+ * will be free'd once no reader can still be using it.
+ *
+ * @warning Must only be called from the server loop.
+ *
+ * @param srv       Server instance.
+ * @param ptr       Object that has been replaced.
+ * @param free_func Function used to free the object.
+ */
+void rcu_retire(amigos_t *srv, void *ptr, void (*free_func)(void *ptr)) {
+	rcu_retired_t *retired;
+
+	/* Keep track of the object. */
+	retired = (rcu_retired_t*)mem_alloc(MEM_SERVER, sizeof(rcu_retired_t));
+	if (retired == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate retired object, leaking it");
+		return;
+	}
+	retired->ptr = ptr;
+	retired->free_func = free_func;
+
+	/* Readers that start after this point can only see the new object. */
+	atomic_fence();
+	retired->epoch = atomic_add_u32(&srv->rcu_epoch, 1);
+	retired->next = srv->rcu_retired_list;
+	srv->rcu_retired_list = retired;
+}
+
+/**
+ * Frees up the retired objects that are no longer reachable by any reader.
+ *
+ * @warning Must only be called from the server loop.
+ *
+ * @param srv Server instance.
+ */
+void rcu_reclaim(amigos_t *srv) {
+	rcu_retired_t **cur;
+	uint32_t oldest;
+	unsigned int i;
+
+	/* Nothing to do. */
+	if (srv->rcu_retired_list == NULL)
+		return;
+
+	/* Find the oldest epoch that's still being read. */
+	oldest = 0xFFFFFFFFUL;
+	for (i = 0; i < RCU_MAX_READERS; i++) {
+		uint32_t epoch = atomic_get_u32(&srv->rcu_readers[i]);
+		if ((epoch != 0) && (epoch < oldest))
+			oldest = epoch;
+	}
+
+	/* Free up whatever was retired before that. */
+	cur = &srv->rcu_retired_list;
+	while (*cur != NULL) {
+		rcu_retired_t *retired = *cur;
+
+		if (retired->epoch < oldest) {
+			*cur = retired->next;
+			retired->free_func(retired->ptr);
+			mem_free(retired);
+		} else {
+			cur = &retired->next;
+		}
+	}
+}
+
+/**
+ * =============================================================================
+ * === Selector Routing ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Initializes the selector router with the default routes and the ones defined
+ * in the routes configuration file.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int router_init(amigos_t *srv) {
+	/* Create the root of the tree. */
+	srv->routes = route_node_new("", 0);
+	if (srv->routes == NULL)
+		return 0;
+
+	/* Setup the default routes. */
+	if (!router_add(srv, "", ROUTE_STATIC, srv->docroot) ||
+			!router_add(srv, SEARCH_SELECTOR, ROUTE_SEARCH, NULL)) {
+		return 0;
+	}
+
+	return router_load(srv, srv->config->routes_path);
+}
+
+/**
+ * Loads the routes defined in a configuration file. Each line of the file maps
+ * a selector prefix to a handler, separated by whitespace, in the form:
+ *
+ *     <prefix> <static|alias|redirect|plugin|search|proxy> [argument]
+ *
+ * Empty lines and lines starting with # are ignored.
+ *
+ * @param srv   Server instance.
+ * @param fname Path to the routes configuration file.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int router_load(amigos_t *srv, const char *fname) {
+	FILE *fh;
+	char buf[512];
+	unsigned int linenum;
+	int ret;
+
+	/* Custom routes are completely optional. */
+	if (!file_exists(fname))
+		return 1;
+
+	/* Open file for reading. */
+	fh = fopen(fname, "r");
+	if (fh == NULL) {
+		log_printf(LOG_ERROR, "Failed to open routes configuration file %s.",
+			fname);
+		return 0;
+	}
+
+	/* Go through the file line by line. */
+	ret = 1;
+	linenum = 0;
+	while (fgets(buf, 512, fh) != NULL) {
+		route_kind_t kind;
+		char *prefix;
+		char *skind;
+		char *arg;
+
+		/* Strip newline and skip empty lines and comments. */
+		linenum++;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if ((*buf == '\0') || (*buf == '#'))
+			continue;
+
+		/* Split the line into its fields. */
+		prefix = buf;
+		skind = prefix + strcspn(prefix, "\t ");
+		if (*skind != '\0')
+			*skind++ = '\0';
+		skind += strspn(skind, "\t ");
+		arg = skind + strcspn(skind, "\t ");
+		if (*arg != '\0')
+			*arg++ = '\0';
+		arg += strspn(arg, "\t ");
+
+		/* Parse the kind of handler. */
+		if (strcmp(skind, "static") == 0) {
+			kind = ROUTE_STATIC;
+		} else if (strcmp(skind, "alias") == 0) {
+			kind = ROUTE_ALIAS;
+		} else if (strcmp(skind, "redirect") == 0) {
+			kind = ROUTE_REDIRECT;
+		} else if (strcmp(skind, "plugin") == 0) {
+			kind = ROUTE_PLUGIN;
+		} else if (strcmp(skind, "search") == 0) {
+			kind = ROUTE_SEARCH;
+		} else if (strcmp(skind, "proxy") == 0) {
+			kind = ROUTE_PROXY;
+		} else {
+			log_printf(LOG_ERROR, "Unknown route kind '%s' at line %u of %s",
+				skind, linenum, fname);
+			ret = 0;
+			break;
+		}
+
+		/* Add the route. */
+		if (!router_add(srv, prefix, kind, (*arg == '\0') ? NULL : arg)) {
+			log_printf(LOG_ERROR, "Invalid route at line %u of %s", linenum,
+				fname);
+			ret = 0;
+			break;
+		}
+	}
+
+	/* Close file handle. */
+	fclose(fh);
+	return ret;
+}
+
+/**
+ * Adds a route to the router, replacing any existing route for the same
+ * prefix.
+ *
+ * @param srv    Server instance.
+ * @param prefix Selector prefix to be routed.
+ * @param kind   Kind of handler for the selectors under the prefix.
+ * @param arg    Handler argument. Its meaning depends on the kind of handler.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int router_add(amigos_t *srv, const char *prefix, route_kind_t kind,
+			   const char *arg) {
+	route_t *route;
+
+	/* Selectors are matched without their leading separators. */
+	while ((*prefix == '/') || (*prefix == '\\'))
+		prefix++;
+
+	/* Create the route and insert it into the tree. */
+	route = route_new(srv, prefix, kind, arg);
+	if (route == NULL)
+		return 0;
+	if (!route_node_insert(srv->routes, prefix, route)) {
+		route_free(route);
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Frees up the router and all of its routes.
+ *
+ * @param srv Server instance.
+ */
+void router_free(amigos_t *srv) {
+	if (srv->routes != NULL)
+		route_node_free(srv->routes);
+	srv->routes = NULL;
+}
+
+/**
+ * Finds the route with the longest prefix that matches a selector, only
+ * considering prefixes that end at a path boundary.
+ *
+ * @param srv      Server instance.
+ * @param selector Selector requested by the client.
+ * @param path     Pointer to the part of the selector after the route's prefix.
+ *
+ * @return Route that should handle the selector or NULL if there's none.
+ */
+const route_t* router_match(amigos_t *srv, const char *selector,
+							 const char **path) {
+	const route_node_t *node;
+	const route_t *match;
+	const char *cur;
+	uint16_t i;
+
+	/* Selectors are matched without their leading separators. */
+	while ((*selector == '/') || (*selector == '\\'))
+		selector++;
+
+	/* Walk down the tree. */
+	node = srv->routes;
+	match = node->route;
+	*path = selector;
+	cur = selector;
+	while (*cur != '\0') {
+		const route_node_t *child;
+
+		/* Find the child that continues the selector. */
+		child = NULL;
+		for (i = 0; i < node->nchildren; i++) {
+			if (*node->children[i]->label == *cur) {
+				child = node->children[i];
+				break;
+			}
+		}
+		if ((child == NULL) || (strncmp(cur, child->label, child->len) != 0))
+			break;
+
+		/* Remember the route if the prefix ends at a path boundary. */
+		cur += child->len;
+		node = child;
+		if ((node->route != NULL) && ((*cur == '\0') || (*cur == '/') ||
+				(*(cur - 1) == '/'))) {
+			match = node->route;
+			*path = cur;
+		}
+	}
+
+	/* Give back the remainder of the selector. */
+	while (**path == '/')
+		(*path)++;
+
+	return match;
+}
+
+/**
+ * Allocates a brand new route object.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param srv    Server instance.
+ * @param prefix Selector prefix to be routed.
+ * @param kind   Kind of handler for the selectors under the prefix.
+ * @param arg    Handler argument. Its meaning depends on the kind of handler.
+ *
+ * @return Allocated route object or NULL if an error occurred.
+ *
+ * @see route_free
+ */
+route_t* route_new(amigos_t *srv, const char *prefix, route_kind_t kind,
+				   const char *arg) {
+	route_t *route;
+
+	/* Try to allocate our route object. */
+	route = (route_t*)mem_alloc(MEM_CONFIG, sizeof(route_t));
+	if (route == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate route");
+		return NULL;
+	}
+	route->kind = kind;
+	route->target = NULL;
+	route->item = NULL;
+	route->upstream = NULL;
+#ifdef WITH_PLUGINS
+	route->plugin = NULL;
+#endif /* WITH_PLUGINS */
+
+	/* Check if we have an argument when we require one. */
+	if ((arg == NULL) && (kind != ROUTE_SEARCH)) {
+		log_printf(LOG_ERROR, "Route for prefix '%s' requires an argument",
+			prefix);
+		goto fail;
+	}
+
+	/* Setup the route's handler. */
+	switch (kind) {
+		case ROUTE_STATIC:
+			/* Directory to serve the files from. */
+			if (!dir_exists(arg)) {
+				log_printf(LOG_ERROR, "Directory '%s' for prefix '%s' doesn't "
+					"exist", arg, prefix);
+				goto fail;
+			}
+			route->target = mem_strdup(MEM_CONFIG, arg);
+			if (route->target == NULL)
+				goto nomem;
+			break;
+		case ROUTE_ALIAS:
+			/* Selector prefix to be used instead. */
+			route->target = mem_strdup(MEM_CONFIG, arg);
+			if (route->target == NULL)
+				goto nomem;
+			break;
+		case ROUTE_REDIRECT:
+			/* Gopher URL or local selector to redirect to. */
+			route->item = gopher_item_new();
+			if (route->item == NULL)
+				goto nomem;
+			route->item->name = mem_strdup(MEM_CONFIG, arg);
+			if (route->item->name == NULL)
+				goto nomem;
+			if (strncmp(arg, "gopher://", 9) == 0) {
+				const char *host;
+				char *end;
+				size_t len;
+				long port;
+
+				/* Hostname and port. */
+				host = arg + 9;
+				len = strcspn(host, ":/");
+				route->item->hostname = (char*)mem_alloc(MEM_CONFIG, len + 1);
+				if (route->item->hostname == NULL)
+					goto nomem;
+				memcpy(route->item->hostname, host, len);
+				route->item->hostname[len] = '\0';
+				host += len;
+				route->item->port = 70;
+				if (*host == ':') {
+					port = strtol(++host, &end, 10);
+					if (!isdigit((unsigned char)*host) ||
+							((*end != '\0') && (*end != '/')) ||
+							(port < 1) || (port > 65535)) {
+						log_printf(LOG_ERROR, "Redirect '%s' for prefix '%s' "
+							"has an invalid port", arg, prefix);
+						goto fail;
+					}
+					route->item->port = (uint16_t)port;
+					host = end;
+				}
+
+				/* Type and selector. */
+				route->item->type = '1';
+				if ((*host == '/') && (*(host + 1) != '\0')) {
+					route->item->type = *(host + 1);
+					host += 2;
+				}
+				route->item->selector = mem_strdup(MEM_CONFIG, host);
+			} else {
+				route->item->type = gopher_types_infer(srv, arg);
+				if (strrchr(arg, '.') == NULL)
+					route->item->type = '1';
+				route->item->selector = mem_strdup(MEM_CONFIG, arg);
+				route->item->hostname = NULL;
+				route->item->port = INVALID_PORT;
+			}
+			if (route->item->selector == NULL)
+				goto nomem;
+			break;
+		case ROUTE_PLUGIN:
+#ifdef WITH_PLUGINS
+			/* Path to the plugin module. */
+			route->plugin = plugins_append(srv, prefix, arg);
+			if (route->plugin == NULL)
+				goto fail;
+			break;
+#else
+			log_printf(LOG_ERROR, "Plugin route for prefix '%s' requires "
+				"compiling with WITH_PLUGINS", prefix);
+			goto fail;
+#endif /* WITH_PLUGINS */
+		case ROUTE_SEARCH:
+			break;
+		case ROUTE_PROXY:
+			/* Upstream server and the prefix for rewriting its menus. */
+			route->upstream = upstream_new(arg);
+			if (route->upstream == NULL)
+				goto fail;
+			route->target = mem_strdup(MEM_CONFIG, prefix);
+			if (route->target == NULL)
+				goto nomem;
+			break;
+	}
+
+	return route;
+
+nomem:
+	log_syserr(LOG_ERROR, "Failed to allocate route for prefix '%s'", prefix);
+fail:
+	route_free(route);
+	return NULL;
+}
+
+/**
+ * Frees up a route object. Plugins are owned by the plugins list.
+ *
+ * @param route Route to be free'd.
+ *
+ * @see route_new
+ */
+void route_free(route_t *route) {
+	if (route->target != NULL)
+		mem_free(route->target);
+	if (route->item != NULL)
+		gopher_item_free(route->item);
+	if (route->upstream != NULL)
+		upstream_free(route->upstream);
+	mem_free(route);
+}
+
+/**
+ * Allocates a brand new radix tree node.
+ *
+ * @param label Label of the edge leading to this node.
+ * @param len   Length of the label.
+ *
+ * @return Allocated node object or NULL if an error occurred.
+ */
+route_node_t* route_node_new(const char *label, size_t len) {
+	route_node_t *node;
+
+	/* Try to allocate our node object. */
+	node = (route_node_t*)mem_alloc(MEM_CONFIG, sizeof(route_node_t));
+	if (node == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate route node");
+		return NULL;
+	}
+	node->label = (char*)mem_alloc(MEM_CONFIG, len + 1);
+	if (node->label == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate route node label");
+		mem_free(node);
+		return NULL;
+	}
+
+	/* Populate it. */
+	memcpy(node->label, label, len);
+	node->label[len] = '\0';
+	node->len = len;
+	node->route = NULL;
+	node->children = NULL;
+	node->nchildren = 0;
+
+	return node;
+}
+
+/**
+ * Recursively frees up a radix tree node, its children, and their routes.
+ *
+ * @param node Node to be free'd.
+ */
+void route_node_free(route_node_t *node) {
+	uint16_t i;
+
+	for (i = 0; i < node->nchildren; i++)
+		route_node_free(node->children[i]);
+	if (node->children != NULL)
+		mem_free(node->children);
+	if (node->route != NULL)
+		route_free(node->route);
+	mem_free(node->label);
+	mem_free(node);
+}
+
+/**
+ * Inserts a route into the radix tree, splitting edges as needed.
+ *
+ * @param root  Root of the tree.
+ * @param key   Prefix of the route.
+ * @param route Route to be inserted. Ownership is taken on success.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int route_node_insert(route_node_t *root, const char *key, route_t *route) {
+	route_node_t *node;
+	route_node_t *child;
+	route_node_t *split;
+	size_t common;
+	uint16_t i;
+	void *tmp;
+
+	node = root;
+	while (*key != '\0') {
+		/* Find the child that shares the first character. */
+		child = NULL;
+		for (i = 0; i < node->nchildren; i++) {
+			if (*node->children[i]->label == *key) {
+				child = node->children[i];
+				break;
+			}
+		}
+
+		/* Nothing shared, so just append a new leaf. */
+		if (child == NULL) {
+			child = route_node_new(key, strlen(key));
+			if (child == NULL)
+				return 0;
+			tmp = mem_realloc(MEM_CONFIG, node->children,
+				(node->nchildren + 1) * sizeof(route_node_t*));
+			if (tmp == NULL) {
+				log_syserr(LOG_ERROR, "Failed to grow route node children");
+				route_node_free(child);
+				return 0;
+			}
+			node->children = (route_node_t**)tmp;
+			node->children[node->nchildren++] = child;
+			node = child;
+			break;
+		}
+
+		/* Figure out how much of the label is shared. */
+		common = 0;
+		while ((common < child->len) && (key[common] == child->label[common]))
+			common++;
+		if (common == child->len) {
+			node = child;
+			key += common;
+			continue;
+		}
+
+		/* Split the edge at the point where they diverge. */
+		split = route_node_new(child->label, common);
+		if (split == NULL)
+			return 0;
+		split->children = (route_node_t**)mem_alloc(MEM_CONFIG,
+			sizeof(route_node_t*));
+		if (split->children == NULL) {
+			log_syserr(LOG_ERROR, "Failed to allocate route node children");
+			route_node_free(split);
+			return 0;
+		}
+		memmove(child->label, child->label + common, child->len - common + 1);
+		child->len -= common;
+		split->children[0] = child;
+		split->nchildren = 1;
+		node->children[i] = split;
+
+		node = split;
+		key += common;
+	}
+
+	/* Replace any route that was already there. */
+	if (node->route != NULL)
+		route_free(node->route);
+	node->route = route;
+
+	return 1;
+}
+
+#ifdef WITH_PLUGINS
+/**
+ * =============================================================================
+ * === Dynamic Handler Plugins =================================================
+ * =============================================================================
+ */
+
+/**
+ * Loads a plugin module that will handle the selectors under a prefix.
+ *
+ * @param srv    Server instance.
+ * @param prefix Selector prefix to be handled by the plugin.
+ * @param path   Path to the plugin module.
+ *
+ * @return Loaded plugin object or NULL if an error occurred.
+ */
+plugin_t* plugins_append(amigos_t *srv, const char *prefix, const char *path) {
+	amigos_plugin_init_func init;
+	plugin_t *plugin;
+	const int *abi;
+	void *tmp;
+
+	/* Reallocate the plugins list to fit another one. */
+	tmp = mem_realloc(MEM_CONFIG, srv->plugins,
+		(srv->plugins_len + 1) * sizeof(plugin_t*));
+	if (tmp == NULL) {
+		log_syserr(LOG_CRIT, "Could not reallocate plugins list");
+		return NULL;
+	}
+	srv->plugins = (plugin_t**)tmp;
+
+	/* Allocate the plugin object. */
+	plugin = (plugin_t*)mem_alloc(MEM_CONFIG, sizeof(plugin_t));
+	if (plugin == NULL) {
+		log_syserr(LOG_CRIT, "Could not allocate plugin object");
+		return NULL;
+	}
+
+	/* Load the plugin module. */
+	plugin->handle = plugin_dlopen(path);
+	if (plugin->handle == NULL) {
+		log_printf(LOG_ERROR, "Failed to load plugin '%s': %s", path,
+			plugin_dlerror());
+		mem_free(plugin);
+		return NULL;
+	}
+
+	/* Ensure we are both talking the same language. */
+	abi = (const int*)plugin_dlsym(plugin->handle, "amigos_plugin_abi");
+	if ((abi == NULL) || (*abi != AMIGOS_PLUGIN_ABI)) {
+		log_printf(LOG_ERROR, "Plugin '%s' doesn't implement ABI version %d",
+			path, AMIGOS_PLUGIN_ABI);
+		goto fail;
+	}
+
+	/* Get the plugin's exported functions. */
+	plugin_dlfunc(plugin->handle, "amigos_handler", plugin->handler);
+	plugin_dlfunc(plugin->handle, "amigos_plugin_free", plugin->cleanup);
+	plugin_dlfunc(plugin->handle, "amigos_plugin_init", init);
+	if (plugin->handler == NULL) {
+		log_printf(LOG_ERROR, "Plugin '%s' doesn't export amigos_handler",
+			path);
+		goto fail;
+	}
+
+	/* Initialize the plugin. */
+	plugin->prefix = mem_strdup(MEM_CONFIG, prefix);
+	if (plugin->prefix == NULL) {
+		log_syserr(LOG_CRIT, "Could not allocate plugin prefix");
+		goto fail;
+	}
+	if ((init != NULL) && !init(plugin->prefix)) {
+		log_printf(LOG_ERROR, "Plugin '%s' failed to initialize", path);
+		mem_free(plugin->prefix);
+		goto fail;
+	}
+
+	log_printf(LOG_INFO, "Plugin '%s' handling selectors under '%s'", path,
+		plugin->prefix);
+	srv->plugins[srv->plugins_len++] = plugin;
+
+	return plugin;
+
+fail:
+	plugin_dlclose(plugin->handle);
+	mem_free(plugin);
+	return NULL;
+}
+
+/**
+ * Unloads all of the plugins and frees up any resources used by them.
+ *
+ * @param srv Server instance.
+ */
+void plugins_free(amigos_t *srv) {
+	uint16_t i;
+
+	/* Unload each plugin. */
+	for (i = 0; i < srv->plugins_len; i++) {
+		if (srv->plugins[i]->cleanup != NULL)
+			srv->plugins[i]->cleanup();
+		plugin_dlclose(srv->plugins[i]->handle);
+		mem_free(srv->plugins[i]->prefix);
+		mem_free(srv->plugins[i]);
+	}
+
+	/* Free the array itself. */
+	if (srv->plugins != NULL)
+		mem_free(srv->plugins);
+	srv->plugins = NULL;
+	srv->plugins_len = 0;
+}
+
+/**
+ * Output writer handed to plugins. Buffers the output and flushes it to the
+ * client whenever it gets big enough.
+ *
+ * @param w   Writer object with a plugin_output_t as its context.
+ * @param buf Data to be written.
+ * @param len Length of the data in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int plugin_writer_write(amigos_writer_t *w, const void *buf, size_t len) {
+	plugin_output_t *out;
+
+	/* Don't bother if the client is already gone. */
+	out = (plugin_output_t*)w->ctx;
+	if (out->failed)
+		return 0;
+
+	/* Append data to the output buffer. */
+	if (!buffer_append(&out->buf, buf, len)) {
+		out->failed = 1;
+		return 0;
+	}
+
+	/* Flush the output buffer if needed. */
+	if (out->buf.len >= PLUGIN_FLUSH_SIZE) {
+		if (!client_send_raw(out->conn, out->buf.data, out->buf.len)) {
+			out->failed = 1;
+			return 0;
+		}
+		out->buf.len = 0;
+	}
+
+	return 1;
+}
+#endif /* WITH_PLUGINS */
+
+/**
+ * =============================================================================
+ * === Content Cache ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Initializes an empty content cache.
+ *
+ * @param cache    Cache to be initialized.
+ * @param max_size Maximum number of bytes of content to be kept in the cache.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ *
+ * @see cache_free
+ */
+int cache_init(cache_t *cache, size_t max_size) {
+	cache->buckets = (cache_entry_t**)mem_calloc(MEM_CACHE, CACHE_BUCKETS,
+		sizeof(cache_entry_t*));
+	if (cache->buckets == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate content cache");
+		return 0;
+	}
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->window_head = NULL;
+	cache->window_tail = NULL;
+	cache->size = 0;
+	cache->max_size = max_size;
+	cache->window_size = 0;
+	cache->window_max = 0;
+	cache->pinned_size = 0;
+	cache->sketch = NULL;
+	cache->sketch_adds = 0;
+	cache->count = 0;
+	cache->stats = NULL;
+	mutex_init(&cache->lock);
+#ifdef HAS_PREFORK
+	cache->shared = NULL;
+#endif /* HAS_PREFORK */
+
+	return 1;
+}
+
+/**
+ * Switches an empty content cache over to TinyLFU admission, so that objects
+ * that are only ever requested once can't push out the ones that are requested
+ * all the time, like when a crawler walks through everything we've got.
+ *
+ * @param cache Cache to be switched over.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int cache_admission(cache_t *cache) {
+	cache->sketch = (uint8_t*)mem_calloc(MEM_CACHE,
+		CACHE_SKETCH_DEPTH * CACHE_SKETCH_WIDTH, sizeof(uint8_t));
+	if (cache->sketch == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate content cache sketch");
+		return 0;
+	}
+	cache->window_max = cache->max_size * CACHE_WINDOW_PERCENT / 100;
+
+	return 1;
+}
+
+/**
+ * Frees up a content cache and everything stored in it.
+ *
+ * @warning No other thread may be using the cache at this point.
+ *
+ * @param cache Cache to be free'd.
+ */
+void cache_free(cache_t *cache) {
+	cache_entry_t *entry;
+
+	/* Free every object. */
+	entry = cache_next(cache, NULL);
+	while (entry != NULL) {
+		cache_entry_t *next = cache_next(cache, entry);
+		cache_entry_free(entry);
+		entry = next;
+	}
+
+	/* Free the cache itself. */
+	if (cache->buckets != NULL)
+		mem_free(cache->buckets);
+	if (cache->sketch != NULL)
+		mem_free(cache->sketch);
+	cache->buckets = NULL;
+	cache->sketch = NULL;
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->window_head = NULL;
+	cache->window_tail = NULL;
+	mutex_destroy(&cache->lock);
+#ifdef HAS_PREFORK
+	if (cache->shared != NULL)
+		shm_cache_free(cache->shared);
+	cache->shared = NULL;
+#endif /* HAS_PREFORK */
+}
+
+#ifdef HAS_PREFORK
+/**
+ * Backs a content cache with a shared memory segment, so that the objects
+ * stored in it are also available to the worker processes forked afterwards.
+ *
+ * @param cache Cache to be shared.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int cache_share(cache_t *cache) {
+	if (cache->shared == NULL)
+		cache->shared = shm_cache_new();
+
+	return cache->shared != NULL;
+}
+#endif /* HAS_PREFORK */
+
+/**
+ * Gets an object from the cache, even if it has expired, so that it can be
+ * used as a fallback.
+ *
+ * @warning The returned object must be released using a special function.
+ *
+ * @param cache Cache to look into.
+ * @param key   Key of the object.
+ * @param state Pointer to where the freshness of the object will be stored.
+ *
+ * @return Cached object or NULL if it wasn't found.
+ *
+ * @see cache_release
+ */
+cache_entry_t* cache_get(cache_t *cache, const char *key,
+						 cache_state_t *state) {
+	cache_entry_t *entry;
+	uint32_t hash;
+	time_t now;
+
+	/* Look for the object, counting the request even if it isn't there. */
+	*state = CACHE_MISS;
+	hash = search_hash(key);
+	mutex_lock(&cache->lock);
+	if (cache->sketch != NULL)
+		cache_sketch_add(cache, hash);
+	entry = cache->buckets[hash % CACHE_BUCKETS];
+	while ((entry != NULL) && ((entry->hash != hash) ||
+			(strcmp(entry->key, key) != 0))) {
+		entry = entry->hnext;
+	}
+
+	/* Move it to the front of its recently used list and hold a reference. */
+	if (entry != NULL) {
+		cache_list_remove(cache, entry);
+		cache_list_push(cache, entry);
+		entry->refs++;
+	}
+	mutex_unlock(&cache->lock);
+
+	now = time(NULL);
+#ifdef HAS_PREFORK
+	/* Another worker process may have a fresher copy of it. */
+	if ((cache->shared != NULL) && ((entry == NULL) ||
+			(now >= entry->expires))) {
+		cache_entry_t *shared;
+
+		shared = shm_cache_get(cache->shared, key, hash);
+		if ((shared != NULL) &&
+				((entry == NULL) || (shared->expires > entry->expires))) {
+			if (entry != NULL)
+				cache_release(cache, entry);
+			entry = cache_insert(cache, shared);
+		} else if (shared != NULL) {
+			cache_entry_free(shared);
+		}
+	}
+#endif /* HAS_PREFORK */
+	if (entry == NULL) {
+		if (cache->stats != NULL)
+			counter_add(&cache->stats->cache_misses, 1);
+		USDT1(cache_miss, key);
+		return NULL;
+	}
+
+	/* Check how fresh it is. */
+	if (now < entry->expires) {
+		*state = CACHE_FRESH;
+	} else if (now < entry->stale) {
+		*state = CACHE_STALE;
+	} else {
+		*state = CACHE_EXPIRED;
+	}
+	if (cache->stats != NULL) {
+		if (*state == CACHE_FRESH) {
+			counter_add(&cache->stats->cache_hits, 1);
+		} else {
+			counter_add(&cache->stats->cache_stale, 1);
+		}
+	}
+	USDT2(cache_hit, key, *state);
+
+	return entry;
+}
+
+/**
+ * Stores an object in the cache, replacing any previous object with the same
+ * key and evicting the least recently used ones to make room for it.
+ *
+ * @warning The returned object must be released using a special function.
+ *
+ * @param cache     Cache to store the object in.
+ * @param key       Key of the object.
+ * @param data      Contents of the object. The cache takes ownership of it if
+ *                  the operation is successful.
+ * @param size      Size of the contents in bytes.
+ * @param ttl       Number of seconds the object is considered fresh.
+ * @param stale_ttl Number of seconds after it expires that the object can still
+ *                  be served while being revalidated.
+ * @param flags     Flags associated with the object.
+ *
+ * @return Cached object or NULL if it couldn't be cached.
+ *
+ * @see cache_release
+ */
+cache_entry_t* cache_put(cache_t *cache, const char *key, char *data,
+						 size_t size, unsigned int ttl, unsigned int stale_ttl,
+						 uint8_t flags) {
+	cache_entry_t *entry;
+	time_t now;
+
+	/* Don't let a single object take over the cache. */
+	if ((data == NULL) || (size > (cache->max_size / 8)))
+		return NULL;
+
+	/* Make room for it under the memory limit of the caches. */
+	if (mem_over(MEM_CACHE, size + sizeof(cache_entry_t) + strlen(key) + 1)) {
+		mutex_lock(&cache->lock);
+		cache_evict(cache, size);
+		mutex_unlock(&cache->lock);
+	}
+
+	/* Build up the object. */
+	entry = (cache_entry_t*)mem_alloc(MEM_CACHE, sizeof(cache_entry_t));
+	if (entry == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate cache entry");
+		return NULL;
+	}
+	entry->key = mem_strdup(MEM_CACHE, key);
+	if (entry->key == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate cache entry key");
+		mem_free(entry);
+		return NULL;
+	}
+	now = time(NULL);
+	mem_retag(data, MEM_CACHE);
+	entry->hash = search_hash(key);
+	entry->data = data;
+	entry->size = size;
+	entry->expires = now + ttl;
+	entry->stale = entry->expires + stale_ttl;
+	entry->flags = flags & CACHE_MENU;
+	entry->refs = 1;
+	if (cache->stats != NULL)
+		counter_add(&cache->stats->cache_stores, 1);
+#ifdef HAS_PREFORK
+	/* Share it with the other worker processes. */
+	if (cache->shared != NULL)
+		shm_cache_put(cache->shared, entry);
+#endif /* HAS_PREFORK */
+
+	return cache_insert(cache, entry);
+}
+
+/**
+ * Inserts a newly built object into the cache, replacing any previous object
+ * with the same key. Without admission the least recently used objects are
+ * evicted to make room for it, otherwise it goes into the window and may end
+ * up being the one that's evicted.
+ *
+ * @param cache Cache to store the object in.
+ * @param entry Object to be inserted, with a reference held by the caller.
+ *
+ * @return The inserted object.
+ */
+cache_entry_t* cache_insert(cache_t *cache, cache_entry_t *entry) {
+	cache_entry_t *cur;
+
+	/* Replace the previous version of the object and make room for it. */
+	mutex_lock(&cache->lock);
+	cur = cache->buckets[entry->hash % CACHE_BUCKETS];
+	while (cur != NULL) {
+		if ((cur->hash == entry->hash) && (strcmp(cur->key, entry->key) == 0)) {
+			cache_unlink(cache, cur);
+			break;
+		}
+		cur = cur->hnext;
+	}
+	if (cache->sketch != NULL) {
+		entry->flags |= CACHE_WINDOW;
+	} else {
+		entry->flags &= ~CACHE_WINDOW;
+		cache_evict(cache, entry->size);
+	}
+
+	/* Insert it into its bucket and at the front of its recently used list. */
+	entry->hnext = cache->buckets[entry->hash % CACHE_BUCKETS];
+	cache->buckets[entry->hash % CACHE_BUCKETS] = entry;
+	cache_list_push(cache, entry);
+	cache->size += entry->size;
+	cache->count++;
+	if (cache->sketch != NULL)
+		cache_admit(cache);
+	if (mem_over(MEM_CACHE, 0))
+		cache_evict(cache, 0);
+	mutex_unlock(&cache->lock);
+
+	return entry;
+}
+
+/**
+ * Evicts the least recently used objects from the main part of the cache
+ * until there's room for some more, both in its budget and under the memory
+ * limit of the caches. Pinned objects are only evicted if nothing else is
+ * left.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache to make room in.
+ * @param size  Number of bytes that have to fit in.
+ */
+void cache_evict(cache_t *cache, size_t size) {
+	cache_entry_t *victim;
+
+	while ((cache->tail != NULL) && (((cache->size - cache->window_size +
+			size) > (cache->max_size - cache->window_max)) ||
+			mem_over(MEM_CACHE, size))) {
+		victim = cache->tail;
+		while ((victim != NULL) && (victim->flags & CACHE_PINNED))
+			victim = victim->prev;
+		cache_unlink(cache, (victim != NULL) ? victim : cache->tail);
+		if (cache->stats != NULL)
+			counter_add(&cache->stats->cache_evictions, 1);
+	}
+
+	/* The window has to give up its objects too to get under the limit. */
+	while ((cache->window_tail != NULL) && mem_over(MEM_CACHE, size)) {
+		cache_unlink(cache, cache->window_tail);
+		if (cache->stats != NULL)
+			counter_add(&cache->stats->cache_evictions, 1);
+	}
+}
+
+/**
+ * Changes how many bytes the cache is allowed to use, evicting the least
+ * recently used objects right away if it's over the new budget.
+ *
+ * @param cache    Cache to be resized.
+ * @param max_size New maximum number of bytes of content.
+ */
+void cache_resize(cache_t *cache, size_t max_size) {
+	mutex_lock(&cache->lock);
+	cache->max_size = max_size;
+	if (cache->sketch != NULL) {
+		cache->window_max = max_size * CACHE_WINDOW_PERCENT / 100;
+		cache_admit(cache);
+	}
+	cache_evict(cache, 0);
+	mutex_unlock(&cache->lock);
+}
+
+/**
+ * Moves the objects that overflow the window into the main part of the cache
+ * if they're requested more often than the object they would push out, or
+ * evicts them otherwise.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache to be tidied up.
+ */
+void cache_admit(cache_t *cache) {
+	cache_entry_t *candidate;
+	cache_entry_t *victim;
+	int admit;
+
+	while (cache->window_size > cache->window_max) {
+		/* Pick the object it would be competing against. */
+		candidate = cache->window_tail;
+		victim = cache->tail;
+		while ((victim != NULL) && (victim->flags & CACHE_PINNED))
+			victim = victim->prev;
+
+		/* Let it in for free if there's room for it. */
+		admit = (victim == NULL) || (candidate->flags & CACHE_PINNED) ||
+			((cache->size - cache->window_size + candidate->size) <=
+			(cache->max_size - cache->window_max)) ||
+			(cache_sketch_freq(cache, candidate->hash) >
+			cache_sketch_freq(cache, victim->hash));
+		if (!admit) {
+			if (cache->stats != NULL)
+				counter_add(&cache->stats->cache_rejected, 1);
+			cache_unlink(cache, candidate);
+			continue;
+		}
+
+		/* Move it over to the main part of the cache. */
+		cache_list_remove(cache, candidate);
+		candidate->flags &= ~CACHE_WINDOW;
+		cache_evict(cache, 0);
+		cache_list_push(cache, candidate);
+		if (cache->stats != NULL)
+			counter_add(&cache->stats->cache_admitted, 1);
+	}
+}
+
+/**
+ * Puts an object at the front of the recently used list it belongs to.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Object that isn't in any list.
+ */
+void cache_list_push(cache_t *cache, cache_entry_t *entry) {
+	cache_entry_t **head;
+	cache_entry_t **tail;
+
+	if (entry->flags & CACHE_WINDOW) {
+		head = &cache->window_head;
+		tail = &cache->window_tail;
+		cache->window_size += entry->size;
+	} else {
+		head = &cache->head;
+		tail = &cache->tail;
+	}
+
+	entry->prev = NULL;
+	entry->next = *head;
+	if (*head != NULL)
+		(*head)->prev = entry;
+	*head = entry;
+	if (*tail == NULL)
+		*tail = entry;
+}
+
+/**
+ * Takes an object out of the recently used list it belongs to.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Object to be taken out.
+ */
+void cache_list_remove(cache_t *cache, cache_entry_t *entry) {
+	cache_entry_t **head;
+	cache_entry_t **tail;
+
+	if (entry->flags & CACHE_WINDOW) {
+		head = &cache->window_head;
+		tail = &cache->window_tail;
+		cache->window_size -= entry->size;
+	} else {
+		head = &cache->head;
+		tail = &cache->tail;
+	}
+
+	if (entry->prev != NULL) {
+		entry->prev->next = entry->next;
+	} else {
+		*head = entry->next;
+	}
+	if (entry->next != NULL) {
+		entry->next->prev = entry->prev;
+	} else {
+		*tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+/**
+ * Walks through every object in the cache, the ones in the window first.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache to walk through.
+ * @param entry Current object or NULL to start from the beginning.
+ *
+ * @return Next object or NULL if there are no more.
+ */
+cache_entry_t* cache_next(const cache_t *cache, const cache_entry_t *entry) {
+	if (entry == NULL)
+		return (cache->window_head != NULL) ? cache->window_head : cache->head;
+	if ((entry->next == NULL) && (entry->flags & CACHE_WINDOW))
+		return cache->head;
+
+	return entry->next;
+}
+
+/**
+ * Counts a request for an object in the frequency sketch, a Count-Min sketch
+ * of small saturating counters that are halved every once in a while so that
+ * it follows the current traffic.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache with a frequency sketch.
+ * @param hash  Hash of the object's key.
+ */
+void cache_sketch_add(cache_t *cache, uint32_t hash) {
+	uint32_t step;
+	uint8_t *counter;
+	unsigned int i;
+
+	/* Bump the counter of the object in every row. */
+	step = ((hash >> 16) | (hash << 16)) | 1;
+	for (i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+		counter = cache->sketch + (i * CACHE_SKETCH_WIDTH) +
+			((hash + (i * step)) % CACHE_SKETCH_WIDTH);
+		if (*counter < 15)
+			(*counter)++;
+	}
+
+	/* Age everything once we've seen enough requests. */
+	if (++cache->sketch_adds >= (CACHE_SKETCH_WIDTH * 10)) {
+		for (i = 0; i < (CACHE_SKETCH_DEPTH * CACHE_SKETCH_WIDTH); i++)
+			cache->sketch[i] >>= 1;
+		cache->sketch_adds = 0;
+	}
+}
+
+/**
+ * Estimates how often an object has been requested lately.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache with a frequency sketch.
+ * @param hash  Hash of the object's key.
+ *
+ * @return Estimated number of requests, which is never underestimated.
+ */
+unsigned int cache_sketch_freq(const cache_t *cache, uint32_t hash) {
+	unsigned int freq;
+	unsigned int i;
+	uint32_t step;
+	uint8_t counter;
+
+	freq = 15;
+	step = ((hash >> 16) | (hash << 16)) | 1;
+	for (i = 0; i < CACHE_SKETCH_DEPTH; i++) {
+		counter = cache->sketch[(i * CACHE_SKETCH_WIDTH) +
+			((hash + (i * step)) % CACHE_SKETCH_WIDTH)];
+		if (counter < freq)
+			freq = counter;
+	}
+
+	return freq;
+}
+
+/**
+ * Releases a reference to a cached object, freeing it if it has been removed
+ * from the cache in the meantime.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Cached object to be released.
+ */
+void cache_release(cache_t *cache, cache_entry_t *entry) {
+	int dead;
+
+	mutex_lock(&cache->lock);
+	entry->refs--;
+	dead = (entry->refs == 0) && (entry->flags & CACHE_DEAD);
+	mutex_unlock(&cache->lock);
+
+	if (dead)
+		cache_entry_free(entry);
+}
+
+/**
+ * Claims the right to revalidate a cached object, ensuring that only a single
+ * revalidation happens at a time. A reference to the object is held until the
+ * revalidation is over.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Cached object to be revalidated.
+ *
+ * @return TRUE if the caller should revalidate the object, FALSE otherwise.
+ *
+ * @see cache_end_refresh
+ */
+int cache_claim_refresh(cache_t *cache, cache_entry_t *entry) {
+	int claimed;
+
+	mutex_lock(&cache->lock);
+	claimed = !(entry->flags & (CACHE_REFRESHING | CACHE_DEAD));
+	if (claimed) {
+		entry->flags |= CACHE_REFRESHING;
+		entry->refs++;
+	}
+	mutex_unlock(&cache->lock);
+
+	return claimed;
+}
+
+/**
+ * Signals that the revalidation of a cached object is over.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Cached object that was being revalidated.
+ *
+ * @see cache_claim_refresh
+ */
+void cache_end_refresh(cache_t *cache, cache_entry_t *entry) {
+	mutex_lock(&cache->lock);
+	entry->flags &= ~CACHE_REFRESHING;
+	mutex_unlock(&cache->lock);
+
+	cache_release(cache, entry);
+}
+
+/**
+ * Removes an object from the cache. It'll only be free'd once every reference
+ * to it has been released.
+ *
+ * @warning The cache must be locked by the caller.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Cached object to be removed.
+ */
+void cache_unlink(cache_t *cache, cache_entry_t *entry) {
+	cache_entry_t **cur;
+
+	/* Remove it from its bucket. */
+	cur = &cache->buckets[entry->hash % CACHE_BUCKETS];
+	while (*cur != entry)
+		cur = &(*cur)->hnext;
+	*cur = entry->hnext;
+
+	/* Remove it from its recently used list. */
+	cache_list_remove(cache, entry);
+	cache->size -= entry->size;
+	cache->count--;
+	if (entry->flags & CACHE_PINNED)
+		cache->pinned_size -= entry->size;
+
+	/* Free it right away if nobody is using it. */
+	entry->flags |= CACHE_DEAD;
+	if (entry->refs == 0)
+		cache_entry_free(entry);
+}
+
+/**
+ * Frees up a cached object.
+ *
+ * @param entry Cached object to be free'd.
+ */
+void cache_entry_free(cache_entry_t *entry) {
+	if (entry->key != NULL)
+		mem_free(entry->key);
+	if (entry->data != NULL)
+		mem_free(entry->data);
+	mem_free(entry);
+}
+
+/**
+ * Pins an object so that it's passed over when making room for new ones. At
+ * most half of the cache can be pinned at once.
+ *
+ * @param cache Cache the object belongs to.
+ * @param entry Cached object to be pinned.
+ *
+ * @return TRUE if the object is pinned, FALSE otherwise.
+ *
+ * @see cache_unpin
+ */
+int cache_pin(cache_t *cache, cache_entry_t *entry) {
+	int pinned;
+
+	mutex_lock(&cache->lock);
+	pinned = (entry->flags & CACHE_PINNED) != 0;
+	if (!pinned && !(entry->flags & CACHE_DEAD) &&
+			((cache->pinned_size + entry->size) <= (cache->max_size / 2))) {
+		entry->flags |= CACHE_PINNED;
+		cache->pinned_size += entry->size;
+		pinned = 1;
+	}
+	mutex_unlock(&cache->lock);
+
+	return pinned;
+}
+
+/**
+ * Unpins every object in the cache.
+ *
+ * @param cache Cache to unpin the objects of.
+ *
+ * @see cache_pin
+ */
+void cache_unpin(cache_t *cache) {
+	cache_entry_t *entry;
+
+	mutex_lock(&cache->lock);
+	for (entry = cache_next(cache, NULL); entry != NULL;
+			entry = cache_next(cache, entry)) {
+		entry->flags &= ~CACHE_PINNED;
+	}
+	cache->pinned_size = 0;
+	mutex_unlock(&cache->lock);
+}
+
+/**
+ * Removes every object picked by a matching function from the cache, and from
+ * the shared cache that backs it.
+ *
+ * @param cache Cache to remove the objects from.
+ * @param match Function that picks the objects to be removed.
+ * @param ctx   Context passed on to the matching function.
+ *
+ * @return Number of objects removed.
+ */
+unsigned int cache_remove(cache_t *cache, cache_match_func match,
+						  const void *ctx) {
+	cache_entry_t *entry;
+	unsigned int count;
+
+	/* Go through the whole cache. */
+	count = 0;
+	mutex_lock(&cache->lock);
+	entry = cache_next(cache, NULL);
+	while (entry != NULL) {
+		cache_entry_t *next = cache_next(cache, entry);
+
+		if (match(entry->key, strlen(entry->key), ctx)) {
+			cache_unlink(cache, entry);
+			count++;
+		}
+		entry = next;
+	}
+	mutex_unlock(&cache->lock);
+
+#ifdef HAS_PREFORK
+	if (cache->shared != NULL)
+		count += shm_cache_remove(cache->shared, match, ctx);
+#endif /* HAS_PREFORK */
+
+	return count;
+}
+
+#ifdef HAS_PREFORK
+/**
+ * =============================================================================
+ * === Shared Content Cache ====================================================
+ * =============================================================================
+ */
+
+/* Offset of the first slot from the start of the shared segment. */
+#define SHM_SLOTS_OFFSET \
+	((sizeof(shm_cache_t) + 63) & ~((size_t)63))
+#define SHM_SHARD_SLOTS \
+	(CACHE_SHM_SIZE / CACHE_SHM_SLOT_SIZE / CACHE_SHM_SHARDS)
+
+/**
+ * Maps an anonymous shared memory segment for the content cache, which is
+ * inherited by every process forked afterwards and outlives any of them.
+ *
+ * @warning This function maps memory that must be free'd using a special
+ *          function.
+ *
+ * @return Shared cache or NULL if an error occurred.
+ *
+ * @see shm_cache_free
+ */
+shm_cache_t* shm_cache_new(void) {
+	pthread_mutexattr_t attr;
+	shm_cache_t *shm;
+	size_t size;
+	int i;
+
+	/* Map the segment, which always starts out zeroed. */
+	size = SHM_SLOTS_OFFSET + ((size_t)SHM_SHARD_SLOTS * CACHE_SHM_SHARDS *
+		CACHE_SHM_SLOT_SIZE);
+	shm = (shm_cache_t*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == (shm_cache_t*)MAP_FAILED) {
+		log_syserr(LOG_CRIT, "Failed to map the shared content cache");
+		return NULL;
+	}
+	shm->size = size;
+
+	/* Setup locks that survive a worker crashing while holding them. */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAS_ROBUST_MUTEX
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif /* HAS_ROBUST_MUTEX */
+	for (i = 0; i < CACHE_SHM_SHARDS; i++) {
+		if (pthread_mutex_init(&shm->locks[i], &attr) != 0) {
+			log_printf(LOG_CRIT, "Failed to initialize the shared content "
+				"cache locks");
+			pthread_mutexattr_destroy(&attr);
+			munmap((void*)shm, size);
+			return NULL;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	return shm;
+}
+
+/**
+ * Unmaps the shared content cache from the current process. The segment is
+ * only released once every process has unmapped it.
+ *
+ * @param shm Shared cache to be unmapped.
+ */
+void shm_cache_free(shm_cache_t *shm) {
+	munmap((void*)shm, shm->size);
+}
+
+/**
+ * Gets a copy of an object from the shared content cache.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param shm  Shared cache to look into.
+ * @param key  Key of the object.
+ * @param hash Hash of the key.
+ *
+ * @return Copy of the cached object, with a single reference held, or NULL if
+ *         it wasn't found.
+ *
+ * @see cache_entry_free
+ */
+cache_entry_t* shm_cache_get(shm_cache_t *shm, const char *key, uint32_t hash) {
+	cache_entry_t *entry;
+	shm_slot_t *slot;
+	unsigned int shard;
+	unsigned int i;
+	size_t keylen;
+
+	/* Look for the object in its shard. */
+	keylen = strlen(key);
+	shard = hash % CACHE_SHM_SHARDS;
+	if (!shm_cache_lock(shm, shard))
+		return NULL;
+	for (i = 0; i < SHM_SHARD_SLOTS; i++) {
+		slot = shm_cache_slot(shm, shard, i);
+		if (slot->valid && (slot->hash == hash) && (slot->keylen == keylen) &&
+				(memcmp(slot + 1, key, keylen) == 0)) {
+			break;
+		}
+	}
+	if (i == SHM_SHARD_SLOTS) {
+		pthread_mutex_unlock(&shm->locks[shard]);
+		return NULL;
+	}
+	slot->used = time(NULL);
+
+	/* Copy it out of the shared segment. */
+	entry = (cache_entry_t*)mem_alloc(MEM_CACHE, sizeof(cache_entry_t));
+	if (entry == NULL) {
+		pthread_mutex_unlock(&shm->locks[shard]);
+		log_syserr(LOG_ERROR, "Failed to allocate cache entry");
+		return NULL;
+	}
+	entry->key = mem_strdup(MEM_CACHE, key);
+	entry->data = (char*)mem_alloc(MEM_CACHE, slot->size + 1);
+	if ((entry->key == NULL) || (entry->data == NULL)) {
+		pthread_mutex_unlock(&shm->locks[shard]);
+		log_syserr(LOG_ERROR, "Failed to allocate cache entry contents");
+		cache_entry_free(entry);
+		return NULL;
+	}
+	memcpy(entry->data, (char*)(slot + 1) + keylen, slot->size);
+	entry->hash = hash;
+	entry->size = slot->size;
+	entry->expires = slot->expires;
+	entry->stale = slot->stale;
+	entry->flags = slot->flags;
+	entry->refs = 1;
+	pthread_mutex_unlock(&shm->locks[shard]);
+
+	return entry;
+}
+
+/**
+ * Stores a copy of an object in the shared content cache, replacing any
+ * previous object with the same key or the least recently used one in its
+ * shard. Objects that don't fit in a slot are ignored.
+ *
+ * @param shm   Shared cache to store the object in.
+ * @param entry Object to be stored.
+ */
+void shm_cache_put(shm_cache_t *shm, const cache_entry_t *entry) {
+	shm_slot_t *victim;
+	shm_slot_t *slot;
+	unsigned int shard;
+	unsigned int i;
+	size_t keylen;
+
+	/* Check if it fits in a slot. */
+	keylen = strlen(entry->key);
+	if ((sizeof(shm_slot_t) + keylen + entry->size) > CACHE_SHM_SLOT_SIZE)
+		return;
+
+	/* Pick the previous version, an empty slot, or the least recently used. */
+	shard = entry->hash % CACHE_SHM_SHARDS;
+	if (!shm_cache_lock(shm, shard))
+		return;
+	victim = NULL;
+	for (i = 0; i < SHM_SHARD_SLOTS; i++) {
+		slot = shm_cache_slot(shm, shard, i);
+		if (!slot->valid) {
+			if ((victim == NULL) || victim->valid)
+				victim = slot;
+			continue;
+		}
+
+		if ((slot->hash == entry->hash) && (slot->keylen == keylen) &&
+				(memcmp(slot + 1, entry->key, keylen) == 0)) {
+			victim = slot;
+			break;
+		}
+		if ((victim == NULL) || (victim->valid && (slot->used < victim->used)))
+			victim = slot;
+	}
+
+	/* Keep the slot invalid while writing it in case we crash halfway. */
+	victim->valid = 0;
+	atomic_fence();
+	victim->hash = entry->hash;
+	victim->keylen = (uint32_t)keylen;
+	victim->size = (uint32_t)entry->size;
+	victim->flags = entry->flags & CACHE_MENU;
+	victim->expires = entry->expires;
+	victim->stale = entry->stale;
+	victim->used = time(NULL);
+	memcpy(victim + 1, entry->key, keylen);
+	memcpy((char*)(victim + 1) + keylen, entry->data, entry->size);
+	atomic_fence();
+	victim->valid = 1;
+	pthread_mutex_unlock(&shm->locks[shard]);
+}
+
+/**
+ * Removes every object picked by a matching function from the shared content
+ * cache.
+ *
+ * @param shm   Shared cache to remove the objects from.
+ * @param match Function that picks the objects to be removed.
+ * @param ctx   Context passed on to the matching function.
+ *
+ * @return Number of objects removed.
+ */
+unsigned int shm_cache_remove(shm_cache_t *shm, cache_match_func match,
+							  const void *ctx) {
+	shm_slot_t *slot;
+	unsigned int shard;
+	unsigned int count;
+	unsigned int i;
+
+	count = 0;
+	for (shard = 0; shard < CACHE_SHM_SHARDS; shard++) {
+		if (!shm_cache_lock(shm, shard))
+			continue;
+		for (i = 0; i < SHM_SHARD_SLOTS; i++) {
+			slot = shm_cache_slot(shm, shard, i);
+			if (slot->valid && match((const char*)(slot + 1), slot->keylen,
+					ctx)) {
+				slot->valid = 0;
+				count++;
+			}
+		}
+		pthread_mutex_unlock(&shm->locks[shard]);
+	}
+
+	return count;
+}
+
+/**
+ * Gets how much of the shared content cache is in use.
+ *
+ * @param shm   Shared cache.
+ * @param count Pointer to where the number of objects will be stored.
+ * @param size  Pointer to where the size of their contents will be stored.
+ */
+void shm_cache_usage(shm_cache_t *shm, uint32_t *count, size_t *size) {
+	shm_slot_t *slot;
+	unsigned int shard;
+	unsigned int i;
+
+	*count = 0;
+	*size = 0;
+	for (shard = 0; shard < CACHE_SHM_SHARDS; shard++) {
+		if (!shm_cache_lock(shm, shard))
+			continue;
+		for (i = 0; i < SHM_SHARD_SLOTS; i++) {
+			slot = shm_cache_slot(shm, shard, i);
+			if (slot->valid) {
+				(*count)++;
+				*size += slot->size;
+			}
+		}
+		pthread_mutex_unlock(&shm->locks[shard]);
+	}
+}
+
+/**
+ * Locks a shard of the shared content cache, recovering it if a worker died
+ * while holding its lock.
+ *
+ * @param shm   Shared cache.
+ * @param shard Index of the shard to be locked.
+ *
+ * @return TRUE if the shard was locked, FALSE otherwise.
+ */
+int shm_cache_lock(shm_cache_t *shm, unsigned int shard) {
+	int ret;
+
+	ret = pthread_mutex_lock(&shm->locks[shard]);
+#ifdef HAS_ROBUST_MUTEX
+	if (ret == EOWNERDEAD) {
+		/* Slots being written when it died were never marked as valid. */
+		log_printf(LOG_WARNING, "Recovering shared cache shard %u from a "
+			"crashed worker", shard);
+		pthread_mutex_consistent(&shm->locks[shard]);
+		ret = 0;
+	}
+#endif /* HAS_ROBUST_MUTEX */
+
+	return ret == 0;
+}
+
+/**
+ * Gets a slot of the shared content cache.
+ *
+ * @param shm   Shared cache.
+ * @param shard Index of the shard the slot belongs to.
+ * @param i     Index of the slot inside the shard.
+ *
+ * @return Slot header, followed by its key and contents.
+ */
+shm_slot_t* shm_cache_slot(shm_cache_t *shm, unsigned int shard,
+						   unsigned int i) {
+	return (shm_slot_t*)((char*)shm + SHM_SLOTS_OFFSET +
+		(((size_t)shard * SHM_SHARD_SLOTS) + i) * CACHE_SHM_SLOT_SIZE);
+}
+
+/**
+ * =============================================================================
+ * === Pre-fork Workers ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Supervises the worker processes that share our listening sockets and
+ * content cache, respawning any of them that dies, until we are asked to
+ * stop.
+ *
+ * @param srv Server instance.
+ */
+void prefork_run(amigos_t *srv) {
+	unsigned int i;
+	pid_t pid;
+	int status;
+
+	/* Start up the workers. */
+	for (i = 0; i < srv->nworkers; i++) {
+		srv->workers[i] = -1;
+		prefork_spawn(srv, i);
+	}
+
+	while (srv->running) {
+		time_t now;
+
+		/* Apply configuration changes and pass them on to the workers. */
+		if (srv->reload_pending) {
+			srv->reload_pending = 0;
+			config_reload(srv);
+			gopher_types_reload(srv);
+			prefork_signal(srv, SIGHUP);
+		}
+		rcu_reclaim(srv);
+		stats_update(srv, 0);
+
+		/* Reap the workers that have died. */
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < srv->nworkers; i++) {
+				if (srv->workers[i] == pid)
+					break;
+			}
+			if (i == srv->nworkers)
+				continue;
+
+			srv->workers[i] = -1;
+			if (WIFSIGNALED(status)) {
+				log_printf(LOG_ERROR, "Worker %u (PID %ld) was killed by "
+					"signal %d", i, (long)pid, WTERMSIG(status));
+			} else {
+				log_printf(LOG_ERROR, "Worker %u (PID %ld) exited with status "
+					"%d", i, (long)pid, WEXITSTATUS(status));
+			}
+		}
+
+		/* Respawn them, without hammering the system if they keep dying. */
+		now = time(NULL);
+		for (i = 0; i < srv->nworkers; i++) {
+			if ((srv->workers[i] == -1) && ((now - srv->workers_started[i]) >=
+					WORKER_RESPAWN_DELAY)) {
+				prefork_spawn(srv, i);
+			}
+		}
+
+		thread_sleep(250);
+	}
+
+	/* Stop the workers and wait for them to finish. */
+	prefork_signal(srv, SIGINT);
+	for (i = 0; i < srv->nworkers; i++) {
+		if (srv->workers[i] != -1)
+			waitpid(srv->workers[i], &status, 0);
+		srv->workers[i] = -1;
+	}
+	server_stop(srv);
+}
+
+/**
+ * Forks a worker process that accepts connections on our listening sockets
+ * until it's asked to stop.
+ *
+ * @param srv Server instance.
+ * @param i   Index of the worker.
+ *
+ * @return TRUE if the worker was started, FALSE otherwise.
+ */
+int prefork_spawn(amigos_t *srv, unsigned int i) {
+	pid_t pid;
+
+	/* Ensure the worker doesn't inherit unwritten log messages. */
+	fflush(stdout);
+	srv->workers_started[i] = time(NULL);
+	pid = fork();
+	if (pid < 0) {
+		log_syserr(LOG_ERROR, "Failed to fork worker %u", i);
+		return 0;
+	}
+
+	/* Run the worker. */
+	if (pid == 0) {
+		srv->worker = (int)i + 1;
+		srv->last_stats = time(NULL);
+#ifdef HAS_MMAP
+		stats_attach(srv, i + 1);
+#endif /* HAS_MMAP */
+#ifdef __linux__
+		prctl(PR_SET_PDEATHSIG, SIGINT);
+#endif /* __linux__ */
+		server_background(srv);
+		server_loop(srv);
+		amigos_free(srv);
+		exit(0);
+	}
+
+	log_printf(LOG_INFO, "Worker %u started with PID %ld", i, (long)pid);
+	srv->workers[i] = pid;
+	return 1;
+}
+
+/**
+ * Sends a signal to every running worker process.
+ *
+ * @param srv    Server instance.
+ * @param signum Signal to be sent.
+ */
+void prefork_signal(amigos_t *srv, int signum) {
+	unsigned int i;
+
+	for (i = 0; i < srv->nworkers; i++) {
+		if (srv->workers[i] != -1)
+			kill(srv->workers[i], signum);
+	}
+}
+#endif /* HAS_PREFORK */
+
+/**
+ * =============================================================================
+ * === Request Watchdog ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Starts the thread that keeps an eye on requests that take too long.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int watchdog_init(amigos_t *srv) {
+	srv->watchdog_thread = INVALID_THREAD;
+	srv->watchdog_running = 1;
+	if (!thread_create(&srv->watchdog_thread, watchdog_thread_func, srv)) {
+		log_printf(LOG_ERROR, "Failed to create request watchdog thread");
+		srv->watchdog_running = 0;
+		srv->watchdog_thread = INVALID_THREAD;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Stops the request watchdog thread.
+ *
+ * @param srv Server instance.
+ */
+void watchdog_stop(amigos_t *srv) {
+	srv->watchdog_running = 0;
+	if (srv->watchdog_thread != INVALID_THREAD)
+		thread_join(srv->watchdog_thread);
+	srv->watchdog_thread = INVALID_THREAD;
+}
+
+/**
+ * Request watchdog thread. Checks every in-flight request once a second.
+ *
+ * @param data Server instance.
+ */
+thread_ret watchdog_thread_func(void *data) {
+	amigos_t *srv;
+	unsigned int elapsed;
+
+	srv = (amigos_t*)data;
+	elapsed = 0;
+	while (srv->watchdog_running) {
+		thread_sleep(250);
+		elapsed += 250;
+		if (elapsed < 1000)
+			continue;
+
+		elapsed = 0;
+		rcu_read_lock(srv, RCU_SLOT_WATCHDOG);
+		watchdog_check(srv,
+			(const config_t*)atomic_get_ptr(&srv->config));
+		rcu_read_unlock(srv, RCU_SLOT_WATCHDOG);
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Looks for requests that haven't made any progress for too long, neither
+ * moving on to another phase nor sending or receiving anything, logging and
+ * counting each of them once as slow and once as stuck, and closing the stuck
+ * ones if we have been asked to.
+ *
+ * @param srv Server instance.
+ * @param cfg Current configuration.
+ */
+void watchdog_check(amigos_t *srv, const config_t *cfg) {
+	conn_score_t *score;
+	char selector[ADMIN_SELECTOR_LEN];
+	char addr[INET6_ADDRSTRLEN];
+	uint8_t status;
+	uint8_t phase;
+	time_t progressed;
+	time_t now;
+	long age;
+	int stuck;
+	int slow;
+	int i;
+
+	now = time(NULL);
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		status = srv->connections[i].status;
+		if (!(status & CONN_INUSE) || (status & CONN_FINISHED))
+			continue;
+
+		/* Start over whenever the request makes some progress. */
+		score = &srv->scores[i];
+		progressed = score->progressed;
+		if (progressed != score->flagged_progressed) {
+			score->flagged_progressed = progressed;
+			score->flagged = 0;
+		}
+		age = (long)(now - progressed);
+		stuck = (cfg->stuck_request > 0) && (age >= (long)cfg->stuck_request);
+		slow = (cfg->slow_request > 0) && (age >= (long)cfg->slow_request);
+		if (!(stuck && (score->flagged < 2)) && !(slow && (score->flagged < 1)))
+			continue;
+
+		/* Take a copy, since the request keeps on going meanwhile. */
+		memcpy(addr, srv->connections[i].addr, INET6_ADDRSTRLEN);
+		addr[INET6_ADDRSTRLEN - 1] = '\0';
+		memcpy(selector, score->selector, ADMIN_SELECTOR_LEN);
+		selector[ADMIN_SELECTOR_LEN - 1] = '\0';
+		phase = score->phase;
+		if (phase > PHASE_CLOSE)
+			phase = PHASE_CLOSE;
+
+		if (stuck) {
+			log_printf(LOG_WARNING, "Request for '%s' from %s stuck in %s "
+				"phase with no progress for %ld seconds", selector, addr,
+				conn_phases[phase], age);
+			counter_add(&srv->stats->stuck_requests, 1);
+			if (slow && (score->flagged < 1))
+				counter_add(&srv->stats->slow_requests, 1);
+			score->flagged = 2;
+
+			if (cfg->kill_stuck && watchdog_kill(srv, i, progressed)) {
+				log_printf(LOG_WARNING, "Closed stuck connection from %s",
+					addr);
+				counter_add(&srv->stats->killed_requests, 1);
+			}
+		} else {
+			log_printf(LOG_NOTICE, "Request for '%s' from %s slow in %s phase "
+				"with no progress for %ld seconds", selector, addr,
+				conn_phases[phase], age);
+			counter_add(&srv->stats->slow_requests, 1);
+			score->flagged = 1;
+		}
+	}
+}
+
+/**
+ * Shuts down the socket of a stuck connection, making whatever its thread is
+ * blocked on with the client fail, and letting it clean up as usual.
+ *
+ * @param srv        Server instance.
+ * @param slot       Index of the connection.
+ * @param progressed When the connection last made any progress, to make sure
+ *                   that it hasn't made some or the slot hasn't been reused in
+ *                   the meantime.
+ *
+ * @return TRUE if the connection was shut down, FALSE if it was already gone.
+ */
+int watchdog_kill(amigos_t *srv, int slot, time_t progressed) {
+	client_conn_t *conn;
+	int killed;
+
+	killed = 0;
+	conn = &srv->connections[slot];
+	mutex_lock(&srv->conn_lock);
+	if ((conn->sockfd != SOCKERR) && !(conn->status & CONN_FINISHED) &&
+			(srv->scores[slot].progressed == progressed)) {
+#ifdef _WIN32
+		shutdown(conn->sockfd, SD_BOTH);
+#else
+		shutdown(conn->sockfd, SHUT_RDWR);
+#endif /* _WIN32 */
+		killed = 1;
+	}
+	mutex_unlock(&srv->conn_lock);
+
+	return killed;
+}
+
+#ifdef WITH_PROFILER
+/**
+ * =============================================================================
+ * === Sampling Profiler =======================================================
+ * =============================================================================
+ */
+
+/**
+ * Starts sampling the stacks of every thread of the process that's using the
+ * processor, at regular intervals of processor time.
+ *
+ * @param srv Server instance whose threads are being profiled.
+ * @param hz  Number of samples to take each second.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ *
+ * @see profiler_stop
+ */
+int profiler_start(amigos_t *srv, unsigned int hz) {
+	struct itimerval it;
+	struct sigaction sa;
+	void *pcs[1];
+
+	/* Only one profile can be taken at a time. */
+	if (pthread_mutex_trylock(&profiler_lock) != 0) {
+		log_printf(LOG_ERROR, "The profiler is already running");
+		return 0;
+	}
+
+	profiler.samples = (prof_sample_t*)mem_calloc(MEM_SERVER,
+		PROFILER_MAX_SAMPLES, sizeof(prof_sample_t));
+	if (profiler.samples == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate the profiler samples");
+		pthread_mutex_unlock(&profiler_lock);
+		return 0;
+	}
+	profiler.srv = srv;
+	profiler.next = 0;
+
+	/* Get the unwinder loaded, since that can't be done in a signal handler. */
+	backtrace(pcs, 1);
+
+	/* Take a sample every time the timer goes off. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = profiler_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, &profiler.old_action);
+	it.it_interval.tv_sec = 0;
+	it.it_interval.tv_usec = (long)(1000000 / hz);
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+		log_syserr(LOG_ERROR, "Failed to start the profiler timer");
+		sigaction(SIGPROF, &profiler.old_action, NULL);
+		mem_free(profiler.samples);
+		profiler.samples = NULL;
+		pthread_mutex_unlock(&profiler_lock);
+		return 0;
+	}
+
+	log_printf(LOG_NOTICE, "Profiling at %u Hz", hz);
+	return 1;
+}
+
+/**
+ * Stops sampling the stacks and writes out the ones that were sampled.
+ *
+ * @param out Buffer to write the stacks to.
+ *
+ * @see profiler_start
+ */
+void profiler_stop(buffer_t *out) {
+	struct itimerval it;
+
+	/* Stop the timer, throw away any signals still pending and let the samples
+	 * being taken finish, before handing the signal back to whoever had it. */
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_PROF, &it, NULL);
+	signal(SIGPROF, SIG_IGN);
+	thread_sleep(10);
+	sigaction(SIGPROF, &profiler.old_action, NULL);
+
+	profiler_fold(out);
+	mem_free(profiler.samples);
+	profiler.samples = NULL;
+	pthread_mutex_unlock(&profiler_lock);
+}
+
+/**
+ * Samples the stack of the thread that was using the processor when the
+ * profiler's timer went off.
+ *
+ * backtrace() isn't async-signal-safe. Loading the unwinder is taken care of
+ * in profiler_start, but the unwinder still takes the dynamic loader's lock
+ * while walking the stack, so a sample landing on a thread that's loading or
+ * unloading a shared object, such as a plugin, can deadlock it.
+ *
+ * @param signum Signal number that was triggered.
+ */
+void profiler_signal(int signum) {
+	prof_sample_t *sample;
+	uint32_t i;
+	int saved;
+
+	(void)signum;
+	saved = errno;
+
+	i = atomic_add_u32(&profiler.next, 1);
+	if ((profiler.samples != NULL) && (i < PROFILER_MAX_SAMPLES)) {
+		sample = &profiler.samples[i];
+		sample->depth = (uint8_t)backtrace(sample->pcs, PROFILER_MAX_DEPTH);
+		sample->tag = profiler_tag(profiler.srv, &sample->kind);
+		sample->ready = 1;
+	}
+
+	errno = saved;
+}
+
+/**
+ * Finds out what the calling thread is doing.
+ *
+ * @param srv  Server instance.
+ * @param kind Where to store the kind of request being served.
+ *
+ * @return Phase of the connection being served or, if it isn't serving one,
+ *         the kind of thread that it is offset by the number of phases.
+ */
+uint8_t profiler_tag(amigos_t *srv, uint8_t *kind) {
+	pthread_t self;
+	uint8_t tag;
+	int i;
+
+	/* Threads serving requests. */
+	self = pthread_self();
+	*kind = REQ_PENDING;
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		if ((srv->connections[i].status != 0) &&
+				pthread_equal(srv->connections[i].thread, self)) {
+			*kind = srv->scores[i].kind;
+			return srv->scores[i].phase;
+		}
+	}
+
+	/* Threads of our own. */
+	tag = PHASE_CLOSE + 1;
+	if (pthread_equal(srv->search_thread, self))
+		return tag;
+	if (pthread_equal(srv->proxy_thread, self))
+		return tag + 1;
+	if (pthread_equal(srv->watchdog_thread, self))
+		return tag + 2;
+	if (pthread_equal(srv->admin_thread, self))
+		return tag + 3;
+	for (i = 0; i < WARMUP_THREADS; i++) {
+		if (pthread_equal(srv->warmup_workers[i].thread, self))
+			return tag + 4;
+	}
+
+	return tag + 5;
+}
+
+/**
+ * Writes out the sampled stacks in the folded format taken by flame graph
+ * tools: a line for each distinct stack, made up of what the thread was
+ * doing, the kind of request, and its functions from the outermost one in,
+ * separated by semicolons, followed by the number of times it was sampled.
+ *
+ * @param out Buffer to write the stacks to.
+ */
+void profiler_fold(buffer_t *out) {
+	prof_sample_t *samples;
+	prof_stack_t *stacks;
+	buffer_t frames;
+	char **symbols;
+	const char *what;
+	unsigned long count;
+	uint32_t nsamples;
+	uint32_t nstacks;
+	uint32_t i;
+	uint32_t j;
+	int depth;
+	int ok;
+	int k;
+
+	samples = profiler.samples;
+	nsamples = profiler.next;
+	if (nsamples > PROFILER_MAX_SAMPLES)
+		nsamples = PROFILER_MAX_SAMPLES;
+	stacks = (prof_stack_t*)mem_calloc(MEM_SERVER, nsamples + 1,
+		sizeof(prof_stack_t));
+	if (stacks == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate the profiler stacks");
+		return;
+	}
+
+	/* Symbolize each distinct stack once. */
+	qsort(samples, nsamples, sizeof(prof_sample_t), profiler_sample_cmp);
+	nstacks = 0;
+	for (i = 0; i < nsamples; i = j) {
+		for (j = i + 1; (j < nsamples) &&
+				(profiler_sample_cmp(&samples[i], &samples[j]) == 0); j++)
+			;
+
+		depth = samples[i].depth - PROFILER_SKIP_FRAMES;
+		if (!samples[i].ready || (depth <= 0))
+			continue;
+		symbols = backtrace_symbols(samples[i].pcs + PROFILER_SKIP_FRAMES,
+			depth);
+		if (symbols == NULL)
+			continue;
+
+		/* What the thread was doing comes first, then the outermost call. */
+		buffer_init(&frames, MEM_SERVER);
+		what = (samples[i].tag <= PHASE_CLOSE) ?
+			conn_phases[samples[i].tag] :
+			prof_threads[samples[i].tag - PHASE_CLOSE - 1];
+		ok = admin_printf(&frames, "%s;%s", what,
+			prof_kinds[samples[i].kind]);
+		for (k = depth - 1; ok && (k >= 0); k--)
+			ok = admin_printf(&frames, ";%s", profiler_symbol(symbols[k]));
+		free(symbols);
+
+		/* Leave out stacks we ran out of memory writing. */
+		if (!ok || (frames.data == NULL)) {
+			buffer_free(&frames);
+			continue;
+		}
+
+		stacks[nstacks].frames = frames.data;
+		stacks[nstacks].count = j - i;
+		nstacks++;
+	}
+
+	/* Different addresses in the same functions make the same stack. */
+	qsort(stacks, nstacks, sizeof(prof_stack_t), profiler_stack_cmp);
+	for (i = 0; i < nstacks; i = j) {
+		count = 0;
+		for (j = i; (j < nstacks) &&
+				(strcmp(stacks[i].frames, stacks[j].frames) == 0); j++) {
+			count += stacks[j].count;
+		}
+		admin_printf(out, "%s %lu\n", stacks[i].frames, count);
+	}
+
+	for (i = 0; i < nstacks; i++)
+		mem_free(stacks[i].frames);
+	mem_free(stacks);
+	log_printf(LOG_NOTICE, "Profiled %lu samples, %lu dropped",
+		(unsigned long)nsamples, (unsigned long)(profiler.next - nsamples));
+}
+
+/**
+ * Gets the name of the function out of a symbol as described by
+ * backtrace_symbols, or its module and offset if it doesn't have one.
+ *
+ * @param sym Symbol description, which gets modified.
+ *
+ * @return Name of the function or where it is.
+ */
+char* profiler_symbol(char *sym) {
+	char *start;
+	char *end;
+
+	/* Named, as in "path(name+0x1f) [0x4021ab]". */
+	start = strchr(sym, '(');
+	if ((start != NULL) && (start[1] != '+') && (start[1] != ')')) {
+		start++;
+		start[strcspn(start, "+)")] = '\0';
+		return start;
+	}
+
+	/* Nameless, so leave the module and offset for addr2line. */
+	end = strchr(sym, ' ');
+	if (end != NULL)
+		*end = '\0';
+	start = strrchr(sym, '/');
+
+	return (start != NULL) ? (start + 1) : sym;
+}
+
+/**
+ * Compares two samples so that identical ones get sorted together.
+ *
+ * @see qsort
+ */
+int profiler_sample_cmp(const void *a, const void *b) {
+	const prof_sample_t *x;
+	const prof_sample_t *y;
+
+	x = (const prof_sample_t*)a;
+	y = (const prof_sample_t*)b;
+	if (x->ready != y->ready)
+		return (int)x->ready - (int)y->ready;
+	if (x->tag != y->tag)
+		return (int)x->tag - (int)y->tag;
+	if (x->kind != y->kind)
+		return (int)x->kind - (int)y->kind;
+	if (x->depth != y->depth)
+		return (int)x->depth - (int)y->depth;
+
+	return memcmp(x->pcs, y->pcs, x->depth * sizeof(void*));
+}
+
+/**
+ * Compares two folded stacks by their frames.
+ *
+ * @see qsort
+ */
+int profiler_stack_cmp(const void *a, const void *b) {
+	return strcmp(((const prof_stack_t*)a)->frames,
+		((const prof_stack_t*)b)->frames);
+}
+#endif /* WITH_PROFILER */
+
+#ifdef HAS_UNIX_SOCKETS
+/**
+ * =============================================================================
+ * === Admin Socket ============================================================
+ * =============================================================================
+ */
+
+/**
+ * Creates the admin socket and starts the thread that answers the commands
+ * sent through it. Pre-fork workers each get their own socket, named after
+ * the configured path followed by the index of the worker.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ *
+ * @see admin_stop
+ */
+int admin_init(amigos_t *srv) {
+	const char *path;
+	mode_t mask;
+
+	srv->admin_socket = SOCKERR;
+	srv->admin_path = NULL;
+	srv->admin_thread = INVALID_THREAD;
+	srv->admin_running = 0;
+	path = srv->config->admin_path;
+	if (*path == '\0')
+		return 1;
+
+	/* Figure out the path of our own socket. */
+	srv->admin_path = (char*)mem_alloc(MEM_SERVER, strlen(path) + 12);
+	if (srv->admin_path == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate admin socket path");
+		return 0;
+	}
+	if (srv->worker) {
+		sprintf(srv->admin_path, "%s.%d", path, srv->worker - 1);
+	} else {
+		strcpy(srv->admin_path, path);
+	}
+
+	/* Create the socket and keep it to ourselves, right from the moment it's
+	 * bound rather than only once its permissions have been tightened. */
+	mask = umask(S_IRWXG | S_IRWXO);
+	srv->admin_socket = server_listen_unix(srv->config, srv->admin_path);
+	umask(mask);
+	if (srv->admin_socket == SOCKERR) {
+		mem_free(srv->admin_path);
+		srv->admin_path = NULL;
+		return 0;
+	}
+	if (chmod(srv->admin_path, S_IRUSR | S_IWUSR) != 0) {
+		log_syserr(LOG_WARNING, "Failed to restrict access to admin socket "
+			"'%s'", srv->admin_path);
+	}
+
+	/* Start answering commands. */
+	srv->admin_running = 1;
+	if (!thread_create(&srv->admin_thread, admin_thread_func, srv)) {
+		log_printf(LOG_ERROR, "Failed to create admin socket thread");
+		srv->admin_running = 0;
+		srv->admin_thread = INVALID_THREAD;
+		admin_stop(srv);
+		return 0;
+	}
+	log_printf(LOG_INFO, "Admin socket listening on %s", srv->admin_path);
+
+	return 1;
+}
+
+/**
+ * Stops the admin socket thread and removes the socket.
+ *
+ * @param srv Server instance.
+ */
+void admin_stop(amigos_t *srv) {
+	/* Wait for the thread to finish. */
+	srv->admin_running = 0;
+	if (srv->admin_thread != INVALID_THREAD)
+		thread_join(srv->admin_thread);
+	srv->admin_thread = INVALID_THREAD;
+
+	/* Get rid of the socket. */
+	if (srv->admin_socket != SOCKERR) {
+		sockclose(srv->admin_socket);
+		unlink(srv->admin_path);
+	}
+	srv->admin_socket = SOCKERR;
+	if (srv->admin_path != NULL)
+		mem_free(srv->admin_path);
+	srv->admin_path = NULL;
+}
+
+/**
+ * Admin socket thread. Answers the commands sent by local clients one at a
+ * time, away from the threads that serve requests.
+ *
+ * @param data Server instance.
+ */
+thread_ret admin_thread_func(void *data) {
+	amigos_t *srv;
+	struct timeval tv;
+	sockfd_t sockfd;
+	fd_set fds;
+
+	srv = (amigos_t*)data;
+	while (srv->admin_running) {
+		/* Check every now and then if we have been asked to stop. */
+		FD_ZERO(&fds);
+		FD_SET(srv->admin_socket, &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 250000;
+		if (select(srv->admin_socket + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+
+		/* Answer the command. */
+		sockfd = accept(srv->admin_socket, NULL, NULL);
+		if (sockfd == SOCKERR)
+			continue;
+		admin_handle(srv, sockfd);
+		sockclose(sockfd);
+	}
+
+	return NULL;
+}
+
+/**
+ * Reads a command from an admin client and sends back its output. Commands
+ * are a single line with a name and an optional argument.
+ *
+ * @param srv    Server instance.
+ * @param sockfd Connected admin client socket.
+ */
+void admin_handle(amigos_t *srv, sockfd_t sockfd) {
+	char cmd[ADMIN_MAX_COMMAND];
+	struct timeval tv;
+	buffer_t out;
+	ssize_t len;
+	size_t used;
+	char *arg;
+
+	/* Read the command line, without a client that never says or reads a thing
+	 * being able to hold up the thread and anyone waiting to stop it. */
+	tv.tv_sec = RECV_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	tv.tv_sec = ADMIN_SEND_TIMEOUT;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	used = 0;
+	cmd[0] = '\0';
+	while ((used < (ADMIN_MAX_COMMAND - 1)) && (strchr(cmd, '\n') == NULL)) {
+		len = recv(sockfd, cmd + used, ADMIN_MAX_COMMAND - 1 - used, 0);
+		if (len <= 0)
+			break;
+		used += len;
+		cmd[used] = '\0';
+	}
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+
+	/* Split off its argument. */
+	arg = strchr(cmd, ' ');
+	if (arg != NULL) {
+		*arg++ = '\0';
+		while (*arg == ' ')
+			arg++;
+	} else {
+		arg = cmd + strlen(cmd);
+	}
+	log_printf(LOG_INFO, "Admin command '%s' '%s'", cmd, arg);
+
+	/* Run it. */
+	buffer_init(&out, MEM_SERVER);
+	if (strcmp(cmd, "conns") == 0) {
+		admin_conns(srv, &out);
+	} else if (strcmp(cmd, "cache") == 0) {
+		admin_cache(srv, &out, arg);
+	} else if (strcmp(cmd, "top") == 0) {
+		admin_top(srv, &out, arg);
+	} else if (strcmp(cmd, "flush") == 0) {
+		admin_flush(srv, &out, arg);
+	} else if (strcmp(cmd, "warm") == 0) {
+		admin_warm(srv, &out, arg);
+	} else if (strcmp(cmd, "loglevel") == 0) {
+		admin_loglevel(&out, arg);
+	} else if (strcmp(cmd, "memory") == 0) {
+		admin_memory(&out);
+#ifdef WITH_PROFILER
+	} else if (strcmp(cmd, "profile") == 0) {
+		admin_profile(srv, &out, arg);
+#endif /* WITH_PROFILER */
+	} else if ((strcmp(cmd, "help") == 0) || (*cmd == '\0')) {
+		admin_printf(&out, "Commands:\n"
+			"  conns             List the connections being served\n"
+			"  cache [text]      List the cached objects with keys containing "
+			"text\n"
+			"  top [list]        Show the heaviest selectors by requests or "
+			"bytes, or clients\n"
+			"  flush <selector>  Remove the cached replies to a selector, or "
+			"everything with *\n"
+			"  warm <selector>   Render a selector to get it into the cache\n"
+			"  loglevel [level]  Show or set the log level (crit, error, "
+			"warning, notice, info)\n"
+			"  memory            Show how much memory each subsystem is "
+			"using\n");
+#ifdef WITH_PROFILER
+		admin_printf(&out, "  profile [s] [hz]  Profile the server for a "
+			"while and show the folded stacks\n");
+#endif /* WITH_PROFILER */
+	} else {
+		admin_printf(&out, "Unknown command '%s', try 'help'\n", cmd);
+	}
+
+	/* Send back whatever it had to say. */
+	used = 0;
+	while (srv->admin_running && (used < out.len)) {
+		len = send(sockfd, out.data + used, out.len - used, MSG_NOSIGNAL);
+		if (len <= 0)
+			break;
+		used += len;
+	}
+	buffer_free(&out);
+}
+
+/**
+ * Lists the connections that are currently being served.
+ *
+ * @param srv Server instance.
+ * @param out Buffer to write the output to.
+ */
+void admin_conns(amigos_t *srv, buffer_t *out) {
+	const conn_score_t *score;
+	char selector[ADMIN_SELECTOR_LEN];
+	char addr[INET6_ADDRSTRLEN];
+	unsigned int count;
+	uint8_t status;
+	uint8_t phase;
+	time_t now;
+	int i;
+
+	admin_printf(out, "%4s %-39s %-9s %6s %10s  %s\n", "SLOT", "CLIENT",
+		"PHASE", "AGE", "SENT", "SELECTOR");
+	now = time(NULL);
+	count = 0;
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		status = srv->connections[i].status;
+		if (!(status & CONN_INUSE) || (status & CONN_FINISHED))
+			continue;
+
+		/* Take a copy, since the connection keeps on going meanwhile. */
+		score = &srv->scores[i];
+		memcpy(addr, srv->connections[i].addr, INET6_ADDRSTRLEN);
+		addr[INET6_ADDRSTRLEN - 1] = '\0';
+		memcpy(selector, score->selector, ADMIN_SELECTOR_LEN);
+		selector[ADMIN_SELECTOR_LEN - 1] = '\0';
+		phase = score->phase;
+		if (phase > PHASE_CLOSE)
+			phase = PHASE_CLOSE;
+
+		admin_printf(out, "%4d %-39s %-9s %5lds %10lu  %s%s\n", i, addr,
+			conn_phases[phase], (long)(now - score->accepted),
+			(unsigned long)score->sent, (status & CONN_TLS) ? "[tls] " : "",
+			selector);
+		count++;
+	}
+	admin_printf(out, "%u connections\n", count);
+}
+
+/**
+ * Lists the objects in the content cache.
+ *
+ * @param srv    Server instance.
+ * @param out    Buffer to write the output to.
+ * @param filter Only list objects with keys containing this or everything if
+ *               it's empty.
+ */
+void admin_cache(amigos_t *srv, buffer_t *out, const char *filter) {
+	const cache_entry_t *entry;
+	cache_t *cache;
+	char key[256];
+	char ttl[16];
+	unsigned int count;
+	time_t now;
+	size_t i;
+
+	cache = &srv->content_cache;
+	admin_printf(out, "%10s %8s %4s  %s\n", "SIZE", "TTL", "REFS", "KEY");
+	now = time(NULL);
+	count = 0;
+	mutex_lock(&cache->lock);
+	for (entry = cache_next(cache, NULL); entry != NULL;
+			entry = cache_next(cache, entry)) {
+		if ((*filter != '\0') && (strstr(entry->key, filter) == NULL))
+			continue;
+
+		/* Make the key fit in a single line. */
+		strncpy(key, entry->key, sizeof(key) - 1);
+		key[sizeof(key) - 1] = '\0';
+		for (i = 0; key[i] != '\0'; i++) {
+			if ((key[i] == '\t') || (key[i] == '\r') || (key[i] == '\n'))
+				key[i] = ' ';
+		}
+
+		/* Check how fresh it is. */
+		if (now < entry->expires) {
+			sprintf(ttl, "%lds", (long)(entry->expires - now));
+		} else if (now < entry->stale) {
+			strcpy(ttl, "stale");
+		} else {
+			strcpy(ttl, "expired");
+		}
+
+		admin_printf(out, "%10lu %8s %4u  %s%s%s\n",
+			(unsigned long)entry->size, ttl, entry->refs,
+			(entry->flags & CACHE_WINDOW) ? "[window] " : "",
+			(entry->flags & CACHE_PINNED) ? "[pinned] " : "", key);
+		count++;
+	}
+	admin_printf(out, "%u of %u objects listed, using %lu of %lu bytes, %lu "
+		"in the window, %lu pinned\n", count, cache->count,
+		(unsigned long)cache->size, (unsigned long)cache->max_size,
+		(unsigned long)cache->window_size, (unsigned long)cache->pinned_size);
+	mutex_unlock(&cache->lock);
+
+#ifdef HAS_PREFORK
+	/* Objects shared with the other workers. */
+	if (cache->shared != NULL) {
+		uint32_t shared_count;
+		size_t shared_size;
+
+		shm_cache_usage(cache->shared, &shared_count, &shared_size);
+		admin_printf(out, "%u objects in the shared cache, using %lu of %lu "
+			"bytes\n", shared_count, (unsigned long)shared_size,
+			(unsigned long)CACHE_SHM_SIZE);
+	}
+#endif /* HAS_PREFORK */
+}
+
+/**
+ * Lists the heaviest selectors and clients.
+ *
+ * @param srv   Server instance.
+ * @param out   Buffer to write the output to.
+ * @param which List to show (requests, bytes or clients) or everything if it's
+ *              empty.
+ */
+void admin_top(amigos_t *srv, buffer_t *out, const char *which) {
+	uint64_t hot;
+	int all;
+
+	rcu_read_lock(srv, RCU_SLOT_ADMIN);
+	hot = ((const config_t*)atomic_get_ptr(&srv->config))->hot_requests;
+	rcu_read_unlock(srv, RCU_SLOT_ADMIN);
+
+	all = *which == '\0';
+	if (all || (strcmp(which, "requests") == 0))
+		admin_top_list(&srv->top_requests, out, "Selectors by requests", hot);
+	if (all || (strcmp(which, "bytes") == 0))
+		admin_top_list(&srv->top_bytes, out, "Selectors by bytes sent", 0);
+	if (all || (strcmp(which, "clients") == 0))
+		admin_top_list(&srv->top_clients, out, "Clients by bytes sent", 0);
+	if (out->len == 0) {
+		admin_printf(out, "Unknown list '%s', try requests, bytes or "
+			"clients\n", which);
+	}
+}
+
+/**
+ * Lists the heaviest items in a set of heavy hitters.
+ *
+ * @param hh    Set of heavy hitters.
+ * @param out   Buffer to write the output to.
+ * @param title Title of the list.
+ * @param hot   Guaranteed count from which the items are hot, or 0 if that
+ *              doesn't apply.
+ */
+void admin_top_list(hitters_t *hh, buffer_t *out, const char *title,
+					uint64_t hot) {
+	hitter_t items[HITTERS_SIZE];
+	unsigned int len;
+	unsigned int i;
+
+	len = hitters_snapshot(hh, items);
+	admin_printf(out, "%s:\n%14s %14s  %s\n", title, "COUNT", "ERROR", "KEY");
+	for (i = 0; (i < len) && (i < ADMIN_TOP_ITEMS); i++) {
+		admin_printf(out, "%14lu %14lu  %s%s\n",
+			(unsigned long)items[i].count, (unsigned long)items[i].error,
+			((hot > 0) && ((items[i].count - items[i].error) >= hot)) ?
+			"[hot] " : "", items[i].key);
+	}
+	admin_printf(out, "%u of %u tracked items listed\n\n", i, len);
+}
+
+/**
+ * Removes the cached replies to a selector from the content cache: the menu
+ * rendered for it, or the objects fetched for it from an upstream server.
+ *
+ * @param srv      Server instance.
+ * @param out      Buffer to write the output to.
+ * @param selector Selector to be flushed or * to flush everything.
+ */
+void admin_flush(amigos_t *srv, buffer_t *out, const char *selector) {
+	admin_flush_t flush;
+	const route_t *route;
+	const char *rpath;
+	char sel[256];
+	char aliases[2][256];
+	char *request;
+	char *key;
+	unsigned int count;
+
+	if (*selector == '\0') {
+		admin_printf(out, "Usage: flush <selector> | flush *\n");
+		return;
+	}
+
+	/* Figure out what to look for. */
+	flush.key = NULL;
+	flush.selector = NULL;
+	key = NULL;
+	if (strcmp(selector, "*") != 0) {
+		strncpy(sel, selector, sizeof(sel) - 1);
+		sel[sizeof(sel) - 1] = '\0';
+		path_sanitize(sel);
+		flush.selector = sel;
+
+		/* Proxied objects are cached under the request sent upstream. */
+		route = server_resolve(srv, sel, aliases, &rpath);
+		if ((route != NULL) && (route->kind == ROUTE_PROXY)) {
+			if (!proxy_request(route->upstream, rpath, NULL, &request, &key)) {
+				admin_printf(out, "Failed to build the cache key\n");
+				return;
+			}
+			mem_free(request);
+			flush.key = key;
+		}
+	}
+
+	count = cache_remove(&srv->content_cache, admin_flush_match, &flush);
+	admin_printf(out, "Flushed %u objects\n", count);
+	if (key != NULL)
+		mem_free(key);
+}
+
+/**
+ * Checks if a cached object has to be flushed.
+ *
+ * @param key Key of the cached object.
+ * @param len Length of the key.
+ * @param ctx What is being flushed.
+ *
+ * @return TRUE if the object has to be flushed, FALSE otherwise.
+ */
+int admin_flush_match(const char *key, size_t len, const void *ctx) {
+	const admin_flush_t *flush;
+	const char *last;
+	const char *sel;
+	size_t klen;
+
+	flush = (const admin_flush_t*)ctx;
+	if (flush->selector == NULL)
+		return 1;
+
+	/* Proxied object, including searches sent to it. */
+	if (flush->key != NULL) {
+		klen = strlen(flush->key);
+		return (len >= klen) && (memcmp(key, flush->key, klen) == 0) &&
+			((len == klen) || (key[klen] == '\t'));
+	}
+
+	/* Rendered menus end with their selector, which clients may or may not
+	 * have started with a separator. */
+	if ((len < 5) || (memcmp(key, "menu\t", 5) != 0))
+		return 0;
+	for (last = key + len; (last > key) && (*(last - 1) != '\t'); last--)
+		;
+	while ((last < (key + len)) && (*last == '/'))
+		last++;
+	sel = flush->selector;
+	while (*sel == '/')
+		sel++;
+	klen = strlen(sel);
+	return ((size_t)((key + len) - last) == klen) &&
+		(memcmp(last, sel, klen) == 0);
+}
+
+/**
+ * Renders a selector without sending it anywhere, just so that it ends up in
+ * the content cache.
+ *
+ * @param srv      Server instance.
+ * @param out      Buffer to write the output to.
+ * @param selector Selector to be rendered.
+ */
+void admin_warm(amigos_t *srv, buffer_t *out, const char *selector) {
+	buffer_t buf;
+	int ret;
+
+	buffer_init(&buf, MEM_SERVER);
+	ret = server_render(srv, RCU_SLOT_ADMIN, selector, &buf);
+	if (ret < 0) {
+		admin_printf(out, "Selector '%s' not found\n", selector);
+	} else if (ret) {
+		admin_printf(out, "Rendered %lu bytes for '%s'\n",
+			(unsigned long)buf.len, selector);
+	} else {
+		admin_printf(out, "Failed to render '%s'\n", selector);
+	}
+	buffer_free(&buf);
+}
+
+/**
+ * Shows or changes the level of the messages that get logged.
+ *
+ * @param out   Buffer to write the output to.
+ * @param level Name of the new log level or an empty string to show it.
+ */
+void admin_loglevel(buffer_t *out, const char *level) {
+	static const char *names[] = {
+		"crit", "error", "warning", "notice", "info"
+	};
+	int i;
+
+	if (*level != '\0') {
+		for (i = LOG_CRIT; i <= LOG_INFO; i++) {
+			if (strcmp(level, names[i]) == 0)
+				break;
+		}
+		if (i > LOG_INFO) {
+			admin_printf(out, "Unknown log level '%s'\n", level);
+			return;
+		}
+		log_level = (log_level_t)i;
+	}
+
+	admin_printf(out, "Log level is %s\n", names[log_level]);
+}
+
+/**
+ * Shows how much memory each subsystem of the process has allocated.
+ *
+ * @param out Buffer to write the output to.
+ */
+void admin_memory(buffer_t *out) {
+	const mem_account_t *acct;
+	uint64_t limit;
+	uint64_t bytes;
+	uint64_t count;
+	char str[24];
+	int i;
+
+	admin_printf(out, "%-12s %12s %12s %10s %12s %8s\n", "SUBSYSTEM", "BYTES",
+		"PEAK", "ALLOCS", "LIMIT", "FAILED");
+	bytes = 0;
+	count = 0;
+	for (i = 0; i < MEM_TAGS; i++) {
+		acct = &mem_accounts[i];
+		limit = atomic_get_u64(&acct->limit);
+		if (limit > 0) {
+			sprintf(str, "%lu", (unsigned long)limit);
+		} else {
+			strcpy(str, "-");
+		}
+
+		admin_printf(out, "%-12s %12lu %12lu %10lu %12s %8lu\n",
+			mem_tag_names[i], (unsigned long)atomic_get_u64(&acct->bytes),
+			(unsigned long)atomic_get_u64(&acct->peak),
+			(unsigned long)atomic_get_u64(&acct->count), str,
+			(unsigned long)atomic_get_u64(&acct->failed));
+		bytes += atomic_get_u64(&acct->bytes);
+		count += atomic_get_u64(&acct->count);
+	}
+	admin_printf(out, "%-12s %12lu %12s %10lu\n", "total",
+		(unsigned long)bytes, "", (unsigned long)count);
+}
+
+#ifdef WITH_PROFILER
+/**
+ * Profiles the server for a while and shows the stacks that were sampled.
+ *
+ * @param srv  Server instance.
+ * @param out  Buffer to write the output to.
+ * @param args Number of seconds to profile for and how many samples to take
+ *             each second, or an empty string for the defaults.
+ */
+void admin_profile(amigos_t *srv, buffer_t *out, const char *args) {
+	unsigned int seconds;
+	unsigned int hz;
+	unsigned int i;
+
+	seconds = PROFILER_SECONDS;
+	hz = PROFILER_HZ;
+	sscanf(args, "%u %u", &seconds, &hz);
+	if ((seconds == 0) || (seconds > PROFILER_MAX_SECONDS) || (hz == 0) ||
+			(hz > 1000)) {
+		admin_printf(out, "Profiles last 1 to %d seconds at 1 to 1000 Hz\n",
+			PROFILER_MAX_SECONDS);
+		return;
+	}
+
+	if (!profiler_start(srv, hz)) {
+		admin_printf(out, "Failed to start the profiler, see the log\n");
+		return;
+	}
+	for (i = 0; (i < (seconds * 10)) && srv->admin_running; i++)
+		thread_sleep(100);
+	profiler_stop(out);
+}
+#endif /* WITH_PROFILER */
+
+/**
+ * Appends formatted text to the output of an admin command.
+ *
+ * @param out    Buffer to write the output to.
+ * @param format Format of the text.
+ * @param ...    Additional variables to be populated.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int admin_printf(buffer_t *out, const char *format, ...) {
+	char line[LOG_MAX_LEN];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (len < 0)
+		return 0;
+	if ((size_t)len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	return buffer_append(out, line, (size_t)len);
+}
+#endif /* HAS_UNIX_SOCKETS */
+
+/**
+ * =============================================================================
+ * === Cache Warm-up ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Starts warming up the caches in the background with the selectors listed in
+ * a file, while the server is already serving requests.
+ *
+ * @param srv   Server instance.
+ * @param fname Path of the manifest or log file listing the selectors.
+ *
+ * @return TRUE if the warm-up has started, FALSE otherwise.
+ *
+ * @see warmup_stop
+ */
+int warmup_init(amigos_t *srv, const char *fname) {
+	unsigned int nthreads;
+	unsigned int i;
+
+	/* Get the selectors, hottest first. */
+	if (!warmup_load(srv, fname) || (srv->warmup_len == 0))
+		return 0;
+	qsort(srv->warmup_items, srv->warmup_len, sizeof(warmup_item_t),
+		warmup_item_cmp);
+	log_printf(LOG_INFO, "Warming up the caches with %u selectors from %s",
+		srv->warmup_len, fname);
+
+	/* Render them in parallel. */
+	srv->warmup_next = 0;
+	srv->warmup_done = 0;
+	srv->warmup_failed = 0;
+	srv->warmup_reported = 0;
+	srv->warmup_started = clock_usec();
+	srv->warmup_running = 1;
+	nthreads = 0;
+	for (i = 0; i < WARMUP_THREADS; i++) {
+		srv->warmup_workers[i].srv = srv;
+		srv->warmup_workers[i].slot = RCU_SLOT_WARMUP + i;
+		if (!thread_create(&srv->warmup_workers[i].thread,
+				warmup_thread_func, &srv->warmup_workers[i])) {
+			log_printf(LOG_ERROR, "Failed to create warm-up thread");
+			srv->warmup_workers[i].thread = INVALID_THREAD;
+			continue;
+		}
+		nthreads++;
+	}
+
+	return nthreads > 0;
+}
+
+/**
+ * Stops the warm-up threads, if they're still going, and frees up the list
+ * of selectors.
+ *
+ * @param srv Server instance.
+ */
+void warmup_stop(amigos_t *srv) {
+	unsigned int i;
+
+	srv->warmup_running = 0;
+	for (i = 0; i < WARMUP_THREADS; i++) {
+		if (srv->warmup_workers[i].thread != INVALID_THREAD)
+			thread_join(srv->warmup_workers[i].thread);
+		srv->warmup_workers[i].thread = INVALID_THREAD;
+	}
+
+	if (srv->warmup_items != NULL) {
+		for (i = 0; i < srv->warmup_len; i++)
+			mem_free(srv->warmup_items[i].selector);
+		mem_free(srv->warmup_items);
+	}
+	srv->warmup_items = NULL;
+	srv->warmup_len = 0;
+}
+
+/**
+ * Warm-up thread. Renders selectors from the list until there are none left.
+ *
+ * @param data Warm-up worker object.
+ */
+thread_ret warmup_thread_func(void *data) {
+	warmup_worker_t *worker;
+	amigos_t *srv;
+	const char *selector;
+	buffer_t buf;
+
+	worker = (warmup_worker_t*)data;
+	srv = worker->srv;
+	while (srv->warmup_running) {
+		/* Grab the next selector. */
+		mutex_lock(&srv->warmup_lock);
+		if (srv->warmup_next >= srv->warmup_len) {
+			mutex_unlock(&srv->warmup_lock);
+			break;
+		}
+		selector = srv->warmup_items[srv->warmup_next++].selector;
+		mutex_unlock(&srv->warmup_lock);
+
+		/* Render it and throw the result away, it's in the caches now. */
+		buffer_init(&buf, MEM_SERVER);
+		warmup_progress(srv, server_render(srv, worker->slot, selector,
+			&buf) > 0);
+		buffer_free(&buf);
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Loads the selectors to be warmed up from a file, which can either be a
+ * manifest with a selector per line, or the server's own log, in which case
+ * only its tail is looked at. Selectors are counted every time they show up.
+ *
+ * @param srv   Server instance.
+ * @param fname Path of the file.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int warmup_load(amigos_t *srv, const char *fname) {
+	static const char marker[] = "requested selector '";
+	char line[LOG_MAX_LEN];
+	char *selector;
+	char *end;
+	FILE *fh;
+	long size;
+
+	/* Open the file and skip to its tail. */
+	fh = fopen(fname, "r");
+	if (fh == NULL) {
+		log_syserr(LOG_ERROR, "Failed to open warm-up file %s", fname);
+		return 0;
+	}
+	if ((fseek(fh, 0, SEEK_END) == 0) && ((size = ftell(fh)) >= 0) &&
+			(size > WARMUP_TAIL_SIZE)) {
+		fseek(fh, size - WARMUP_TAIL_SIZE, SEEK_SET);
+		fgets(line, sizeof(line), fh);  /* Most likely a partial line. */
+	} else {
+		rewind(fh);
+	}
+
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		/* Log lines start with a timestamp followed by the level. */
+		if (isdigit((unsigned char)*line) && (strstr(line, "Z [") != NULL)) {
+			selector = strstr(line, marker);
+			if (selector == NULL)
+				continue;
+			selector += sizeof(marker) - 1;
+			end = strrchr(selector, '\'');
+			if (end == NULL)
+				continue;
+			*end = '\0';
+		} else if ((*line == '#') || (*line == '\0')) {
+			continue;
+		} else {
+			selector = line;
+		}
+
+		if (!warmup_add(srv, selector))
+			break;
+	}
+
+	fclose(fh);
+	return 1;
+}
+
+/**
+ * Adds a selector to the warm-up list, or counts it once more if it's already
+ * there.
+ *
+ * @param srv      Server instance.
+ * @param selector Selector to be added.
+ *
+ * @return FALSE if the list can't take any more selectors, TRUE otherwise.
+ */
+int warmup_add(amigos_t *srv, const char *selector) {
+	warmup_item_t *item;
+	uint32_t hash;
+	uint32_t i;
+
+	/* Count it again if we've seen it before. */
+	hash = search_hash(selector);
+	for (i = 0; i < srv->warmup_len; i++) {
+		item = &srv->warmup_items[i];
+		if ((item->hash == hash) && (strcmp(item->selector, selector) == 0)) {
+			item->count++;
+			return 1;
+		}
+	}
+	if (srv->warmup_len >= WARMUP_MAX_SELECTORS)
+		return 1;
+
+	/* Append it to the list. */
+	if ((srv->warmup_len % 64) == 0) {
+		item = (warmup_item_t*)mem_realloc(MEM_SERVER, srv->warmup_items,
+			(srv->warmup_len + 64) * sizeof(warmup_item_t));
+		if (item == NULL) {
+			log_syserr(LOG_ERROR, "Failed to grow the warm-up list");
+			return 0;
+		}
+		srv->warmup_items = item;
+	}
+	item = &srv->warmup_items[srv->warmup_len];
+	item->selector = mem_strdup(MEM_SERVER, selector);
+	if (item->selector == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate warm-up selector");
+		return 0;
+	}
+	item->hash = hash;
+	item->count = 1;
+	item->order = srv->warmup_len++;
+
+	return 1;
+}
+
+/**
+ * Accounts for a selector that has been warmed up, logging the progress every
+ * tenth of the way and once it's over.
+ *
+ * @param srv Server instance.
+ * @param ok  Whether the selector was rendered successfully.
+ */
+void warmup_progress(amigos_t *srv, int ok) {
+	uint32_t tenths;
+
+	mutex_lock(&srv->warmup_lock);
+	srv->warmup_done++;
+	if (!ok)
+		srv->warmup_failed++;
+
+	tenths = (srv->warmup_done * 10) / srv->warmup_len;
+	if (srv->warmup_done == srv->warmup_len) {
+		log_printf(LOG_INFO, "Warm-up finished in %.2fs: %u selectors, %u "
+			"failed", (double)(clock_usec() - srv->warmup_started) / 1000000,
+			srv->warmup_len, srv->warmup_failed);
+	} else if (tenths > srv->warmup_reported) {
+		log_printf(LOG_INFO, "Warm-up %u%% done (%u of %u selectors)",
+			tenths * 10, srv->warmup_done, srv->warmup_len);
+	}
+	srv->warmup_reported = tenths;
+	mutex_unlock(&srv->warmup_lock);
+}
+
+/**
+ * Compares two warm-up selectors for qsort, the most listed ones first and
+ * then in the order they were listed.
+ */
+int warmup_item_cmp(const void *a, const void *b) {
+	const warmup_item_t *wa = (const warmup_item_t*)a;
+	const warmup_item_t *wb = (const warmup_item_t*)b;
+
+	if (wa->count != wb->count)
+		return (wa->count > wb->count) ? -1 : 1;
+	return (wa->order < wb->order) ? -1 : 1;
+}
+
+/**
+ * =============================================================================
+ * === Caching Proxy ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Initializes the caching proxy and starts the thread that revalidates stale
+ * objects in the background.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int proxy_init(amigos_t *srv) {
+	srv->proxy_jobs = NULL;
+	srv->proxy_thread = INVALID_THREAD;
+	mutex_init(&srv->proxy_lock);
+
+	/* Start the revalidation thread. */
+	srv->proxy_running = 1;
+	if (!thread_create(&srv->proxy_thread, proxy_thread_func, srv)) {
+		log_printf(LOG_ERROR, "Failed to create proxy revalidation thread");
+		srv->proxy_running = 0;
+		srv->proxy_thread = INVALID_THREAD;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Stops the revalidation thread and drops any pending revalidations.
+ *
+ * @param srv Server instance.
+ */
+void proxy_stop(amigos_t *srv) {
+	proxy_job_t *job;
+
+	/* Wait for the revalidation thread to finish. */
+	srv->proxy_running = 0;
+	if (srv->proxy_thread != INVALID_THREAD)
+		thread_join(srv->proxy_thread);
+	srv->proxy_thread = INVALID_THREAD;
+
+	/* Drop pending revalidations. */
+	while (srv->proxy_jobs != NULL) {
+		job = srv->proxy_jobs;
+		srv->proxy_jobs = job->next;
+		cache_end_refresh(&srv->content_cache, job->entry);
+		mem_free(job->request);
+		mem_free(job->key);
+		mem_free(job);
+	}
+	mutex_destroy(&srv->proxy_lock);
+}
+
+/**
+ * Proxy revalidation thread. Fetches fresh copies of stale objects that have
+ * been served from the cache.
+ *
+ * @param data Server instance.
+ */
+thread_ret proxy_thread_func(void *data) {
+	amigos_t *srv;
+	proxy_job_t *job;
+	buffer_t buf;
+	int streamed;
+
+	srv = (amigos_t*)data;
+	while (srv->proxy_running) {
+		/* Grab the next revalidation. */
+		mutex_lock(&srv->proxy_lock);
+		job = srv->proxy_jobs;
+		if (job != NULL)
+			srv->proxy_jobs = job->next;
+		mutex_unlock(&srv->proxy_lock);
+		if (job == NULL) {
+			thread_sleep(100);
+			continue;
+		}
+
+		/* Fetch a fresh copy and replace the stale one with it. */
+		buffer_init(&buf, MEM_PROXY);
+		if (proxy_acquire(srv, job->upstream)) {
+			if (proxy_fetch(job->upstream, job->request, &buf, NULL,
+					&streamed)) {
+				cache_entry_t *entry;
+
+				entry = cache_put(&srv->content_cache, job->key, buf.data,
+					buf.len, PROXY_CACHE_TTL, PROXY_STALE_TTL,
+					proxy_is_menu(buf.data, buf.len) ? CACHE_MENU : 0);
+				if (entry != NULL) {
+					buffer_init(&buf, MEM_PROXY);
+					cache_release(&srv->content_cache, entry);
+				}
+			}
+			proxy_release(srv, job->upstream);
+		}
+		buffer_free(&buf);
+
+		/* Let the stale object be revalidated again if we failed. */
+		cache_end_refresh(&srv->content_cache, job->entry);
+		mem_free(job->request);
+		mem_free(job->key);
+		mem_free(job);
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Allocates a brand new upstream server object from a route argument in the
+ * form host[:port][/selector].
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param arg Upstream server definition.
+ *
+ * @return Allocated upstream server object or NULL if an error occurred.
+ *
+ * @see upstream_free
+ */
+upstream_t* upstream_new(const char *arg) {
+	upstream_t *upstream;
+	const char *cur;
+	char *end;
+	size_t len;
+	long port;
+
+	/* Try to allocate our upstream object. */
+	upstream = (upstream_t*)mem_calloc(MEM_PROXY, 1, sizeof(upstream_t));
+	if (upstream == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate upstream server");
+		return NULL;
+	}
+
+	/* Hostname. */
+	if (strncmp(arg, "gopher://", 9) == 0)
+		arg += 9;
+	len = strcspn(arg, ":/");
+	if (len == 0) {
+		log_printf(LOG_ERROR, "Upstream server '%s' has no hostname", arg);
+		upstream_free(upstream);
+		return NULL;
+	}
+	upstream->host = (char*)mem_alloc(MEM_PROXY, len + 1);
+	if (upstream->host == NULL)
+		goto nomem;
+	memcpy(upstream->host, arg, len);
+	upstream->host[len] = '\0';
+	cur = arg + len;
+
+	/* Port. */
+	if (*cur == ':') {
+		cur++;
+		port = strtol(cur, &end, 10);
+		if (!isdigit((unsigned char)*cur) ||
+				((*end != '\0') && (*end != '/')) ||
+				(port < 1) || (port > 65535)) {
+			log_printf(LOG_ERROR, "Upstream server '%s' has a missing or "
+				"invalid port", arg);
+			upstream_free(upstream);
+			return NULL;
+		}
+		len = (size_t)(end - cur);
+		upstream->port = (char*)mem_alloc(MEM_PROXY, len + 1);
+		if (upstream->port == NULL)
+			goto nomem;
+		memcpy(upstream->port, cur, len);
+		upstream->port[len] = '\0';
+		cur += len;
+	} else {
+		upstream->port = mem_strdup(MEM_PROXY, "70");
+		if (upstream->port == NULL)
+			goto nomem;
+	}
+
+	/* Base selector. */
+	if (*cur == '/')
+		cur++;
+	upstream->selector = mem_strdup(MEM_PROXY, cur);
+	if (upstream->selector == NULL)
+		goto nomem;
+
+	return upstream;
+
+nomem:
+	log_syserr(LOG_ERROR, "Failed to allocate upstream server '%s'", arg);
+	upstream_free(upstream);
+	return NULL;
+}
+
+/**
+ * Frees up an upstream server object.
+ *
+ * @param upstream Upstream server to be free'd.
+ *
+ * @see upstream_new
+ */
+void upstream_free(upstream_t *upstream) {
+	if (upstream->host != NULL)
+		mem_free(upstream->host);
+	if (upstream->port != NULL)
+		mem_free(upstream->port);
+	if (upstream->selector != NULL)
+		mem_free(upstream->selector);
+	mem_free(upstream);
+}
+
+/**
+ * Builds the request line to be sent to an upstream server and the key used to
+ * cache its reply.
+ *
+ * @warning This function allocates memory that must be free'd by the caller.
+ *
+ * @param upstream Upstream server.
+ * @param path     Part of the selector after the route's prefix.
+ * @param query    Search string sent by the client or NULL.
+ * @param request  Pointer to where the request line will be stored.
+ * @param key      Pointer to where the cache key will be stored.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int proxy_request(const upstream_t *upstream, const char *path,
+				  const char *query, char **request, char **key) {
+	const char *sep;
+	size_t len;
+
+	/* Join the base selector with the requested path. */
+	sep = "";
+	len = strlen(upstream->selector);
+	if ((len > 0) && (*path != '\0') && (upstream->selector[len - 1] != '/'))
+		sep = "/";
+	len += strlen(path) + 2 + ((query == NULL) ? 0 : strlen(query));
+	*request = (char*)mem_alloc(MEM_PROXY, len + 1);
+	if (*request == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate upstream request");
+		return 0;
+	}
+	sprintf(*request, "%s%s%s%s%s", upstream->selector, sep, path,
+		(query == NULL) ? "" : "\t", (query == NULL) ? "" : query);
+
+	/* Objects are cached by upstream server and request. */
+	len += strlen(upstream->host) + strlen(upstream->port) + 2;
+	*key = (char*)mem_alloc(MEM_PROXY, len + 1);
+	if (*key == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate cache key");
+		mem_free(*request);
+		*request = NULL;
+		return 0;
+	}
+	sprintf(*key, "%s:%s\t%s", upstream->host, upstream->port, *request);
+
+	return 1;
+}
+
+/**
+ * Reserves a connection to an upstream server, respecting its connection
+ * limit.
+ *
+ * @param srv      Server instance.
+ * @param upstream Upstream server.
+ *
+ * @return TRUE if a connection can be made, FALSE if the limit was reached.
+ *
+ * @see proxy_release
+ */
+int proxy_acquire(amigos_t *srv, upstream_t *upstream) {
+	int ret;
+
+	mutex_lock(&srv->proxy_lock);
+	ret = upstream->nconns < PROXY_MAX_CONNS;
+	if (ret)
+		upstream->nconns++;
+	mutex_unlock(&srv->proxy_lock);
+
+	return ret;
+}
+
+/**
+ * Releases a connection reserved to an upstream server.
+ *
+ * @param srv      Server instance.
+ * @param upstream Upstream server.
+ *
+ * @see proxy_acquire
+ */
+void proxy_release(amigos_t *srv, upstream_t *upstream) {
+	mutex_lock(&srv->proxy_lock);
+	upstream->nconns--;
+	mutex_unlock(&srv->proxy_lock);
+}
+
+/**
+ * Fetches an object from an upstream server. Objects that are too large to be
+ * cached are streamed directly to the client, if there's one.
+ *
+ * @param upstream Upstream server.
+ * @param request  Request line without the terminating CRLF.
+ * @param buf      Buffer where the object will be stored.
+ * @param conn     Client connection to stream large objects to or NULL.
+ * @param streamed Pointer to a flag that's set if data was sent to the client.
+ *
+ * @return TRUE if the whole object was received, FALSE otherwise.
+ */
+int proxy_fetch(const upstream_t *upstream, const char *request,
+				buffer_t *buf, const client_conn_t *conn, int *streamed) {
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct addrinfo *ai;
+	struct timeval tv;
+	sockfd_t sockfd;
+	char chunk[4096];
+	const char *cur;
+	size_t left;
+	ssize_t len;
+#ifdef SO_NOSIGPIPE
+	int flag;
+#endif /* SO_NOSIGPIPE */
+	int ret;
+
+	/* Resolve the upstream server. */
+	*streamed = 0;
+	memset(&hints, '\0', sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((ret = getaddrinfo(upstream->host, upstream->port, &hints, &res)) != 0) {
+		log_printf(LOG_ERROR, "Failed to resolve upstream %s: %s",
+			upstream->host, gai_strerror(ret));
+		return 0;
+	}
+
+	/* Connect to it. */
+	tv.tv_sec = PROXY_TIMEOUT;
+	tv.tv_usec = 0;
+	sockfd = SOCKERR;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sockfd == SOCKERR)
+			continue;
+#ifdef _WIN32
+		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv,
+			sizeof(tv));
+		setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (const char*)&tv,
+			sizeof(tv));
+#else
+		setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif /* _WIN32 */
+#ifdef SO_NOSIGPIPE
+		flag = 1;
+		setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &flag, sizeof(flag));
+#endif /* SO_NOSIGPIPE */
+		if (connect(sockfd, ai->ai_addr, ai->ai_addrlen) != SOCKERR)
+			break;
+
+		sockclose(sockfd);
+		sockfd = SOCKERR;
+	}
+	freeaddrinfo(res);
+	if (sockfd == SOCKERR) {
+		log_sockerr(LOG_ERROR, "Failed to connect to upstream %s:%s",
+			upstream->host, upstream->port);
+		return 0;
+	}
+
+	/* Send the request. */
+	ret = 0;
+	cur = request;
+	left = strlen(request);
+	while (left > 0) {
+		len = send(sockfd, cur, left, MSG_NOSIGNAL);
+		if (len < 0) {
+			log_sockerr(LOG_ERROR, "Failed to send request to upstream %s:%s",
+				upstream->host, upstream->port);
+			goto close_sock;
+		}
+
+		cur += len;
+		left -= len;
+	}
+	if (send(sockfd, "\r\n", 2, MSG_NOSIGNAL) != 2) {
+		log_sockerr(LOG_ERROR, "Failed to send request to upstream %s:%s",
+			upstream->host, upstream->port);
+		goto close_sock;
+	}
+
+	/* Receive the object until the upstream server closes the connection. */
+	while ((len = recv(sockfd, chunk, sizeof(chunk), 0)) > 0) {
+		/* Stream objects that are too large to be cached. */
+		if (*streamed) {
+			if (!client_send_raw(conn, chunk, len))
+				goto close_sock;
+			continue;
+		}
+
+		if (!buffer_append(buf, chunk, len))
+			goto close_sock;
+		if (buf->len > PROXY_MAX_OBJECT_SIZE) {
+			if (conn == NULL) {
+				log_printf(LOG_WARNING, "Object '%s' from upstream %s:%s is "
+					"too large to be cached", request, upstream->host,
+					upstream->port);
+				goto close_sock;
+			}
+
+			*streamed = 1;
+			if (!client_send_raw(conn, buf->data, buf->len))
+				goto close_sock;
+			buf->len = 0;
+		}
+	}
+	if (len < 0) {
+		log_sockerr(LOG_ERROR, "Failed to receive from upstream %s:%s",
+			upstream->host, upstream->port);
+		goto close_sock;
+	}
+	ret = 1;
+
+close_sock:
+	sockclose(sockfd);
+	return ret;
+}
+
+/**
+ * Queues a stale cached object to be revalidated in the background, unless
+ * it's already being revalidated.
+ *
+ * @param srv      Server instance.
+ * @param upstream Upstream server.
+ * @param request  Request line of the object.
+ * @param key      Cache key of the object.
+ * @param entry    Stale cached object.
+ */
+void proxy_refresh(amigos_t *srv, upstream_t *upstream, const char *request,
+				   const char *key, cache_entry_t *entry) {
+	proxy_job_t *job;
+
+	/* Only a single revalidation at a time. */
+	if (!srv->proxy_running || !cache_claim_refresh(&srv->content_cache, entry))
+		return;
+
+	/* Build up the job. */
+	job = (proxy_job_t*)mem_alloc(MEM_PROXY, sizeof(proxy_job_t));
+	if (job == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate proxy revalidation");
+		cache_end_refresh(&srv->content_cache, entry);
+		return;
+	}
+	job->upstream = upstream;
+	job->request = mem_strdup(MEM_PROXY, request);
+	job->key = mem_strdup(MEM_PROXY, key);
+	job->entry = entry;
+	if ((job->request == NULL) || (job->key == NULL)) {
+		log_syserr(LOG_ERROR, "Failed to allocate proxy revalidation");
+		if (job->request != NULL)
+			mem_free(job->request);
+		if (job->key != NULL)
+			mem_free(job->key);
+		mem_free(job);
+		cache_end_refresh(&srv->content_cache, entry);
+		return;
+	}
+
+	/* Queue it up. */
+	mutex_lock(&srv->proxy_lock);
+	job->next = srv->proxy_jobs;
+	srv->proxy_jobs = job;
+	mutex_unlock(&srv->proxy_lock);
+}
+
+/**
+ * Sends a proxied object to the client. Menu items that point to the upstream
+ * server are rewritten to point to us instead.
+ *
+ * @param conn  Client connection object.
+ * @param route Proxy route that handled the request.
+ * @param data  Contents of the object.
+ * @param size  Size of the contents in bytes.
+ * @param menu  Is the object a menu?
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int proxy_send(const client_conn_t *conn, const route_t *route,
+			   const char *data, size_t size, int menu) {
+	const upstream_t *upstream;
+	const char *end;
+	buffer_t buf;
+	char port[6];
+	size_t baselen;
+	int ret;
+
+	/* Only menus need to be rewritten. */
+	if (!menu)
+		return client_send_raw(conn, data, size);
+
+	/* Go through the menu line by line. */
+	upstream = route->upstream;
+	baselen = strlen(upstream->selector);
+	snprintf(port, 6, "%u", conn->config->port);
+	buffer_init(&buf, MEM_PROXY);
+	end = data + size;
+	ret = 1;
+	while (ret && (data < end)) {
+		const char *fields[4];
+		const char *eol;
+		const char *sel;
+		size_t lens[4];
+		int i;
+
+		/* Split the item into its fields. */
+		eol = (const char*)memchr(data, '\n', end - data);
+		eol = (eol == NULL) ? end : (eol + 1);
+		fields[0] = data;
+		for (i = 0; i < 4; i++) {
+			if (i > 0)
+				fields[i] = fields[i - 1] + lens[i - 1] + 1;
+			lens[i] = 0;
+			while (((fields[i] + lens[i]) < eol) &&
+					(strchr("\t\r\n", fields[i][lens[i]]) == NULL)) {
+				lens[i]++;
+			}
+			if ((i < 3) && (fields[i][lens[i]] != '\t'))
+				break;
+		}
+
+		/* Leave items that don't point to the upstream server alone. */
+		sel = fields[1];
+		if ((i < 3) || (lens[2] != strlen(upstream->host)) ||
+				(strncmp(fields[2], upstream->host, lens[2]) != 0) ||
+				(lens[3] != strlen(upstream->port)) ||
+				(strncmp(fields[3], upstream->port, lens[3]) != 0) ||
+				(lens[1] < baselen) ||
+				(strncmp(sel, upstream->selector, baselen) != 0)) {
+			ret = buffer_append(&buf, data, eol - data);
+			data = eol;
+			continue;
+		}
+
+		/* Replace the base selector with our prefix. */
+		sel += baselen;
+		while ((sel < (fields[1] + lens[1])) && (*sel == '/'))
+			sel++;
+		ret = buffer_append(&buf, fields[0], lens[0] + 1) &&
+			buffer_append(&buf, route->target, strlen(route->target)) &&
+			(((*route->target == '\0') || (sel == (fields[1] + lens[1]))) ||
+				buffer_append(&buf, "/", 1)) &&
+			buffer_append(&buf, sel, (fields[1] + lens[1]) - sel) &&
+			buffer_append(&buf, "\t", 1) &&
+			buffer_append(&buf, conn->config->hostname,
+				strlen(conn->config->hostname)) &&
+			buffer_append(&buf, "\t", 1) &&
+			buffer_append(&buf, port, strlen(port)) &&
+			buffer_append(&buf, fields[3] + lens[3],
+				eol - (fields[3] + lens[3]));
+		data = eol;
+	}
+
+	/* Send the rewritten menu. */
+	if (ret && (buf.len > 0))
+		ret = client_send_raw(conn, buf.data, buf.len);
+	buffer_free(&buf);
+
+	return ret;
+}
+
+/**
+ * Checks if an object fetched from an upstream server looks like a menu, since
+ * Gopher servers don't tell us what they are sending.
+ *
+ * @param data Contents of the object.
+ * @param size Size of the contents in bytes.
+ *
+ * @return TRUE if every line is a menu item and it's properly terminated.
+ */
+int proxy_is_menu(const char *data, size_t size) {
+	const char *end;
+	int tabs;
+
+	/* Menus are always terminated by a lone period. */
+	if ((data == NULL) || (size == 0))
+		return 0;
+	end = data + size;
+	if (*(end - 1) == '\n')
+		end--;
+	if ((end > data) && (*(end - 1) == '\r'))
+		end--;
+	if ((end == data) || (*(end - 1) != '.') ||
+			(((end - 1) != data) && (*(end - 2) != '\n'))) {
+		return 0;
+	}
+	end--;
+
+	/* Every other line must have at least a selector, host, and port. */
+	tabs = 0;
+	while (data < end) {
+		if (*data == '\t') {
+			tabs++;
+		} else if (*data == '\n') {
+			if (tabs < 3)
+				return 0;
+			tabs = 0;
+		}
+
+		data++;
+	}
+
+	return 1;
+}
+
+/**
+ * =============================================================================
+ * === Full-Text Search ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Initializes the full-text search subsystem and starts building the index of
+ * the document root in the background.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_init(amigos_t *srv) {
+	srv->search_index = NULL;
+	srv->search_thread = INVALID_THREAD;
+	mutex_init(&srv->search_lock);
+
+	/* Start the indexing thread. */
+	srv->search_running = 1;
+	if (!thread_create(&srv->search_thread, search_thread_func, srv)) {
+		log_printf(LOG_ERROR, "Failed to create search indexing thread");
+		srv->search_running = 0;
+		srv->search_thread = INVALID_THREAD;
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Stops the search indexing thread and frees up the index.
+ *
+ * @param srv Server instance.
+ */
+void search_stop(amigos_t *srv) {
+	/* Wait for the indexing thread to finish. */
+	srv->search_running = 0;
+	if (srv->search_thread != INVALID_THREAD)
+		thread_join(srv->search_thread);
+	srv->search_thread = INVALID_THREAD;
+
+	/* Free up the index. */
+	if (srv->search_index != NULL)
+		search_index_free(srv->search_index);
+	srv->search_index = NULL;
+	mutex_destroy(&srv->search_lock);
+}
+
+/**
+ * Search indexing thread. Builds the initial index and periodically rescans the
+ * document root for changes.
+ *
+ * @param data Server instance.
+ */
+thread_ret search_thread_func(void *data) {
+	amigos_t *srv;
+	search_index_t *index;
+	unsigned int elapsed;
+
+	srv = (amigos_t*)data;
+
+	/* Build the initial index. */
+	index = search_build(srv);
+	if (index != NULL) {
+		log_printf(LOG_INFO, "Search index built with %u documents and %u "
+			"terms", index->ndocs, index->nterms);
+		mutex_lock(&srv->search_lock);
+		srv->search_index = index;
+		mutex_unlock(&srv->search_lock);
+	}
+
+	/* Keep the index up to date. */
+	elapsed = 0;
+	while (srv->search_running) {
+		thread_sleep(250);
+		elapsed += 250;
+		if (elapsed < (SEARCH_RESCAN_INTERVAL * 1000))
+			continue;
+
+		elapsed = 0;
+		search_rescan(srv);
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Builds a brand new index of the document root.
+ *
+ * @param srv Server instance.
+ *
+ * @return Newly built index or NULL if an error occurred.
+ */
+search_index_t* search_build(amigos_t *srv) {
+	search_index_t *index;
+
+	/* Gather all of the documents that can be indexed. */
+	index = search_index_new();
+	if (index == NULL)
+		return NULL;
+	rcu_read_lock(srv, RCU_SLOT_SEARCH);
+	if (!search_walk(srv, index, srv->docroot, "", 0)) {
+		rcu_read_unlock(srv, RCU_SLOT_SEARCH);
+		search_index_free(index);
+		return NULL;
+	}
+	rcu_read_unlock(srv, RCU_SLOT_SEARCH);
+	qsort(index->docs, index->ndocs, sizeof(search_doc_t), search_doc_cmp);
+
+	/* Tokenize the documents. */
+	if (!search_tokenize_docs(index, index->docs, index->ndocs, 0)) {
+		search_index_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+/**
+ * Rescans the document root and incrementally updates the index with the
+ * documents that have been added, changed, or removed since the last scan.
+ *
+ * @warning Must only be called from the search indexing thread.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_rescan(amigos_t *srv) {
+	search_index_t *cur;
+	search_index_t *list;
+	search_index_t *changes;
+	search_doc_t **live;
+	uint32_t *dead;
+	uint32_t ndead;
+	uint32_t nlive;
+	uint32_t i;
+	uint32_t j;
+	int ret;
+
+	/* Only the indexing thread modifies the index, so we can read it. */
+	cur = srv->search_index;
+	if (cur == NULL) {
+		cur = search_build(srv);
+		if (cur == NULL)
+			return 0;
+
+		mutex_lock(&srv->search_lock);
+		srv->search_index = cur;
+		mutex_unlock(&srv->search_lock);
+		return 1;
+	}
+
+	/* Rebuild the whole thing if there are too many dead documents. */
+	if ((cur->ndocs > 64) && (cur->ndead > (cur->ndocs / 2))) {
+		search_index_t *index = search_build(srv);
+		if (index == NULL)
+			return 0;
+
+		mutex_lock(&srv->search_lock);
+		srv->search_index = index;
+		mutex_unlock(&srv->search_lock);
+		search_index_free(cur);
+		return 1;
+	}
+
+	/* Walk the document root. */
+	ret = 0;
+	live = NULL;
+	dead = NULL;
+	changes = NULL;
+	list = search_index_new();
+	if (list == NULL)
+		return 0;
+	rcu_read_lock(srv, RCU_SLOT_SEARCH);
+	ret = search_walk(srv, list, srv->docroot, "", 0);
+	rcu_read_unlock(srv, RCU_SLOT_SEARCH);
+	if (!ret)
+		goto cleanup;
+	ret = 0;
+	qsort(list->docs, list->ndocs, sizeof(search_doc_t), search_doc_cmp);
+
+	/* Sort the documents currently in the index. */
+	live = (search_doc_t**)mem_alloc(MEM_SEARCH,
+		(cur->ndocs + 1) * sizeof(search_doc_t*));
+	dead = (uint32_t*)mem_alloc(MEM_SEARCH,
+		(cur->ndocs + 1) * sizeof(uint32_t));
+	changes = search_index_new();
+	if ((live == NULL) || (dead == NULL) || (changes == NULL)) {
+		log_syserr(LOG_ERROR, "Failed to allocate search rescan state");
+		goto cleanup;
+	}
+	nlive = 0;
+	for (i = 0; i < cur->ndocs; i++) {
+		if (cur->docs[i].alive)
+			live[nlive++] = &cur->docs[i];
+	}
+	qsort(live, nlive, sizeof(search_doc_t*), search_docp_cmp);
+
+	/* Find out what has changed. */
+	i = 0;
+	j = 0;
+	ndead = 0;
+	while ((i < list->ndocs) || (j < nlive)) {
+		search_doc_t *doc;
+		int cmp;
+
+		if (i >= list->ndocs) {
+			cmp = 1;
+		} else if (j >= nlive) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(list->docs[i].selector, live[j]->selector);
+		}
+
+		if (cmp > 0) {
+			/* Document has been removed. */
+			dead[ndead++] = (uint32_t)(live[j] - cur->docs);
+			j++;
+			continue;
+		}
+
+		/* Document has been added or changed. */
+		doc = &list->docs[i];
+		if (cmp == 0) {
+			if ((doc->mtime == live[j]->mtime) &&
+					(doc->size == live[j]->size)) {
+				i++;
+				j++;
+				continue;
+			}
+
+			dead[ndead++] = (uint32_t)(live[j] - cur->docs);
+			j++;
+		}
+		if (!search_index_add_doc(changes, doc))
+			goto cleanup;
+		doc->selector = NULL;
+		doc->path = NULL;
+		i++;
+	}
+
+	/* Nothing to do. */
+	if ((ndead == 0) && (changes->ndocs == 0)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* Tokenize the changed documents. */
+	if (!search_tokenize_docs(changes, changes->docs, changes->ndocs, 0))
+		goto cleanup;
+
+	/* Make room for the new documents before touching the index. */
+	if (!search_index_reserve(cur, cur->ndocs + changes->ndocs))
+		goto cleanup;
+
+	/* Apply the changes to the index, undoing them if we run out of memory
+	 * halfway, so that no postings point past the end of the documents. */
+	mutex_lock(&srv->search_lock);
+	ret = search_index_merge(cur, changes, cur->ndocs);
+	if (!ret) {
+		search_index_truncate(cur, cur->ndocs);
+		mutex_unlock(&srv->search_lock);
+		log_printf(LOG_ERROR, "Failed to update the search index, will try "
+			"again on the next scan");
+		goto cleanup;
+	}
+	for (i = 0; i < ndead; i++) {
+		cur->docs[dead[i]].alive = 0;
+		cur->totterms -= cur->docs[dead[i]].nterms;
+		cur->ndead++;
+	}
+	for (i = 0; i < changes->ndocs; i++) {
+		search_index_add_doc(cur, &changes->docs[i]);
+		changes->docs[i].selector = NULL;
+		changes->docs[i].path = NULL;
+	}
+	cur->totterms += changes->totterms;
+	mutex_unlock(&srv->search_lock);
+
+	log_printf(LOG_INFO, "Search index updated with %u new and %u removed "
+		"documents", changes->ndocs, ndead);
+
+cleanup:
+	/* Free up temporary resources. */
+	if (live != NULL)
+		mem_free(live);
+	if (dead != NULL)
+		mem_free(dead);
+	if (changes != NULL)
+		search_index_free(changes);
+	search_index_free(list);
+
+	return ret;
+}
+
+/**
+ * Recursively walks a directory looking for documents that can be indexed.
+ *
+ * @param srv      Server instance.
+ * @param list     Index object used as a list of documents found.
+ * @param path     Local path of the directory to walk.
+ * @param selector Selector of the directory to walk.
+ * @param depth    Current recursion depth.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_walk(amigos_t *srv, search_index_t *list, const char *path,
+				const char *selector, int depth) {
+#ifdef _WIN32
+	WIN32_FIND_DATA ffd;
+	char szDir[MAX_PATH];
+	HANDLE hFind;
+#else
+	struct dirent *dirent;
+	struct stat sb;
+	DIR *dh;
+#endif /* _WIN32 */
+	search_doc_t doc;
+	const char *name;
+	char sep;
+	int isdir;
+	int ret;
+
+	/* Don't get lost in symbolic link loops. */
+	if (depth > SEARCH_MAX_DEPTH)
+		return 1;
+
+	/* Open directory. */
+	ret = 1;
+	sep = PATH_SEPARATOR;
+#ifdef _WIN32
+	snprintf(szDir, MAX_PATH, "%s\\*", path);
+	hFind = FindFirstFile(szDir, &ffd);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return 1;
+
+	do {
+		name = ffd.cFileName;
+		isdir = (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		doc.mtime = ((uint64_t)ffd.ftLastWriteTime.dwHighDateTime << 32) |
+			ffd.ftLastWriteTime.dwLowDateTime;
+		doc.size = ((uint64_t)ffd.nFileSizeHigh << 32) | ffd.nFileSizeLow;
+#else
+	dh = opendir(path);
+	if (dh == NULL)
+		return 1;
+
+	while ((dirent = readdir(dh)) != NULL) {
+		name = dirent->d_name;
+#endif /* _WIN32 */
+
+		/* Skip hidden and special files. */
+		if (*name == '.')
+			goto next;
+
+		/* Build up the document's path and selector. */
+		doc.path = NULL;
+		doc.selector = NULL;
+		if (!path_concat(&doc.path, &sep, path, name, NULL) ||
+				((*selector == '\0') ?
+				((doc.selector = mem_strdup(MEM_SEARCH, name)) == NULL) :
+				!path_concat(&doc.selector, "/", selector, name, NULL))) {
+			log_printf(LOG_ERROR, "Failed to build path for search document "
+				"'%s'", name);
+			if (doc.path != NULL)
+				mem_free(doc.path);
+			if (doc.selector != NULL)
+				mem_free(doc.selector);
+			ret = 0;
+			break;
+		}
+
+#ifndef _WIN32
+		/* Get the file's information. */
+		if (stat(doc.path, &sb) < 0) {
+			mem_free(doc.path);
+			mem_free(doc.selector);
+			continue;
+		}
+		isdir = S_ISDIR(sb.st_mode);
+		doc.mtime = (uint64_t)sb.st_mtime;
+		doc.size = (uint64_t)sb.st_size;
+#endif /* !_WIN32 */
+
+		/* Recurse into directories. */
+		if (isdir) {
+			ret = search_walk(srv, list, doc.path, doc.selector, depth + 1);
+			mem_free(doc.path);
+			mem_free(doc.selector);
+			if (!ret)
+				break;
+			goto next;
+		}
+
+		/* Only index text files and gophermaps that aren't too big. */
+		doc.type = gopher_types_infer(srv, name);
+		if (strcmp(name, "gophermap") == 0) {
+			/* Gophermaps represent their directory. */
+			doc.type = '1';
+			doc.selector[strlen(doc.selector) - 9] = '\0';
+			if (doc.selector[0] != '\0')
+				doc.selector[strlen(doc.selector) - 1] = '\0';
+		}
+		if (((doc.type != '0') && (doc.type != '1')) ||
+				(doc.size > SEARCH_MAX_FILE_SIZE)) {
+			mem_free(doc.path);
+			mem_free(doc.selector);
+			goto next;
+		}
+
+		/* Append the document to the list. */
+		doc.nterms = 0;
+		doc.alive = 1;
+		mem_retag(doc.path, MEM_SEARCH);
+		mem_retag(doc.selector, MEM_SEARCH);
+		if (!search_index_add_doc(list, &doc)) {
+			mem_free(doc.path);
+			mem_free(doc.selector);
+			ret = 0;
+			break;
+		}
+
+next:
+#ifdef _WIN32
+		;
+	} while (FindNextFile(hFind, &ffd));
+
+	FindClose(hFind);
+#else
+		;
+	}
+
+	closedir(dh);
+#endif /* _WIN32 */
+
+	return ret;
+}
+
+/**
+ * Tokenizes a list of documents into an index using multiple threads.
+ *
+ * @param index Index to store the terms into.
+ * @param docs  Documents to be tokenized. Their number of terms is updated.
+ * @param ndocs Number of documents to be tokenized.
+ * @param base  Document ID in the index of the first document in the list.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_tokenize_docs(search_index_t *index, search_doc_t *docs,
+						 uint32_t ndocs, uint32_t base) {
+	search_job_t jobs[SEARCH_THREADS];
+	uint32_t nthreads;
+	uint32_t slice;
+	uint32_t offset;
+	uint32_t i;
+	int ret;
+
+	/* Figure out how to split the work between the threads. */
+	nthreads = (ndocs / 16) + 1;
+	if (nthreads > SEARCH_THREADS)
+		nthreads = SEARCH_THREADS;
+	slice = (ndocs + nthreads - 1) / nthreads;
+
+	/* Start the tokenizer threads. */
+	ret = 1;
+	offset = 0;
+	for (i = 0; i < nthreads; i++) {
+		jobs[i].docs = docs + offset;
+		jobs[i].ndocs = ((ndocs - offset) < slice) ? (ndocs - offset) : slice;
+		jobs[i].index = search_index_new();
+		jobs[i].thread = INVALID_THREAD;
+		offset += jobs[i].ndocs;
+
+		if (jobs[i].index == NULL) {
+			ret = 0;
+			continue;
+		}
+
+		/* The last slice is tokenized by us. */
+		if ((i < (nthreads - 1)) &&
+				!thread_create(&jobs[i].thread, search_tokenize_thread,
+				&jobs[i])) {
+			log_printf(LOG_WARNING, "Failed to create search tokenizer "
+				"thread, doing it ourselves");
+			jobs[i].thread = INVALID_THREAD;
+			search_tokenize_thread(&jobs[i]);
+		}
+	}
+	if (jobs[nthreads - 1].index != NULL)
+		search_tokenize_thread(&jobs[nthreads - 1]);
+
+	/* Merge the partial indexes in order to keep postings sorted. */
+	offset = base;
+	for (i = 0; i < nthreads; i++) {
+		if (jobs[i].thread != INVALID_THREAD)
+			thread_join(jobs[i].thread);
+		if (jobs[i].index == NULL)
+			continue;
+
+		if (ret && !search_index_merge(index, jobs[i].index, offset))
+			ret = 0;
+		index->totterms += jobs[i].index->totterms;
+		offset += jobs[i].ndocs;
+		search_index_free(jobs[i].index);
+	}
+
+	return ret;
+}
+
+/**
+ * Tokenizer thread. Tokenizes a slice of documents into a partial index using
+ * document IDs relative to the start of the slice.
+ *
+ * @param data Pointer to a search_job_t structure.
+ */
+thread_ret search_tokenize_thread(void *data) {
+	search_job_t *job;
+	uint32_t i;
+
+	job = (search_job_t*)data;
+	for (i = 0; i < job->ndocs; i++) {
+		search_tokenize_file(job->index, i, job->docs[i].path,
+			&job->docs[i].nterms);
+		job->index->totterms += job->docs[i].nterms;
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif /* _WIN32 */
+}
+
+/**
+ * Tokenizes the contents of a file into an index.
+ *
+ * @param index  Index to store the terms into.
+ * @param doc    ID of the document in the index.
+ * @param path   Path to the file to be tokenized.
+ * @param nterms Pointer to store the number of terms found in the document.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_tokenize_file(search_index_t *index, uint32_t doc, const char *path,
+						 uint32_t *nterms) {
+	FILE *fh;
+	char term[SEARCH_TERM_MAX_LEN + 1];
+	uint8_t buf[4096];
+	size_t tlen;
+	size_t flen;
+	size_t i;
+	int ret;
+
+	/* Open file for reading. */
+	*nterms = 0;
+	fh = fopen(path, "rb");
+	if (fh == NULL) {
+		log_printf(LOG_WARNING, "Failed to open file %s for indexing", path);
+		return 0;
+	}
+
+	/* Split the contents into lowercase alphanumeric terms. */
+	ret = 1;
+	tlen = 0;
+	while (ret && ((flen = fread(buf, sizeof(uint8_t), 4096, fh)) > 0)) {
+		for (i = 0; i <= flen; i++) {
+			uint8_t c = (i < flen) ? buf[i] : ' ';
+
+			/* Build up the term. */
+			if (((c >= 'a') && (c <= 'z')) || ((c >= '0') && (c <= '9')) ||
+					(c >= 0x80)) {
+				if (tlen < SEARCH_TERM_MAX_LEN)
+					term[tlen++] = (char)c;
+				continue;
+			} else if ((c >= 'A') && (c <= 'Z')) {
+				if (tlen < SEARCH_TERM_MAX_LEN)
+					term[tlen++] = (char)(c + ('a' - 'A'));
+				continue;
+			}
+
+			/* Terms may continue in the next chunk. */
+			if ((i == flen) && (flen == 4096))
+				break;
+
+			/* Index the term. Single characters aren't worth it. */
+			if (tlen > 1) {
+				term[tlen] = '\0';
+				if (!search_index_posting(index, term, doc, 1)) {
+					ret = 0;
+					break;
+				}
+				(*nterms)++;
+			}
+			tlen = 0;
+		}
+	}
+
+	/* Index the last term if the file ended right at a chunk boundary. */
+	if (ret && (tlen > 1)) {
+		term[tlen] = '\0';
+		ret = search_index_posting(index, term, doc, 1);
+		(*nterms)++;
+	}
+
+	/* Close file handle. */
+	fclose(fh);
+	return ret;
+}
+
+/**
+ * Splits a search query into unique lowercase terms.
+ *
+ * @param query Search query sent by the client.
+ * @param terms Array to store the terms into.
+ *
+ * @return Number of terms found in the query.
+ */
+int search_tokenize_query(const char *query,
+						  char terms[][SEARCH_TERM_MAX_LEN + 1]) {
+	char term[SEARCH_TERM_MAX_LEN + 1];
+	size_t tlen;
+	int nterms;
+	int i;
+
+	nterms = 0;
+	tlen = 0;
+	while (nterms < SEARCH_MAX_TERMS) {
+		uint8_t c = (uint8_t)*query;
+
+		/* Build up the term the same way documents are tokenized. */
+		if (((c >= 'a') && (c <= 'z')) || ((c >= '0') && (c <= '9')) ||
+				(c >= 0x80)) {
+			if (tlen < SEARCH_TERM_MAX_LEN)
+				term[tlen++] = (char)c;
+		} else if ((c >= 'A') && (c <= 'Z')) {
+			if (tlen < SEARCH_TERM_MAX_LEN)
+				term[tlen++] = (char)(c + ('a' - 'A'));
+		} else {
+			/* Store the term if it isn't a duplicate. */
+			if (tlen > 1) {
+				term[tlen] = '\0';
+				for (i = 0; i < nterms; i++) {
+					if (strcmp(terms[i], term) == 0)
+						break;
+				}
+				if (i == nterms)
+					strcpy(terms[nterms++], term);
+			}
+			tlen = 0;
+
+			if (c == '\0')
+				break;
+		}
+
+		query++;
+	}
+
+	return nterms;
+}
+
+/**
+ * Queries the index for documents that contain any of the terms, ranking them
+ * using BM25 and favoring documents that contain more of the terms.
+ *
+ * @warning This function allocates memory that must be free'd by you!
+ *
+ * @param index  Index to be queried.
+ * @param terms  Terms to look for.
+ * @param nterms Number of terms to look for.
+ * @param count  Pointer to store the number of results found.
+ *
+ * @return Best results sorted by relevance or NULL if there are none.
+ */
+search_result_t* search_query(const search_index_t *index,
+							  char terms[][SEARCH_TERM_MAX_LEN + 1],
+							  int nterms, uint32_t *count) {
+	search_result_t *results;
+	uint32_t nresults;
+	uint32_t nlive;
+	double avglen;
+	int t;
+
+	/* Get some statistics about the index. */
+	*count = 0;
+	results = NULL;
+	nresults = 0;
+	nlive = index->ndocs - index->ndead;
+	if (nlive == 0)
+		return NULL;
+	avglen = (double)index->totterms / nlive;
+	if (avglen < 1)
+		avglen = 1;
+
+	/* Merge the postings of each term into the results. */
+	for (t = 0; t < nterms; t++) {
+		const search_term_t *term;
+		search_result_t *merged;
+		uint32_t nmerged;
+		uint32_t i;
+		uint32_t j;
+		double idf;
+
+		/* Get the term's postings. */
+		term = search_index_term((search_index_t*)index, terms[t], 0);
+		if ((term == NULL) || (term->len == 0))
+			continue;
+		idf = search_ln(1.0 + ((nlive - term->len + 0.5) / (term->len + 0.5)));
+		if (idf < 0.01)
+			idf = 0.01;
+
+		/* Both lists are sorted by document ID. */
+		merged = (search_result_t*)mem_alloc(MEM_SEARCH,
+			(nresults + term->len) * sizeof(search_result_t));
+		if (merged == NULL) {
+			log_syserr(LOG_ERROR, "Failed to allocate search results");
+			break;
+		}
+		i = 0;
+		j = 0;
+		nmerged = 0;
+		while ((i < nresults) || (j < term->len)) {
+			const search_posting_t *posting;
+			const search_doc_t *doc;
+			double tf;
+
+			/* Carry over results that don't contain this term. */
+			if ((j >= term->len) ||
+					((i < nresults) && (results[i].doc < term->postings[j].doc))) {
+				merged[nmerged++] = results[i++];
+				continue;
+			}
+
+			/* Skip documents that are no longer there. */
+			posting = &term->postings[j++];
+			doc = &index->docs[posting->doc];
+			if (!doc->alive)
+				continue;
+
+			/* Score the term's occurrence in the document. */
+			tf = (posting->freq * 2.2) / (posting->freq + 1.2 *
+				(0.25 + 0.75 * (doc->nterms / avglen)));
+			if ((i < nresults) && (results[i].doc == posting->doc)) {
+				merged[nmerged] = results[i++];
+			} else {
+				merged[nmerged].doc = posting->doc;
+				merged[nmerged].matches = 0;
+				merged[nmerged].score = 0;
+			}
+			merged[nmerged].matches++;
+			merged[nmerged].score += idf * tf;
+			nmerged++;
+		}
+
+		if (results != NULL)
+			mem_free(results);
+		results = merged;
+		nresults = nmerged;
+	}
+
+	/* Rank the results. */
+	if (nresults == 0) {
+		if (results != NULL)
+			mem_free(results);
+		return NULL;
+	}
+	for (t = 0; (uint32_t)t < nresults; t++)
+		results[t].score *= (double)results[t].matches / nterms;
+	qsort(results, nresults, sizeof(search_result_t), search_result_cmp);
+
+	*count = (nresults > SEARCH_MAX_RESULTS) ? SEARCH_MAX_RESULTS : nresults;
+	return results;
+}
+
+/**
+ * Allocates a brand new empty index.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @return Allocated index object or NULL if an error occurred.
+ *
+ * @see search_index_free
+ */
+search_index_t* search_index_new(void) {
+	search_index_t *index;
+
+	/* Try to allocate our index object. */
+	index = (search_index_t*)mem_alloc(MEM_SEARCH, sizeof(search_index_t));
+	if (index == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate search index");
+		return NULL;
+	}
+
+	/* Allocate the terms hash table. */
+	index->nbuckets = 256;
+	index->buckets = (search_term_t**)mem_calloc(MEM_SEARCH, index->nbuckets,
+		sizeof(search_term_t*));
+	if (index->buckets == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate search index buckets");
+		mem_free(index);
+		return NULL;
+	}
+
+	/* Populate it with sane defaults. */
+	index->nterms = 0;
+	index->docs = NULL;
+	index->ndocs = 0;
+	index->docs_size = 0;
+	index->ndead = 0;
+	index->totterms = 0;
+
+	return index;
+}
+
+/**
+ * Frees up an index and all of its terms and documents.
+ *
+ * @param index Index to be free'd.
+ *
+ * @see search_index_new
+ */
+void search_index_free(search_index_t *index) {
+	uint32_t i;
+
+	/* Free the terms. */
+	for (i = 0; i < index->nbuckets; i++) {
+		search_term_t *term = index->buckets[i];
+		while (term != NULL) {
+			search_term_t *next = term->next;
+			mem_free(term->term);
+			if (term->postings != NULL)
+				mem_free(term->postings);
+			mem_free(term);
+			term = next;
+		}
+	}
+	mem_free(index->buckets);
+
+	/* Free the documents. */
+	for (i = 0; i < index->ndocs; i++) {
+		if (index->docs[i].selector != NULL)
+			mem_free(index->docs[i].selector);
+		if (index->docs[i].path != NULL)
+			mem_free(index->docs[i].path);
+	}
+	if (index->docs != NULL)
+		mem_free(index->docs);
+
+	mem_free(index);
+}
+
+/**
+ * Appends a document to an index. The index takes ownership of the document's
+ * strings.
+ *
+ * @param index Index to append the document to.
+ * @param doc   Document to be appended.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_index_add_doc(search_index_t *index, const search_doc_t *doc) {
+	if (!search_index_reserve(index, index->ndocs + 1))
+		return 0;
+
+	index->docs[index->ndocs++] = *doc;
+	return 1;
+}
+
+/**
+ * Makes sure an index has room for a number of documents, so that they can
+ * be appended to it without failing.
+ *
+ * @param index Index to grow.
+ * @param ndocs Number of documents it must have room for.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_index_reserve(search_index_t *index, uint32_t ndocs) {
+	uint32_t size;
+	void *tmp;
+
+	if (ndocs <= index->docs_size)
+		return 1;
+
+	size = (index->docs_size == 0) ? 64 : index->docs_size;
+	while (size < ndocs)
+		size *= 2;
+	tmp = mem_realloc(MEM_SEARCH, index->docs, size * sizeof(search_doc_t));
+	if (tmp == NULL) {
+		log_syserr(LOG_ERROR, "Failed to grow search documents list");
+		return 0;
+	}
+	index->docs = (search_doc_t*)tmp;
+	index->docs_size = size;
+
+	return 1;
+}
+
+/**
+ * Looks up a term in an index.
+ *
+ * @param index  Index to look the term up in.
+ * @param term   Term to look for.
+ * @param create Create the term if it isn't in the index yet?
+ *
+ * @return Term object or NULL if it wasn't found or an error occurred.
+ */
+search_term_t* search_index_term(search_index_t *index, const char *term,
+								 int create) {
+	search_term_t *entry;
+	uint32_t hash;
+
+	/* Look for the term in its bucket. */
+	hash = search_hash(term);
+	entry = index->buckets[hash & (index->nbuckets - 1)];
+	while (entry != NULL) {
+		if ((entry->hash == hash) && (strcmp(entry->term, term) == 0))
+			return entry;
+		entry = entry->next;
+	}
+	if (!create)
+		return NULL;
+
+	/* Grow the hash table if it's getting crowded. */
+	if (index->nterms >= (index->nbuckets * 2)) {
+		search_term_t **buckets;
+		uint32_t nbuckets;
+		uint32_t i;
+
+		nbuckets = index->nbuckets * 4;
+		buckets = (search_term_t**)mem_calloc(MEM_SEARCH, nbuckets,
+			sizeof(search_term_t*));
+		if (buckets != NULL) {
+			for (i = 0; i < index->nbuckets; i++) {
+				entry = index->buckets[i];
+				while (entry != NULL) {
+					search_term_t *next = entry->next;
+					entry->next = buckets[entry->hash & (nbuckets - 1)];
+					buckets[entry->hash & (nbuckets - 1)] = entry;
+					entry = next;
+				}
+			}
+
+			mem_free(index->buckets);
+			index->buckets = buckets;
+			index->nbuckets = nbuckets;
+		}
+	}
+
+	/* Create a new term. */
+	entry = (search_term_t*)mem_alloc(MEM_SEARCH, sizeof(search_term_t));
+	if (entry == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate search term");
+		return NULL;
+	}
+	entry->term = mem_strdup(MEM_SEARCH, term);
+	if (entry->term == NULL) {
+		log_syserr(LOG_ERROR, "Failed to allocate search term");
+		mem_free(entry);
+		return NULL;
+	}
+	entry->hash = hash;
+	entry->len = 0;
+	entry->size = 0;
+	entry->postings = NULL;
+	entry->next = index->buckets[hash & (index->nbuckets - 1)];
+	index->buckets[hash & (index->nbuckets - 1)] = entry;
+	index->nterms++;
+
+	return entry;
+}
+
+/**
+ * Records occurrences of a term in a document. Documents must be added in
+ * ascending ID order.
+ *
+ * @param index Index to store the occurrence into.
+ * @param term  Term that occurred.
+ * @param doc   ID of the document it occurred in.
+ * @param freq  Number of times it occurred.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_index_posting(search_index_t *index, const char *term,
+						 uint32_t doc, uint32_t freq) {
+	search_term_t *entry;
+
+	/* Get the term. */
+	entry = search_index_term(index, term, 1);
+	if (entry == NULL)
+		return 0;
+
+	/* Check if we are just counting another occurrence. */
+	if ((entry->len > 0) && (entry->postings[entry->len - 1].doc == doc)) {
+		entry->postings[entry->len - 1].freq += freq;
+		return 1;
+	}
+
+	/* Grow the postings list if needed. */
+	if (entry->len == entry->size) {
+		uint32_t size;
+		void *tmp;
+
+		size = (entry->size == 0) ? 4 : (entry->size * 2);
+		tmp = mem_realloc(MEM_SEARCH, entry->postings,
+			size * sizeof(search_posting_t));
+		if (tmp == NULL) {
+			log_syserr(LOG_ERROR, "Failed to grow search postings list");
+			return 0;
+		}
+		entry->postings = (search_posting_t*)tmp;
+		entry->size = size;
+	}
+
+	/* Append the posting. */
+	entry->postings[entry->len].doc = doc;
+	entry->postings[entry->len].freq = freq;
+	entry->len++;
+
+	return 1;
+}
+
+/**
+ * Merges the terms of an index into another.
+ *
+ * @param dst    Index that will receive the terms.
+ * @param src    Index to get the terms from.
+ * @param offset Offset to be applied to the document IDs of the source index.
+ *               Must be larger than any document ID already in dst.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int search_index_merge(search_index_t *dst, const search_index_t *src,
+					   uint32_t offset) {
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < src->nbuckets; i++) {
+		const search_term_t *term = src->buckets[i];
+		while (term != NULL) {
+			for (j = 0; j < term->len; j++) {
+				if (!search_index_posting(dst, term->term,
+						term->postings[j].doc + offset,
+						term->postings[j].freq)) {
+					return 0;
+				}
+			}
+
+			term = term->next;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Removes the postings of the documents past a certain ID, undoing a merge
+ * that failed halfway.
+ *
+ * @param index Index to remove the postings from.
+ * @param ndocs Number of documents that should be left in it.
+ *
+ * @see search_index_merge
+ */
+void search_index_truncate(search_index_t *index, uint32_t ndocs) {
+	search_term_t *term;
+	uint32_t i;
+
+	/* Postings are sorted by document ID, so the new ones are at the end. */
+	for (i = 0; i < index->nbuckets; i++) {
+		for (term = index->buckets[i]; term != NULL; term = term->next) {
+			while ((term->len > 0) &&
+					(term->postings[term->len - 1].doc >= ndocs)) {
+				term->len--;
+			}
+		}
+	}
+}
+
+/**
+ * Compares two documents by selector for qsort.
+ */
+int search_doc_cmp(const void *a, const void *b) {
+	return strcmp(((const search_doc_t*)a)->selector,
+		((const search_doc_t*)b)->selector);
+}
+
+/**
+ * Compares two pointers to documents by selector for qsort.
+ */
+int search_docp_cmp(const void *a, const void *b) {
+	return strcmp((*(search_doc_t* const*)a)->selector,
+		(*(search_doc_t* const*)b)->selector);
+}
+
+/**
+ * Compares two search results by descending score for qsort.
+ */
+int search_result_cmp(const void *a, const void *b) {
+	double sa = ((const search_result_t*)a)->score;
+	double sb = ((const search_result_t*)b)->score;
+
+	if (sa < sb)
+		return 1;
+	return (sa > sb) ? -1 : 0;
+}
+
+/**
+ * Hashes a string using FNV-1a.
+ *
+ * @param str String to be hashed.
+ *
+ * @return Hash of the string.
+ */
+uint32_t search_hash(const char *str) {
+	uint32_t hash = 2166136261UL;
+
+	while (*str != '\0') {
+		hash ^= (uint8_t)*str++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/**
+ * Calculates the natural logarithm of a positive number without having to
+ * link against the math library.
+ *
+ * @param x Positive number.
+ *
+ * @return Natural logarithm of the number.
+ */
+double search_ln(double x) {
+	double y;
+	double y2;
+	double sum;
+	int exp;
+	int i;
+
+	/* Reduce the range to [1, 2). */
+	exp = 0;
+	while (x >= 2.0) {
+		x /= 2.0;
+		exp++;
+	}
+	while (x < 1.0) {
+		x *= 2.0;
+		exp--;
+	}
+
+	/* ln(x) = 2 * atanh((x - 1) / (x + 1)) */
+	y = (x - 1.0) / (x + 1.0);
+	y2 = y * y;
+	sum = 0;
+	for (i = 1; i < 16; i += 2) {
+		sum += y / i;
+		y *= y2;
 	}
 
-	return DEFAULT_FILE_TYPE;
+	return (2.0 * sum) + (exp * 0.69314718055994530942);
+}
+
+/**
+ * =============================================================================
+ * === Threading ===============================================================
+ * =============================================================================
+ */
+
+/**
+ * Creates a new thread.
+ *
+ * @param thread Pointer to store the thread handle.
+ * @param func   Function to be executed by the thread.
+ * @param arg    Argument to be passed to the function.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int thread_create(thread_hnd_t *thread, thread_func_t *func, void *arg) {
+#ifdef _WIN32
+	unsigned int tid;
+
+	*thread = (HANDLE)_beginthreadex(NULL, 0, func, arg, 0, &tid);
+	return *thread != 0;
+#else
+	sigset_t set;
+	sigset_t oldset;
+	int ret;
+
+	/* Ensure process signals are only handled by the main thread, and that
+	 * writes to closed sockets made by ours (sendfile and TLS included) fail
+	 * with EPIPE instead of raising a SIGPIPE that would kill the host. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	ret = pthread_create(thread, NULL, func, arg);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return ret == 0;
+#endif /* _WIN32 */
+}
+
+/**
+ * Waits for a thread to finish and releases its handle.
+ *
+ * @param thread Thread to wait for.
+ */
+void thread_join(thread_hnd_t thread) {
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif /* _WIN32 */
+}
+
+/**
+ * Suspends the execution of the current thread.
+ *
+ * @param ms Time to sleep for in milliseconds.
+ */
+void thread_sleep(unsigned int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+#endif /* _WIN32 */
+}
+
+#ifdef _WIN32
+/**
+ * Takes the spinlock that guards atomic operations on a variable.
+ *
+ * @param p Variable that's going to be operated on.
+ *
+ * @see win32_atomic_unlock
+ */
+void win32_atomic_lock(volatile void *p) {
+	LONG volatile *lock;
+
+	lock = &atomic_locks[((size_t)p / sizeof(uint32_t)) % ATOMIC_LOCKS];
+	while (InterlockedExchange((LPLONG)lock, 1) != 0)
+		Sleep(0);
+}
+
+/**
+ * Releases the spinlock that guards atomic operations on a variable.
+ *
+ * @param p Variable that was operated on.
+ *
+ * @see win32_atomic_lock
+ */
+void win32_atomic_unlock(volatile void *p) {
+	LONG volatile *lock;
+
+	lock = &atomic_locks[((size_t)p / sizeof(uint32_t)) % ATOMIC_LOCKS];
+	InterlockedExchange((LPLONG)lock, 0);
+}
+
+/**
+ * Atomically adds to a 32-bit variable.
+ *
+ * @param p Variable to add to.
+ * @param v Value to be added.
+ *
+ * @return Value of the variable before the addition.
+ */
+uint32_t win32_atomic_add_u32(volatile uint32_t *p, uint32_t v) {
+	uint32_t old;
+
+	win32_atomic_lock(p);
+	old = *p;
+	*p = old + v;
+	win32_atomic_unlock(p);
+
+	return old;
+}
+
+/**
+ * Atomically sets a 32-bit variable.
+ *
+ * @param p Variable to be set.
+ * @param v Value to set it to.
+ */
+void win32_atomic_set_u32(volatile uint32_t *p, uint32_t v) {
+	win32_atomic_lock(p);
+	*p = v;
+	win32_atomic_unlock(p);
+}
+
+/**
+ * Atomically adds to a 64-bit variable, which 32-bit processors can't even
+ * read in one go.
+ *
+ * @param p Variable to add to.
+ * @param v Value to be added.
+ *
+ * @return Value of the variable before the addition.
+ */
+uint64_t win32_atomic_add_u64(volatile uint64_t *p, uint64_t v) {
+	uint64_t old;
+
+	win32_atomic_lock(p);
+	old = *p;
+	*p = old + v;
+	win32_atomic_unlock(p);
+
+	return old;
+}
+
+/**
+ * Atomically sets a 64-bit variable.
+ *
+ * @param p Variable to be set.
+ * @param v Value to set it to.
+ */
+void win32_atomic_set_u64(volatile uint64_t *p, uint64_t v) {
+	win32_atomic_lock(p);
+	*p = v;
+	win32_atomic_unlock(p);
+}
+
+/**
+ * Atomically gets a pointer.
+ *
+ * @param p Pointer to be read.
+ *
+ * @return Value of the pointer.
+ */
+void* win32_atomic_get_ptr(void* volatile *p) {
+	void *v;
+
+	win32_atomic_lock(p);
+	v = *p;
+	win32_atomic_unlock(p);
+
+	return v;
 }
 
 /**
- * Dumps the contents of the Gopher file type information array for debugging
- * pursposes.
+ * Atomically sets a pointer.
+ *
+ * @param p Pointer to be set.
+ * @param v Value to set it to.
  */
-void gopher_types_dump(void) {
-	uint16_t i;
-
-	/* Do we even have any? */
-	if (gopher_types == NULL) {
-		log_printf(LOG_WARNING, "No Gopher file type associations.");
-		return;
-	}
-
-	/* Dump associations array. */
-	printf("Gopher file type associations (%u):", gopher_types_len);
-	for (i = 0; i < gopher_types_len; i++)
-		printf(" %s", gopher_types[i]);
-	printf("\n");
+void win32_atomic_set_ptr(void* volatile *p, void *v) {
+	win32_atomic_lock(p);
+	*p = v;
+	win32_atomic_unlock(p);
 }
+#endif /* _WIN32 */
 
 /**
  * =============================================================================
@@ -1570,6 +11721,62 @@ int dir_exists(const char *path) {
 #endif /* _WIN32 */
 }
 
+/**
+ * Checks what kind of file system entry a path points to with a single lookup.
+ *
+ * @param path Path to be checked.
+ *
+ * @return PATH_DIR for directories, PATH_FILE for anything else that exists,
+ *         or PATH_NONE if the path doesn't exist.
+ */
+int path_type(const char *path) {
+#ifdef _WIN32
+	DWORD dwAttrib;
+
+	/* Get file attributes. */
+	dwAttrib = GetFileAttributes(path);
+	if (dwAttrib == INVALID_FILE_ATTRIBUTES)
+		return PATH_NONE;
+
+	return (dwAttrib & FILE_ATTRIBUTE_DIRECTORY) ? PATH_DIR : PATH_FILE;
+#else
+	struct stat sb;
+
+	/* Ensure that we can stat the path. */
+	if (stat(path, &sb) < 0)
+		return PATH_NONE;
+
+	return S_ISDIR(sb.st_mode) ? PATH_DIR : PATH_FILE;
+#endif /* _WIN32 */
+}
+
+/**
+ * Gets the last modification time of a file system entry.
+ *
+ * @param path Path to be checked.
+ *
+ * @return Modification time in a platform-specific unit or 0 if the path
+ *         doesn't exist.
+ */
+uint64_t path_mtime(const char *path) {
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+
+	if (!GetFileAttributesEx(path, GetFileExInfoStandard, &fad))
+		return 0;
+
+	return ((uint64_t)fad.ftLastWriteTime.dwHighDateTime << 32) |
+		fad.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat sb;
+
+	if (stat(path, &sb) < 0)
+		return 0;
+
+	return (uint64_t)sb.st_mtime;
+#endif /* _WIN32 */
+}
+
 /**
  * Sanitizes a path to ensure idiots don't abuse us.
  *
@@ -1619,74 +11826,559 @@ int path_normalize(char *path, char fromsep, char tosep) {
 			ret = 1;
 		}
 
-		buf++;
-	}
+		buf++;
+	}
+
+	return ret;
+}
+
+/**
+ * Concatenates paths together safely.
+ *
+ * @warning This function allocates memory that must be free'd by you!
+ *
+ * @param buf Pointer to final path string. ((Re)Allocated internally)
+ * @param sep Path separator to use when normalizing and concatenating.
+ * @param ... Paths to be concatenated. WARNING: A NULL must be placed at the
+ *            end to indicate the end of the list.
+ *
+ * @return Size of the final buffer or 0 if an error occurred.
+ */
+size_t path_concat(char **buf, const char *sep, ...) {
+	va_list ap;
+	size_t len;
+	const char *path;
+	char *cur;
+
+	/* Initialize things and ensure we leave space for the NULL terminator. */
+	*buf = NULL;
+	len = 1;
+
+	/* Go through the paths. */
+	va_start(ap, sep);
+	path = va_arg(ap, char *);
+	while (path != NULL) {
+		size_t plen;
+
+		/* Reallocate the buffer memory and set the cursor for concatenation. */
+		plen = len;
+		len += strlen(path);
+		*buf = (char *)mem_realloc(MEM_PATHS, *buf, (len + 1) * sizeof(char));
+		if (*buf == NULL)
+			return 0L;
+		cur = (*buf) + plen - 1;
+
+		/* Should we bother prepending the path separator? */
+		if ((plen > 1) && (*(cur - 1) != *sep)) {
+			*cur = *sep;
+			cur++;
+			len++;
+		}
+
+		/* Concatenate the next path while normalizing separators. */
+		while (*path != '\0') {
+			*cur = *path;
+			if ((*cur == '/') || (*cur == '\\'))
+				*cur = *sep;
+
+			cur++;
+			path++;
+		}
+
+		/* Ensure we NULL terminate the string. */
+		*cur = '\0';
+
+		/* Fetch the next path. */
+		path = va_arg(ap, char *);
+	}
+	va_end(ap);
+
+	return len;
+}
+
+#ifdef WITH_FAULTS
+/**
+ * =============================================================================
+ * === Fault Injection =========================================================
+ * =============================================================================
+ */
+
+/**
+ * Parses the faults to be injected into a kind of call, given as a list of
+ * settings separated by spaces:
+ *
+ *     delay=<ms> jitter=<ms> delay_rate=<%> short_rate=<%> error_rate=<%>
+ *     errno=<name or number>
+ *
+ * Calls are delayed every time unless a rate is given for it.
+ *
+ * @param cfg  Configuration object.
+ * @param op   Name of the kind of call.
+ * @param spec Faults to be injected into it.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int fault_parse(config_t *cfg, const char *op, const char *spec) {
+	fault_t fault;
+	char key[16];
+	char value[32];
+	const char *cur;
+	char *end;
+	double num;
+	int delay_rate;
+	int len;
+	int i;
+
+	/* Find out which calls we're talking about. */
+	for (i = 0; i < FAULT_OPS; i++) {
+		if (strcmp(op, fault_op_names[i]) == 0)
+			break;
+	}
+	if (i == FAULT_OPS)
+		return 0;
+
+	memset(&fault, 0, sizeof(fault_t));
+	fault.error = fault_op_errors[i];
+	delay_rate = 0;
+	for (cur = spec; sscanf(cur, " %15[^= ]=%31s%n", key, value, &len) == 2;
+			cur += len) {
+		/* Errors by name or number. */
+		if (strcmp(key, "errno") == 0) {
+			if (strcmp(value, "EIO") == 0) {
+				fault.error = EIO;
+			} else if (strcmp(value, "ENOENT") == 0) {
+				fault.error = ENOENT;
+			} else if (strcmp(value, "EACCES") == 0) {
+				fault.error = EACCES;
+			} else if (strcmp(value, "EMFILE") == 0) {
+				fault.error = EMFILE;
+			} else if (strcmp(value, "ENOMEM") == 0) {
+				fault.error = ENOMEM;
+			} else if (strcmp(value, "EPIPE") == 0) {
+				fault.error = EPIPE;
+			} else if (strcmp(value, "ECONNRESET") == 0) {
+				fault.error = ECONNRESET;
+			} else if (strcmp(value, "ETIMEDOUT") == 0) {
+				fault.error = ETIMEDOUT;
+			} else {
+				fault.error = (int)strtol(value, &end, 10);
+				if ((*end != '\0') || (fault.error <= 0)) {
+					log_printf(LOG_ERROR, "Unknown error '%s' to inject into "
+						"%s calls", value, op);
+					return 0;
+				}
+			}
+			continue;
+		}
+
+		num = strtod(value, &end);
+		if ((*end != '\0') || (num < 0)) {
+			log_printf(LOG_ERROR, "Invalid value '%s' for the %s fault of %s "
+				"calls", value, key, op);
+			return 0;
+		}
+
+		/* Delays in milliseconds. */
+		if (strcmp(key, "delay") == 0) {
+			fault.delay = (uint32_t)num;
+			continue;
+		} else if (strcmp(key, "jitter") == 0) {
+			fault.jitter = (uint32_t)num;
+			continue;
+		}
+
+		/* Rates in percent. */
+		if (num > 100) {
+			log_printf(LOG_ERROR, "The %s fault of %s calls can't be over "
+				"100%%", key, op);
+			return 0;
+		}
+		if (strcmp(key, "delay_rate") == 0) {
+			fault.delay_rate = (uint32_t)((num * 10000.0) + 0.5);
+			delay_rate = 1;
+		} else if (strcmp(key, "short_rate") == 0) {
+			fault.short_rate = (uint32_t)((num * 10000.0) + 0.5);
+		} else if (strcmp(key, "error_rate") == 0) {
+			fault.error_rate = (uint32_t)((num * 10000.0) + 0.5);
+		} else {
+			log_printf(LOG_ERROR, "Unknown fault '%s' for %s calls", key, op);
+			return 0;
+		}
+	}
+	cur += strspn(cur, " \t");
+	if (*cur != '\0') {
+		log_printf(LOG_ERROR, "Invalid faults '%s' for %s calls", cur, op);
+		return 0;
+	}
+
+	/* A delay without a rate holds up every call. */
+	if (!delay_rate && ((fault.delay > 0) || (fault.jitter > 0)))
+		fault.delay_rate = 1000000;
+
+	cfg->faults[i] = fault;
+	log_printf(LOG_WARNING, "Injecting faults into %s calls", op);
+
+	return 1;
+}
+
+/**
+ * Injects the configured faults into a call that's about to be made: holds it
+ * up for a while, fails it, or cuts the amount of data it transfers short.
+ *
+ * @param conn Client connection object.
+ * @param op   Kind of call.
+ * @param len  Number of bytes the call will transfer, which may be cut short,
+ *             or NULL if it doesn't transfer any.
+ *
+ * @return TRUE if the call should go ahead, FALSE if it should fail with the
+ *         error that was left in errno.
+ */
+int fault_inject(const client_conn_t *conn, fault_op_t op, size_t *len) {
+	const fault_t *fault;
+	uint32_t ms;
+
+	fault = &conn->config->faults[op];
+
+	/* Hold it up. */
+	if ((fault->delay_rate > 0) &&
+			((fault_random() % 1000000) < fault->delay_rate)) {
+		ms = fault->delay;
+		if (fault->jitter > 0)
+			ms += fault_random() % (fault->jitter + 1);
+		thread_sleep(ms);
+	}
+
+	/* Make it fail. */
+	if ((fault->error_rate > 0) &&
+			((fault_random() % 1000000) < fault->error_rate)) {
+		errno = fault->error;
+		return 0;
+	}
+
+	/* Make it transfer less than it was asked to. */
+	if ((len != NULL) && (*len > 1) && (fault->short_rate > 0) &&
+			((fault_random() % 1000000) < fault->short_rate)) {
+		*len = 1 + (fault_random() % (*len - 1));
+	}
+
+	return 1;
+}
+
+/**
+ * Generates a pseudo-random number for deciding which faults to inject. Safe
+ * to be called from any thread.
+ *
+ * @return Pseudo-random number.
+ */
+uint32_t fault_random(void) {
+	uint32_t x;
+
+	/* Hash a counter, which is cheaper than locking a proper generator. */
+	x = atomic_add_u32(&fault_state, 0x9e3779b9UL);
+	x ^= x >> 16;
+	x *= 0x85ebca6bUL;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35UL;
+	x ^= x >> 16;
+
+	return x;
+}
+#endif /* WITH_FAULTS */
+
+/**
+ * =============================================================================
+ * === Memory Accounting =======================================================
+ * =============================================================================
+ */
+
+/**
+ * Allocates memory on behalf of a subsystem, refusing to if it would take the
+ * subsystem over its limit.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param tag  Subsystem that the memory is accounted to.
+ * @param size Number of bytes to allocate.
+ *
+ * @return Allocated memory or NULL if an error occurred.
+ *
+ * @see mem_free
+ */
+void* mem_alloc(mem_tag_t tag, size_t size) {
+	mem_header_t *hdr;
+
+	/* Keep the subsystem within its limit. */
+	if (mem_over(tag, size)) {
+		counter_add(&mem_accounts[tag].failed, 1);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	hdr = (mem_header_t*)malloc(sizeof(mem_header_t) + size);
+	if (hdr == NULL) {
+		counter_add(&mem_accounts[tag].failed, 1);
+		return NULL;
+	}
+	hdr->info.size = size;
+	hdr->info.tag = tag;
+	mem_charge(tag, size, 0);
+	counter_add(&mem_accounts[tag].count, 1);
+	counter_add(&mem_accounts[tag].total, 1);
+
+	return hdr + 1;
+}
+
+/**
+ * Allocates zeroed memory for an array on behalf of a subsystem.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param tag   Subsystem that the memory is accounted to.
+ * @param nmemb Number of elements in the array.
+ * @param size  Size of each element in bytes.
+ *
+ * @return Allocated memory or NULL if an error occurred.
+ *
+ * @see mem_free
+ */
+void* mem_calloc(mem_tag_t tag, size_t nmemb, size_t size) {
+	void *ptr;
+
+	/* Don't let the multiplication wrap around. */
+	if ((size != 0) && (nmemb > ((size_t)-1 - sizeof(mem_header_t)) / size)) {
+		counter_add(&mem_accounts[tag].failed, 1);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = mem_alloc(tag, nmemb * size);
+	if (ptr != NULL)
+		memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+/**
+ * Changes the size of a block of accounted memory. The block stays accounted
+ * to the subsystem it was allocated for.
+ *
+ * @param tag  Subsystem that the memory is accounted to if it's a new block.
+ * @param ptr  Block to be resized or NULL to allocate a new one.
+ * @param size New size of the block in bytes.
+ *
+ * @return Resized block or NULL if an error occurred, in which case the
+ *         original block is left untouched.
+ */
+void* mem_realloc(mem_tag_t tag, void *ptr, size_t size) {
+	mem_header_t *hdr;
+	size_t prev;
+
+	if (ptr == NULL)
+		return mem_alloc(tag, size);
+
+	/* Only growing the block counts against the limit. */
+	hdr = (mem_header_t*)ptr - 1;
+	tag = hdr->info.tag;
+	prev = hdr->info.size;
+	if ((size > prev) && mem_over(tag, size - prev)) {
+		counter_add(&mem_accounts[tag].failed, 1);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	hdr = (mem_header_t*)realloc(hdr, sizeof(mem_header_t) + size);
+	if (hdr == NULL) {
+		counter_add(&mem_accounts[tag].failed, 1);
+		return NULL;
+	}
+	hdr->info.size = size;
+	mem_charge(tag, size, prev);
+
+	return hdr + 1;
+}
+
+/**
+ * Duplicates a string on behalf of a subsystem.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param tag Subsystem that the memory is accounted to.
+ * @param str String to be duplicated.
+ *
+ * @return Duplicated string or NULL if an error occurred.
+ *
+ * @see mem_free
+ */
+char* mem_strdup(mem_tag_t tag, const char *str) {
+	char *dup;
+	size_t len;
+
+	len = strlen(str) + 1;
+	dup = (char*)mem_alloc(tag, len);
+	if (dup != NULL)
+		memcpy(dup, str, len);
+
+	return dup;
+}
+
+/**
+ * Frees up a block of accounted memory.
+ *
+ * @param ptr Block allocated by any of the accounting functions or NULL.
+ */
+void mem_free(void *ptr) {
+	mem_header_t *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (mem_header_t*)ptr - 1;
+	mem_charge(hdr->info.tag, 0, hdr->info.size);
+	counter_add(&mem_accounts[hdr->info.tag].count, (uint64_t)-1);
+	free(hdr);
+}
+
+/**
+ * Hands a block of accounted memory over to another subsystem, such as when
+ * a rendered reply ends up in the content cache. This never fails, so the new
+ * subsystem may end up over its limit and has to make room on its own.
+ *
+ * @param ptr Block allocated by any of the accounting functions or NULL.
+ * @param tag Subsystem that the memory is accounted to from now on.
+ */
+void mem_retag(void *ptr, mem_tag_t tag) {
+	mem_header_t *hdr;
+
+	if (ptr == NULL)
+		return;
 
-	return ret;
+	hdr = (mem_header_t*)ptr - 1;
+	if (hdr->info.tag == tag)
+		return;
+
+	mem_charge(hdr->info.tag, 0, hdr->info.size);
+	counter_add(&mem_accounts[hdr->info.tag].count, (uint64_t)-1);
+	hdr->info.tag = tag;
+	mem_charge(tag, hdr->info.size, 0);
+	counter_add(&mem_accounts[tag].count, 1);
 }
 
 /**
- * Concatenates paths together safely.
+ * Checks if allocating some more memory would take a subsystem over its limit.
+ * Concurrent allocations aren't serialized, so they may overshoot it a bit.
  *
- * @warning This function allocates memory that must be free'd by you!
+ * @param tag  Subsystem to be checked.
+ * @param size Number of bytes about to be allocated.
  *
- * @param buf Pointer to final path string. ((Re)Allocated internally)
- * @param sep Path separator to use when normalizing and concatenating.
- * @param ... Paths to be concatenated. WARNING: A NULL must be placed at the
- *            end to indicate the end of the list.
+ * @return TRUE if the subsystem would end up over its limit.
+ */
+int mem_over(mem_tag_t tag, size_t size) {
+	uint64_t limit;
+
+	limit = atomic_get_u64(&mem_accounts[tag].limit);
+	return (limit > 0) &&
+		((atomic_get_u64(&mem_accounts[tag].bytes) + size) > limit);
+}
+
+/**
+ * Updates the number of bytes accounted to a subsystem after a block of memory
+ * changed size.
  *
- * @return Size of the final buffer or 0 if an error occurred.
+ * @param tag  Subsystem that the memory is accounted to.
+ * @param size Current size of the block in bytes.
+ * @param prev Previous size of the block in bytes.
  */
-size_t path_concat(char **buf, const char *sep, ...) {
-	va_list ap;
-	size_t len;
-	const char *path;
-	char *cur;
+void mem_charge(mem_tag_t tag, size_t size, size_t prev) {
+	mem_account_t *acct;
+	uint64_t delta;
+	uint64_t bytes;
+
+	/* Unsigned arithmetic wraps around nicely when shrinking. */
+	acct = &mem_accounts[tag];
+	delta = (uint64_t)size - (uint64_t)prev;
+	bytes = (uint64_t)atomic_add_u64(&acct->bytes, delta) + delta;
+	if ((size > prev) && (bytes > atomic_get_u64(&acct->peak)))
+		gauge_set(&acct->peak, bytes);
+}
 
-	/* Initialize things and ensure we leave space for the NULL terminator. */
-	*buf = NULL;
-	len = 1;
+/**
+ * Applies the memory limits of each subsystem from a configuration. Limits are
+ * shared by every server instance in the process, so the last one wins.
+ *
+ * @param cfg Configuration with the limits.
+ */
+void mem_limit(const config_t *cfg) {
+	int i;
 
-	/* Go through the paths. */
-	va_start(ap, sep);
-	path = va_arg(ap, char *);
-	while (path != NULL) {
-		size_t plen;
+	for (i = 0; i < MEM_TAGS; i++)
+		gauge_set(&mem_accounts[i].limit, cfg->memory_limits[i]);
+}
 
-		/* Reallocate the buffer memory and set the cursor for concatenation. */
-		plen = len;
-		len += strlen(path);
-		*buf = (char *)realloc(*buf, (len + 1) * sizeof(char));
-		if (*buf == NULL)
-			return 0L;
-		cur = (*buf) + plen - 1;
+/**
+ * =============================================================================
+ * === Memory Buffers ==========================================================
+ * =============================================================================
+ */
 
-		/* Should we bother prepending the path separator? */
-		if ((plen > 1) && (*(cur - 1) != *sep)) {
-			*cur = *sep;
-			cur++;
-			len++;
-		}
+/**
+ * Initializes an empty memory buffer.
+ *
+ * @param buf Buffer to be initialized.
+ * @param tag Subsystem that the buffer's memory is accounted to.
+ */
+void buffer_init(buffer_t *buf, mem_tag_t tag) {
+	buf->data = NULL;
+	buf->len = 0;
+	buf->size = 0;
+	buf->tag = tag;
+}
 
-		/* Concatenate the next path while normalizing separators. */
-		while (*path != '\0') {
-			*cur = *path;
-			if ((*cur == '/') || (*cur == '\\'))
-				*cur = *sep;
+/**
+ * Appends data to a memory buffer, growing it if needed.
+ *
+ * @param buf  Buffer to append the data to.
+ * @param data Data to be appended.
+ * @param len  Length of the data in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int buffer_append(buffer_t *buf, const void *data, size_t len) {
+	/* Grow the buffer geometrically if needed. */
+	if ((buf->len + len) > buf->size) {
+		size_t size;
+		void *tmp;
 
-			cur++;
-			path++;
+		size = (buf->size == 0) ? 256 : buf->size;
+		while (size < (buf->len + len))
+			size *= 2;
+
+		tmp = mem_realloc(buf->tag, buf->data, size);
+		if (tmp == NULL) {
+			log_syserr(LOG_ERROR, "Failed to grow memory buffer");
+			return 0;
 		}
+		buf->data = (char*)tmp;
+		buf->size = size;
+	}
 
-		/* Ensure we NULL terminate the string. */
-		*cur = '\0';
+	/* Append the data. */
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
 
-		/* Fetch the next path. */
-		path = va_arg(ap, char *);
-	}
-	va_end(ap);
+	return 1;
+}
 
-	return len;
+/**
+ * Frees up the memory used by a buffer and leaves it empty.
+ *
+ * @param buf Buffer to be free'd.
+ */
+void buffer_free(buffer_t *buf) {
+	mem_free(buf->data);
+	buffer_init(buf, buf->tag);
 }
 
 /**
@@ -1696,47 +12388,75 @@ size_t path_concat(char **buf, const char *sep, ...) {
  */
 
 /**
- * Prints out logging information with an associated log level tag using the
- * printf function style.
+ * Logs a message with an associated log level tag using the printf function
+ * style, handing it over to the logging hook if one was set, or printing it
+ * to the standard output in a single call so that lines from different
+ * threads don't get mixed up.
  *
  * @param level  Severity of the logged information.
+ * @param suffix String appended to the message or NULL.
  * @param format Format of the desired output without the tag.
  * @param ap     Additional variables to be populated.
  */
-void log_vprintf(log_level_t level, const char *format, va_list ap) {
+void log_vprintf(log_level_t level, const char *suffix, const char *format,
+				 va_list ap) {
+	char msg[LOG_MAX_LEN];
+	const char *tag;
 	char ts[22];
+	time_t tm;
+	struct tm *gmt;
+	size_t len;
+
+	/* Drop messages that are too verbose. */
+	if (level > log_level)
+		return;
+
+	/* Build the message. */
+	vsnprintf(msg, sizeof(msg), format, ap);
+	msg[sizeof(msg) - 1] = '\0';
+	if (suffix != NULL) {
+		len = strlen(msg);
+		strncpy(msg + len, suffix, sizeof(msg) - len - 1);
+		msg[sizeof(msg) - 1] = '\0';
+	}
+
+	/* Let the host application deal with it if it wants to. */
+	if (log_hook != NULL) {
+		log_hook((int)level, msg, log_hook_ctx);
+		return;
+	}
 
 	/* Time and date. */
-	time_t tm = time(NULL);
-	struct tm* gmt = gmtime(&tm);
+	tm = time(NULL);
+	gmt = gmtime(&tm);
 	if (strftime(ts, 22, "%Y-%m-%dT%H:%M:%SZ", gmt) == 0)
 		ts[20] = '?';
 	ts[21] = '\0';
 
-	/* Print the log level tag. */
+	/* Get the log level tag. */
 	switch (level) {
 		case LOG_CRIT:
-			printf("%s [CRITICAL] ", ts);
+			tag = "CRITICAL";
 			break;
 		case LOG_ERROR:
-			printf("%s [ERROR] ", ts);
+			tag = "ERROR";
 			break;
 		case LOG_WARNING:
-			printf("%s [WARNING] ", ts);
+			tag = "WARNING";
 			break;
 		case LOG_NOTICE:
-			printf("%s [NOTICE] ", ts);
+			tag = "NOTICE";
 			break;
 		case LOG_INFO:
-			printf("%s [INFO] ", ts);
+			tag = "INFO";
 			break;
 		default:
-			printf("%s [UNKNOWN] ", ts);
+			tag = "UNKNOWN";
 			break;
 	}
 
 	/* Print the actual message. */
-	vprintf(format, ap);
+	printf("%s [%s] %s\n", ts, tag, msg);
 }
 
 /**
@@ -1753,11 +12473,8 @@ void log_printf(log_level_t level, const char *format, ...) {
 
 	/* Print the log message. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vprintf(level, NULL, format, args);
 	va_end(args);
-	
-	/* Ensure we finish with a newline. */
-	printf("\n");
 }
 
 /**
@@ -1770,6 +12487,7 @@ void log_printf(log_level_t level, const char *format, ...) {
  */
 void log_syserr(log_level_t level, const char *format, ...) {
 	va_list args;
+	char reason[256];
 	int err;
 
 #ifdef _WIN32
@@ -1782,26 +12500,23 @@ void log_syserr(log_level_t level, const char *format, ...) {
 		szErrorMessage = strdup("FormatMessage failed");
 	}
 
-	/* Print the application's error message. */
-	va_start(args, format);
-	log_vprintf(level, format, args);
-	va_end(args);
-
-	/* Print the system error message. */
-	printf(": System Error (%d) %ls\n", err, szErrorMessage);
+	/* Build the system error message. */
+	snprintf(reason, sizeof(reason), ": System Error (%d) %ls", err,
+		szErrorMessage);
+	reason[sizeof(reason) - 1] = '\0';
 
 	/* Free up any resources. */
 	LocalFree(szErrorMessage);
 #else
-	/* Print the application's error message. */
+	/* Build the system error message. */
 	err = errno;
+	snprintf(reason, sizeof(reason), ": (%d) %s", err, strerror(err));
+#endif /* _WIN32 */
+
+	/* Print the application's error message along with the system's. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vprintf(level, reason, format, args);
 	va_end(args);
-
-	/* Print the system error message. */
-	printf(": (%d) %s\n", err, strerror(err));
-#endif /* _WIN32 */
 }
 
 /**
@@ -1815,6 +12530,7 @@ void log_syserr(log_level_t level, const char *format, ...) {
  */
 void log_sockerr(log_level_t level, const char *format, ...) {
 	va_list args;
+	char reason[256];
 	int err;
 
 #ifdef _WIN32
@@ -1827,45 +12543,525 @@ void log_sockerr(log_level_t level, const char *format, ...) {
 		szErrorMessage = strdup("FormatMessage failed");
 	}
 
-	/* Print the application's error message. */
-	va_start(args, format);
-	log_vprintf(level, format, args);
-	va_end(args);
-
-	/* Print the system error message. */
-	printf(": WSAError (%d) %ls\n", err, szErrorMessage);
+	/* Build the system error message. */
+	snprintf(reason, sizeof(reason), ": WSAError (%d) %ls", err,
+		szErrorMessage);
+	reason[sizeof(reason) - 1] = '\0';
 
 	/* Free up any resources. */
 	LocalFree(szErrorMessage);
 #else
-	/* Print the application's error message. */
+	/* Build the system error message. */
 	err = errno;
+	snprintf(reason, sizeof(reason), ": (%d) %s", err, strerror(err));
+#endif /* _WIN32 */
+
+	/* Print the application's error message along with the system's. */
 	va_start(args, format);
-	log_vprintf(level, format, args);
+	log_vprintf(level, reason, format, args);
 	va_end(args);
+}
 
-	/* Print the system error message. */
-	printf(": (%d) %s\n", err, strerror(err));
-#endif /* _WIN32 */
+#ifdef WITH_TLS
+/**
+ * Prints out a TLS error message along with the reason from the OpenSSL error
+ * queue.
+ *
+ * @param level  Severity of the logged information.
+ * @param format Format of the desired output without the tag.
+ * @param ...    Additional variables to be populated.
+ */
+void log_tlserr(log_level_t level, const char *format, ...) {
+	va_list args;
+	unsigned long err;
+	char reason[256];
+
+	/* Get the reason and clear the queue for the next operation. */
+	err = ERR_get_error();
+	if (err != 0) {
+		reason[0] = ':';
+		reason[1] = ' ';
+		ERR_error_string_n(err, reason + 2, sizeof(reason) - 2);
+	} else {
+		strcpy(reason, ": connection closed");
+	}
+	ERR_clear_error();
+
+	/* Print the application's error message along with the reason. */
+	va_start(args, format);
+	log_vprintf(level, reason, format, args);
+	va_end(args);
 }
+#endif /* WITH_TLS */
 
 /**
  * =============================================================================
- * === Lookup Constants ========================================================
+ * === Library Interface =======================================================
  * =============================================================================
  */
 
 /**
- * Initializes our constant variables that will be used later for quick checks.
+ * Creates a new server instance with its runtime configuration loaded, but
+ * without starting it.
+ *
+ * @warning This function allocates memory that must be free'd using a special
+ *          function.
+ *
+ * @param docroot     Path to the document root folder.
+ * @param config_path Path to the configuration file or NULL to start from the
+ *                    compile-time defaults.
+ *
+ * @return Server instance or NULL if an error occurred.
+ *
+ * @see amigos_free
+ */
+amigos_t* amigos_new(const char *docroot, const char *config_path) {
+	amigos_t *srv;
+	int i;
+
+	/* Try to allocate our instance. */
+	srv = (amigos_t*)mem_calloc(MEM_SERVER, 1, sizeof(amigos_t));
+	if (srv == NULL) {
+		log_syserr(LOG_CRIT, "Failed to allocate server instance");
+		return NULL;
+	}
+
+	/* Initialize state variables. */
+	srv->af = LISTEN_AF;
+	srv->running = 0;
+	srv->reload_pending = 0;
+	srv->started = 0;
+	srv->background = 0;
+	srv->worker = 0;
+	srv->rcu_epoch = 1;
+	srv->rcu_retired_list = NULL;
+	srv->gopher_types = NULL;
+	srv->gopher_types_generation = 0;
+	srv->routes = NULL;
+	srv->search_index = NULL;
+	srv->search_thread = INVALID_THREAD;
+	srv->proxy_jobs = NULL;
+	srv->proxy_thread = INVALID_THREAD;
+	srv->watchdog_thread = INVALID_THREAD;
+	srv->server_socket = SOCKERR;
+#ifdef HAS_UNIX_SOCKETS
+	srv->unix_socket = SOCKERR;
+	srv->admin_socket = SOCKERR;
+	srv->admin_path = NULL;
+	srv->admin_thread = INVALID_THREAD;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	srv->tls_socket = SOCKERR;
+	srv->tls_ctx = NULL;
+#endif /* WITH_TLS */
+#ifdef WITH_PLUGINS
+	srv->plugins = NULL;
+	srv->plugins_len = 0;
+#endif /* WITH_PLUGINS */
+#ifdef HAS_PREFORK
+	srv->nworkers = 0;
+#endif /* HAS_PREFORK */
+	for (i = 0; i < RCU_MAX_READERS; i++)
+		srv->rcu_readers[i] = 0;
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		srv->connections[i].server = srv;
+		srv->connections[i].sockfd = SOCKERR;
+		srv->connections[i].status = 0;
+		srv->connections[i].thread = INVALID_THREAD;
+		srv->connections[i].selector = NULL;
+		srv->connections[i].query = NULL;
+#ifdef WITH_TLS
+		srv->connections[i].ssl = NULL;
+#endif /* WITH_TLS */
+	}
+	mutex_init(&srv->conn_lock);
+#ifdef HAS_CGROUPS
+	srv->memory_cgroup = NULL;
+	srv->memory_psi = NULL;
+	srv->memory_checked = 0;
+#endif /* HAS_CGROUPS */
+	srv->warmup_items = NULL;
+	srv->warmup_len = 0;
+	srv->warmup_running = 0;
+	for (i = 0; i < WARMUP_THREADS; i++)
+		srv->warmup_workers[i].thread = INVALID_THREAD;
+	mutex_init(&srv->warmup_lock);
+	hitters_init(&srv->top_requests);
+	hitters_init(&srv->top_bytes);
+	hitters_init(&srv->top_clients);
+	srv->hitters_decayed = time(NULL);
+	memset(&srv->local_stats, '\0', sizeof(srv->local_stats));
+	srv->stats = &srv->local_stats;
+#ifdef HAS_MMAP
+	srv->stats_file = NULL;
+#endif /* HAS_MMAP */
+
+	/* Keep our own copies of the paths. */
+	srv->docroot = mem_strdup(MEM_SERVER, docroot);
+	srv->config_path = (config_path != NULL) ?
+		mem_strdup(MEM_SERVER, config_path) : NULL;
+	if ((srv->docroot == NULL) ||
+			((config_path != NULL) && (srv->config_path == NULL))) {
+		log_syserr(LOG_CRIT, "Failed to allocate server paths");
+		goto failure;
+	}
+
+	/* Load the runtime configuration. */
+	if (config_path != NULL) {
+		srv->config = config_load(config_path);
+	} else {
+		srv->config = config_new();
+	}
+	if (srv->config == NULL)
+		goto failure;
+
+	/* Setup the content cache. */
+	if (!cache_init(&srv->content_cache, CACHE_MAX_SIZE))
+		goto failure;
+	stats_attach(srv, 0);
+
+	return srv;
+
+failure:
+	amigos_free(srv);
+	return NULL;
+}
+
+/**
+ * Sets an option of a server instance's configuration, using the same keys as
+ * the configuration file.
+ *
+ * @warning Must only be called before the server is started. Options set this
+ *          way are replaced by the ones in the configuration file whenever it
+ *          gets reloaded.
+ *
+ * @param srv   Server instance.
+ * @param key   Name of the option.
+ * @param value Value of the option as a string.
+ *
+ * @return TRUE if the operation was successful, FALSE if the server has
+ *         already been started, the option is unknown, or its value is invalid.
+ */
+int amigos_set(amigos_t *srv, const char *key, const char *value) {
+	uint16_t listen_port;
+
+	/* Ensure that nobody is using the configuration yet. */
+	if (srv->started) {
+		log_printf(LOG_ERROR, "Tried to set option '%s' on a running server",
+			key);
+		return 0;
+	}
+
+	/* Advertise the port we are listening on unless told otherwise. */
+	listen_port = srv->config->listen_port;
+	if (!config_set(srv->config, key, value))
+		return 0;
+	if ((strcmp(key, "listen_port") == 0) &&
+			(srv->config->port == listen_port)) {
+		srv->config->port = srv->config->listen_port;
+	}
+
+	return 1;
+}
+
+/**
+ * Starts up a server instance: loads its file type associations and routes,
+ * binds its listening sockets, and starts its background threads, unless it's
+ * going to run in pre-fork mode, where that's left up to each worker.
+ *
+ * @param srv Server instance.
+ *
+ * @return TRUE if the server is ready to accept connections, FALSE otherwise.
+ *
+ * @see amigos_free
+ */
+int amigos_start(amigos_t *srv) {
+	/* Ensure that we only start once. */
+	if (srv->started) {
+		log_printf(LOG_CRIT, "Tried to start a server that's already started.");
+		return 0;
+	}
+
+	/* Check if document root folder actually exists. */
+	if (!dir_exists(srv->docroot)) {
+		log_printf(LOG_CRIT, "Document root path '%s' doesn't exist.",
+			srv->docroot);
+		return 0;
+	}
+
+	/* Hold every subsystem to its memory limit from the start. */
+	mem_limit(srv->config);
+
+	/* Load Gopher file type information. */
+	srv->gopher_types = gopher_types_load(srv, srv->config->filetypes_path);
+	if (srv->gopher_types == NULL)
+		return 0;
+#ifdef DEBUG
+	gopher_types_dump(srv->gopher_types);
+#endif /* DEBUG */
+
+	/* Setup the selector routes. */
+	srv->started = 1;
+	if (!router_init(srv))
+		return 0;
+
+	/* Start server. */
+	srv->server_socket = server_start(srv, srv->config);
+	if (srv->server_socket == SOCKERR)
+		return 0;
+#ifdef HAS_UNIX_SOCKETS
+	if (*srv->config->unix_path != '\0') {
+		srv->unix_socket = server_listen_unix(srv->config,
+			srv->config->unix_path);
+		if (srv->unix_socket == SOCKERR)
+			return 0;
+		log_printf(LOG_INFO, "Server running on %s", srv->config->unix_path);
+	}
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	if (!tls_start(srv, srv->config))
+		return 0;
+#endif /* WITH_TLS */
+	srv->last_stats = time(NULL);
+
+#ifdef HAS_PREFORK
+	/* Workers share our listeners and content cache. */
+	srv->nworkers = srv->config->workers;
+#endif /* HAS_PREFORK */
+#ifdef HAS_MMAP
+	/* Publish our statistics with a slot for each process. */
+	if (*srv->config->stats_path != '\0') {
+		if (!stats_open(srv, srv->config->stats_path, srv->nworkers + 1))
+			return 0;
+		log_printf(LOG_INFO, "Publishing statistics in %s",
+			srv->config->stats_path);
+	}
+#endif /* HAS_MMAP */
+	if (srv->config->cache_tinylfu && !cache_admission(&srv->content_cache))
+		return 0;
+#ifdef HAS_CGROUPS
+	memory_init(srv);
+#endif /* HAS_CGROUPS */
+#ifdef HAS_PREFORK
+	if (srv->nworkers > 0) {
+		amigos_socket_t fds[3];
+		int nfds;
+		int i;
+
+		if (!cache_share(&srv->content_cache))
+			return 0;
+
+		/* Don't let the workers that lose the race to accept get stuck. */
+		nfds = amigos_listeners(srv, fds, 3);
+		for (i = 0; i < nfds; i++) {
+			if (!socket_set_blocking(fds[i], 0))
+				return 0;
+		}
+
+		return 1;
+	}
+#endif /* HAS_PREFORK */
+
+	/* Start building the search index and revalidating proxied objects. */
+	server_background(srv);
+	return 1;
+}
+
+/**
+ * Asks a server instance to stop accepting connections. The server stops
+ * once its loop notices it, or when the instance is free'd.
+ *
+ * @remark This function is safe to be called from a signal handler.
+ *
+ * @param srv Server instance.
+ */
+void amigos_stop(amigos_t *srv) {
+	if (srv != NULL)
+		srv->running = 0;
+}
+
+/**
+ * Asks a server instance to reload its configuration file and file type
+ * associations. The reload happens on the next housekeeping round.
+ *
+ * @remark This function is safe to be called from a signal handler.
+ *
+ * @param srv Server instance.
+ */
+void amigos_reload(amigos_t *srv) {
+	if (srv != NULL)
+		srv->reload_pending = 1;
+}
+
+/**
+ * Stops a server instance if needed, waiting for every request that's being
+ * processed, and frees up all of its resources.
+ *
+ * @param srv Server instance to be free'd.
+ *
+ * @see amigos_new
+ */
+void amigos_free(amigos_t *srv) {
+	if (srv == NULL)
+		return;
+
+	/* Close all of the connections. */
+	if ((srv->server_socket != SOCKERR) || srv->running)
+		server_stop(srv);
+#ifdef HAS_UNIX_SOCKETS
+	if ((srv->config != NULL) && (*srv->config->unix_path != '\0') &&
+			srv->started && !srv->worker) {
+		unlink(srv->config->unix_path);
+	}
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef HAS_MMAP
+	if ((srv->stats_file != NULL) && !srv->worker)
+		unlink(srv->config->stats_path);
+#endif /* HAS_MMAP */
+
+	/* Stop every subsystem that was started. */
+	if (srv->background) {
+		warmup_stop(srv);
+#ifdef HAS_UNIX_SOCKETS
+		admin_stop(srv);
+#endif /* HAS_UNIX_SOCKETS */
+		watchdog_stop(srv);
+		search_stop(srv);
+		proxy_stop(srv);
+	}
+#ifdef WITH_TLS
+	tls_stop(srv);
+#endif /* WITH_TLS */
+	router_free(srv);
+	cache_free(&srv->content_cache);
+#ifdef WITH_PLUGINS
+	plugins_free(srv);
+#endif /* WITH_PLUGINS */
+	rcu_reclaim(srv);
+#ifdef HAS_MMAP
+	stats_close(srv);
+#endif /* HAS_MMAP */
+	hitters_free(&srv->top_requests);
+	hitters_free(&srv->top_bytes);
+	hitters_free(&srv->top_clients);
+#ifdef HAS_CGROUPS
+	memory_free(srv);
+#endif /* HAS_CGROUPS */
+	mutex_destroy(&srv->warmup_lock);
+	mutex_destroy(&srv->conn_lock);
+
+	/* Free up the remaining state. */
+	config_free(srv->config);
+	gopher_types_free(srv->gopher_types);
+	if (srv->docroot != NULL)
+		mem_free(srv->docroot);
+	if (srv->config_path != NULL)
+		mem_free(srv->config_path);
+	mem_free(srv);
+}
+
+/**
+ * Gets the listening sockets of a server instance so that they can be
+ * watched by the host application's own event loop.
+ *
+ * @param srv Server instance.
+ * @param fds Array to be populated with the listening sockets.
+ * @param max Maximum number of sockets that fit in the array.
+ *
+ * @return Number of listening sockets placed in the array.
+ */
+int amigos_listeners(const amigos_t *srv, amigos_socket_t *fds, int max) {
+	int n;
+
+	n = 0;
+	if ((srv->server_socket != SOCKERR) && (n < max))
+		fds[n++] = srv->server_socket;
+#ifdef HAS_UNIX_SOCKETS
+	if ((srv->unix_socket != SOCKERR) && (n < max))
+		fds[n++] = srv->unix_socket;
+#endif /* HAS_UNIX_SOCKETS */
+#ifdef WITH_TLS
+	if ((srv->tls_socket != SOCKERR) && (n < max))
+		fds[n++] = srv->tls_socket;
+#endif /* WITH_TLS */
+
+	return n;
+}
+
+/**
+ * Accepts a connection waiting on one of the server's listening sockets.
+ *
+ * @warning Must be called from the same thread as amigos_poll.
+ *
+ * @param srv      Server instance.
+ * @param listener Listening socket that became readable.
+ *
+ * @return TRUE if the connection is being served, FALSE otherwise.
+ *
+ * @see amigos_listeners
+ */
+int amigos_accept(amigos_t *srv, amigos_socket_t listener) {
+	return server_accept(srv, listener);
+}
+
+/**
+ * Serves a client connection that was accepted by the host application.
+ *
+ * @warning Must be called from the same thread as amigos_poll.
+ *
+ * @param srv    Server instance.
+ * @param sockfd Connected client socket. Closed by the server once the
+ *               request has been served.
+ * @param addr   Client address string or NULL if unknown.
+ *
+ * @return TRUE if the connection is being served, FALSE if it couldn't be, in
+ *         which case the socket is still owned by the caller.
+ */
+int amigos_serve(amigos_t *srv, amigos_socket_t sockfd, const char *addr) {
+	counter_add(&srv->stats->connections, 1);
+	return server_serve(srv, sockfd, CONN_INUSE, (addr != NULL) ? addr : "?");
+}
+
+/**
+ * Performs the periodic housekeeping of a server instance. Should be called
+ * at least once a second by host applications that drive the server from
+ * their own event loop.
+ *
+ * @param srv Server instance.
+ *
+ * @return Number of new connections that can be accepted at the moment.
+ */
+int amigos_poll(amigos_t *srv) {
+	return server_poll(srv);
+}
+
+/**
+ * Runs the server's own listening loop until it's asked to stop, or supervises
+ * the worker processes that run it if the server is in pre-fork mode.
+ *
+ * @param srv Server instance.
+ *
+ * @see amigos_stop
  */
-void const_init(void) {
-	invalid_host_c = (char*)malloc((strlen(INVALID_HOST) + 1) * sizeof(char));
-	strcpy(invalid_host_c, INVALID_HOST);
+void amigos_run(amigos_t *srv) {
+#ifdef HAS_PREFORK
+	if (srv->nworkers > 0) {
+		prefork_run(srv);
+		return;
+	}
+#endif /* HAS_PREFORK */
+
+	server_loop(srv);
 }
 
 /**
- * Frees up the memory allocated for our constants.
+ * Replaces the function that receives every log message, which is shared by
+ * all of the server instances in the process.
+ *
+ * @param func Logging function or NULL to print to the standard output.
+ * @param ctx  Context pointer handed to the logging function.
  */
-void const_free(void) {
-	free(invalid_host_c);
+void amigos_set_logger(amigos_log_func func, void *ctx) {
+	log_hook_ctx = ctx;
+	log_hook = func;
 }
@@ -0,0 +1,82 @@
+/**
+ * amigos.h
+ * Public interface of the amigos Gopher server engine, for embedding one or
+ * more server instances inside another application. Build amigos.c with
+ * AMIGOS_LIBRARY defined to leave out the standalone program's entry point.
+ *
+ * The engine doesn't touch the host's signal dispositions: the threads it
+ * starts block SIGPIPE (along with SIGINT, SIGHUP and SIGTERM) and its sends
+ * ask not to raise it, so a client going away mid-reply can't kill the host.
+ * Hosts that serve connections from their own threads through amigos_serve
+ * are fine too, since requests are always processed by the engine's threads.
+ *
+ * Some state is shared by every instance in the process: the log level and
+ * hook, the memory accounts and their limits, and the sampling profiler.
+ * amigos_run in pre-fork mode (the workers option) forks the host process
+ * itself, so it should be called before the host creates threads of its own.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _AMIGOS_H
+#define _AMIGOS_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+
+	#define AMIGOS_EXPORT __declspec(dllexport)
+	typedef SOCKET amigos_socket_t;
+#else
+	#if defined(__GNUC__) && (__GNUC__ >= 4)
+		#define AMIGOS_EXPORT __attribute__((visibility("default")))
+	#else
+		#define AMIGOS_EXPORT
+	#endif /* __GNUC__ >= 4 */
+	typedef int amigos_socket_t;
+#endif /* _WIN32 */
+
+/* Severity of logged messages. */
+#define AMIGOS_LOG_CRIT    0
+#define AMIGOS_LOG_ERROR   1
+#define AMIGOS_LOG_WARNING 2
+#define AMIGOS_LOG_NOTICE  3
+#define AMIGOS_LOG_INFO    4
+
+/**
+ * Opaque server instance.
+ */
+typedef struct amigos amigos_t;
+
+/**
+ * Receives a complete log message, without a trailing newline. May be called
+ * from any of the server's threads at the same time.
+ */
+typedef void (*amigos_log_func)(int level, const char *msg, void *ctx);
+
+/* Instance lifecycle. */
+AMIGOS_EXPORT amigos_t* amigos_new(const char *docroot,
+								   const char *config_path);
+AMIGOS_EXPORT int amigos_set(amigos_t *srv, const char *key,
+							 const char *value);
+AMIGOS_EXPORT int amigos_start(amigos_t *srv);
+AMIGOS_EXPORT void amigos_stop(amigos_t *srv);
+AMIGOS_EXPORT void amigos_free(amigos_t *srv);
+
+/* Driving the server from the host's event loop. */
+AMIGOS_EXPORT int amigos_listeners(const amigos_t *srv, amigos_socket_t *fds,
+								   int max);
+AMIGOS_EXPORT int amigos_accept(amigos_t *srv, amigos_socket_t listener);
+AMIGOS_EXPORT int amigos_serve(amigos_t *srv, amigos_socket_t sockfd,
+							   const char *addr);
+AMIGOS_EXPORT int amigos_poll(amigos_t *srv);
+AMIGOS_EXPORT void amigos_reload(amigos_t *srv);
+
+/* Letting the server drive itself. */
+AMIGOS_EXPORT void amigos_run(amigos_t *srv);
+
+/* Logging. */
+AMIGOS_EXPORT void amigos_set_logger(amigos_log_func func, void *ctx);
+
+#endif /* _AMIGOS_H */
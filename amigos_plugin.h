@@ -0,0 +1,56 @@
+/**
+ * amigos_plugin.h
+ * Stable ABI for in-process dynamic handler plugins of the amigos Gopher
+ * server. A plugin is a shared library that exports the symbols described
+ * below and gets mapped to a selector prefix in the plugins configuration file.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _AMIGOS_PLUGIN_H
+#define _AMIGOS_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+	#define AMIGOS_PLUGIN_EXPORT __declspec(dllexport)
+#else
+	#define AMIGOS_PLUGIN_EXPORT
+#endif /* _WIN32 */
+
+/* Version of the ABI. Must be exported by plugins as amigos_plugin_abi. */
+#define AMIGOS_PLUGIN_ABI 1
+
+/* Return values of a handler. */
+#define AMIGOS_HANDLER_ERROR 0  /* Failed, server replies with an error item. */
+#define AMIGOS_HANDLER_MENU  1  /* Output is a menu, server terminates it. */
+#define AMIGOS_HANDLER_RAW   2  /* Output is sent exactly as written. */
+
+/**
+ * Request information handed to a plugin handler.
+ */
+typedef struct amigos_request {
+	const char *selector;  /* Full sanitized selector requested. */
+	const char *path;      /* Part of the selector after the mapped prefix. */
+	const char *query;     /* Search string sent after a TAB or NULL. */
+	const char *client;    /* Client address string. */
+	const char *hostname;  /* Hostname to be used in generated items. */
+	unsigned short port;   /* Port to be used in generated items. */
+} amigos_request_t;
+
+/**
+ * Output writer handed to a plugin handler. Data is buffered by the server
+ * before being sent to the client.
+ */
+typedef struct amigos_writer {
+	int (*write)(struct amigos_writer *w, const void *buf, size_t len);
+	void *ctx;
+} amigos_writer_t;
+
+/* Plugin exported functions. Only amigos_handler is required. */
+typedef int (*amigos_plugin_init_func)(const char *prefix);
+typedef int (*amigos_handler_func)(const amigos_request_t *req,
+								   amigos_writer_t *out);
+typedef void (*amigos_plugin_free_func)(void);
+
+#endif /* _AMIGOS_PLUGIN_H */
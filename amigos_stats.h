@@ -0,0 +1,105 @@
+/**
+ * amigos_stats.h
+ * Layout of the live statistics file published by the amigos Gopher server.
+ * The file starts with a header followed by an array of slots, one for each
+ * process, which are updated in place while the server is running so that
+ * they can be read at any time without involving the server.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _AMIGOS_STATS_H
+#define _AMIGOS_STATS_H
+
+#include <stdint.h>
+
+/* Identification of the file. The version changes whenever the layout does. */
+#define AMIGOS_STATS_MAGIC   0x54534d41UL  /* "AMST" */
+#define AMIGOS_STATS_VERSION 5
+
+/* Slot 0 belongs to the single process or the pre-fork master. */
+#define AMIGOS_STATS_SLOTS 65
+
+/* Kinds of requests. */
+#define AMIGOS_STATS_REQ_STATIC    0  /* Files and menus served locally. */
+#define AMIGOS_STATS_REQ_REDIRECT  1
+#define AMIGOS_STATS_REQ_SEARCH    2
+#define AMIGOS_STATS_REQ_PLUGIN    3
+#define AMIGOS_STATS_REQ_PROXY     4
+#define AMIGOS_STATS_REQ_NOT_FOUND 5
+#define AMIGOS_STATS_REQ_HTTP      6  /* Anything requested over HTTP. */
+#define AMIGOS_STATS_REQ_KINDS     8
+
+/* Request latency histogram. Bucket i counts requests that took less than
+ * AMIGOS_STATS_LATENCY_BASE << i microseconds, the last one everything else. */
+#define AMIGOS_STATS_LATENCY_BUCKETS 20
+#define AMIGOS_STATS_LATENCY_BASE    64
+
+/**
+ * Header at the start of the file. Readers must check the magic number and
+ * the version, and use the sizes in here to find the slots.
+ */
+typedef struct amigos_stats_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;  /* Offset of the first slot. */
+	uint32_t slot_size;    /* Size of each slot. */
+	uint32_t nslots;       /* Number of slots in use. */
+	uint32_t reserved1;
+	int64_t pid;           /* Process that created the file. */
+	int64_t started;       /* UNIX timestamp of when the server started. */
+	uint64_t reserved2[3];
+} amigos_stats_header_t;
+
+/**
+ * Statistics of a single process. Counters only ever go up, while gauges hold
+ * the latest value of something. The size is a multiple of 64 bytes so that
+ * processes don't share cache lines.
+ */
+typedef struct amigos_stats_slot {
+	int64_t pid;          /* Process using the slot, 0 if it never was. */
+	int64_t updated;      /* UNIX timestamp of the last housekeeping round. */
+
+	/* Counters. */
+	uint64_t connections;
+	uint64_t requests[AMIGOS_STATS_REQ_KINDS];
+	uint64_t latency[AMIGOS_STATS_LATENCY_BUCKETS];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t cache_hits;
+	uint64_t cache_stale;
+	uint64_t cache_misses;
+	uint64_t cache_stores;
+	uint64_t cache_admitted;  /* Objects let out of the TinyLFU window. */
+	uint64_t cache_rejected;  /* Objects evicted from the window instead. */
+	uint64_t cache_evictions; /* Objects evicted to make room. */
+	uint64_t tls_handshakes;
+	uint64_t tls_resumed;
+	uint64_t tls_failed;
+	uint64_t tls_ktls;
+	uint64_t tls_bytes_in;
+	uint64_t tls_bytes_out;
+	uint64_t slow_requests;    /* Flagged by the watchdog. */
+	uint64_t stuck_requests;
+	uint64_t killed_requests;  /* Stuck requests that were closed. */
+
+	/* Gauges. */
+	uint64_t active;       /* Connections being served. */
+	uint64_t cache_bytes;  /* Bytes of content in the process' cache. */
+	uint64_t cache_objects;
+	uint64_t proxy_queue;  /* Stale objects waiting to be revalidated. */
+	uint64_t cache_budget; /* Bytes the process' cache is allowed to use. */
+
+	/* Gauges of the whole cgroup, the same in every slot that has them. */
+	uint64_t memory_current;   /* Bytes in use, without inactive file pages. */
+	uint64_t memory_limit;     /* Bytes allowed, 0 if unlimited. */
+	uint64_t memory_pressure;  /* Share of time stalled, in 1/100 percent. */
+
+	uint64_t reserved[7];
+} amigos_stats_slot_t;
+
+/* Fails to compile if a slot stops being a multiple of 64 bytes. */
+typedef char amigos_stats_slot_size_check[
+	((sizeof(amigos_stats_slot_t) % 64) == 0) ? 1 : -1];
+
+#endif /* _AMIGOS_STATS_H */
@@ -0,0 +1,94 @@
+/**
+ * counter.c
+ * Example amigos plugin that counts how many times it has been requested and
+ * echoes back the request information.
+ *
+ * Compile with: gcc -ansi -std=gnu89 -Wall -pedantic -shared -fPIC -I..
+ *               counter.c -o counter.so
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+	#include <windows.h>
+#endif /* _WIN32 */
+
+#include "amigos_plugin.h"
+
+/* Exported ABI version. */
+AMIGOS_PLUGIN_EXPORT const int amigos_plugin_abi = AMIGOS_PLUGIN_ABI;
+
+/* Number of requests handled so far, counted from every serving thread. */
+#ifdef _WIN32
+static LONG volatile hits;
+#else
+static unsigned long hits;
+#endif /* _WIN32 */
+
+/**
+ * Writes an info line to the output.
+ *
+ * @param out Output writer.
+ * @param msg Message to be written.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int write_info(amigos_writer_t *out, const char *msg) {
+	char buf[256];
+	int len;
+
+	len = snprintf(buf, 256, "i%s\tnull.host\t0\r\n", msg);
+	if ((len < 0) || (len >= 256))
+		return 0;
+
+	return out->write(out, buf, len);
+}
+
+/**
+ * Initializes the plugin.
+ *
+ * @param prefix Selector prefix the plugin was mapped to.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+AMIGOS_PLUGIN_EXPORT int amigos_plugin_init(const char *prefix) {
+	(void)prefix;
+	hits = 0;
+	return 1;
+}
+
+/**
+ * Handles a request.
+ *
+ * @param req Request information.
+ * @param out Output writer.
+ *
+ * @return Type of output generated.
+ */
+AMIGOS_PLUGIN_EXPORT int amigos_handler(const amigos_request_t *req,
+										amigos_writer_t *out) {
+	unsigned long count;
+	char msg[200];
+
+	/* Requests come from multiple threads at once. */
+#ifdef _WIN32
+	count = (unsigned long)InterlockedIncrement(&hits);
+#else
+	count = __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+#endif /* _WIN32 */
+
+	snprintf(msg, 200, "This page has been requested %lu times.", count);
+	write_info(out, msg);
+	snprintf(msg, 200, "Path: '%.150s'", req->path);
+	write_info(out, msg);
+	if (req->query != NULL) {
+		snprintf(msg, 200, "Query: '%.150s'", req->query);
+		write_info(out, msg);
+	}
+	snprintf(msg, 200, "Client: %.60s", req->client);
+	write_info(out, msg);
+
+	return AMIGOS_HANDLER_MENU;
+}
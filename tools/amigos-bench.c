@@ -0,0 +1,1268 @@
+/**
+ * amigos-bench.c
+ * End-to-end benchmark of the amigos Gopher server. Generates a document root,
+ * starts the server given to it on it, and runs a set of scenarios against it
+ * a number of times each: cold and warm menus, small, large and huge files, a
+ * huge directory, a flood of missing selectors, and a crowd of slow clients.
+ * The results can be saved as a baseline, and compared against a previous one
+ * with a test of whether the differences are significant or just noise, to
+ * tell if a release is faster or slower than the last one before it's out.
+ *
+ * Only runs on UNIX systems, and expects the server to be built with support
+ * for the admin socket, which is used to empty the cache for cold runs.
+ *
+ * Compile with: gcc -ansi -std=gnu89 -Wall -pedantic -pthread amigos-bench.c
+ *               harness.c -o amigos-bench -lm
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/* Defaults of the command line options. */
+#define BENCH_DURATION    3.0
+#define BENCH_REPETITIONS 5
+#define BENCH_PORT        7070
+#define BENCH_ALPHA       0.05
+#define BENCH_MAX_OPTIONS 32
+#define BENCH_MAX_REPS    50
+
+/* Shape of the generated document root. */
+#define BENCH_DIRS        100
+#define BENCH_DIR_FILES   100
+#define BENCH_HUGE_FILES  10000
+#define BENCH_SMALL_SIZE  1024L
+#define BENCH_LARGE_SIZE  1048576L
+#define BENCH_HUGE_SIZE   1073741824L
+
+/* Behaviour of the clients. */
+#define WARMUP_DURATION   1.0
+#define SLOW_CLIENTS      1000
+#define SLOW_TICK         50     /* Milliseconds between each byte. */
+#define SLOW_READ_SIZE    512
+#define SLOW_RETRY        1.0    /* Seconds before reconnecting. */
+#define SLOW_SETTLE       1000000
+#define IO_TIMEOUT        30
+
+/* Things that are requested. */
+enum request_kinds {
+	REQ_MENU = 0,
+	REQ_SMALL,
+	REQ_LARGE,
+	REQ_HUGE,
+	REQ_DIR,
+	REQ_MISSING
+};
+
+/* Measurements taken in each run. */
+enum metric_ids {
+	METRIC_RPS = 0,
+	METRIC_MBPS,
+	METRIC_P50,
+	METRIC_P99,
+	METRIC_ERRORS,
+	METRICS
+};
+
+/**
+ * Benchmark scenario.
+ */
+typedef struct scenario {
+	const char *name;
+	unsigned int kind;
+	unsigned int clients;
+	unsigned int slow;     /* Slow clients hanging around at the same time. */
+	int cold;              /* Empty the cache before every request. */
+} scenario_t;
+
+/**
+ * Measurement taken in each run of a scenario.
+ */
+typedef struct metric {
+	const char *name;
+	const char *unit;
+	int higher_better;
+} metric_t;
+
+/**
+ * Values of a measurement across every run of a scenario.
+ */
+typedef struct result {
+	char scenario[32];
+	char metric[16];
+	unsigned int n;
+	double values[BENCH_MAX_REPS];
+} result_t;
+
+/**
+ * Set of results, either from this run or loaded from a baseline.
+ */
+typedef struct results {
+	result_t *items;
+	size_t len;
+	size_t size;
+} results_t;
+
+/**
+ * State of a single run of a scenario, shared by every client thread.
+ */
+typedef struct run {
+	pthread_mutex_t lock;
+	const scenario_t *scenario;
+	volatile int stopping;
+	unsigned long requests;
+	unsigned long errors;
+	double bytes;
+	double excluded;   /* Seconds spent emptying the cache. */
+	double *latency;   /* Seconds taken by each successful request. */
+	size_t nlatency;
+	size_t size;
+} run_t;
+
+/**
+ * Connection of a slow client.
+ */
+typedef struct slow_conn {
+	int sockfd;
+	size_t sent;
+	double retry;
+} slow_conn_t;
+
+/* Every scenario that we know of. */
+static const scenario_t scenarios[] = {
+	{ "menu-cold",    REQ_MENU,    1,  0,            1 },
+	{ "menu-warm",    REQ_MENU,    8,  0,            0 },
+	{ "file-1k",      REQ_SMALL,   8,  0,            0 },
+	{ "file-1m",      REQ_LARGE,   8,  0,            0 },
+	{ "file-1g",      REQ_HUGE,    1,  0,            0 },
+	{ "dir-10k",      REQ_DIR,     1,  0,            1 },
+	{ "404-flood",    REQ_MISSING, 16, 0,            0 },
+	{ "slow-clients", REQ_SMALL,   4,  SLOW_CLIENTS, 0 },
+	{ NULL, 0, 0, 0, 0 }
+};
+
+/* Measurements and whether they're better higher or lower. */
+static const metric_t metrics[METRICS] = {
+	{ "rps",    "req/s", 1 },
+	{ "mbps",   "MB/s",  1 },
+	{ "p50",    "ms",    0 },
+	{ "p99",    "ms",    0 },
+	{ "errors", "%",     0 }
+};
+
+/* State shared with the client threads. */
+static run_t run;
+static volatile int interrupted;
+static struct sockaddr_in server_addr;
+static char admin_path[512];
+
+/**
+ * Handles the signals that should end the run early.
+ *
+ * @param signum Signal number that was triggered.
+ */
+static void signal_handler(int signum) {
+	(void)signum;
+	interrupted = 1;
+	run.stopping = 1;
+}
+
+/**
+ * =============================================================================
+ * === Document Root ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Generates the document root: a bunch of ordinary directories for the menus,
+ * files of each size, and a directory with a huge number of entries.
+ *
+ * @param root Path of the document root, which must not exist yet.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int docroot_generate(const char *root) {
+	char path[512];
+	unsigned int d;
+
+	if (!harness_mkdir(root))
+		return 0;
+
+	/* Directories for the menus. */
+	for (d = 0; d < BENCH_DIRS; d++) {
+		sprintf(path, "%s/d%03u", root, d);
+		if (!harness_mkdir(path))
+			return 0;
+		if (!harness_files(path, "f%03u.txt", BENCH_DIR_FILES, 0))
+			return 0;
+	}
+
+	/* Files of each size. */
+	sprintf(path, "%s/files", root);
+	if (!harness_mkdir(path))
+		return 0;
+	sprintf(path, "%s/files/1k.txt", root);
+	if (!harness_write_text(path, BENCH_SMALL_SIZE))
+		return 0;
+	sprintf(path, "%s/files/1m.txt", root);
+	if (!harness_write_text(path, BENCH_LARGE_SIZE))
+		return 0;
+	sprintf(path, "%s/files/1g.bin", root);
+	if (!harness_write_sparse(path, BENCH_HUGE_SIZE))
+		return 0;
+
+	/* Huge directory. */
+	sprintf(path, "%s/huge", root);
+	if (!harness_mkdir(path))
+		return 0;
+	if (!harness_files(path, "entry-%05u.txt", BENCH_HUGE_FILES, 0))
+		return 0;
+
+	return 1;
+}
+
+/**
+ * =============================================================================
+ * === Clients =================================================================
+ * =============================================================================
+ */
+
+/**
+ * Opens a connection to the server.
+ *
+ * @return Connected socket or -1 if an error occurred.
+ */
+static int client_connect(void) {
+	struct timeval tv;
+	int sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+
+	tv.tv_sec = IO_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (connect(sockfd, (struct sockaddr*)&server_addr,
+			sizeof(server_addr)) != 0) {
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/**
+ * Requests a selector and reads the whole reply.
+ *
+ * @param selector Selector to be requested.
+ * @param first    Where to store the first byte of the reply.
+ *
+ * @return Number of bytes read or -1 if an error occurred.
+ */
+static double client_request(const char *selector, char *first) {
+	char buf[65536];
+	char req[256];
+	size_t reqlen;
+	double total;
+	ssize_t n;
+	int sockfd;
+
+	sockfd = client_connect();
+	if (sockfd < 0)
+		return -1;
+
+	reqlen = (size_t)sprintf(req, "%s\r\n", selector);
+	if (send(sockfd, req, reqlen, MSG_NOSIGNAL) != (ssize_t)reqlen) {
+		close(sockfd);
+		return -1;
+	}
+
+	*first = '\0';
+	total = 0;
+	while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
+		if (total == 0)
+			*first = buf[0];
+		total += (double)n;
+	}
+	close(sockfd);
+
+	return (n < 0) ? -1 : total;
+}
+
+/**
+ * Sends a command to the server's admin socket and ignores its reply.
+ *
+ * @param cmd Command to be sent.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int admin_command(const char *cmd) {
+	struct sockaddr_un addr;
+	char buf[4096];
+	size_t len;
+	int sockfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, admin_path, sizeof(addr.sun_path) - 1);
+	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return 0;
+	if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(sockfd);
+		return 0;
+	}
+
+	len = strlen(cmd);
+	if ((send(sockfd, cmd, len, MSG_NOSIGNAL) != (ssize_t)len) ||
+			(send(sockfd, "\n", 1, MSG_NOSIGNAL) != 1)) {
+		close(sockfd);
+		return 0;
+	}
+	while (recv(sockfd, buf, sizeof(buf), 0) > 0)
+		;
+	close(sockfd);
+
+	return 1;
+}
+
+/**
+ * Picks a selector to be requested and the reply that's expected of it.
+ *
+ * @param kind     Kind of request.
+ * @param seed     State of the thread's random number generator.
+ * @param selector Buffer that will hold the selector.
+ * @param size     Where to store the expected size of the reply, 0 if unknown.
+ *
+ * @return First character of the expected reply, or '\0' for any.
+ */
+static char selector_pick(unsigned int kind, unsigned int *seed,
+						  char *selector, double *size) {
+	*size = 0;
+	switch (kind) {
+		case REQ_MENU:
+			sprintf(selector, "/d%03u", (unsigned int)(rand_r(seed) %
+				BENCH_DIRS));
+			return '\0';
+		case REQ_SMALL:
+			strcpy(selector, "/files/1k.txt");
+			*size = BENCH_SMALL_SIZE;
+			return '\0';
+		case REQ_LARGE:
+			strcpy(selector, "/files/1m.txt");
+			*size = BENCH_LARGE_SIZE;
+			return '\0';
+		case REQ_HUGE:
+			strcpy(selector, "/files/1g.bin");
+			*size = BENCH_HUGE_SIZE;
+			return '\0';
+		case REQ_DIR:
+			strcpy(selector, "/huge");
+			return '\0';
+		default:
+			sprintf(selector, "/d%03u/missing%u.txt",
+				(unsigned int)(rand_r(seed) % BENCH_DIRS),
+				(unsigned int)rand_r(seed));
+			return '3';
+	}
+}
+
+/**
+ * Keeps making requests until the run is over.
+ *
+ * @param data Seed for the thread's random number generator.
+ *
+ * @return Always NULL.
+ */
+static void* client_thread(void *data) {
+	char selector[128];
+	char cmd[160];
+	unsigned int seed;
+	unsigned long requests;
+	unsigned long errors;
+	double *latency;
+	double *tmp;
+	size_t nlatency;
+	size_t size;
+	double excluded;
+	double expected;
+	double bytes;
+	double start;
+	double got;
+	char first;
+	char want;
+	int ok;
+
+	seed = (unsigned int)(size_t)data;
+	latency = NULL;
+	nlatency = 0;
+	size = 0;
+	requests = 0;
+	errors = 0;
+	bytes = 0;
+	excluded = 0;
+	while (!run.stopping) {
+		want = selector_pick(run.scenario->kind, &seed, selector, &expected);
+
+		/* Make sure the reply has to be rendered from scratch. */
+		if (run.scenario->cold) {
+			start = harness_now();
+			sprintf(cmd, "flush %s", selector);
+			admin_command(cmd);
+			excluded += harness_now() - start;
+		}
+
+		start = harness_now();
+		got = client_request(selector, &first);
+		ok = (got > 0) && ((expected == 0) || (got == expected)) &&
+			((want == '\0') || (first == want));
+		requests++;
+		if (!ok) {
+			errors++;
+			continue;
+		}
+		bytes += got;
+
+		if (nlatency == size) {
+			size = (size == 0) ? 1024 : (size * 2);
+			tmp = (double*)realloc(latency, size * sizeof(double));
+			if (tmp == NULL)
+				continue;
+			latency = tmp;
+		}
+		latency[nlatency++] = harness_now() - start;
+	}
+
+	/* Hand everything over to the run. */
+	pthread_mutex_lock(&run.lock);
+	run.requests += requests;
+	run.errors += errors;
+	run.bytes += bytes;
+	run.excluded += excluded;
+	if ((run.nlatency + nlatency) > run.size) {
+		tmp = (double*)realloc(run.latency, (run.nlatency + nlatency) *
+			sizeof(double));
+		if (tmp != NULL) {
+			run.latency = tmp;
+			run.size = run.nlatency + nlatency;
+		}
+	}
+	if ((run.nlatency + nlatency) <= run.size) {
+		memcpy(run.latency + run.nlatency, latency, nlatency * sizeof(double));
+		run.nlatency += nlatency;
+	}
+	pthread_mutex_unlock(&run.lock);
+	free(latency);
+
+	return NULL;
+}
+
+/**
+ * Keeps a crowd of clients connected that send their request and read the
+ * reply a tiny bit at a time, reconnecting whenever they get hung up on.
+ *
+ * @param data Number of slow clients.
+ *
+ * @return Always NULL.
+ */
+static void* slow_thread(void *data) {
+	static const char req[] = "/files/1k.txt\r\n";
+	slow_conn_t *conns;
+	unsigned int nconns;
+	unsigned int i;
+	char buf[SLOW_READ_SIZE];
+	ssize_t n;
+	double now;
+	int flags;
+
+	nconns = (unsigned int)(size_t)data;
+	conns = (slow_conn_t*)calloc(nconns, sizeof(slow_conn_t));
+	if (conns == NULL) {
+		fprintf(stderr, "Failed to allocate the slow clients\n");
+		return NULL;
+	}
+	for (i = 0; i < nconns; i++)
+		conns[i].sockfd = -1;
+
+	while (!run.stopping) {
+		now = harness_now();
+		for (i = 0; i < nconns; i++) {
+			/* (Re)connect without waiting for it to go through. */
+			if (conns[i].sockfd < 0) {
+				if (now < conns[i].retry)
+					continue;
+				conns[i].sockfd = socket(AF_INET, SOCK_STREAM, 0);
+				if (conns[i].sockfd < 0)
+					continue;
+				flags = fcntl(conns[i].sockfd, F_GETFL, 0);
+				fcntl(conns[i].sockfd, F_SETFL, flags | O_NONBLOCK);
+				connect(conns[i].sockfd, (struct sockaddr*)&server_addr,
+					sizeof(server_addr));
+				conns[i].sent = 0;
+				continue;
+			}
+
+			/* Send the request a byte at a time, then read the reply. */
+			if (conns[i].sent < (sizeof(req) - 1)) {
+				n = send(conns[i].sockfd, req + conns[i].sent, 1,
+					MSG_NOSIGNAL);
+				if (n == 1) {
+					conns[i].sent++;
+					continue;
+				}
+			} else {
+				n = recv(conns[i].sockfd, buf, sizeof(buf), 0);
+				if (n > 0)
+					continue;
+			}
+			if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+					(errno == ENOTCONN) || (errno == EINPROGRESS))) {
+				continue;
+			}
+
+			/* Hung up on or done, so come back later. */
+			close(conns[i].sockfd);
+			conns[i].sockfd = -1;
+			conns[i].retry = now + SLOW_RETRY;
+		}
+
+		usleep(SLOW_TICK * 1000);
+	}
+
+	for (i = 0; i < nconns; i++) {
+		if (conns[i].sockfd >= 0)
+			close(conns[i].sockfd);
+	}
+	free(conns);
+
+	return NULL;
+}
+
+/**
+ * =============================================================================
+ * === Scenarios ===============================================================
+ * =============================================================================
+ */
+
+/**
+ * Compares two doubles for sorting.
+ *
+ * @see qsort
+ */
+static int double_cmp(const void *a, const void *b) {
+	double x;
+	double y;
+
+	x = *(const double*)a;
+	y = *(const double*)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/**
+ * Gets a percentile of a sorted set of values.
+ *
+ * @param values  Sorted values.
+ * @param len     Number of values.
+ * @param percent Percentile to get.
+ *
+ * @return Value at the percentile or 0 if there are no values.
+ */
+static double percentile(const double *values, size_t len, double percent) {
+	size_t i;
+
+	if (len == 0)
+		return 0;
+
+	i = (size_t)((percent / 100.0) * (double)len);
+	if (i >= len)
+		i = len - 1;
+
+	return values[i];
+}
+
+/**
+ * Runs a scenario once.
+ *
+ * @param sc       Scenario to be run.
+ * @param duration Number of seconds to run it for.
+ * @param values   Where to store the measurements.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int scenario_run(const scenario_t *sc, double duration,
+						double values[METRICS]) {
+	pthread_t threads[64];
+	pthread_t slow;
+	unsigned int clients;
+	unsigned int i;
+	double started;
+	double elapsed;
+
+	run.scenario = sc;
+	run.requests = 0;
+	run.errors = 0;
+	run.bytes = 0;
+	run.excluded = 0;
+	run.stopping = interrupted;
+
+	/* Let the slow clients take up their places first. */
+	if (sc->slow > 0) {
+		if (pthread_create(&slow, NULL, slow_thread,
+				(void*)(size_t)sc->slow) != 0) {
+			fprintf(stderr, "Failed to create the slow clients thread\n");
+			return 0;
+		}
+		usleep(SLOW_SETTLE);
+	}
+
+	/* Run the clients for a while. */
+	started = harness_now();
+	clients = 0;
+	for (i = 0; i < sc->clients; i++) {
+		if (pthread_create(&threads[i], NULL, client_thread,
+				(void*)(size_t)(i * 2654435761UL + 1)) != 0) {
+			fprintf(stderr, "Failed to create client thread\n");
+			break;
+		}
+		clients++;
+	}
+	while (!run.stopping && ((harness_now() - started) < duration))
+		usleep(10000);
+	run.stopping = 1;
+	for (i = 0; i < clients; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = harness_now() - started;
+	if (sc->slow > 0)
+		pthread_join(slow, NULL);
+	if (clients == 0)
+		return 0;
+
+	/* Time spent emptying the cache doesn't count. */
+	elapsed -= run.excluded / clients;
+	if (elapsed <= 0)
+		elapsed = duration;
+
+	qsort(run.latency, run.nlatency, sizeof(double), double_cmp);
+	values[METRIC_RPS] = (double)run.requests / elapsed;
+	values[METRIC_MBPS] = (run.bytes / 1048576.0) / elapsed;
+	values[METRIC_P50] = percentile(run.latency, run.nlatency, 50) * 1000.0;
+	values[METRIC_P99] = percentile(run.latency, run.nlatency, 99) * 1000.0;
+	values[METRIC_ERRORS] = (run.requests == 0) ? 100.0 :
+		((double)run.errors * 100.0) / (double)run.requests;
+
+	free(run.latency);
+	run.latency = NULL;
+	run.nlatency = 0;
+	run.size = 0;
+
+	return !interrupted;
+}
+
+/**
+ * =============================================================================
+ * === Results =================================================================
+ * =============================================================================
+ */
+
+/**
+ * Finds the results of a measurement of a scenario, optionally adding them if
+ * they aren't there yet.
+ *
+ * @param res      Set of results.
+ * @param scenario Name of the scenario.
+ * @param metric   Name of the measurement.
+ * @param add      Add it if it isn't there.
+ *
+ * @return Results of the measurement or NULL if they aren't there.
+ */
+static result_t* results_find(results_t *res, const char *scenario,
+							  const char *metric, int add) {
+	result_t *tmp;
+	size_t i;
+
+	for (i = 0; i < res->len; i++) {
+		if ((strcmp(res->items[i].scenario, scenario) == 0) &&
+				(strcmp(res->items[i].metric, metric) == 0)) {
+			return &res->items[i];
+		}
+	}
+	if (!add)
+		return NULL;
+
+	if (res->len == res->size) {
+		res->size = (res->size == 0) ? 64 : (res->size * 2);
+		tmp = (result_t*)realloc(res->items, res->size * sizeof(result_t));
+		if (tmp == NULL) {
+			fprintf(stderr, "Failed to allocate the results\n");
+			exit(2);
+		}
+		res->items = tmp;
+	}
+
+	tmp = &res->items[res->len++];
+	memset(tmp, 0, sizeof(result_t));
+	strncpy(tmp->scenario, scenario, sizeof(tmp->scenario) - 1);
+	strncpy(tmp->metric, metric, sizeof(tmp->metric) - 1);
+
+	return tmp;
+}
+
+/**
+ * Loads the results saved in a baseline file. Each line holds the name of a
+ * scenario, the name of a measurement and its value in each run, separated
+ * by spaces, and lines starting with a # are comments.
+ *
+ * @param res  Set of results to load them into.
+ * @param path Path to the baseline file.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int results_load(results_t *res, const char *path) {
+	char line[2048];
+	char scenario[32];
+	char metric[16];
+	result_t *result;
+	char *cur;
+	char *end;
+	double value;
+	int len;
+	FILE *fh;
+
+	fh = fopen(path, "r");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		if ((line[0] == '#') ||
+				(sscanf(line, "%31s %15s %n", scenario, metric, &len) != 2)) {
+			continue;
+		}
+
+		result = results_find(res, scenario, metric, 1);
+		for (cur = line + len; result->n < BENCH_MAX_REPS; cur = end) {
+			value = strtod(cur, &end);
+			if (end == cur)
+				break;
+			result->values[result->n++] = value;
+		}
+	}
+
+	fclose(fh);
+	return 1;
+}
+
+/**
+ * Saves the results as a baseline file.
+ *
+ * @param res    Set of results.
+ * @param path   Path to the baseline file.
+ * @param server Path to the server that was benchmarked.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int results_save(const results_t *res, const char *path,
+						const char *server) {
+	char date[64];
+	time_t now;
+	size_t i;
+	unsigned int j;
+	FILE *fh;
+
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	fprintf(fh, "# amigos-bench results of %s taken on %s\n", server, date);
+	fprintf(fh, "# scenario metric value...\n");
+	for (i = 0; i < res->len; i++) {
+		fprintf(fh, "%s %s", res->items[i].scenario, res->items[i].metric);
+		for (j = 0; j < res->items[i].n; j++)
+			fprintf(fh, " %.6g", res->items[i].values[j]);
+		fprintf(fh, "\n");
+	}
+
+	return fclose(fh) == 0;
+}
+
+/**
+ * Gets the mean and variance of a set of values.
+ *
+ * @param result Values of a measurement.
+ * @param mean   Where to store the mean.
+ * @param var    Where to store the sample variance.
+ */
+static void result_stats(const result_t *result, double *mean, double *var) {
+	unsigned int i;
+
+	*mean = 0;
+	*var = 0;
+	if (result->n == 0)
+		return;
+
+	for (i = 0; i < result->n; i++)
+		*mean += result->values[i];
+	*mean /= result->n;
+	if (result->n < 2)
+		return;
+
+	for (i = 0; i < result->n; i++) {
+		*var += (result->values[i] - *mean) * (result->values[i] - *mean);
+	}
+	*var /= (result->n - 1);
+}
+
+/**
+ * Evaluates the continued fraction of the incomplete beta function.
+ *
+ * @param a First shape parameter.
+ * @param b Second shape parameter.
+ * @param x Point to evaluate it at.
+ *
+ * @return Value of the continued fraction.
+ */
+static double beta_cf(double a, double b, double x) {
+	double aa;
+	double c;
+	double d;
+	double del;
+	double h;
+	int m;
+
+	c = 1.0;
+	d = 1.0 - ((a + b) * x / (a + 1.0));
+	if (fabs(d) < 1e-30)
+		d = 1e-30;
+	d = 1.0 / d;
+	h = d;
+	for (m = 1; m <= 200; m++) {
+		aa = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+		d = 1.0 + aa * d;
+		if (fabs(d) < 1e-30)
+			d = 1e-30;
+		c = 1.0 + aa / c;
+		if (fabs(c) < 1e-30)
+			c = 1e-30;
+		d = 1.0 / d;
+		h *= d * c;
+
+		aa = -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+		d = 1.0 + aa * d;
+		if (fabs(d) < 1e-30)
+			d = 1e-30;
+		c = 1.0 + aa / c;
+		if (fabs(c) < 1e-30)
+			c = 1e-30;
+		d = 1.0 / d;
+		del = d * c;
+		h *= del;
+		if (fabs(del - 1.0) < 1e-10)
+			break;
+	}
+
+	return h;
+}
+
+/**
+ * Evaluates the regularized incomplete beta function.
+ *
+ * @param a First shape parameter.
+ * @param b Second shape parameter.
+ * @param x Point to evaluate it at, between 0 and 1.
+ *
+ * @return Value of the function.
+ */
+static double beta_inc(double a, double b, double x) {
+	double bt;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+
+	bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + (a * log(x)) +
+		(b * log(1.0 - x)));
+	if (x < ((a + 1.0) / (a + b + 2.0)))
+		return bt * beta_cf(a, b, x) / a;
+
+	return 1.0 - (bt * beta_cf(b, a, 1.0 - x) / b);
+}
+
+/**
+ * Performs Welch's t-test to check if the means of two sets of values are
+ * different, without assuming that they vary by the same amount.
+ *
+ * @param a First set of values.
+ * @param b Second set of values.
+ *
+ * @return Two-sided p-value, the chance of seeing a difference this large if
+ *         the means were the same.
+ */
+static double welch_test(const result_t *a, const result_t *b) {
+	double mean_a;
+	double mean_b;
+	double var_a;
+	double var_b;
+	double se_a;
+	double se_b;
+	double df;
+	double t;
+
+	if ((a->n < 2) || (b->n < 2))
+		return 1.0;
+
+	result_stats(a, &mean_a, &var_a);
+	result_stats(b, &mean_b, &var_b);
+	se_a = var_a / a->n;
+	se_b = var_b / b->n;
+	if ((se_a + se_b) <= 0)
+		return (mean_a == mean_b) ? 1.0 : 0.0;
+
+	t = (mean_a - mean_b) / sqrt(se_a + se_b);
+	df = ((se_a + se_b) * (se_a + se_b)) / (((se_a * se_a) / (a->n - 1)) +
+		((se_b * se_b) / (b->n - 1)));
+
+	return beta_inc(df / 2.0, 0.5, df / (df + (t * t)));
+}
+
+/**
+ * Prints the results of this run, compared against a baseline if there's one.
+ *
+ * @param res   Results of this run.
+ * @param base  Results of the baseline or NULL.
+ * @param alpha Significance level for the differences.
+ *
+ * @return Number of measurements that got significantly worse.
+ */
+static unsigned int results_print(const results_t *res, results_t *base,
+								  double alpha) {
+	const result_t *prev;
+	const metric_t *metric;
+	unsigned int worse;
+	unsigned int m;
+	double mean_prev;
+	double var_prev;
+	double mean;
+	double var;
+	double change;
+	double p;
+	size_t i;
+
+	if (base == NULL) {
+		printf("%-13s %-7s %12s %10s %6s\n", "SCENARIO", "METRIC", "MEAN",
+			"STDDEV", "UNIT");
+	} else {
+		printf("%-13s %-7s %12s %12s %8s %7s  %s\n", "SCENARIO", "METRIC",
+			"BASELINE", "CURRENT", "CHANGE", "P", "VERDICT");
+	}
+
+	worse = 0;
+	for (i = 0; i < res->len; i++) {
+		for (m = 0, metric = NULL; m < METRICS; m++) {
+			if (strcmp(metrics[m].name, res->items[i].metric) == 0)
+				metric = &metrics[m];
+		}
+		result_stats(&res->items[i], &mean, &var);
+
+		if (base == NULL) {
+			printf("%-13s %-7s %12.2f %10.2f %6s\n", res->items[i].scenario,
+				res->items[i].metric, mean, sqrt(var),
+				(metric == NULL) ? "" : metric->unit);
+			continue;
+		}
+
+		prev = results_find(base, res->items[i].scenario,
+			res->items[i].metric, 0);
+		if ((prev == NULL) || (prev->n == 0)) {
+			printf("%-13s %-7s %12s %12.2f %8s %7s  %s\n",
+				res->items[i].scenario, res->items[i].metric, "-", mean, "-",
+				"-", "new");
+			continue;
+		}
+
+		/* Only call it a change if it's unlikely to be noise. */
+		result_stats(prev, &mean_prev, &var_prev);
+		change = (mean_prev != 0) ? ((mean - mean_prev) * 100.0 / mean_prev) :
+			0;
+		p = welch_test(prev, &res->items[i]);
+		printf("%-13s %-7s %12.2f %12.2f %+7.1f%% %7.3f  ",
+			res->items[i].scenario, res->items[i].metric, mean_prev, mean,
+			change, p);
+		if ((p >= alpha) || (metric == NULL) || (mean == mean_prev)) {
+			printf("same\n");
+		} else if ((mean > mean_prev) == metric->higher_better) {
+			printf("better\n");
+		} else {
+			printf("WORSE\n");
+			worse++;
+		}
+	}
+
+	return worse;
+}
+
+/**
+ * =============================================================================
+ * === Main ====================================================================
+ * =============================================================================
+ */
+
+/**
+ * Prints the program's usage.
+ *
+ * @param name Name of the program.
+ */
+static void usage(const char *name) {
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-r repetitions] [-t seconds] [-p port] "
+		"[-w workdir] [-o key=value]... [-s results] [-b baseline] "
+		"[-a alpha] server [scenario]...\n\nScenarios:", name);
+	for (i = 0; scenarios[i].name != NULL; i++)
+		fprintf(stderr, " %s", scenarios[i].name);
+	fprintf(stderr, "\n");
+}
+
+/**
+ * Checks if a scenario was asked for.
+ *
+ * @param sc   Scenario to be checked.
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return TRUE if it should be run, FALSE otherwise.
+ */
+static int scenario_wanted(const scenario_t *sc, int argc, char **argv) {
+	int i;
+
+	if ((optind + 1) >= argc)
+		return 1;
+
+	for (i = optind + 1; i < argc; i++) {
+		if (strncmp(sc->name, argv[i], strlen(argv[i])) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Program's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return 0 if nothing got worse, 1 if something did, 2 if the benchmark
+ *         itself failed.
+ */
+int main(int argc, char **argv) {
+	char *options[BENCH_MAX_OPTIONS];
+	const char *save_path;
+	const char *base_path;
+	char workdir[256];
+	char server[512];
+	char path[512];
+	double values[METRICS];
+	results_t results;
+	results_t baseline;
+	const scenario_t *sc;
+	result_t *result;
+	struct sigaction sa;
+	struct rlimit rl;
+	unsigned int repetitions;
+	unsigned int port;
+	unsigned int nopts;
+	unsigned int rep;
+	unsigned int m;
+	double duration;
+	double alpha;
+	pid_t pid;
+	int ret;
+	int opt;
+
+	/* Parse the arguments. */
+	repetitions = BENCH_REPETITIONS;
+	duration = BENCH_DURATION;
+	port = BENCH_PORT;
+	alpha = BENCH_ALPHA;
+	save_path = NULL;
+	base_path = NULL;
+	nopts = 0;
+	workdir[0] = '\0';
+	while ((opt = getopt(argc, argv, "r:t:p:w:o:s:b:a:")) != -1) {
+		switch (opt) {
+			case 'r':
+				repetitions = (unsigned int)atoi(optarg);
+				if ((repetitions == 0) || (repetitions > BENCH_MAX_REPS))
+					repetitions = BENCH_REPETITIONS;
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			case 'p':
+				port = (unsigned int)atoi(optarg);
+				break;
+			case 'w':
+				strncpy(workdir, optarg, sizeof(workdir) - 1);
+				workdir[sizeof(workdir) - 1] = '\0';
+				break;
+			case 'o':
+				if (nopts < BENCH_MAX_OPTIONS)
+					options[nopts++] = optarg;
+				break;
+			case 's':
+				save_path = optarg;
+				break;
+			case 'b':
+				base_path = optarg;
+				break;
+			case 'a':
+				alpha = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* Load the baseline before going through all the trouble. */
+	memset(&baseline, 0, sizeof(baseline));
+	memset(&results, 0, sizeof(results));
+	if ((base_path != NULL) && !results_load(&baseline, base_path))
+		return 2;
+
+	/* The server runs somewhere else, so it needs an absolute path. */
+	if (realpath(argv[optind], server) == NULL) {
+		fprintf(stderr, "Can't find the server %s: %s\n", argv[optind],
+			strerror(errno));
+		return 2;
+	}
+
+	/* Set up the working directory, reusing the document root if it's there. */
+	if (!harness_workdir(workdir, "amigos-bench", NULL))
+		return 2;
+	sprintf(path, "%s/docroot", workdir);
+	if (access(path, F_OK) != 0) {
+		printf("Generating the document root in %s\n", path);
+		if (!docroot_generate(path))
+			return 2;
+	}
+	if (!harness_config_write(workdir, port, "amigos.admin", options, nopts))
+		return 2;
+	sprintf(admin_path, "%s/amigos.admin", workdir);
+
+	/* The slow clients need plenty of file descriptors, and so does the
+	 * server, which inherits them. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	/* Start the server. */
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((uint16_t)port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pid = harness_start(server, workdir, &server_addr);
+	if (pid < 0)
+		return 2;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	pthread_mutex_init(&run.lock, NULL);
+
+	/* Run every scenario that was asked for. */
+	printf("Benchmarking PID %ld, %u runs of %.1f seconds per scenario\n\n",
+		(long)pid, repetitions, duration);
+	ret = 0;
+	for (sc = scenarios; (sc->name != NULL) && (ret == 0); sc++) {
+		if (!scenario_wanted(sc, argc, argv))
+			continue;
+
+		/* Get everything into the caches before measuring. */
+		if (!sc->cold && !scenario_run(sc, WARMUP_DURATION, values)) {
+			ret = 2;
+			break;
+		}
+
+		for (rep = 0; rep < repetitions; rep++) {
+			if (!scenario_run(sc, duration, values) ||
+					(waitpid(pid, NULL, WNOHANG) != 0)) {
+				ret = 2;
+				break;
+			}
+
+			printf("%-13s run %2u: %10.1f req/s %9.1f MB/s  p50 %8.2f ms  "
+				"p99 %8.2f ms  %5.1f%% errors\n", sc->name, rep + 1,
+				values[METRIC_RPS], values[METRIC_MBPS], values[METRIC_P50],
+				values[METRIC_P99], values[METRIC_ERRORS]);
+			fflush(stdout);
+			for (m = 0; m < METRICS; m++) {
+				result = results_find(&results, sc->name, metrics[m].name, 1);
+				result->values[result->n++] = values[m];
+			}
+		}
+	}
+	if (waitpid(pid, NULL, WNOHANG) != 0) {
+		printf("Server died, see %s/amigos.log\n", workdir);
+		ret = 2;
+	} else {
+		harness_stop(pid);
+	}
+
+	/* Report and keep the results. */
+	if (ret == 0) {
+		printf("\n");
+		if (results_print(&results, (base_path != NULL) ? &baseline : NULL,
+				alpha) > 0) {
+			ret = 1;
+		}
+		if ((save_path != NULL) &&
+				!results_save(&results, save_path, server)) {
+			ret = 2;
+		}
+	} else if (interrupted) {
+		printf("Interrupted, nothing was saved\n");
+	}
+	printf("Server log in %s/amigos.log\n", workdir);
+
+	free(results.items);
+	free(baseline.items);
+	pthread_mutex_destroy(&run.lock);
+	return ret;
+}
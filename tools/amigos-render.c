@@ -0,0 +1,595 @@
+/**
+ * amigos-render.c
+ * Benchmark harness for the reply rendering of the amigos Gopher server. Builds
+ * the server right into itself and calls the functions that render files,
+ * directory listings, gophermaps and menu items directly, with a connection
+ * backed by a socket pair or an in-memory sink, against a generated document
+ * root with deep trees, huge directories and long gophermaps. Reports the
+ * throughput along with the system calls and allocations made per response,
+ * without any networking, threads or scheduling getting in the way.
+ *
+ * The sends are counted by wrapping send() and sendfile(), and the reads are
+ * taken from /proc, so the system call counts are only available on Linux.
+ *
+ * Compile from the root of the repository with:
+ *   gcc -ansi -std=gnu89 -Wall -pedantic -pthread -I. tools/amigos-render.c
+ *       tools/harness.c -o amigos-render
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#define AMIGOS_LIBRARY
+
+/* Pull in the declarations before wrapping the functions they declare. */
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif /* __linux__ */
+
+#define send     render_send
+#define sendfile render_sendfile
+static ssize_t render_send(int sockfd, const void *buf, size_t len, int flags);
+#ifdef __linux__
+static ssize_t render_sendfile(int out_fd, int in_fd, off_t *offset,
+							   size_t count);
+#endif /* __linux__ */
+
+#include "amigos.c"
+
+#undef send
+#undef sendfile
+
+#include "harness.h"
+
+/* Defaults of the command line options. */
+#define RENDER_DURATION 1.0
+#define RENDER_MIN_RUNS 10
+
+/* Shape of the generated document root. */
+#define RENDER_HUGE_FILES     10000
+#define RENDER_DEEP_LEVELS    32
+#define RENDER_DEEP_FILES     8
+#define RENDER_MAP_LINES      5000
+#define RENDER_SMALL_SIZE     512L
+#define RENDER_MEDIUM_SIZE    65536L
+#define RENDER_LARGE_SIZE     1048576L
+#define RENDER_DRAIN_SIZE     65536
+
+/* Ways of rendering the reply. */
+enum render_kinds {
+	RENDER_FILE = 0,
+	RENDER_DIR,
+	RENDER_GOPHERMAP,
+	RENDER_ITEM,
+	RENDER_MENU
+};
+
+/**
+ * Single benchmark to be run.
+ */
+typedef struct bench {
+	const char *name;
+	unsigned int kind;
+	const char *selector;  /* Relative to the document root. */
+} bench_t;
+
+/**
+ * System calls made by the rendering functions.
+ */
+typedef struct syscalls {
+	unsigned long sends;
+	unsigned long sendfiles;
+	unsigned long reads;
+} syscalls_t;
+
+/* Every benchmark that we know of. */
+static const bench_t benches[] = {
+	{ "file-small",     RENDER_FILE,      "files/small.txt" },
+	{ "file-medium",    RENDER_FILE,      "files/medium.txt" },
+	{ "file-large",     RENDER_FILE,      "files/large.txt" },
+	{ "dir-huge",       RENDER_DIR,       "huge" },
+	{ "dir-deep",       RENDER_DIR,       NULL },
+	{ "gophermap-long", RENDER_GOPHERMAP, "map/gophermap" },
+	{ "item",           RENDER_ITEM,      "files/small.txt" },
+	{ "menu-cached",    RENDER_MENU,      "huge" },
+	{ NULL, 0, NULL }
+};
+
+/* System calls made by the wrapped functions. */
+static syscalls_t calls;
+
+/**
+ * Sends data through a socket, counting the call.
+ *
+ * @see send
+ */
+static ssize_t render_send(int sockfd, const void *buf, size_t len,
+						   int flags) {
+	calls.sends++;
+	return send(sockfd, buf, len, flags);
+}
+
+#ifdef __linux__
+/**
+ * Pipes a file through a socket, counting the call.
+ *
+ * @see sendfile
+ */
+static ssize_t render_sendfile(int out_fd, int in_fd, off_t *offset,
+							   size_t count) {
+	calls.sendfiles++;
+	return sendfile(out_fd, in_fd, offset, count);
+}
+#endif /* __linux__ */
+
+/**
+ * Gets the number of read system calls made by the calling thread so far.
+ *
+ * @return Number of calls or 0 if it isn't known.
+ */
+static unsigned long reads_made(void) {
+	unsigned long value;
+	char line[128];
+	FILE *fh;
+
+	value = 0;
+	fh = fopen("/proc/thread-self/io", "r");
+	if (fh == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		if (sscanf(line, "syscr: %lu", &value) == 1)
+			break;
+	}
+	fclose(fh);
+
+	return value;
+}
+
+/**
+ * Gets the number of allocations made by the server so far.
+ *
+ * @return Number of allocations and reallocations across every subsystem.
+ */
+static uint64_t allocs_made(void) {
+	uint64_t total;
+	int i;
+
+	total = 0;
+	for (i = 0; i < MEM_TAGS; i++)
+		total += mem_accounts[i].total;
+
+	return total;
+}
+
+/**
+ * =============================================================================
+ * === Document Root ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Builds the path of the deepest directory of the deep tree.
+ *
+ * @param path Buffer that will hold the path.
+ * @param root Path of the document root.
+ */
+static void deep_path(char *path, const char *root) {
+	unsigned int i;
+
+	strcpy(path, root);
+	strcat(path, "/deep");
+	for (i = 0; i < RENDER_DEEP_LEVELS; i++)
+		sprintf(path + strlen(path), "/l%02u", i);
+}
+
+/**
+ * Generates the document root: files of a few sizes, a directory with a huge
+ * number of entries, a very deep tree with a few files at every level, and a
+ * long gophermap.
+ *
+ * @param root Path of the document root, which must not exist yet.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int docroot_generate(const char *root) {
+	char path[1024];
+	unsigned int i;
+	FILE *fh;
+
+	if (!harness_mkdir(root))
+		return 0;
+
+	/* Plain files. */
+	sprintf(path, "%s/files", root);
+	if (!harness_mkdir(path))
+		return 0;
+	sprintf(path, "%s/files/small.txt", root);
+	if (!harness_write_text(path, RENDER_SMALL_SIZE))
+		return 0;
+	sprintf(path, "%s/files/medium.txt", root);
+	if (!harness_write_text(path, RENDER_MEDIUM_SIZE))
+		return 0;
+	sprintf(path, "%s/files/large.txt", root);
+	if (!harness_write_text(path, RENDER_LARGE_SIZE))
+		return 0;
+
+	/* Huge directory, with a mix of file types to be inferred. */
+	sprintf(path, "%s/huge", root);
+	if (!harness_mkdir(path))
+		return 0;
+	for (i = 0; i < RENDER_HUGE_FILES; i++) {
+		sprintf(path, "%s/huge/entry-%05u.%s", root, i,
+			((i % 4) == 0) ? "gif" : (((i % 4) == 1) ? "html" : "txt"));
+		if (!harness_write_text(path, 64))
+			return 0;
+	}
+
+	/* Deep tree. */
+	sprintf(path, "%s/deep", root);
+	if (!harness_mkdir(path))
+		return 0;
+	for (i = 0; i < RENDER_DEEP_LEVELS; i++) {
+		sprintf(path + strlen(path), "/l%02u", i);
+		if (!harness_mkdir(path))
+			return 0;
+
+		if (!harness_files(path, "f%u.txt", RENDER_DEEP_FILES, 64))
+			return 0;
+	}
+
+	/* Long gophermap, with every kind of line that gets parsed. */
+	sprintf(path, "%s/map", root);
+	if (!harness_mkdir(path))
+		return 0;
+	sprintf(path, "%s/map/gophermap", root);
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+	for (i = 0; i < RENDER_MAP_LINES; i++) {
+		switch (i % 5) {
+			case 0:
+				fprintf(fh, "Section %u of the long gophermap.\n", i / 5);
+				break;
+			case 1:
+				fprintf(fh, "0Relative file %u\tfile-%u.txt\n", i, i);
+				break;
+			case 2:
+				fprintf(fh, "1Absolute menu %u\t/huge\n", i);
+				break;
+			case 3:
+				fprintf(fh, "0Remote file %u\t/file-%u.txt\texample.org\t70\n",
+					i, i);
+				break;
+			default:
+				fprintf(fh, "hWeb link %u\tURL:https://example.org/%u\n", i, i);
+				break;
+		}
+	}
+	if (fclose(fh) != 0) {
+		fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * =============================================================================
+ * === Rendering ===============================================================
+ * =============================================================================
+ */
+
+/**
+ * Reads everything that comes out of the other end of the socket pair, so that
+ * the sends never block for long.
+ *
+ * @param data Socket to read from.
+ *
+ * @return Always NULL.
+ */
+static void* drain_thread(void *data) {
+	char buf[RENDER_DRAIN_SIZE];
+	int sockfd;
+
+	sockfd = (int)(size_t)data;
+	while (read(sockfd, buf, sizeof(buf)) > 0)
+		;
+
+	return NULL;
+}
+
+/**
+ * Renders a single reply.
+ *
+ * @param conn  Client connection object.
+ * @param bench Benchmark being run.
+ * @param path  Path to the object being rendered.
+ * @param item  Item to be rendered.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int render_once(client_conn_t *conn, const bench_t *bench,
+					   const char *path, const gopher_item_t *item) {
+	switch (bench->kind) {
+		case RENDER_FILE:
+			return client_send_file(conn, path);
+		case RENDER_DIR:
+			return client_send_dir(conn, path, 1);
+		case RENDER_GOPHERMAP:
+			return client_send_gophermap(conn, path);
+		case RENDER_ITEM:
+			return client_send_item(conn, item);
+		case RENDER_MENU:
+			return client_send_menu(conn, path);
+	}
+
+	return 0;
+}
+
+/**
+ * Runs a benchmark and prints its results.
+ *
+ * @param conn     Client connection object.
+ * @param bench    Benchmark to be run.
+ * @param root     Path of the document root.
+ * @param duration Minimum number of seconds to spend rendering.
+ *
+ * @return TRUE if every reply was rendered, FALSE otherwise.
+ */
+static int bench_run(client_conn_t *conn, const bench_t *bench,
+					 const char *root, double duration) {
+	char path[1024];
+	char selector[1024];
+	gopher_item_t item;
+	syscalls_t start_calls;
+	unsigned long start_reads;
+	unsigned long reads;
+	unsigned long runs;
+	uint64_t start_allocs;
+	uint64_t allocs;
+	uint64_t bytes;
+	uint64_t sent;
+	double started;
+	double elapsed;
+
+	/* Work out what's being rendered. */
+	if (bench->selector == NULL) {
+		deep_path(path, root);
+	} else {
+		sprintf(path, "%s/%s", root, bench->selector);
+	}
+	strcpy(selector, path + strlen(root));
+	if (bench->kind == RENDER_GOPHERMAP)
+		*strrchr(selector, '/') = '\0';
+	conn->selector = selector;
+	strncpy(conn->score->selector, selector, ADMIN_SELECTOR_LEN - 1);
+	conn->score->selector[ADMIN_SELECTOR_LEN - 1] = '\0';
+	item.type = '0';
+	item.name = "A file that is rendered as a menu item";
+	item.selector = selector;
+	item.hostname = NULL;
+	item.port = 0;
+
+	/* Render it once first so that it's all in the page cache. */
+	if (!render_once(conn, bench, path, &item)) {
+		fprintf(stderr, "Failed to render %s\n", bench->name);
+		return 0;
+	}
+	if (conn->capture != NULL)
+		conn->capture->len = 0;
+
+	/* Render it over and over again. */
+	runs = 0;
+	bytes = 0;
+	sent = conn->score->sent;
+	start_calls = calls;
+	start_reads = reads_made();
+	start_allocs = allocs_made();
+	started = harness_now();
+	do {
+		if (!render_once(conn, bench, path, &item)) {
+			fprintf(stderr, "Failed to render %s\n", bench->name);
+			return 0;
+		}
+		if (conn->capture != NULL) {
+			bytes += conn->capture->len;
+			conn->capture->len = 0;
+		}
+		runs++;
+		elapsed = harness_now() - started;
+	} while ((runs < RENDER_MIN_RUNS) || (elapsed < duration));
+	reads = reads_made() - start_reads;
+	allocs = allocs_made() - start_allocs;
+	if (conn->capture == NULL)
+		bytes = conn->score->sent - sent;
+
+	printf("%-15s %9lu %10.2f %9.1f %10.0f %8.2f %8.2f %8.2f %8.2f\n",
+		bench->name, runs, (elapsed * 1000000.0) / runs,
+		(bytes / 1048576.0) / elapsed, (double)bytes / runs,
+		(double)(calls.sends - start_calls.sends) / runs,
+		(double)(calls.sendfiles - start_calls.sendfiles) / runs,
+		(double)reads / runs, (double)allocs / runs);
+
+	return 1;
+}
+
+/**
+ * =============================================================================
+ * === Main ====================================================================
+ * =============================================================================
+ */
+
+/**
+ * Prints the program's usage.
+ *
+ * @param name Name of the program.
+ */
+static void usage(const char *name) {
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-m socket|memory] [-t seconds] [-w workdir] "
+		"[-f filetypes] [benchmark]...\n\nBenchmarks:", name);
+	for (i = 0; benches[i].name != NULL; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+}
+
+/**
+ * Checks if a benchmark was asked for.
+ *
+ * @param bench Benchmark to be checked.
+ * @param argc  Number of command line arguments.
+ * @param argv  Command line arguments.
+ *
+ * @return TRUE if it should be run, FALSE otherwise.
+ */
+static int bench_wanted(const bench_t *bench, int argc, char **argv) {
+	int i;
+
+	if (optind >= argc)
+		return 1;
+
+	for (i = optind; i < argc; i++) {
+		if (strncmp(bench->name, argv[i], strlen(argv[i])) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Program's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return 0 if every reply was rendered, 1 if any failed, 2 if the harness
+ *         couldn't be set up.
+ */
+int main(int argc, char **argv) {
+	const char *filetypes;
+	char workdir[256];
+	char root[512];
+	client_conn_t *conn;
+	buffer_t sink;
+	pthread_t drain;
+	amigos_t *srv;
+	double duration;
+	int sockets[2];
+	int in_memory;
+	int generated;
+	int ret;
+	int opt;
+	int i;
+
+	/* Parse the arguments. */
+	in_memory = 0;
+	duration = RENDER_DURATION;
+	filetypes = FILETYPES_CONF_PATH;
+	workdir[0] = '\0';
+	while ((opt = getopt(argc, argv, "m:t:w:f:")) != -1) {
+		switch (opt) {
+			case 'm':
+				if (strcmp(optarg, "memory") == 0) {
+					in_memory = 1;
+				} else if (strcmp(optarg, "socket") == 0) {
+					in_memory = 0;
+				} else {
+					usage(argv[0]);
+					return 2;
+				}
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			case 'w':
+				strncpy(workdir, optarg, sizeof(workdir) - 1);
+				workdir[sizeof(workdir) - 1] = '\0';
+				break;
+			case 'f':
+				filetypes = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	/* Generate the document root unless it's already been. */
+	if (!harness_workdir(workdir, "amigos-render", &generated))
+		return 2;
+	sprintf(root, "%s/docroot", workdir);
+	if (!file_exists(root)) {
+		printf("Generating the document root in %s\n", root);
+		if (!docroot_generate(root))
+			return 2;
+	}
+
+	/* Set up a server that never listens to anything. */
+	srv = amigos_new(root, NULL);
+	if (srv == NULL)
+		return 2;
+	if (file_exists(filetypes))
+		srv->gopher_types = gopher_types_load(srv, filetypes);
+
+	/* Set up the connection the replies get rendered to. */
+	conn = &srv->connections[0];
+	conn->status = CONN_INUSE;
+	conn->config = srv->config;
+	conn->score = &srv->scores[0];
+	conn->query = NULL;
+	strcpy(conn->addr, "render");
+	if (in_memory) {
+		buffer_init(&sink, MEM_CONNECTIONS);
+		conn->capture = &sink;
+	} else {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+			perror("Failed to create the socket pair");
+			amigos_free(srv);
+			return 2;
+		}
+		if (pthread_create(&drain, NULL, drain_thread,
+				(void*)(size_t)sockets[1]) != 0) {
+			fprintf(stderr, "Failed to create the drain thread\n");
+			amigos_free(srv);
+			return 2;
+		}
+		conn->capture = NULL;
+		conn->sockfd = sockets[0];
+	}
+
+	/* Run the benchmarks. */
+	printf("Rendering to %s for at least %.1f seconds each\n\n",
+		in_memory ? "memory" : "a socket pair", duration);
+	printf("%-15s %9s %10s %9s %10s %8s %8s %8s %8s\n", "BENCHMARK", "RUNS",
+		"US/RUN", "MB/S", "BYTES/RUN", "SENDS", "SENDFILE", "READS",
+		"ALLOCS");
+	ret = 0;
+	for (i = 0; benches[i].name != NULL; i++) {
+		if (!bench_wanted(&benches[i], argc, argv))
+			continue;
+		if (!bench_run(conn, &benches[i], root, duration))
+			ret = 1;
+	}
+
+	/* Tear everything down. */
+	if (in_memory) {
+		buffer_free(&sink);
+	} else {
+		close(sockets[0]);
+		pthread_join(drain, NULL);
+		close(sockets[1]);
+	}
+	conn->capture = NULL;
+	conn->selector = NULL;
+	conn->sockfd = SOCKERR;
+	conn->status = 0;
+	amigos_free(srv);
+	if (generated)
+		harness_tree_remove(workdir);
+
+	return ret;
+}
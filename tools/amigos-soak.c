@@ -0,0 +1,861 @@
+/**
+ * amigos-soak.c
+ * Soak test harness for the amigos Gopher server. Generates a document root,
+ * starts the server on it, and drives a mix of traffic at it for hours while
+ * sampling the resident memory, open file descriptors and threads of the
+ * server process along with the latency of its replies. Fails if any of them
+ * keeps on growing, since that's what leaks and slow degradations look like
+ * long before they take a server down.
+ *
+ * Only runs on Linux, since the process is sampled through /proc.
+ *
+ * Compile with: gcc -ansi -std=gnu89 -Wall -pedantic -pthread amigos-soak.c
+ *               harness.c -o amigos-soak
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/* Defaults of the command line options. */
+#define SOAK_DURATION  7200
+#define SOAK_INTERVAL  10
+#define SOAK_CLIENTS   8
+#define SOAK_PORT      7070
+
+/* Shape of the generated document root. */
+#define SOAK_DIRS        40
+#define SOAK_FILES       25
+#define SOAK_BIG_DIRS    4
+#define SOAK_BIG_SIZE    4194304L
+#define SOAK_MAX_OPTIONS 32
+
+/* Behaviour of the misbehaving clients. */
+#define ABORT_AFTER      16384
+#define SLOW_SEND_DELAY  20000   /* Microseconds between each byte sent. */
+#define SLOW_READ_SIZE   512
+#define SLOW_READ_DELAY  20000   /* Microseconds between each read. */
+#define SILENT_DELAY     100000
+#define RECV_TIMEOUT     30
+
+/* Judging the trends. Samples taken while things settle down are ignored and
+ * the rest are split into windows whose averages are compared. */
+#define WARMUP_PERCENT   10
+#define TREND_WINDOWS    4
+
+/* Latency histogram. Bucket i counts requests that took less than
+ * LATENCY_BASE << i microseconds, the last one everything else. */
+#define LATENCY_BUCKETS  24
+#define LATENCY_BASE     64
+
+/* Kinds of requests in the traffic mix. */
+enum request_kinds {
+	REQ_MENU = 0,
+	REQ_FILE,
+	REQ_MISSING,
+	REQ_SEARCH,
+	REQ_ABORT,
+	REQ_SLOW,
+	REQ_SILENT,
+	REQ_KINDS
+};
+
+/**
+ * Counters shared by every client thread, reset after each sample except for
+ * the totals.
+ */
+typedef struct traffic {
+	pthread_mutex_t lock;
+	unsigned long totals[REQ_KINDS];
+	unsigned long failed[REQ_KINDS];
+	unsigned long requests[REQ_KINDS];
+	unsigned long errors;
+	unsigned long latency[LATENCY_BUCKETS];
+	unsigned long measured;
+} traffic_t;
+
+/**
+ * What the server process looked like at some point.
+ */
+typedef struct sample {
+	double elapsed;
+	unsigned long requests;
+	unsigned long errors;
+	double p50;     /* Milliseconds. */
+	double p99;
+	double rss;     /* KiB. */
+	double fds;
+	double threads;
+} sample_t;
+
+/**
+ * Metric of the samples to be checked for growth.
+ */
+typedef struct metric {
+	const char *name;
+	const char *unit;
+	size_t offset;     /* Offset of the value in sample_t. */
+	double min_abs;    /* Growth below this is just noise. */
+	double min_rel;    /* So is growth below this fraction. */
+} metric_t;
+
+/* Names and weights of the kinds of requests. */
+static const char *request_names[REQ_KINDS] = {
+	"menu", "file", "missing", "search", "abort", "slow", "silent"
+};
+static const unsigned int request_weights[REQ_KINDS] = {
+	28, 40, 10, 5, 10, 2, 5
+};
+
+/* Metrics that must not keep growing. */
+static const metric_t metrics[] = {
+	{ "RSS",         "KiB", offsetof(sample_t, rss),     1024.0, 0.05 },
+	{ "Open fds",    "",    offsetof(sample_t, fds),     2.0,    0.0 },
+	{ "Threads",     "",    offsetof(sample_t, threads), 1.0,    0.0 },
+	{ "p99 latency", "ms",  offsetof(sample_t, p99),     1.0,    0.25 },
+	{ NULL, NULL, 0, 0.0, 0.0 }
+};
+
+/* State shared with the client threads. */
+static traffic_t traffic;
+static volatile int stopping;
+static struct sockaddr_in server_addr;
+
+/**
+ * Handles the signals that should end the run early.
+ *
+ * @param signum Signal number that was triggered.
+ */
+static void signal_handler(int signum) {
+	(void)signum;
+	stopping = 1;
+}
+
+/**
+ * =============================================================================
+ * === Document Root ===========================================================
+ * =============================================================================
+ */
+
+/**
+ * Size of a generated text file, spread between a few hundred bytes and 64 KiB
+ * the same way on every run.
+ *
+ * @param dir  Index of the directory.
+ * @param file Index of the file.
+ *
+ * @return Size of the file in bytes.
+ */
+static long file_size(unsigned int dir, unsigned int file) {
+	return 200L + (long)(((dir * 7919UL) + (file * 104729UL)) % 65336UL);
+}
+
+/**
+ * Generates the document root: directories full of text files, some of them
+ * with a gophermap and some with a big file for aborted downloads.
+ *
+ * @param root Path of the document root, which must not exist yet.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int docroot_generate(const char *root) {
+	char path[512];
+	unsigned int d;
+	unsigned int f;
+	FILE *fh;
+
+	if (!harness_mkdir(root))
+		return 0;
+
+	for (d = 0; d < SOAK_DIRS; d++) {
+		sprintf(path, "%s/d%02u", root, d);
+		if (!harness_mkdir(path))
+			return 0;
+
+		/* Text files of all sorts of sizes. */
+		for (f = 0; f < SOAK_FILES; f++) {
+			sprintf(path, "%s/d%02u/f%02u.txt", root, d, f);
+			if (!harness_write_text(path, file_size(d, f)))
+				return 0;
+		}
+
+		/* Big files to give up on halfway through. */
+		if (d < SOAK_BIG_DIRS) {
+			sprintf(path, "%s/d%02u/big.txt", root, d);
+			if (!harness_write_text(path, SOAK_BIG_SIZE))
+				return 0;
+		}
+
+		/* Every third directory has a menu of its own. */
+		if ((d % 3) == 0) {
+			sprintf(path, "%s/d%02u/gophermap", root, d);
+			fh = fopen(path, "w");
+			if (fh == NULL) {
+				fprintf(stderr, "Failed to create %s: %s\n", path,
+					strerror(errno));
+				return 0;
+			}
+			fprintf(fh, "Directory %u of the soak test.\n\n", d);
+			for (f = 0; f < SOAK_FILES; f += 2)
+				fprintf(fh, "0File number %u\tf%02u.txt\n", f, f);
+			fprintf(fh, "1Back to the top\t/\n");
+			fclose(fh);
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * =============================================================================
+ * === Traffic =================================================================
+ * =============================================================================
+ */
+
+/**
+ * Opens a connection to the server.
+ *
+ * @return Connected socket or -1 if an error occurred.
+ */
+static int client_connect(void) {
+	struct timeval tv;
+	int sockfd;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+
+	tv.tv_sec = RECV_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (connect(sockfd, (struct sockaddr*)&server_addr,
+			sizeof(server_addr)) != 0) {
+		close(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+/**
+ * Closes a connection abruptly, resetting it instead of shutting it down.
+ *
+ * @param sockfd Socket to be closed.
+ */
+static void client_reset(int sockfd) {
+	struct linger lg;
+
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(sockfd);
+}
+
+/**
+ * Requests a selector and reads the reply.
+ *
+ * @param selector Selector to be requested.
+ * @param reply    Buffer for the start of the reply or NULL.
+ * @param len      Size of the reply buffer.
+ * @param limit    Hang up after reading this many bytes, or 0 to read it all.
+ * @param slow     Send and read the data as slowly as a bad connection would.
+ *
+ * @return Number of bytes read or -1 if an error occurred.
+ */
+static long client_request(const char *selector, char *reply, size_t len,
+						   long limit, int slow) {
+	char buf[8192];
+	char req[256];
+	size_t reqlen;
+	size_t i;
+	long total;
+	ssize_t n;
+	int sockfd;
+
+	sockfd = client_connect();
+	if (sockfd < 0)
+		return -1;
+
+	/* Send the request, a byte at a time if we're slow. */
+	reqlen = (size_t)sprintf(req, "%s\r\n", selector);
+	if (slow) {
+		for (i = 0; i < reqlen; i++) {
+			if (send(sockfd, req + i, 1, MSG_NOSIGNAL) != 1) {
+				close(sockfd);
+				return -1;
+			}
+			usleep(SLOW_SEND_DELAY);
+		}
+	} else if (send(sockfd, req, reqlen, MSG_NOSIGNAL) != (ssize_t)reqlen) {
+		close(sockfd);
+		return -1;
+	}
+
+	/* Read the reply. */
+	total = 0;
+	while ((n = recv(sockfd, buf, slow ? SLOW_READ_SIZE : sizeof(buf),
+			0)) > 0) {
+		if ((reply != NULL) && ((size_t)total < (len - 1))) {
+			i = (size_t)n;
+			if (i > (len - 1 - (size_t)total))
+				i = len - 1 - (size_t)total;
+			memcpy(reply + total, buf, i);
+			reply[total + i] = '\0';
+		}
+		total += (long)n;
+
+		/* Give up halfway through. */
+		if ((limit > 0) && (total >= limit)) {
+			client_reset(sockfd);
+			return total;
+		}
+		if (slow)
+			usleep(SLOW_READ_DELAY);
+	}
+	close(sockfd);
+
+	return (n < 0) ? -1 : total;
+}
+
+/**
+ * Records the outcome of a request.
+ *
+ * @param kind    Kind of request.
+ * @param ok      Whether the reply was what was expected.
+ * @param start   When the request started or 0 if its latency doesn't count.
+ */
+static void traffic_record(unsigned int kind, int ok, double start) {
+	unsigned int bucket;
+	double usec;
+
+	pthread_mutex_lock(&traffic.lock);
+	traffic.requests[kind]++;
+	traffic.totals[kind]++;
+	if (!ok) {
+		traffic.errors++;
+		traffic.failed[kind]++;
+	}
+	if (ok && (start > 0)) {
+		usec = (harness_now() - start) * 1000000.0;
+		for (bucket = 0; (bucket < (LATENCY_BUCKETS - 1)) &&
+				(usec >= (double)((unsigned long)LATENCY_BASE << bucket));
+				bucket++)
+			;
+		traffic.latency[bucket]++;
+		traffic.measured++;
+	}
+	pthread_mutex_unlock(&traffic.lock);
+}
+
+/**
+ * Makes one request of a random kind, checking that the reply makes sense.
+ *
+ * @param seed State of the thread's random number generator.
+ */
+static void client_step(unsigned int *seed) {
+	char selector[128];
+	char reply[256];
+	unsigned int kind;
+	unsigned int pick;
+	unsigned int d;
+	unsigned int f;
+	double start;
+	long got;
+	int sockfd;
+	int ok;
+
+	/* Pick what to do. */
+	pick = (unsigned int)(rand_r(seed) % 100);
+	for (kind = 0; pick >= request_weights[kind]; kind++)
+		pick -= request_weights[kind];
+	d = (unsigned int)(rand_r(seed) % SOAK_DIRS);
+	f = (unsigned int)(rand_r(seed) % SOAK_FILES);
+
+	start = harness_now();
+	switch (kind) {
+		case REQ_MENU:
+			if ((rand_r(seed) % 8) == 0) {
+				strcpy(selector, "/");
+			} else {
+				sprintf(selector, "/d%02u", d);
+			}
+			got = client_request(selector, NULL, 0, 0, 0);
+			ok = got > 0;
+			break;
+		case REQ_FILE:
+			sprintf(selector, "/d%02u/f%02u.txt", d, f);
+			got = client_request(selector, NULL, 0, 0, 0);
+			ok = got >= file_size(d, f);
+			break;
+		case REQ_MISSING:
+			sprintf(selector, "/d%02u/missing%u.txt", d, f);
+			got = client_request(selector, reply, sizeof(reply), 0, 0);
+			ok = (got > 0) && (reply[0] == '3');
+			break;
+		case REQ_SEARCH:
+			sprintf(selector, "search\tline d%02u", d);
+			got = client_request(selector, NULL, 0, 0, 0);
+			ok = got > 0;
+			break;
+		case REQ_ABORT:
+			sprintf(selector, "/d%02u/big.txt", d % SOAK_BIG_DIRS);
+			got = client_request(selector, NULL, 0, ABORT_AFTER, 0);
+			ok = got >= ABORT_AFTER;
+			start = 0;
+			break;
+		case REQ_SLOW:
+			sprintf(selector, "/d%02u/f%02u.txt", d, f);
+			got = client_request(selector, NULL, 0, 0, 1);
+			ok = got >= file_size(d, f);
+			start = 0;
+			break;
+		default:
+			/* Connect and never say a thing. */
+			sockfd = client_connect();
+			ok = sockfd >= 0;
+			if (ok) {
+				usleep(SILENT_DELAY);
+				close(sockfd);
+			}
+			start = 0;
+			break;
+	}
+
+	traffic_record(kind, ok, start);
+}
+
+/**
+ * Keeps making requests until told to stop.
+ *
+ * @param data Seed for the thread's random number generator.
+ *
+ * @return Nothing.
+ */
+static void* client_thread(void *data) {
+	unsigned int seed;
+
+	seed = (unsigned int)(size_t)data;
+	while (!stopping)
+		client_step(&seed);
+
+	return NULL;
+}
+
+/**
+ * =============================================================================
+ * === Sampling ================================================================
+ * =============================================================================
+ */
+
+/**
+ * Reads the resident memory and thread count of a process.
+ *
+ * @param pid     Process to be sampled.
+ * @param rss     Resident memory in KiB.
+ * @param threads Number of threads.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int proc_status(pid_t pid, double *rss, double *threads) {
+	char path[64];
+	char line[256];
+	FILE *fh;
+
+	sprintf(path, "/proc/%ld/status", (long)pid);
+	fh = fopen(path, "r");
+	if (fh == NULL)
+		return 0;
+
+	*rss = 0;
+	*threads = 0;
+	while (fgets(line, sizeof(line), fh) != NULL) {
+		if (strncmp(line, "VmRSS:", 6) == 0) {
+			*rss = strtod(line + 6, NULL);
+		} else if (strncmp(line, "Threads:", 8) == 0) {
+			*threads = strtod(line + 8, NULL);
+		}
+	}
+	fclose(fh);
+
+	return 1;
+}
+
+/**
+ * Counts the open file descriptors of a process.
+ *
+ * @param pid Process to be sampled.
+ *
+ * @return Number of open file descriptors or -1 if an error occurred.
+ */
+static long proc_fds(pid_t pid) {
+	struct dirent *dirent;
+	char path[64];
+	long count;
+	DIR *dh;
+
+	sprintf(path, "/proc/%ld/fd", (long)pid);
+	dh = opendir(path);
+	if (dh == NULL)
+		return -1;
+
+	count = 0;
+	while ((dirent = readdir(dh)) != NULL) {
+		if (dirent->d_name[0] != '.')
+			count++;
+	}
+	closedir(dh);
+
+	return count;
+}
+
+/**
+ * Gets a latency percentile out of the histogram.
+ *
+ * @param latency Latency histogram.
+ * @param count   Number of requests in it.
+ * @param pct     Percentile to get.
+ *
+ * @return Upper bound of the bucket the percentile is in, in milliseconds.
+ */
+static double percentile(const unsigned long *latency, unsigned long count,
+						 unsigned int pct) {
+	unsigned long seen;
+	unsigned long target;
+	unsigned int i;
+
+	if (count == 0)
+		return 0;
+
+	target = ((count * pct) + 99) / 100;
+	seen = 0;
+	for (i = 0; i < (LATENCY_BUCKETS - 1); i++) {
+		seen += latency[i];
+		if (seen >= target)
+			break;
+	}
+
+	return (double)((unsigned long)LATENCY_BASE << i) / 1000.0;
+}
+
+/**
+ * Takes a sample of the server process and the traffic since the last one.
+ *
+ * @param pid     Server process.
+ * @param started When the run started.
+ * @param sample  Sample to be populated.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int sample_take(pid_t pid, double started, sample_t *sample) {
+	unsigned int i;
+
+	if (!proc_status(pid, &sample->rss, &sample->threads))
+		return 0;
+	sample->fds = (double)proc_fds(pid);
+	sample->elapsed = harness_now() - started;
+
+	/* Drain the counters of the traffic. */
+	pthread_mutex_lock(&traffic.lock);
+	sample->requests = 0;
+	for (i = 0; i < REQ_KINDS; i++)
+		sample->requests += traffic.requests[i];
+	sample->errors = traffic.errors;
+	sample->p50 = percentile(traffic.latency, traffic.measured, 50);
+	sample->p99 = percentile(traffic.latency, traffic.measured, 99);
+	memset(traffic.requests, 0, sizeof(traffic.requests));
+	memset(traffic.latency, 0, sizeof(traffic.latency));
+	traffic.errors = 0;
+	traffic.measured = 0;
+	pthread_mutex_unlock(&traffic.lock);
+
+	return 1;
+}
+
+/**
+ * Checks whether a metric kept growing over the run, by splitting the samples
+ * taken after things settled down into windows and comparing their averages.
+ *
+ * @param metric  Metric to be checked.
+ * @param samples Samples taken during the run.
+ * @param count   Number of samples.
+ *
+ * @return TRUE if the metric is steady, FALSE if it kept on growing.
+ */
+static int trend_check(const metric_t *metric, const sample_t *samples,
+					   size_t count) {
+	double windows[TREND_WINDOWS];
+	size_t first;
+	size_t per;
+	size_t i;
+	size_t w;
+	int growing;
+	double growth;
+
+	/* Leave out the samples from while caches were filling up. */
+	first = (count * WARMUP_PERCENT) / 100;
+	per = (count - first) / TREND_WINDOWS;
+	if (per == 0) {
+		printf("%-12s not enough samples to tell\n", metric->name);
+		return 1;
+	}
+
+	/* Average each window. */
+	for (w = 0; w < TREND_WINDOWS; w++) {
+		windows[w] = 0;
+		for (i = 0; i < per; i++) {
+			windows[w] += *(const double*)((const char*)&samples[first +
+				(w * per) + i] + metric->offset);
+		}
+		windows[w] /= (double)per;
+	}
+
+	/* Growing in every window by more than the noise is a leak. */
+	growing = 1;
+	for (w = 1; w < TREND_WINDOWS; w++) {
+		if (windows[w] <= windows[w - 1])
+			growing = 0;
+	}
+	growth = windows[TREND_WINDOWS - 1] - windows[0];
+	if ((growth < metric->min_abs) || (growth < (metric->min_rel * windows[0])))
+		growing = 0;
+
+	printf("%-12s", metric->name);
+	for (w = 0; w < TREND_WINDOWS; w++)
+		printf(" %10.1f", windows[w]);
+	printf(" %-3s  %s\n", metric->unit, growing ? "GROWING" : "steady");
+
+	return !growing;
+}
+
+/**
+ * =============================================================================
+ * === Main ====================================================================
+ * =============================================================================
+ */
+
+/**
+ * Prints the program's usage.
+ *
+ * @param name Name of the program.
+ */
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-t seconds] [-i seconds] [-c clients] "
+		"[-p port] [-w workdir] [-o key=value]... server\n", name);
+}
+
+/**
+ * Program's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return 0 if nothing kept growing, 1 if something did, 2 if the run itself
+ *         failed.
+ */
+int main(int argc, char **argv) {
+	char *options[SOAK_MAX_OPTIONS];
+	pthread_t threads[64];
+	char workdir[256];
+	char server[512];
+	char path[512];
+	sample_t *samples;
+	sample_t *tmp;
+	size_t nsamples;
+	size_t size;
+	unsigned int duration;
+	unsigned int interval;
+	unsigned int clients;
+	unsigned int port;
+	unsigned int nopts;
+	unsigned int i;
+	const metric_t *metric;
+	struct sigaction sa;
+	double started;
+	double next;
+	pid_t pid;
+	int ret;
+	int opt;
+
+	/* Parse the arguments. */
+	duration = SOAK_DURATION;
+	interval = SOAK_INTERVAL;
+	clients = SOAK_CLIENTS;
+	port = SOAK_PORT;
+	nopts = 0;
+	workdir[0] = '\0';
+	while ((opt = getopt(argc, argv, "t:i:c:p:w:o:")) != -1) {
+		switch (opt) {
+			case 't':
+				duration = (unsigned int)atoi(optarg);
+				break;
+			case 'i':
+				interval = (unsigned int)atoi(optarg);
+				if (interval == 0)
+					interval = 1;
+				break;
+			case 'c':
+				clients = (unsigned int)atoi(optarg);
+				if ((clients == 0) || (clients > 64))
+					clients = SOAK_CLIENTS;
+				break;
+			case 'p':
+				port = (unsigned int)atoi(optarg);
+				break;
+			case 'w':
+				strncpy(workdir, optarg, sizeof(workdir) - 1);
+				workdir[sizeof(workdir) - 1] = '\0';
+				break;
+			case 'o':
+				if (nopts < SOAK_MAX_OPTIONS)
+					options[nopts++] = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind != (argc - 1)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* The server runs somewhere else, so it needs an absolute path. */
+	if (realpath(argv[optind], server) == NULL) {
+		fprintf(stderr, "Can't find the server %s: %s\n", argv[optind],
+			strerror(errno));
+		return 2;
+	}
+
+	/* Set up the working directory. */
+	if (!harness_workdir(workdir, "amigos-soak", NULL))
+		return 2;
+	sprintf(path, "%s/docroot", workdir);
+	printf("Generating the document root in %s\n", path);
+	if (!docroot_generate(path) ||
+			!harness_config_write(workdir, port, NULL, options, nopts)) {
+		return 2;
+	}
+
+	/* Start the server. */
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((uint16_t)port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pid = harness_start(server, workdir, &server_addr);
+	if (pid < 0)
+		return 2;
+
+	/* Stop early and still judge the run on a ^C. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Unleash the clients. */
+	pthread_mutex_init(&traffic.lock, NULL);
+	for (i = 0; i < clients; i++) {
+		if (pthread_create(&threads[i], NULL, client_thread,
+				(void*)(size_t)(i * 2654435761UL + 1)) != 0) {
+			fprintf(stderr, "Failed to create client thread\n");
+			stopping = 1;
+			clients = i;
+			break;
+		}
+	}
+	printf("Soaking PID %ld for %u seconds with %u clients\n\n", (long)pid,
+		duration, clients);
+	printf("%8s %8s %8s %8s %8s %10s %6s %7s\n", "ELAPSED", "REQ/S", "ERRORS",
+		"P50 MS", "P99 MS", "RSS KIB", "FDS", "THREADS");
+
+	/* Sample it until we're done. */
+	samples = NULL;
+	nsamples = 0;
+	size = 0;
+	ret = 0;
+	started = harness_now();
+	next = started + interval;
+	while (!stopping && (harness_now() < (started + duration))) {
+		if (harness_now() < next) {
+			usleep(100000);
+			continue;
+		}
+		next += interval;
+
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			printf("Server died, see %s/amigos.log\n", workdir);
+			pid = 0;
+			ret = 2;
+			break;
+		}
+		if (nsamples == size) {
+			size = (size == 0) ? 256 : (size * 2);
+			tmp = (sample_t*)realloc(samples, size * sizeof(sample_t));
+			if (tmp == NULL) {
+				fprintf(stderr, "Failed to allocate the samples\n");
+				ret = 2;
+				break;
+			}
+			samples = tmp;
+		}
+		if (!sample_take(pid, started, &samples[nsamples]))
+			continue;
+
+		printf("%7.0fs %8.1f %8lu %8.2f %8.2f %10.0f %6.0f %7.0f\n",
+			samples[nsamples].elapsed,
+			(double)samples[nsamples].requests / interval,
+			samples[nsamples].errors, samples[nsamples].p50,
+			samples[nsamples].p99, samples[nsamples].rss,
+			samples[nsamples].fds, samples[nsamples].threads);
+		fflush(stdout);
+		nsamples++;
+	}
+
+	/* Wind down. */
+	stopping = 1;
+	for (i = 0; i < clients; i++)
+		pthread_join(threads[i], NULL);
+	if ((pid > 0) && !harness_stop(pid))
+		ret = 2;
+
+	/* Judge the run. */
+	printf("\n%-8s %10s %10s\n", "KIND", "REQUESTS", "FAILED");
+	for (i = 0; i < REQ_KINDS; i++) {
+		printf("%-8s %10lu %10lu\n", request_names[i], traffic.totals[i],
+			traffic.failed[i]);
+	}
+	if (ret == 0) {
+		printf("\nAverages over %u windows after the first %u%% of the "
+			"run:\n", TREND_WINDOWS, WARMUP_PERCENT);
+		for (metric = metrics; metric->name != NULL; metric++) {
+			if (!trend_check(metric, samples, nsamples))
+				ret = 1;
+		}
+		printf("\n%s\n", (ret == 0) ? "PASS" : "FAIL: something kept growing");
+	}
+	printf("Server log in %s/amigos.log\n", workdir);
+
+	free(samples);
+	pthread_mutex_destroy(&traffic.lock);
+	return ret;
+}
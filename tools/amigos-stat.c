@@ -0,0 +1,490 @@
+/**
+ * amigos-stat.c
+ * Displays the live statistics published by an amigos server through its
+ * statistics file, refreshing them periodically like top does. Reading the
+ * file doesn't involve the server in any way.
+ *
+ * Compile with: gcc -ansi -std=gnu89 -Wall -pedantic -I.. amigos-stat.c
+ *               -o amigos-stat
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amigos_stats.h"
+
+/* Slots are considered idle if they haven't been updated for this long. */
+#define STALE_SECONDS 5
+
+/**
+ * Snapshot of the whole statistics file.
+ */
+typedef struct snapshot {
+	amigos_stats_header_t header;
+	amigos_stats_slot_t slots[AMIGOS_STATS_SLOTS];
+	amigos_stats_slot_t total;
+	double taken;
+} snapshot_t;
+
+/* Names of the kinds of requests. */
+static const char *request_kinds[AMIGOS_STATS_REQ_KINDS] = {
+	"static", "redirect", "search", "plugin", "proxy", "not found", "http", NULL
+};
+
+/**
+ * Gets the current time.
+ *
+ * @return Seconds since the epoch, with sub-second precision.
+ */
+static double now_seconds(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+}
+
+/**
+ * Adds up the counters and gauges of a slot into another one.
+ *
+ * @param total Slot to accumulate into.
+ * @param slot  Slot to be added.
+ */
+static void slot_add(amigos_stats_slot_t *total,
+					 const amigos_stats_slot_t *slot) {
+	amigos_stats_slot_t memory;
+	const uint64_t *src;
+	uint64_t *dst;
+	size_t i;
+
+	/* Everything after the PID and timestamp is a 64-bit value. */
+	memory = *total;
+	src = &slot->connections;
+	dst = &total->connections;
+	for (i = 0; i < ((sizeof(amigos_stats_slot_t) -
+			offsetof(amigos_stats_slot_t, connections)) / sizeof(uint64_t));
+			i++) {
+		dst[i] += src[i];
+	}
+
+	/* Except for the memory of the cgroup, which every process shares. */
+	if (slot->memory_current > memory.memory_current)
+		memory.memory_current = slot->memory_current;
+	if (slot->memory_limit > memory.memory_limit)
+		memory.memory_limit = slot->memory_limit;
+	if (slot->memory_pressure > memory.memory_pressure)
+		memory.memory_pressure = slot->memory_pressure;
+	total->memory_current = memory.memory_current;
+	total->memory_limit = memory.memory_limit;
+	total->memory_pressure = memory.memory_pressure;
+}
+
+/**
+ * Takes a snapshot of a statistics file. The file is mapped every time, so
+ * that we pick up a new one if the server gets restarted.
+ *
+ * @param path Path of the statistics file.
+ * @param snap Snapshot to be populated.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+static int snapshot_take(const char *path, snapshot_t *snap) {
+	const amigos_stats_header_t *hdr;
+	const char *base;
+	struct stat sb;
+	size_t slot_size;
+	uint32_t i;
+	int fd;
+
+	/* Map the file. */
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+	if ((fstat(fd, &sb) != 0) ||
+			(sb.st_size < (off_t)sizeof(amigos_stats_header_t))) {
+		fprintf(stderr, "'%s' isn't a statistics file\n", path);
+		close(fd);
+		return 0;
+	}
+	base = (const char*)mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	if (base == (const char*)MAP_FAILED) {
+		fprintf(stderr, "Failed to map '%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	/* Check the header. */
+	hdr = (const amigos_stats_header_t*)base;
+	if ((hdr->magic != AMIGOS_STATS_MAGIC) ||
+			(hdr->version != AMIGOS_STATS_VERSION) ||
+			(hdr->header_size < sizeof(amigos_stats_header_t)) ||
+			(hdr->slot_size < sizeof(amigos_stats_slot_t)) ||
+			(hdr->nslots > AMIGOS_STATS_SLOTS) ||
+			((off_t)(hdr->header_size + ((size_t)hdr->nslots *
+			hdr->slot_size)) > sb.st_size)) {
+		fprintf(stderr, "'%s' isn't a compatible statistics file\n", path);
+		munmap((void*)base, (size_t)sb.st_size);
+		return 0;
+	}
+
+	/* Copy the slots. Values are updated individually, so they may be from
+	 * slightly different points in time. */
+	memset(snap, 0, sizeof(snapshot_t));
+	memcpy(&snap->header, hdr, sizeof(amigos_stats_header_t));
+	slot_size = hdr->slot_size;
+	for (i = 0; i < snap->header.nslots; i++) {
+		memcpy(&snap->slots[i], base + hdr->header_size + (i * slot_size),
+			sizeof(amigos_stats_slot_t));
+		slot_add(&snap->total, &snap->slots[i]);
+	}
+	snap->taken = now_seconds();
+
+	munmap((void*)base, (size_t)sb.st_size);
+	return 1;
+}
+
+/**
+ * Formats a number of bytes in a human readable way.
+ *
+ * @param buf   Destination string.
+ * @param len   Size of the destination string.
+ * @param bytes Number of bytes.
+ *
+ * @return Destination string.
+ */
+static const char* format_bytes(char *buf, size_t len, double bytes) {
+	const char *units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+	unsigned int i;
+
+	for (i = 0; (bytes >= 1024.0) && (i < 4); i++)
+		bytes /= 1024.0;
+	if (i == 0) {
+		snprintf(buf, len, "%.0f %s", bytes, units[i]);
+	} else {
+		snprintf(buf, len, "%.1f %s", bytes, units[i]);
+	}
+
+	return buf;
+}
+
+/**
+ * Formats the upper bound of a latency bucket.
+ *
+ * @param buf    Destination string.
+ * @param len    Size of the destination string.
+ * @param bucket Index of the latency bucket.
+ *
+ * @return Destination string.
+ */
+static const char* format_bucket(char *buf, size_t len, unsigned int bucket) {
+	double usec;
+
+	/* The last bucket has no upper bound. */
+	if (bucket == (AMIGOS_STATS_LATENCY_BUCKETS - 1)) {
+		usec = (double)((uint64_t)AMIGOS_STATS_LATENCY_BASE << (bucket - 1));
+		snprintf(buf, len, ">=%.0fms", usec / 1000.0);
+		return buf;
+	}
+
+	usec = (double)((uint64_t)AMIGOS_STATS_LATENCY_BASE << bucket);
+	if (usec < 1000.0) {
+		snprintf(buf, len, "<%.0fus", usec);
+	} else if (usec < 1000000.0) {
+		snprintf(buf, len, "<%.0fms", usec / 1000.0);
+	} else {
+		snprintf(buf, len, "<%.1fs", usec / 1000000.0);
+	}
+
+	return buf;
+}
+
+/**
+ * Finds the latency bucket that contains a given percentile.
+ *
+ * @param latency Latency histogram.
+ * @param count   Number of requests in the histogram.
+ * @param pct     Percentile to look for.
+ *
+ * @return Index of the bucket.
+ */
+static unsigned int percentile(const uint64_t *latency, uint64_t count,
+							   double pct) {
+	uint64_t seen;
+	unsigned int i;
+
+	seen = 0;
+	for (i = 0; i < (AMIGOS_STATS_LATENCY_BUCKETS - 1); i++) {
+		seen += latency[i];
+		if ((double)seen >= ((double)count * pct))
+			break;
+	}
+
+	return i;
+}
+
+/**
+ * Displays a snapshot, with rates calculated from the previous one.
+ *
+ * @param cur  Current snapshot.
+ * @param prev Previous snapshot or NULL if there isn't one.
+ */
+static void snapshot_print(const snapshot_t *cur, const snapshot_t *prev) {
+	const amigos_stats_slot_t *t;
+	uint64_t latency[AMIGOS_STATS_LATENCY_BUCKETS];
+	uint64_t requests;
+	uint64_t reqs;
+	uint64_t lookups;
+	uint64_t recent;
+	double elapsed;
+	char buf[4][32];
+	time_t now;
+	long uptime;
+	uint32_t i;
+
+	t = &cur->total;
+	elapsed = (prev != NULL) ? (cur->taken - prev->taken) : 0;
+	if (elapsed <= 0)
+		elapsed = 1;
+
+	/* Header line. */
+	now = time(NULL);
+	uptime = (long)(now - cur->header.started);
+	printf("amigos (PID %ld), up %ldd %02ld:%02ld:%02ld, %u processes\n\n",
+		(long)cur->header.pid, uptime / 86400, (uptime / 3600) % 24,
+		(uptime / 60) % 60, uptime % 60, (unsigned int)cur->header.nslots);
+
+	/* Connections and requests. */
+	requests = 0;
+	for (i = 0; i < AMIGOS_STATS_REQ_KINDS; i++)
+		requests += t->requests[i];
+	printf("Connections: %lu total, %.1f/s, %lu active\n",
+		(unsigned long)t->connections, (prev == NULL) ? 0.0 :
+		(double)(t->connections - prev->total.connections) / elapsed,
+		(unsigned long)t->active);
+	reqs = 0;
+	if (prev != NULL) {
+		for (i = 0; i < AMIGOS_STATS_REQ_KINDS; i++)
+			reqs += t->requests[i] - prev->total.requests[i];
+	}
+	printf("Requests:    %lu total, %.1f/s,", (unsigned long)requests,
+		(double)reqs / elapsed);
+	for (i = 0; i < AMIGOS_STATS_REQ_KINDS; i++) {
+		if (request_kinds[i] != NULL)
+			printf(" %s %lu", request_kinds[i], (unsigned long)t->requests[i]);
+	}
+	printf("\n");
+
+	/* Latency over the last interval, or since the start. */
+	reqs = 0;
+	for (i = 0; i < AMIGOS_STATS_LATENCY_BUCKETS; i++) {
+		latency[i] = t->latency[i];
+		if (prev != NULL)
+			latency[i] -= prev->total.latency[i];
+		reqs += latency[i];
+	}
+	if (reqs > 0) {
+		printf("Latency:     p50 %s, p90 %s, p99 %s\n",
+			format_bucket(buf[0], 32, percentile(latency, reqs, 0.5)),
+			format_bucket(buf[1], 32, percentile(latency, reqs, 0.9)),
+			format_bucket(buf[2], 32, percentile(latency, reqs, 0.99)));
+	} else {
+		printf("Latency:     -\n");
+	}
+
+	/* Traffic. */
+	printf("Traffic:     in %s (%s/s), out %s (%s/s)\n",
+		format_bytes(buf[0], 32, (double)t->bytes_in),
+		format_bytes(buf[1], 32, (prev == NULL) ? 0.0 :
+			(double)(t->bytes_in - prev->total.bytes_in) / elapsed),
+		format_bytes(buf[2], 32, (double)t->bytes_out),
+		format_bytes(buf[3], 32, (prev == NULL) ? 0.0 :
+			(double)(t->bytes_out - prev->total.bytes_out) / elapsed));
+
+	/* Content cache, with the hit ratio since the last refresh so that
+	 * admission policies can be compared under the same traffic. */
+	lookups = t->cache_hits + t->cache_stale + t->cache_misses;
+	recent = 0;
+	if (prev != NULL) {
+		recent = lookups - (prev->total.cache_hits + prev->total.cache_stale +
+			prev->total.cache_misses);
+	}
+	printf("Cache:       %.1f%% hits (%.1f%% lately), %lu hits, %lu stale, "
+		"%lu misses, %lu stores, %lu objects in %s, %lu queued\n",
+		(lookups == 0) ? 0.0 : (100.0 * t->cache_hits) / lookups,
+		(recent == 0) ? 0.0 :
+		(100.0 * (t->cache_hits - prev->total.cache_hits)) / recent,
+		(unsigned long)t->cache_hits, (unsigned long)t->cache_stale,
+		(unsigned long)t->cache_misses, (unsigned long)t->cache_stores,
+		(unsigned long)t->cache_objects,
+		format_bytes(buf[0], 32, (double)t->cache_bytes),
+		(unsigned long)t->proxy_queue);
+	if ((t->cache_admitted + t->cache_rejected) > 0) {
+		printf("Admission:   %lu admitted, %lu rejected from the window\n",
+			(unsigned long)t->cache_admitted,
+			(unsigned long)t->cache_rejected);
+	}
+
+	/* Memory of the cgroup and how the cache budgets adapted to it. */
+	if (t->memory_current > 0) {
+		printf("Memory:      %s of %s, %.2f%% stalled, cache budget %s, %lu "
+			"evictions\n", format_bytes(buf[0], 32, (double)t->memory_current),
+			(t->memory_limit == 0) ? "unlimited" :
+			format_bytes(buf[1], 32, (double)t->memory_limit),
+			(double)t->memory_pressure / 100,
+			format_bytes(buf[2], 32, (double)t->cache_budget),
+			(unsigned long)t->cache_evictions);
+	}
+
+	/* Requests flagged by the watchdog. */
+	if (t->slow_requests > 0) {
+		printf("Watchdog:    %lu slow, %lu stuck, %lu closed\n",
+			(unsigned long)t->slow_requests, (unsigned long)t->stuck_requests,
+			(unsigned long)t->killed_requests);
+	}
+
+	/* TLS. */
+	if (t->tls_handshakes > 0) {
+		printf("TLS:         %lu handshakes, %lu resumed, %lu failed, "
+			"%lu offloaded\n", (unsigned long)t->tls_handshakes,
+			(unsigned long)t->tls_resumed, (unsigned long)t->tls_failed,
+			(unsigned long)t->tls_ktls);
+	}
+
+	/* Processes. */
+	printf("\n%4s %8s %6s %8s %8s %6s %11s %11s\n", "SLOT", "PID", "AGE",
+		"CONN/s", "REQ/s", "ACTIVE", "IN/s", "OUT/s");
+	for (i = 0; i < cur->header.nslots; i++) {
+		const amigos_stats_slot_t *s = &cur->slots[i];
+		const amigos_stats_slot_t *p;
+		uint32_t k;
+
+		if (s->pid == 0)
+			continue;
+		p = (prev != NULL) ? &prev->slots[i] : NULL;
+		if ((p != NULL) && (p->pid != s->pid))
+			p = NULL;
+
+		reqs = 0;
+		if (p != NULL) {
+			for (k = 0; k < AMIGOS_STATS_REQ_KINDS; k++)
+				reqs += s->requests[k] - p->requests[k];
+		}
+		printf("%4u %8ld %5lds %8.1f %8.1f %6lu %11s %11s%s\n",
+			(unsigned int)i, (long)s->pid, (long)(now - s->updated),
+			(p == NULL) ? 0.0 :
+				(double)(s->connections - p->connections) / elapsed,
+			(double)reqs / elapsed, (unsigned long)s->active,
+			format_bytes(buf[0], 32, (p == NULL) ? 0.0 :
+				(double)(s->bytes_in - p->bytes_in) / elapsed),
+			format_bytes(buf[1], 32, (p == NULL) ? 0.0 :
+				(double)(s->bytes_out - p->bytes_out) / elapsed),
+			((now - s->updated) > STALE_SECONDS) ? " (stale)" : "");
+	}
+}
+
+/**
+ * Prints the program's usage.
+ *
+ * @param name Name of the program.
+ */
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-i seconds] [-n count] statsfile\n", name);
+}
+
+/**
+ * Program's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return Exit code.
+ */
+int main(int argc, char **argv) {
+	snapshot_t *cur;
+	snapshot_t *prev;
+	snapshot_t *tmp;
+	unsigned int interval;
+	unsigned long count;
+	unsigned long n;
+	int have_prev;
+	int clear;
+	int opt;
+
+	/* Parse the arguments. */
+	interval = 1;
+	count = 0;
+	while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+		switch (opt) {
+			case 'i':
+				interval = (unsigned int)atoi(optarg);
+				if (interval == 0)
+					interval = 1;
+				break;
+			case 'n':
+				count = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != (argc - 1)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Keep refreshing. */
+	cur = (snapshot_t*)malloc(sizeof(snapshot_t));
+	prev = (snapshot_t*)malloc(sizeof(snapshot_t));
+	if ((cur == NULL) || (prev == NULL)) {
+		fprintf(stderr, "Failed to allocate the snapshots\n");
+		return 1;
+	}
+	clear = isatty(STDOUT_FILENO);
+	have_prev = 0;
+	for (n = 0; (count == 0) || (n < count); n++) {
+		if (n > 0)
+			sleep(interval);
+		if (!snapshot_take(argv[optind], cur)) {
+			free(cur);
+			free(prev);
+			return 1;
+		}
+
+		/* Rates make no sense across server restarts. */
+		if (have_prev && ((prev->header.pid != cur->header.pid) ||
+				(prev->header.started != cur->header.started))) {
+			have_prev = 0;
+		}
+
+		if (clear) {
+			printf("\033[H\033[2J");
+		} else if (n > 0) {
+			printf("\n");
+		}
+		snapshot_print(cur, have_prev ? prev : NULL);
+		fflush(stdout);
+
+		tmp = prev;
+		prev = cur;
+		cur = tmp;
+		have_prev = 1;
+	}
+
+	free(cur);
+	free(prev);
+	return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * amigos-watchdog.c
+ * Test of the request watchdog of the amigos Gopher server. Starts the server
+ * with a short stuck_request and kill_stuck set, and checks that a download
+ * that keeps moving along for longer than that is left alone, while one whose
+ * client stops reading halfway through gets closed.
+ *
+ * Only runs on UNIX systems.
+ *
+ * Compile with: gcc -ansi -std=gnu89 -Wall -pedantic amigos-watchdog.c
+ *               harness.c -o amigos-watchdog
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/* Defaults of the command line options. */
+#define WATCHDOG_PORT    7070
+#define WATCHDOG_STUCK   2
+
+/* Shape of the download. */
+#define FILE_SIZE        16777216L
+#define READ_SIZE        16384
+#define RECV_BUF_SIZE    16384
+#define RECV_TIMEOUT     30
+
+/* Server being tested. */
+static struct sockaddr_in server_addr;
+
+/**
+ * Downloads the big file, either reading it steadily over a given time or
+ * stopping for a while after the first few reads.
+ *
+ * @param duration How long the download should take, in seconds.
+ * @param stall    How long to stop reading for halfway through, in seconds,
+ *                 or 0 to keep on reading.
+ *
+ * @return Number of bytes received or -1 if an error occurred.
+ */
+static long download(double duration, unsigned int stall) {
+	char buf[READ_SIZE];
+	struct timeval tv;
+	double started;
+	double due;
+	long total;
+	ssize_t n;
+	int sockfd;
+	int size;
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+		return -1;
+
+	/* Keep the buffers small, so that the server can't get ahead of us. */
+	size = RECV_BUF_SIZE;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	tv.tv_sec = RECV_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if ((connect(sockfd, (struct sockaddr*)&server_addr,
+			sizeof(server_addr)) != 0) ||
+			(send(sockfd, "/big.bin\r\n", 10, MSG_NOSIGNAL) != 10)) {
+		close(sockfd);
+		return -1;
+	}
+
+	total = 0;
+	started = harness_now();
+	while ((n = recv(sockfd, buf, sizeof(buf), 0)) > 0) {
+		total += (long)n;
+
+		/* Give up reading for a while. */
+		if (stall > 0) {
+			sleep(stall);
+			stall = 0;
+		}
+
+		/* Keep to the pace. */
+		due = started + ((duration * (double)total) / (double)FILE_SIZE);
+		if (harness_now() < due)
+			usleep((useconds_t)((due - harness_now()) * 1000000.0));
+	}
+	close(sockfd);
+
+	return (n < 0) ? -1 : total;
+}
+
+/**
+ * Prints the program's usage.
+ *
+ * @param name Name of the program.
+ */
+static void usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-s seconds] [-p port] [-w workdir] server\n",
+		name);
+}
+
+/**
+ * Program's main entry point.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Command line arguments.
+ *
+ * @return 0 if the watchdog behaved, 1 if it didn't, 2 if the test itself
+ *         failed.
+ */
+int main(int argc, char **argv) {
+	char *options[3];
+	char option[64];
+	char workdir[256];
+	char server[512];
+	char path[512];
+	unsigned int stuck;
+	unsigned int port;
+	long got;
+	pid_t pid;
+	int ret;
+	int opt;
+
+	/* Parse the arguments. */
+	stuck = WATCHDOG_STUCK;
+	port = WATCHDOG_PORT;
+	workdir[0] = '\0';
+	while ((opt = getopt(argc, argv, "s:p:w:")) != -1) {
+		switch (opt) {
+			case 's':
+				stuck = (unsigned int)atoi(optarg);
+				if (stuck == 0)
+					stuck = WATCHDOG_STUCK;
+				break;
+			case 'p':
+				port = (unsigned int)atoi(optarg);
+				break;
+			case 'w':
+				strncpy(workdir, optarg, sizeof(workdir) - 1);
+				workdir[sizeof(workdir) - 1] = '\0';
+				break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+	if (optind != (argc - 1)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* The server runs somewhere else, so it needs an absolute path. */
+	if (realpath(argv[optind], server) == NULL) {
+		fprintf(stderr, "Can't find the server %s: %s\n", argv[optind],
+			strerror(errno));
+		return 2;
+	}
+
+	/* Set up the working directory and the file to be downloaded. */
+	if (!harness_workdir(workdir, "amigos-watchdog", NULL))
+		return 2;
+	sprintf(path, "%s/docroot", workdir);
+	if (!harness_mkdir(path))
+		return 2;
+	sprintf(path, "%s/docroot/big.bin", workdir);
+	if (!harness_write_sparse(path, FILE_SIZE))
+		return 2;
+	sprintf(option, "stuck_request=%u", stuck);
+	options[0] = option;
+	options[1] = "slow_request=0";
+	options[2] = "kill_stuck=1";
+	if (!harness_config_write(workdir, port, NULL, options, 3))
+		return 2;
+
+	/* Start the server. */
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((uint16_t)port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	pid = harness_start(server, workdir, &server_addr);
+	if (pid < 0)
+		return 2;
+	ret = 0;
+
+	/* A download that takes a while but keeps going must be left alone. */
+	got = download((double)(stuck * 3), 0);
+	printf("%-10s %10ld of %ld bytes  %s\n", "reading", got, FILE_SIZE,
+		(got == FILE_SIZE) ? "ok" : "FAIL: closed while making progress");
+	if (got != FILE_SIZE)
+		ret = 1;
+
+	/* One whose client stops reading must be closed. */
+	got = download(0, stuck + 3);
+	printf("%-10s %10ld of %ld bytes  %s\n", "stalled", got, FILE_SIZE,
+		((got >= 0) && (got < FILE_SIZE)) ? "ok" :
+		"FAIL: not closed while stuck");
+	if ((got < 0) || (got == FILE_SIZE))
+		ret = 1;
+
+	if (!harness_stop(pid))
+		ret = 2;
+	printf("\n%s\n", (ret == 0) ? "PASS" : "FAIL");
+	printf("Server log in %s/amigos.log\n", workdir);
+
+	return ret;
+}
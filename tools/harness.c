@@ -0,0 +1,402 @@
+/**
+ * harness.c
+ * Fixtures shared by the test and benchmark tools of the amigos Gopher server:
+ * generating document roots, writing the server's configuration, and starting
+ * and stopping it in a working directory of its own.
+ *
+ * Only available on UNIX systems. Compiled into each tool along with it.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+/**
+ * =============================================================================
+ * === Timing ==================================================================
+ * =============================================================================
+ */
+
+/**
+ * Gets the current time.
+ *
+ * @return Seconds since the epoch, with sub-second precision.
+ */
+double harness_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+}
+
+/**
+ * =============================================================================
+ * === Document Roots ==========================================================
+ * =============================================================================
+ */
+
+/**
+ * Sets up the working directory of a tool, making up a temporary one if none
+ * was given.
+ *
+ * @param workdir Path of the working directory, or an empty string to make up
+ *                one, in which case it must be able to hold its path.
+ * @param tool    Name of the tool, used for temporary directories.
+ * @param created Where to store whether a temporary directory was made, or
+ *                NULL if it doesn't matter.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_workdir(char *workdir, const char *tool, int *created) {
+	if (created != NULL)
+		*created = 0;
+
+	if (workdir[0] == '\0') {
+		sprintf(workdir, "/tmp/%s.XXXXXX", tool);
+		if (mkdtemp(workdir) == NULL) {
+			fprintf(stderr, "Failed to create the working directory: %s\n",
+				strerror(errno));
+			return 0;
+		}
+		if (created != NULL)
+			*created = 1;
+	} else if ((mkdir(workdir, 0755) != 0) && (errno != EEXIST)) {
+		fprintf(stderr, "Failed to create %s: %s\n", workdir,
+			strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Creates a directory, complaining if it can't be done.
+ *
+ * @param path Path of the directory.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_mkdir(const char *path) {
+	if (mkdir(path, 0755) != 0) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Writes a text file made up of numbered lines.
+ *
+ * @param path Path of the file.
+ * @param size Size of the file in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_write_text(const char *path, long size) {
+	char line[640];
+	long written;
+	FILE *fh;
+	int len;
+
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	for (written = 0; written < size; written += len) {
+		len = sprintf(line, "Line %ld of %s, nothing to see here.\n", written,
+			path);
+		if ((written + len) > size)
+			len = (int)(size - written);
+		fwrite(line, 1, (size_t)len, fh);
+	}
+
+	return fclose(fh) == 0;
+}
+
+/**
+ * Creates a sparse file, for files too big to be written out.
+ *
+ * @param path Path of the file.
+ * @param size Size of the file in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_write_sparse(const char *path, long size) {
+	FILE *fh;
+
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	if (ftruncate(fileno(fh), (off_t)size) != 0) {
+		fprintf(stderr, "Failed to grow %s: %s\n", path, strerror(errno));
+		fclose(fh);
+		return 0;
+	}
+
+	return fclose(fh) == 0;
+}
+
+/**
+ * Fills a directory with numbered text files of the same size.
+ *
+ * @param dir   Path of the directory, which must exist already.
+ * @param name  Name of the files, with a %u where their number goes.
+ * @param count Number of files.
+ * @param size  Size of each file in bytes.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_files(const char *dir, const char *name, unsigned int count,
+				  long size) {
+	char path[1024];
+	unsigned int i;
+	size_t len;
+
+	len = strlen(dir);
+	if ((len + strlen(name) + 16) > sizeof(path)) {
+		fprintf(stderr, "Path of the files in %s is too long\n", dir);
+		return 0;
+	}
+
+	memcpy(path, dir, len);
+	path[len++] = '/';
+	for (i = 0; i < count; i++) {
+		sprintf(path + len, name, i);
+		if (!harness_write_text(path, size))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Removes a directory and everything inside it.
+ *
+ * @param path Path of the directory.
+ */
+void harness_tree_remove(const char *path) {
+	struct dirent *dirent;
+	struct stat sb;
+	char *child;
+	DIR *dh;
+
+	dh = opendir(path);
+	if (dh == NULL)
+		return;
+
+	while ((dirent = readdir(dh)) != NULL) {
+		if ((strcmp(dirent->d_name, ".") == 0) ||
+				(strcmp(dirent->d_name, "..") == 0)) {
+			continue;
+		}
+
+		child = (char*)malloc(strlen(path) + strlen(dirent->d_name) + 2);
+		if (child == NULL)
+			break;
+		sprintf(child, "%s/%s", path, dirent->d_name);
+		if ((lstat(child, &sb) == 0) && S_ISDIR(sb.st_mode)) {
+			harness_tree_remove(child);
+		} else {
+			unlink(child);
+		}
+		free(child);
+	}
+
+	closedir(dh);
+	rmdir(path);
+}
+
+/**
+ * =============================================================================
+ * === Server Processes ========================================================
+ * =============================================================================
+ */
+
+/**
+ * Writes the configuration file of the server.
+ *
+ * @param workdir Directory the server runs in.
+ * @param port    Port for the server to listen on.
+ * @param admin   Path of the admin socket, relative to the working directory,
+ *                or NULL to go without one.
+ * @param options Extra options in the key=value form.
+ * @param nopts   Number of extra options.
+ *
+ * @return TRUE if the operation was successful, FALSE otherwise.
+ */
+int harness_config_write(const char *workdir, unsigned int port,
+						 const char *admin, char **options,
+						 unsigned int nopts) {
+	char path[512];
+	char cwd[512];
+	unsigned int i;
+	char *eq;
+	FILE *fh;
+
+	sprintf(path, "%s/amigos.conf", workdir);
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	fprintf(fh, "listen_port = %u\n", port);
+	fprintf(fh, "hostname = localhost\n");
+	if (admin != NULL)
+		fprintf(fh, "admin_path = %s\n", admin);
+
+	/* The server can't do without its file types. */
+	if ((getcwd(cwd, sizeof(cwd) - 16) != NULL) &&
+			(access("filetypes.conf", R_OK) == 0)) {
+		fprintf(fh, "filetypes_path = %s/filetypes.conf\n", cwd);
+	}
+
+	for (i = 0; i < nopts; i++) {
+		eq = strchr(options[i], '=');
+		if (eq == NULL) {
+			fprintf(fh, "%s\n", options[i]);
+		} else {
+			fprintf(fh, "%.*s = %s\n", (int)(eq - options[i]), options[i],
+				eq + 1);
+		}
+	}
+
+	return fclose(fh) == 0;
+}
+
+/**
+ * Starts the server and waits for it to accept connections, getting rid of
+ * it if it doesn't.
+ *
+ * @param server  Path to the server executable.
+ * @param workdir Directory for the server to run in.
+ * @param addr    Address the server listens on.
+ *
+ * @return PID of the server or -1 if it didn't start.
+ */
+pid_t harness_start(const char *server, const char *workdir,
+					const struct sockaddr_in *addr) {
+	pid_t pid;
+
+	pid = harness_spawn(server, workdir);
+	if ((pid < 0) || !harness_wait(pid, addr)) {
+		fprintf(stderr, "Server didn't start, see %s/amigos.log\n", workdir);
+		if (pid > 0) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		return -1;
+	}
+
+	return pid;
+}
+
+/**
+ * Starts the server in its working directory with its output going to a log
+ * file in there.
+ *
+ * @param server  Path to the server executable.
+ * @param workdir Directory for the server to run in.
+ *
+ * @return PID of the server or -1 if an error occurred.
+ */
+pid_t harness_spawn(const char *server, const char *workdir) {
+	char path[512];
+	pid_t pid;
+	int fd;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	/* Child. */
+	sprintf(path, "%s/amigos.log", workdir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (chdir(workdir) != 0))
+		_exit(127);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	close(fd);
+	execl(server, server, "docroot", (char*)NULL);
+	_exit(127);
+}
+
+/**
+ * Waits for the server to start accepting connections.
+ *
+ * @param pid  Server process.
+ * @param addr Address the server listens on.
+ *
+ * @return TRUE if the server is up, FALSE if it didn't make it.
+ */
+int harness_wait(pid_t pid, const struct sockaddr_in *addr) {
+	unsigned int i;
+	int sockfd;
+	int ret;
+
+	for (i = 0; i < 100; i++) {
+		if (waitpid(pid, NULL, WNOHANG) != 0)
+			return 0;
+
+		sockfd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sockfd < 0)
+			return 0;
+		ret = connect(sockfd, (const struct sockaddr*)addr, sizeof(*addr));
+		close(sockfd);
+		if (ret == 0)
+			return 1;
+		usleep(100000);
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the server and checks that it exited cleanly.
+ *
+ * @param pid Server process.
+ *
+ * @return TRUE if the server exited cleanly, FALSE otherwise.
+ */
+int harness_stop(pid_t pid) {
+	unsigned int i;
+	int status;
+
+	kill(pid, SIGINT);
+	for (i = 0; i < 300; i++) {
+		if (waitpid(pid, &status, WNOHANG) == pid) {
+			if (WIFSIGNALED(status)) {
+				printf("Server was killed by signal %d while stopping\n",
+					WTERMSIG(status));
+				return 0;
+			}
+			return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+		}
+		usleep(100000);
+	}
+
+	printf("Server didn't stop within 30 seconds\n");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
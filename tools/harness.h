@@ -0,0 +1,40 @@
+/**
+ * harness.h
+ * Fixtures shared by the test and benchmark tools of the amigos Gopher server:
+ * generating document roots, writing the server's configuration, and starting
+ * and stopping it in a working directory of its own.
+ *
+ * Only available on UNIX systems.
+ *
+ * @author Nathan Campos <nathan@innoveworkshop.com>
+ */
+
+#ifndef _HARNESS_H
+#define _HARNESS_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/* Timing. */
+double harness_now(void);
+
+/* Document roots. */
+int harness_workdir(char *workdir, const char *tool, int *created);
+int harness_mkdir(const char *path);
+int harness_write_text(const char *path, long size);
+int harness_write_sparse(const char *path, long size);
+int harness_files(const char *dir, const char *name, unsigned int count,
+				  long size);
+void harness_tree_remove(const char *path);
+
+/* Server processes. */
+int harness_config_write(const char *workdir, unsigned int port,
+						 const char *admin, char **options,
+						 unsigned int nopts);
+pid_t harness_start(const char *server, const char *workdir,
+					const struct sockaddr_in *addr);
+pid_t harness_spawn(const char *server, const char *workdir);
+int harness_wait(pid_t pid, const struct sockaddr_in *addr);
+int harness_stop(pid_t pid);
+
+#endif /* _HARNESS_H */
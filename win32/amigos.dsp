@@ -98,6 +98,10 @@ SOURCE=..\amigos.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\amigos_plugin.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\config.h
 # End Source File
 # End Target